@@ -0,0 +1,1081 @@
+/* CPU-side benchmarks for the frame helpers used by the examples.
+ * They work on synthetic frames, so neither the GPU nor an input file is needed.
+ *
+ * Usage: ./benchmark [name ...]   (runs all benchmarks when no name is given)
+ * Build with optimisations for meaningful numbers: make OPTFLAGS=-O2 benchmark */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "frame.h"
+#include "text_overlay.h"
+#include "colour_convert.h"
+#include "scale.h"
+#include "scene_detect.h"
+#include "spsc_queue.h"
+#include "event_loop.h"
+#include "shm_frame_ring.h"
+#include "event_recorder.h"
+#include "segmenter.h"
+#include "metrics.h"
+#include "trace.h"
+#include "y4m.h"
+#include "quality.h"
+#include "frame_hash.h"
+
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_ALIGNED_HEIGHT 1088
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** Allocate a 1080p I420 frame filled with a gradient */
+static uint8_t *bench_alloc_frame(FRAME_T *frame)
+{
+    size_t size = BENCH_WIDTH * BENCH_ALIGNED_HEIGHT * 3 / 2, i;
+    uint8_t *data = malloc(size);
+
+    if (!data) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < size; i++)
+        data[i] = (uint8_t)(i * 7 + i / BENCH_WIDTH);
+    frame_init_i420(frame, data, BENCH_WIDTH, BENCH_ALIGNED_HEIGHT, BENCH_WIDTH, BENCH_HEIGHT);
+    return data;
+}
+
+/** Timecode burn-in at 1080p, as done per frame in manual_decode_overlay_encode */
+static void bench_text_overlay(void)
+{
+    static const unsigned int flags[] = { 0, TEXT_OVERLAY_FLAG_OPAQUE };
+    const unsigned int frames = 2000;
+    FRAME_T frame;
+    uint8_t *data = bench_alloc_frame(&frame);
+    unsigned int f, i;
+
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        TEXT_OVERLAY_T ov;
+        uint64_t start, elapsed;
+        char text[TEXT_OVERLAY_MAX_CHARS + 1];
+
+        if (text_overlay_create(&ov, BENCH_HEIGHT / 270, flags[i]) != 0) {
+            fprintf(stderr, "could not create text overlay\n");
+            exit(1);
+        }
+        ov.x = ov.y = 16;
+
+        start = bench_now_ns();
+        for (f = 0; f < frames; f++) {
+            /* a 25fps timecode: milliseconds and frame number change every frame */
+            snprintf(text, sizeof(text), "CAM0 2026-10-19 12:%02u:%02u.%03u F%06u",
+                     f / 1500, f / 25 % 60, f % 25 * 40, f);
+            text_overlay_set_text(&ov, text);
+            text_overlay_blit(&ov, &frame);
+        }
+        elapsed = bench_now_ns() - start;
+
+        printf("text_overlay %-12s %ux%u scale %u: %.4f ms/frame, %.1f glyphs redrawn/frame\n",
+               flags[i] & TEXT_OVERLAY_FLAG_OPAQUE ? "(opaque)" : "(outline)",
+               BENCH_WIDTH, BENCH_HEIGHT, ov.scale, elapsed / 1e6 / frames,
+               (double)ov.glyphs_redrawn / frames);
+        text_overlay_destroy(&ov);
+    }
+    free(data);
+}
+
+/** Compare the visible area of two frames of the same layout, returns the number of differing bytes */
+static unsigned long bench_compare(const FRAME_T *a, const FRAME_T *b, unsigned int planes,
+                                   const unsigned int *row_bytes, const unsigned int *rows)
+{
+    unsigned long diff = 0;
+    unsigned int p, y, x;
+
+    for (p = 0; p < planes; p++)
+        for (y = 0; y < rows[p]; y++)
+            for (x = 0; x < row_bytes[p]; x++)
+                diff += a->plane[p][y * a->pitch[p] + x] != b->plane[p][y * b->pitch[p] + x];
+    return diff;
+}
+
+/** All conversions at 1080p: vector kernels against the scalar reference
+ * (must be bit-exact), single threaded and split across all cores */
+static void bench_colour_convert(void)
+{
+    static const struct {
+        const char *name;
+        COLOUR_CONVERSION_T conversion;
+    } conversions[] = {
+        { "I420->NV12", COLOUR_I420_TO_NV12 },
+        { "NV12->I420", COLOUR_NV12_TO_I420 },
+        { "I420->RGB24", COLOUR_I420_TO_RGB24 },
+        { "I420->RGBA", COLOUR_I420_TO_RGBA },
+        { "RGBA->I420", COLOUR_RGBA_TO_I420 },
+    };
+    /* pad the pitch so that kernels which ignore it produce wrong results */
+    const unsigned int w = BENCH_WIDTH, h = BENCH_HEIGHT, pitch = BENCH_WIDTH + 64;
+    const unsigned int frames = 30;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t size = (size_t)pitch * 4 * BENCH_ALIGNED_HEIGHT;
+    uint8_t *src_data = malloc(size), *dst_data = malloc(size), *ref_data = malloc(size);
+    COLOUR_COEFFS_T coeffs;
+    COLOUR_WORKERS_T workers;
+    unsigned int c, f, m, r;
+    size_t i;
+    int failed = 0;
+
+    if (!src_data || !dst_data || !ref_data || colour_workers_create(&workers, threads > 0 ? threads : 1) != 0) {
+        fprintf(stderr, "could not set up colour conversion benchmark\n");
+        exit(1);
+    }
+    srand(1);
+    for (i = 0; i < size; i++)
+        src_data[i] = rand();
+
+    for (m = 0; m < 2; m++) {
+        for (r = 0; r < 2; r++) {
+            colour_coeffs_init(&coeffs, m ? COLOUR_MATRIX_BT709 : COLOUR_MATRIX_BT601,
+                               r ? COLOUR_RANGE_FULL : COLOUR_RANGE_LIMITED);
+            for (c = 0; c < sizeof(conversions) / sizeof(conversions[0]); c++) {
+                COLOUR_CONVERSION_T conv = conversions[c].conversion;
+                FRAME_T src, dst, ref;
+                COLOUR_JOB_T job = { conv, &src, &dst, &coeffs }, ref_job = { conv, &src, &ref, &coeffs };
+                unsigned int row_bytes[3] = { w, w / 2, w / 2 }, rows[3] = { h, h / 2, h / 2 }, planes = 3;
+                uint64_t start, t_ref, t_simd, t_mt;
+                unsigned long diff;
+
+                if (conv == COLOUR_RGBA_TO_I420)
+                    frame_init_packed(&src, src_data, pitch * 4, w, h);
+                else if (conv == COLOUR_NV12_TO_I420)
+                    frame_init_nv12(&src, src_data, pitch, BENCH_ALIGNED_HEIGHT, w, h);
+                else
+                    frame_init_i420(&src, src_data, pitch, BENCH_ALIGNED_HEIGHT, w, h);
+
+                if (conv == COLOUR_I420_TO_NV12) {
+                    frame_init_nv12(&dst, dst_data, pitch, BENCH_ALIGNED_HEIGHT, w, h);
+                    frame_init_nv12(&ref, ref_data, pitch, BENCH_ALIGNED_HEIGHT, w, h);
+                    row_bytes[1] = w;
+                    planes = 2;
+                } else if (conv == COLOUR_I420_TO_RGB24 || conv == COLOUR_I420_TO_RGBA) {
+                    unsigned int bpp = conv == COLOUR_I420_TO_RGBA ? 4 : 3;
+                    frame_init_packed(&dst, dst_data, pitch * bpp, w, h);
+                    frame_init_packed(&ref, ref_data, pitch * bpp, w, h);
+                    row_bytes[0] = w * bpp;
+                    planes = 1;
+                } else {
+                    frame_init_i420(&dst, dst_data, pitch, BENCH_ALIGNED_HEIGHT, w, h);
+                    frame_init_i420(&ref, ref_data, pitch, BENCH_ALIGNED_HEIGHT, w, h);
+                }
+
+                start = bench_now_ns();
+                for (f = 0; f < frames; f++)
+                    colour_convert_ref(&ref_job);
+                t_ref = bench_now_ns() - start;
+
+                start = bench_now_ns();
+                for (f = 0; f < frames; f++)
+                    colour_convert(&job);
+                t_simd = bench_now_ns() - start;
+                diff = bench_compare(&dst, &ref, planes, row_bytes, rows);
+
+                memset(dst_data, 0, size);
+                start = bench_now_ns();
+                for (f = 0; f < frames; f++)
+                    colour_workers_run(&workers, &job);
+                t_mt = bench_now_ns() - start;
+                diff += bench_compare(&dst, &ref, planes, row_bytes, rows);
+
+                printf("colour_convert %-11s %s %-7s: reference %.2f ms, vector %.2f ms, %u threads %.2f ms%s\n",
+                       conversions[c].name, m ? "BT.709" : "BT.601", r ? "full" : "limited",
+                       t_ref / 1e6 / frames, t_simd / 1e6 / frames, workers.count + 1, t_mt / 1e6 / frames,
+                       diff ? " MISMATCH" : ", bit-exact");
+                failed |= diff != 0;
+            }
+        }
+    }
+
+    colour_workers_destroy(&workers);
+    free(src_data);
+    free(dst_data);
+    free(ref_data);
+    if (failed)
+        exit(1);
+}
+
+/** Thumbnail downscaling of a 1080p frame, as done by thumbnail_decode */
+static void bench_scale(void)
+{
+    static const unsigned int widths[] = { 160, 320, 640 };
+    const unsigned int frames = 200;
+    FRAME_T frame;
+    uint8_t *data = bench_alloc_frame(&frame);
+    uint16_t *acc = malloc(BENCH_WIDTH * sizeof(*acc));
+    unsigned int f, i;
+
+    for (i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+        unsigned int w = widths[i], h = (BENCH_HEIGHT * w / BENCH_WIDTH) & ~1u;
+        uint8_t *thumb_data = malloc(w * h * 3 / 2);
+        FRAME_T thumb;
+        uint64_t start, elapsed;
+
+        if (!acc || !thumb_data) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        frame_init_i420(&thumb, thumb_data, w, h, w, h);
+
+        start = bench_now_ns();
+        for (f = 0; f < frames; f++)
+            scale_frame_i420(&frame, &thumb, acc);
+        elapsed = bench_now_ns() - start;
+
+        printf("scale %ux%u -> %ux%u: %.3f ms/frame\n", BENCH_WIDTH, BENCH_HEIGHT, w, h, elapsed / 1e6 / frames);
+        free(thumb_data);
+    }
+    free(acc);
+    free(data);
+}
+
+/** Scene-cut detection at 1080p on a synthetic clip: three scenes, each slowly
+ * panning, with cuts at known frames which all have to be found */
+static void bench_scene_detect(void)
+{
+    static const unsigned int cuts[] = { 100, 220 };
+    const unsigned int frames = 300, pan = 64, pitch = BENCH_WIDTH + pan;
+    uint8_t *scenes[3];
+    SCENE_DETECT_T sd;
+    unsigned int s, f, x, y, shift, found = 0, false_cuts = 0;
+
+    for (s = 0; s < 3; s++) {
+        scenes[s] = malloc((size_t)pitch * BENCH_HEIGHT);
+        if (!scenes[s]) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        for (y = 0; y < BENCH_HEIGHT; y++)
+            for (x = 0; x < pitch; x++)
+                scenes[s][y * pitch + x] = s == 0 ? x / 8 + y / 8 : s == 1 ? 255 - x / 10 : (x / 32 + y / 32) % 2 * 160 + 40;
+    }
+    if (scene_detect_create(&sd, BENCH_WIDTH, BENCH_HEIGHT, 4) != 0) {
+        fprintf(stderr, "could not create scene detector\n");
+        exit(1);
+    }
+
+    for (f = 0; f < frames; f++) {
+        FRAME_T frame;
+        s = f >= cuts[1] ? 2 : f >= cuts[0] ? 1 : 0;
+        /* luma only, panning back and forth by one pixel per frame */
+        shift = f % (2 * pan) < pan ? f % (2 * pan) : 2 * pan - f % (2 * pan);
+        frame_init_packed(&frame, scenes[s] + shift, pitch, BENCH_WIDTH, BENCH_HEIGHT);
+        if (scene_detect_frame(&sd, &frame)) {
+            if (f == cuts[0] || f == cuts[1])
+                found++;
+            else
+                false_cuts++;
+        }
+    }
+
+    printf("scene_detect %ux%u every 4th row: %.4f ms/frame, %u of %u cuts found, %u false\n",
+           BENCH_WIDTH, BENCH_HEIGHT, sd.us / 1000.0 / sd.frames, found,
+           (unsigned int)(sizeof(cuts) / sizeof(cuts[0])), false_cuts);
+    scene_detect_destroy(&sd);
+    for (s = 0; s < 3; s++)
+        free(scenes[s]);
+    if (found != sizeof(cuts) / sizeof(cuts[0]) || false_cuts)
+        exit(1);
+}
+
+/* Handoff of buffers from a callback thread to the main loop. The "locked"
+ * variant is what the examples did before spsc_queue.h: a mutex protected
+ * queue (as in mmal_queue_put) and one semaphore post per buffer. */
+typedef struct BENCH_HANDOFF_T {
+    int spsc;
+    unsigned int items, burst;        /* producer pauses 100us after every burst items, 0 = never */
+
+    SPSC_QUEUE_T ring;
+    SPSC_BELL_T bell;
+
+    VCOS_MUTEX_T lock;
+    VCOS_SEMAPHORE_T semaphore;
+    uintptr_t *locked_items;
+    unsigned int locked_head, locked_tail;
+} BENCH_HANDOFF_T;
+
+static void *bench_handoff_producer(void *arg)
+{
+    BENCH_HANDOFF_T *h = (BENCH_HANDOFF_T *)arg;
+    uintptr_t i;
+
+    for (i = 1; i <= h->items; i++) {
+        if (h->spsc) {
+            while (spsc_queue_push(&h->ring, (void *)i) != 0)
+                sched_yield();
+            spsc_bell_ring(&h->bell);
+        } else {
+            vcos_mutex_lock(&h->lock);
+            h->locked_items[h->locked_tail++] = i;
+            vcos_mutex_unlock(&h->lock);
+            vcos_semaphore_post(&h->semaphore);
+        }
+        if (h->burst && i % h->burst == 0)
+            usleep(100);
+    }
+    return NULL;
+}
+
+static void bench_handoff_run(int spsc, unsigned int items, unsigned int burst)
+{
+    BENCH_HANDOFF_T h;
+    VCOS_THREAD_T thread;
+    struct rusage before, after;
+    uint64_t start, elapsed;
+    uintptr_t expected = 1, item;
+    unsigned int wakeups = 0;
+
+    memset(&h, 0, sizeof(h));
+    h.spsc = spsc;
+    h.items = items;
+    h.burst = burst;
+    if (spsc_queue_create(&h.ring, 256) != 0 || !(h.locked_items = malloc(items * sizeof(*h.locked_items))) ||
+        vcos_mutex_create(&h.lock, "bench") != VCOS_SUCCESS ||
+        vcos_semaphore_create(&h.semaphore, "bench", 0) != VCOS_SUCCESS) {
+        fprintf(stderr, "could not set up handoff benchmark\n");
+        exit(1);
+    }
+    spsc_bell_init(&h.bell, 2000);
+
+    getrusage(RUSAGE_SELF, &before);
+    start = bench_now_ns();
+    vcos_thread_create(&thread, "producer", NULL, bench_handoff_producer, &h);
+
+    /* the consumer is shaped like the main loop of the examples: wait, then drain */
+    while (expected <= items) {
+        wakeups++;
+        if (spsc) {
+            spsc_bell_wait(&h.bell);
+            while ((item = (uintptr_t)spsc_queue_pop(&h.ring)) != 0)
+                if (item != expected++)
+                    exit(1);
+        } else {
+            vcos_semaphore_wait(&h.semaphore);
+            for (;;) {
+                vcos_mutex_lock(&h.lock);
+                item = h.locked_head < h.locked_tail ? h.locked_items[h.locked_head++] : 0;
+                vcos_mutex_unlock(&h.lock);
+                if (!item)
+                    break;
+                if (item != expected++)
+                    exit(1);
+            }
+        }
+    }
+    vcos_thread_join(&thread, NULL);
+    elapsed = bench_now_ns() - start;
+    getrusage(RUSAGE_SELF, &after);
+
+    printf("handoff %-6s %-14s: %7.1f ns/buffer, %.3f wake-ups/buffer, %.3f context switches/buffer",
+           spsc ? "spsc" : "locked", burst ? "bursts of 8" : "streaming", (double)elapsed / items,
+           (double)wakeups / items,
+           (double)(after.ru_nvcsw - before.ru_nvcsw + after.ru_nivcsw - before.ru_nivcsw) / items);
+    if (spsc)
+        printf(", %.3f futex wakes/buffer", (double)h.bell.wakes / items);
+    else
+        printf(", 1 semaphore post/buffer");
+    printf("\n");
+
+    spsc_queue_destroy(&h.ring);
+    free(h.locked_items);
+    vcos_mutex_delete(&h.lock);
+    vcos_semaphore_delete(&h.semaphore);
+}
+
+static void bench_handoff(void)
+{
+    int spsc;
+
+    for (spsc = 0; spsc < 2; spsc++) {
+        bench_handoff_run(spsc, 2000000, 0);
+        bench_handoff_run(spsc, 8 * 2000, 8);
+    }
+}
+
+/* Wake-up latency of the main loop: a thread standing in for the MMAL
+ * callbacks signals bursts of buffers, either with a semaphore post each (the
+ * old main loops) or through an event loop notifier (event_loop.h). */
+typedef struct BENCH_WAKE_T {
+    int use_event_loop;
+    unsigned int items, burst;
+    uint64_t *sent;                 /* signal time of every item */
+    unsigned int produced;          /* atomic */
+    VCOS_SEMAPHORE_T semaphore;
+    EVENT_LOOP_T loop;
+    EVENT_SOURCE_T notifier;
+} BENCH_WAKE_T;
+
+static void *bench_wake_producer(void *arg)
+{
+    BENCH_WAKE_T *w = (BENCH_WAKE_T *)arg;
+    unsigned int i;
+
+    for (i = 0; i < w->items; i++) {
+        w->sent[i] = bench_now_ns();
+        __atomic_store_n(&w->produced, i + 1, __ATOMIC_RELEASE);
+        if (w->use_event_loop)
+            event_loop_notify(&w->notifier);
+        else
+            vcos_semaphore_post(&w->semaphore);
+        if ((i + 1) % w->burst == 0)
+            usleep(500);
+    }
+    return NULL;
+}
+
+static void bench_wake_handler(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    (void)loop;
+    (void)source;
+    (void)events;
+}
+
+static int bench_compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_wake_run(int use_event_loop, unsigned int burst)
+{
+    const unsigned int items = 4000;
+    BENCH_WAKE_T w;
+    VCOS_THREAD_T thread;
+    struct rusage before, after;
+    uint64_t *latency = malloc(items * sizeof(*latency));
+    unsigned int consumed = 0, wakeups = 0;
+
+    memset(&w, 0, sizeof(w));
+    w.use_event_loop = use_event_loop;
+    w.items = items;
+    w.burst = burst;
+    w.sent = malloc(items * sizeof(*w.sent));
+    if (!latency || !w.sent || vcos_semaphore_create(&w.semaphore, "bench", 0) != VCOS_SUCCESS ||
+        event_loop_create(&w.loop) != 0 ||
+        event_loop_add_notifier(&w.loop, &w.notifier, bench_wake_handler, &w) != 0) {
+        fprintf(stderr, "could not set up wake-up benchmark\n");
+        exit(1);
+    }
+
+    getrusage(RUSAGE_SELF, &before);
+    vcos_thread_create(&thread, "producer", NULL, bench_wake_producer, &w);
+    while (consumed < items) {
+        unsigned int produced;
+        uint64_t now;
+
+        if (use_event_loop)
+            event_loop_run_once(&w.loop, -1);
+        else
+            vcos_semaphore_wait(&w.semaphore);
+        wakeups++;
+        now = bench_now_ns();
+        produced = __atomic_load_n(&w.produced, __ATOMIC_ACQUIRE);
+        for (; consumed < produced; consumed++)
+            latency[consumed] = now - w.sent[consumed];
+    }
+    vcos_thread_join(&thread, NULL);
+    getrusage(RUSAGE_SELF, &after);
+
+    qsort(latency, items, sizeof(*latency), bench_compare_u64);
+    printf("wake %-10s bursts of %u: latency p50 %.1f us, p99 %.1f us, %.2f wake-ups/buffer, %.2f context switches/buffer\n",
+           use_event_loop ? "event_loop" : "semaphore", burst, latency[items / 2] / 1e3,
+           latency[items * 99 / 100] / 1e3, (double)wakeups / items,
+           (double)(after.ru_nvcsw - before.ru_nvcsw + after.ru_nivcsw - before.ru_nivcsw) / items);
+
+    event_loop_remove(&w.loop, &w.notifier);
+    event_loop_destroy(&w.loop);
+    vcos_semaphore_delete(&w.semaphore);
+    free(w.sent);
+    free(latency);
+}
+
+static void bench_event_loop(void)
+{
+    int use_event_loop;
+
+    for (use_event_loop = 0; use_event_loop < 2; use_event_loop++) {
+        bench_wake_run(use_event_loop, 1);
+        bench_wake_run(use_event_loop, 4);
+    }
+}
+
+typedef struct {
+    unsigned int read, skipped, torn;
+    double p50_us, p99_us;
+} BENCH_SHM_RESULT_T;
+
+/** Child process: read frames in place (a slow consumer only the latest ones)
+ * and sum their luma, standing in for analysis. Reports through the pipe. */
+static void bench_shm_consumer(int ring_fd, int result_fd, unsigned int frames, unsigned int work_us)
+{
+    SHM_RING_CONSUMER_T c;
+    BENCH_SHM_RESULT_T result;
+    uint64_t *latency = malloc(frames * sizeof(*latency));
+    unsigned int n = 0;
+
+    memset(&result, 0, sizeof(result));
+    if (!latency || shm_ring_consumer_attach(&c, ring_fd) != 0)
+        _exit(1);
+    c.next = 0;
+    while (c.next < frames) {
+        FRAME_T frame;
+        int64_t pts;
+        uint64_t published, arrived, sum = 0;
+        unsigned int y, x;
+
+        if (!shm_ring_wait(&c, 1000))
+            break;
+        while (shm_ring_begin(&c, &frame, &pts, &published, work_us != 0)) {
+            arrived = shm_ring_now_us();
+            for (y = 0; y < frame.height; y++)
+                for (x = 0; x < frame.width; x++)
+                    sum += frame.plane[0][y * frame.pitch[0] + x];
+            if (work_us)
+                usleep(work_us);
+            if (shm_ring_end(&c) && sum)
+                latency[n++] = arrived - published;
+        }
+    }
+    result.read = c.read;
+    result.skipped = c.skipped;
+    result.torn = c.torn;
+    if (n) {
+        qsort(latency, n, sizeof(*latency), bench_compare_u64);
+        result.p50_us = latency[n / 2];
+        result.p99_us = latency[n * 99 / 100];
+    }
+    if (write(result_fd, &result, sizeof(result)) != sizeof(result))
+        _exit(1);
+    _exit(0);
+}
+
+static void bench_shm_run(unsigned int frames, unsigned int interval_us, unsigned int work_us)
+{
+    SHM_RING_PUBLISHER_T pub;
+    BENCH_SHM_RESULT_T result;
+    FRAME_T frame;
+    uint8_t *data = bench_alloc_frame(&frame);
+    uint64_t start, elapsed;
+    unsigned int i;
+    int pipefd[2], status;
+    pid_t pid;
+
+    if (shm_ring_publisher_create(&pub, 4, BENCH_WIDTH, BENCH_HEIGHT) != 0 || pipe(pipefd) != 0) {
+        fprintf(stderr, "could not create the frame ring\n");
+        exit(1);
+    }
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0)
+        bench_shm_consumer(pub.fd, pipefd[1], frames, work_us);
+    usleep(100000); /* let the consumer map the ring */
+
+    start = bench_now_ns();
+    for (i = 0; i < frames; i++) {
+        data[i % 4096] = i;
+        shm_ring_publish(&pub, &frame, i);
+        if (interval_us)
+            usleep(interval_us);
+    }
+    elapsed = bench_now_ns() - start;
+
+    memset(&result, 0, sizeof(result));
+    if (read(pipefd[0], &result, sizeof(result)) != sizeof(result))
+        fprintf(stderr, "consumer failed\n");
+    waitpid(pid, &status, 0);
+    printf("shm ring %s publisher, consumer %s: published %.0f frames/s (%.3f ms/frame copying), consumer read %u, skipped %u, torn %u, latency p50 %.0f us, p99 %.0f us\n",
+           interval_us ? "paced" : "flat out", work_us ? "slow" : "fast", frames * 1e9 / elapsed,
+           pub.copy_us / 1e3 / frames, result.read, result.skipped, result.torn, result.p50_us, result.p99_us);
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    shm_ring_publisher_destroy(&pub);
+    free(data);
+}
+
+/** Publishing 1080p frames to another process, with a consumer that keeps
+ * up and one that is slower than the publisher. A consumer has to be done with
+ * a frame within slots - 1 frame intervals, or the frame is torn. */
+static void bench_shm_ring(void)
+{
+    bench_shm_run(200, 0, 0);
+    bench_shm_run(200, 10000, 0);
+    bench_shm_run(200, 10000, 20000);
+}
+
+/** A minute of synthetic 8 Mbit/s stream (25 fps, an IDR every 2 s, IDRs
+ * four times the size of the other frames) through a ring for 9 s of
+ * pre-roll (so 10 s back to the IDR), then a trigger: cost per access unit and how long it takes to get
+ * the pre-roll onto the disk (into the page cache, no fsync) */
+static void bench_event_recorder(void)
+{
+    const unsigned int fps = 25, gop = 50, frames = 60 * fps, seconds = 10 + gop / fps + 1;
+    const size_t p_size = 8000000 / 8 / fps * gop / (gop + 3), i_size = 4 * p_size;
+    EVENT_RECORDER_T rec;
+    uint8_t *au = malloc(i_size), config[32] = { 0, 0, 0, 1, 0x67 };
+    uint64_t now = event_recorder_now_us(), start, add_ns;
+    unsigned int i;
+    char path[64];
+    FILE *file;
+    uint8_t first[5 + sizeof(config)];
+
+    if (!au || event_recorder_create(&rec, (size_t)25000000 / 8 * seconds, fps * seconds, 9000, 0,
+                                     "/tmp/benchmark-event-") != 0) {
+        fprintf(stderr, "could not create the event recorder\n");
+        exit(1);
+    }
+    memset(au, 0x55, i_size);
+    au[0] = au[1] = au[2] = 0;
+    au[3] = 1;
+    event_recorder_add(&rec, config, sizeof(config), EVENT_RECORDER_CONFIG, now - frames * 40000ull);
+    start = bench_now_ns();
+    for (i = 0; i < frames; i++) {
+        au[4] = i % gop ? 0x41 : 0x65;
+        /* in two pieces, as the encoder may hand them out */
+        event_recorder_add(&rec, au, 1000, i % gop ? 0 : EVENT_RECORDER_KEYFRAME, now - (frames - i) * 40000ull);
+        event_recorder_add(&rec, au + 1000, (i % gop ? p_size : i_size) - 1000, EVENT_RECORDER_FRAME_END,
+                           now - (frames - i) * 40000ull);
+    }
+    add_ns = bench_now_ns() - start;
+
+    if (event_recorder_trigger(&rec) != 0) {
+        fprintf(stderr, "could not write the event file\n");
+        exit(1);
+    }
+    event_recorder_close(&rec);
+    snprintf(path, sizeof(path), "/tmp/benchmark-event-%03u.h264", rec.events - 1);
+    file = fopen(path, "rb");
+    if (!file || fread(first, 1, sizeof(first), file) != sizeof(first) ||
+        memcmp(first, config, sizeof(config)) || first[sizeof(config) + 4] != 0x65)
+        fprintf(stderr, "event file does not start with the config and an IDR\n");
+    if (file)
+        fclose(file);
+    unlink(path);
+
+    printf("event recorder: %.1f us/access unit added, pre-roll of %.1f s (%.1f MB) written in %.2f ms, "
+           "%.1f s kept in %zu MB\n", add_ns / 1e3 / frames, rec.dump_seconds, rec.dump_bytes / 1e6,
+           rec.dump_us / 1e3, (event_recorder_au(&rec, rec.count - 1)->time_us - event_recorder_au(&rec, 0)->time_us) / 1e6,
+           rec.capacity >> 20);
+    event_recorder_destroy(&rec);
+    free(au);
+}
+
+/** A minute of synthetic stream (25 fps, an IDR every 2 s) cut into 4 s
+ * segments, sped up 40 times: what rotating costs on the encoder output path
+ * and what opening a file costs on the writer thread */
+static void bench_segmenter(void)
+{
+    const unsigned int fps = 25, gop = 50, frames = 60 * fps;
+    uint8_t *au = malloc(160000), config[32] = { 0, 0, 0, 1, 0x67 }, first[5 + sizeof(config)];
+    char dir[] = "/tmp/benchmark-segmenter-XXXXXX", playlist[64], path[256], line[64];
+    SEGMENTER_T seg;
+    unsigned int i, entries = 0;
+    FILE *file;
+
+    if (!au || !mkdtemp(dir)) {
+        fprintf(stderr, "could not set up segmenter benchmark\n");
+        exit(1);
+    }
+    snprintf(playlist, sizeof(playlist), "%s/live.m3u8", dir);
+    if (segmenter_create(&seg, playlist, 4000) != 0) {
+        fprintf(stderr, "could not create the segmenter\n");
+        exit(1);
+    }
+    memset(au, 0x55, 160000);
+    au[0] = au[1] = au[2] = 0;
+    au[3] = 1;
+    segmenter_add(&seg, config, sizeof(config), SEGMENTER_CONFIG, 0);
+    for (i = 0; i < frames; i++) {
+        au[4] = i % gop ? 0x41 : 0x65;
+        segmenter_add(&seg, au, i % gop ? 40000 : 160000, (i % gop ? 0 : SEGMENTER_KEYFRAME) | SEGMENTER_FRAME_END,
+                      i * 1000000ll / fps);
+        usleep(1000);
+    }
+    segmenter_destroy(&seg);
+    segmenter_print(&seg, stdout);
+
+    /* the playlist lists the last segments, each starts with the config and an IDR */
+    file = fopen(playlist, "r");
+    while (file && fgets(line, sizeof(line), file)) {
+        FILE *segment;
+        if (line[0] == '#')
+            continue;
+        line[strcspn(line, "\n")] = 0;
+        snprintf(path, sizeof(path), "%s/%s", dir, line);
+        segment = fopen(path, "rb");
+        if (!segment || fread(first, 1, sizeof(first), segment) != sizeof(first) ||
+            memcmp(first, config, sizeof(config)) || first[sizeof(config) + 4] != 0x65)
+            fprintf(stderr, "%s does not start with the config and an IDR\n", path);
+        if (segment)
+            fclose(segment);
+        entries++;
+    }
+    if (file)
+        fclose(file);
+    if (entries != SEGMENTER_WINDOW)
+        fprintf(stderr, "%u segments in the playlist\n", entries);
+
+    for (i = 0; i < seg.next_index; i++) {
+        segmenter_path(&seg, i, path, sizeof(path));
+        unlink(path);
+    }
+    unlink(playlist);
+    rmdir(dir);
+    free(au);
+}
+
+enum { BENCH_METRICS, BENCH_ATOMIC, BENCH_PLAIN };
+
+typedef struct {
+    METRICS_T *m;
+    int mode, id;
+    unsigned int counts;
+    uint64_t plain;
+} BENCH_METRICS_THREAD_T;
+
+static uint64_t bench_metrics_shared;
+
+static void *bench_metrics_thread(void *arg)
+{
+    BENCH_METRICS_THREAD_T *t = (BENCH_METRICS_THREAD_T *)arg;
+    unsigned int i;
+
+    for (i = 0; i < t->counts; i++) {
+        if (t->mode == BENCH_METRICS)
+            metrics_inc(t->m, t->id);
+        else if (t->mode == BENCH_ATOMIC)
+            __atomic_fetch_add(&bench_metrics_shared, 1, __ATOMIC_RELAXED);
+        else
+            t->plain++;
+        /* keeps the compiler from folding the plain loop into one add */
+        __asm__ volatile("" : : "r"(t->plain) : "memory");
+    }
+    return NULL;
+}
+
+/** ns per count with threads counting into the same counter at once */
+static double bench_metrics_run(METRICS_T *m, int id, int mode, unsigned int threads, unsigned int counts)
+{
+    BENCH_METRICS_THREAD_T t[4];
+    VCOS_THREAD_T thread[4];
+    uint64_t start, elapsed;
+    unsigned int i;
+
+    start = bench_now_ns();
+    for (i = 0; i < threads; i++) {
+        t[i].m = m;
+        t[i].mode = mode;
+        t[i].id = id;
+        t[i].counts = counts;
+        t[i].plain = 0;
+        vcos_thread_create(&thread[i], "counter", NULL, bench_metrics_thread, &t[i]);
+    }
+    for (i = 0; i < threads; i++)
+        vcos_thread_join(&thread[i], NULL);
+    elapsed = bench_now_ns() - start;
+    return (double)elapsed / ((double)threads * counts);
+}
+
+static void bench_metrics(void)
+{
+    const unsigned int counts = 20000000, threads[] = { 1, 4 };
+    static METRICS_T m;
+    static char text[16384];
+    METRICS_PORT_T ports[4];
+    METRICS_EVENTS_T events[2];
+    MMAL_POOL_T *pool = NULL;
+    uint64_t start;
+    size_t length = 0;
+    unsigned int i, t, scrapes = 1000;
+    int id;
+
+    /* a registry the size of the one in manual_decode_overlay_encode */
+    metrics_init(&m, 0);
+    id = metrics_register(&m, "bench_counts_total", METRICS_COUNTER, "Counts");
+    for (i = 0; i < 4; i++)
+        metrics_register_port(&m, &ports[i], i ? "decoder_out" : "decoder_in");
+    metrics_register_events(&m, &events[0], "decoder");
+    metrics_register_events(&m, &events[1], "encoder");
+    for (i = 0; i < 3; i++)
+        metrics_register_pool(&m, "decoder_in", &pool);
+
+    for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        double disabled, enabled, atomic, plain;
+
+        m.enabled = 0;
+        disabled = bench_metrics_run(&m, id, BENCH_METRICS, threads[t], counts / threads[t]);
+        m.enabled = 1;
+        enabled = bench_metrics_run(&m, id, BENCH_METRICS, threads[t], counts / threads[t]);
+        atomic = bench_metrics_run(&m, id, BENCH_ATOMIC, threads[t], counts / threads[t]);
+        plain = bench_metrics_run(&m, id, BENCH_PLAIN, threads[t], counts / threads[t]);
+        printf("metrics: %u thread(s), ns/count: %.2f disabled, %.2f enabled (sharded), %.2f shared atomic, "
+               "%.2f plain increment\n", threads[t], disabled, enabled, atomic, plain);
+    }
+    if (metrics_value(&m, id) != (int64_t)counts * (sizeof(threads) / sizeof(threads[0])))
+        fprintf(stderr, "metrics: lost counts, %lld\n", (long long)metrics_value(&m, id));
+
+    start = bench_now_ns();
+    for (i = 0; i < scrapes; i++)
+        length = metrics_format(&m, text, sizeof(text));
+    printf("metrics: %u metrics formatted in %.1f us (%zu bytes)\n", m.count,
+           (bench_now_ns() - start) / 1e3 / scrapes, length);
+}
+
+typedef struct {
+    unsigned int events;
+    MMAL_BUFFER_HEADER_T headers[8];
+    int port, queue;
+} BENCH_TRACE_THREAD_T;
+
+/** The events of a buffer going round: out of the pool, sent, returned, queued, released */
+static void *bench_trace_thread(void *arg)
+{
+    BENCH_TRACE_THREAD_T *t = (BENCH_TRACE_THREAD_T *)arg;
+    unsigned int i;
+
+    for (i = 0; i < t->events; i += 5) {
+        MMAL_BUFFER_HEADER_T *header = &t->headers[i / 5 % 8];
+        trace_event(TRACE_GET, &t->queue, header);
+        trace_event(TRACE_SEND, &t->port, header);
+        trace_event(TRACE_CALLBACK, &t->port, header);
+        trace_event(TRACE_PUT, &t->queue, header);
+        trace_event(TRACE_RELEASE, NULL, header);
+    }
+    return NULL;
+}
+
+static double bench_trace_run(unsigned int threads, unsigned int events)
+{
+    static BENCH_TRACE_THREAD_T t[4];
+    VCOS_THREAD_T thread[4];
+    uint64_t start;
+    unsigned int i;
+    char name[32];
+
+    start = bench_now_ns();
+    for (i = 0; i < threads; i++) {
+        memset(&t[i], 0, sizeof(t[i]));
+        t[i].events = events;
+        snprintf(name, sizeof(name), "port %u", i);
+        trace_name(&t[i].port, name);
+        vcos_thread_create(&thread[i], "tracer", NULL, bench_trace_thread, &t[i]);
+    }
+    for (i = 0; i < threads; i++)
+        vcos_thread_join(&thread[i], NULL);
+    return (double)(bench_now_ns() - start) / ((double)threads * events);
+}
+
+static void bench_trace(void)
+{
+    const unsigned int events = 10000000, threads[] = { 1, 4 };
+    const char *path = "/tmp/benchmark-trace.json";
+    unsigned int t;
+    uint64_t start;
+    int written;
+
+    for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        double disabled, enabled;
+
+        /* a fresh set of rings each time, claimed by the new threads */
+        trace_init(16384);
+        disabled = bench_trace_run(threads[t], events / threads[t]);
+        trace_enable(1);
+        enabled = bench_trace_run(threads[t], events / threads[t]);
+        trace_enable(0);
+
+        start = bench_now_ns();
+        written = trace_write(path);
+        printf("trace: %u thread(s), ns/event: %.2f disabled, %.2f enabled; %d events written in %.1f ms\n",
+               threads[t], disabled, enabled, written, (bench_now_ns() - start) / 1e6);
+        for (; trace_global.rings; trace_global.rings--)
+            free(trace_global.ring[trace_global.rings - 1].events);
+    }
+    unlink(path);
+}
+
+/** What encode_yuv pays per frame when the size is not aligned: a packed 1080p
+ * frame copied into the padded port layout, next to a plain memcpy of it */
+static void bench_y4m(void)
+{
+    const unsigned int frames = 200;
+    const size_t packed = y4m_frame_size(BENCH_WIDTH, BENCH_HEIGHT);
+    uint8_t *src = malloc(packed), *dst = malloc(BENCH_WIDTH * BENCH_ALIGNED_HEIGHT * 3 / 2);
+    uint64_t start, copy, plain;
+    unsigned int f;
+
+    if (!src || !dst) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(src, 0x80, packed);
+    memset(dst, 0, BENCH_WIDTH * BENCH_ALIGNED_HEIGHT * 3 / 2);
+
+    start = bench_now_ns();
+    for (f = 0; f < frames; f++)
+        y4m_copy_i420(dst, BENCH_WIDTH, BENCH_ALIGNED_HEIGHT, src, BENCH_WIDTH, BENCH_HEIGHT);
+    copy = bench_now_ns() - start;
+    start = bench_now_ns();
+    for (f = 0; f < frames; f++)
+        memcpy(dst, src, packed);
+    plain = bench_now_ns() - start;
+
+    printf("y4m: %ux%u into %ux%u: %.3f ms/frame (%.0f MB/s), memcpy %.3f ms/frame\n", BENCH_WIDTH, BENCH_HEIGHT,
+           BENCH_WIDTH, BENCH_ALIGNED_HEIGHT, copy / 1e6 / frames, (double)packed * frames / (copy / 1e3),
+           plain / 1e6 / frames);
+    free(src);
+    free(dst);
+}
+
+/** PSNR/SSIM of a 1080p frame against a noisy copy: vector kernels against the
+ * scalar reference (must give the same result), single threaded and split
+ * across all cores */
+static void bench_quality(void)
+{
+    const unsigned int frames = 30;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t size = BENCH_WIDTH * BENCH_ALIGNED_HEIGHT * 3 / 2, i;
+    FRAME_T ref, dist;
+    uint8_t *ref_data = bench_alloc_frame(&ref), *dist_data = bench_alloc_frame(&dist);
+    QUALITY_WORKERS_T workers;
+    QUALITY_T q_ref, q_simd, q_mt, same;
+    uint64_t start, t_ref, t_simd, t_mt;
+    unsigned int f, p;
+    int mismatch = 0;
+
+    if (quality_workers_create(&workers, threads > 0 ? threads : 1) != 0) {
+        fprintf(stderr, "could not set up quality benchmark\n");
+        exit(1);
+    }
+    srand(1);
+    for (i = 0; i < size; i++) {
+        int v = dist_data[i] + rand() % 9 - 4;
+        dist_data[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+    }
+
+    start = bench_now_ns();
+    for (f = 0; f < frames; f++)
+        quality_frame_ref(&ref, &dist, &q_ref);
+    t_ref = bench_now_ns() - start;
+    start = bench_now_ns();
+    for (f = 0; f < frames; f++)
+        quality_frame(&ref, &dist, &q_simd);
+    t_simd = bench_now_ns() - start;
+    start = bench_now_ns();
+    for (f = 0; f < frames; f++)
+        quality_workers_run(&workers, &ref, &dist, &q_mt);
+    t_mt = bench_now_ns() - start;
+    quality_frame(&ref, &ref, &same);
+
+    /* the bands of the threads sum the SSIM in another order */
+    for (p = 0; p < 4; p++)
+        mismatch |= q_ref.psnr[p] != q_simd.psnr[p] || q_ref.ssim[p] != q_simd.ssim[p] ||
+                    q_ref.psnr[p] != q_mt.psnr[p] || fabs(q_ref.ssim[p] - q_mt.ssim[p]) > 1e-9;
+    mismatch |= same.psnr[3] != QUALITY_PSNR_MAX || same.ssim[3] != 1.0;
+
+    printf("quality: PSNR %.2f/%.2f/%.2f dB SSIM %.4f/%.4f/%.4f: reference %.2f ms, vector %.2f ms, "
+           "%u threads %.2f ms (%.0f fps)%s\n", q_simd.psnr[0], q_simd.psnr[1], q_simd.psnr[2], q_simd.ssim[0],
+           q_simd.ssim[1], q_simd.ssim[2], t_ref / 1e6 / frames, t_simd / 1e6 / frames, workers.count + 1,
+           t_mt / 1e6 / frames, t_mt ? frames * 1e9 / t_mt : 0, mismatch ? " MISMATCH" : ", identical");
+
+    quality_workers_destroy(&workers);
+    free(ref_data);
+    free(dist_data);
+    if (mismatch)
+        exit(1);
+}
+
+/** Frame CRCs at 1080p, as logged per frame with MMAL_HASH: with the crc32c
+ * instructions (if the CPU has them, the path MMAL_HASH takes) and with the
+ * tables */
+static void bench_hash(void)
+{
+    const unsigned int frames = 60;
+    FRAME_T frame;
+    uint8_t *data = bench_alloc_frame(&frame);
+    uint32_t crc[2][3], padded[3];
+    uint64_t start, ns;
+    unsigned int f, path, paths;
+    int mismatch = 0;
+
+    frame_hash_init();
+    paths = frame_hash_hw ? 2 : 1;
+    for (path = 0; path < paths; path++) {
+        frame_hash_hw = paths == 2 && path == 0;
+        /* the check value of CRC-32C, in one go and in pieces */
+        mismatch |= frame_hash_crc32c(0, (const uint8_t *)"123456789", 9) != 0xe3069283 ||
+                    frame_hash_crc32c(frame_hash_crc32c(0, (const uint8_t *)"123", 3), (const uint8_t *)"456789",
+                                      6) != 0xe3069283;
+
+        start = bench_now_ns();
+        for (f = 0; f < frames; f++)
+            frame_hash_planes(&frame, crc[path]);
+        ns = bench_now_ns() - start;
+        mismatch |= memcmp(crc[path], crc[0], sizeof(crc[0])) != 0;
+
+        printf("hash %ux%u (%s%s): %.3f ms/frame, %.0f MB/s, %.1f%% of a core at 60 fps\n", BENCH_WIDTH,
+               BENCH_HEIGHT, frame_hash_impl(), path ? "" : ", used", ns / 1e6 / frames,
+               ns ? BENCH_WIDTH * BENCH_HEIGHT * 3 / 2 * (double)frames * 1e3 / ns : 0, ns * 60.0 / frames / 1e7);
+    }
+    /* the padding rows do not count */
+    memset(data + BENCH_WIDTH * BENCH_HEIGHT, 0xff, BENCH_WIDTH * (BENCH_ALIGNED_HEIGHT - BENCH_HEIGHT));
+    frame_hash_planes(&frame, padded);
+    mismatch |= memcmp(crc[0], padded, sizeof(padded)) != 0;
+
+    printf("hash: %s\n", mismatch ? "MISMATCH" : "check value, padding and both paths agree");
+    free(data);
+    if (mismatch)
+        exit(1);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} benchmarks[] = {
+    { "text_overlay", bench_text_overlay },
+    { "colour_convert", bench_colour_convert },
+    { "scale", bench_scale },
+    { "scene_detect", bench_scene_detect },
+    { "handoff", bench_handoff },
+    { "event_loop", bench_event_loop },
+    { "shm_ring", bench_shm_ring },
+    { "event_recorder", bench_event_recorder },
+    { "segmenter", bench_segmenter },
+    { "metrics", bench_metrics },
+    { "trace", bench_trace },
+    { "y4m", bench_y4m },
+    { "quality", bench_quality },
+    { "hash", bench_hash },
+};
+
+int main(int argc, char *argv[])
+{
+    unsigned int i;
+    int a, found;
+
+    for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        found = argc < 2;
+        for (a = 1; a < argc; a++)
+            found |= !strcmp(argv[a], benchmarks[i].name);
+        if (found)
+            benchmarks[i].run();
+    }
+    return 0;
+}
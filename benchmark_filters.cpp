@@ -0,0 +1,111 @@
+/* Fused filter chain (filter_chain.hpp) against the same filters run one
+ * after the other, on a synthetic 1080p I420 frame. No GPU or input needed.
+ *
+ * Usage: ./benchmark_filters [frames]
+ * Build with optimisations for meaningful numbers: make OPTFLAGS=-O2 benchmark_filters */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "frame.h"
+#include "filter_chain.hpp"
+
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_ALIGNED_HEIGHT 1088
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint8_t *bench_alloc_frame(FRAME_T *frame, size_t *size)
+{
+    uint8_t *data;
+
+    *size = BENCH_WIDTH * BENCH_ALIGNED_HEIGHT * 3 / 2;
+    data = (uint8_t *)malloc(*size);
+    if (!data) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < *size; i++)
+        data[i] = (uint8_t)(i * 7 + i / BENCH_WIDTH);
+    frame_init_i420(frame, data, BENCH_WIDTH, BENCH_ALIGNED_HEIGHT, BENCH_WIDTH, BENCH_HEIGHT);
+    return data;
+}
+
+#define BENCH_FRAMES 8
+
+typedef FilterChain<I420, BrightnessContrast, PrivacyMask, CropFill, ChessOverlay> BENCH_CHAIN_T;
+/* two full frame filters, e.g. a brightness and a separate contrast step */
+typedef FilterChain<I420, BrightnessContrast, BrightnessContrast> BENCH_TWO_PASS_T;
+
+/** ms per frame. Cycles through BENCH_FRAMES frames (25 MB), so every frame
+ * comes from memory like a freshly decoded one and not from the cache. */
+template <class Run>
+static double bench_run(const FRAME_T *frames, unsigned int count, Run run)
+{
+    uint64_t start;
+
+    for (unsigned int f = 0; f < BENCH_FRAMES; f++)
+        run(&frames[f]); /* warm up */
+    start = bench_now_ns();
+    for (unsigned int f = 0; f < count; f++)
+        run(&frames[f % BENCH_FRAMES]);
+    return (bench_now_ns() - start) / 1e6 / count;
+}
+
+template <class Chain>
+static void bench_chain(const char *name, const Chain &chain, const FRAME_T *frames, unsigned int count)
+{
+    const size_t filters = std::tuple_size<decltype(chain.filters)>::value;
+    double fused, sequential;
+
+    sequential = bench_run(frames, count, [&chain](const FRAME_T *f) { chain.run_sequential(f); });
+    fused = bench_run(frames, count, [&chain](const FRAME_T *f) { chain.run(f); });
+    printf("%s (%zu filters): sequential %.3f ms/frame, fused %.3f ms/frame (%.2fx)\n",
+           name, filters, sequential, fused, sequential / fused);
+}
+
+int main(int argc, char *argv[])
+{
+    const unsigned int count = argc > 1 ? atoi(argv[1]) : 200;
+    /* 2.35:1 picture letterboxed into 1080p, a masked window and the chess board */
+    const BENCH_CHAIN_T chain(BrightnessContrast(8, 288), PrivacyMask(1200, 300, 320, 240),
+                              CropFill(0, 131, BENCH_WIDTH, 818, BENCH_WIDTH, BENCH_HEIGHT),
+                              ChessOverlay(100, 200, 100, 100));
+    const BENCH_TWO_PASS_T two_pass(BrightnessContrast(8, 256), BrightnessContrast(0, 288));
+    const FilterChain<I420, BrightnessContrast> one_pass(BrightnessContrast(8, 288));
+    const size_t luma = BENCH_WIDTH * BENCH_HEIGHT;
+    FRAME_T frames[BENCH_FRAMES], check;
+    uint8_t *data[BENCH_FRAMES], *check_data;
+    double ms;
+    size_t size;
+
+    for (unsigned int f = 0; f < BENCH_FRAMES; f++)
+        data[f] = bench_alloc_frame(&frames[f], &size);
+    check_data = bench_alloc_frame(&check, &size);
+
+    chain.run(&frames[0]);
+    chain.run_sequential(&check);
+    if (memcmp(data[0], check_data, size)) {
+        fprintf(stderr, "fused and sequential results differ\n");
+        return 1;
+    }
+
+    printf("filter chain, %ux%u I420, %u frames:\n", BENCH_WIDTH, BENCH_HEIGHT, count);
+    ms = bench_run(frames, count, [&one_pass](const FRAME_T *f) { one_pass.run(f); });
+    printf("brightness/contrast alone: %.3f ms/frame, %.0f MB/s read+written\n", ms, 2 * luma / 1e3 / ms);
+    bench_chain("overlay chain", chain, frames, count);
+    bench_chain("brightness + contrast", two_pass, frames, count);
+
+    for (unsigned int f = 0; f < BENCH_FRAMES; f++)
+        free(data[f]);
+    free(check_data);
+    return 0;
+}
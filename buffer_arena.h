@@ -0,0 +1,363 @@
+#ifndef BUFFER_ARENA_H
+#define BUFFER_ARENA_H
+
+/* One memory budget for the buffer pools of a process, and an arena the
+ * payloads of CPU-side pools are carved from.
+ *
+ * Pools are declared first (buffer_arena_pool_add(): the minimum and the
+ * wanted number of buffers and their size), then created. Creating the first
+ * pool plans all declared ones: each gets its minimum, the rest of the budget
+ * goes one buffer at a time to the pool with the smallest share of what it
+ * wanted, so streams are cut back evenly instead of the last one failing. A
+ * pool declared later, or re-sized on a format change, gets what is left.
+ *
+ * A pool of a port with zero copy gets its payloads from the port (VideoCore
+ * memory, mmal_port_pool_create()) and is only counted. Any other pool gets
+ * them from the arena through mmal_pool_create_with_allocator(): large chunks
+ * mapped at once (2 MB hugepages with "huge", else normal pages with a hint
+ * for transparent hugepages), buffers of a page or more start on a page, the
+ * others on a cache line, so neither the CPU nor a VCHIQ bulk transfer splits
+ * lines with a neighbour. Freed payloads are kept for the next pool.
+ *
+ * buffer_arena_sample() counts the buffers each pool has out, for the peak
+ * and steady state (median) printed by buffer_arena_print().
+ *
+ * The budget comes from MMAL_POOL_BUDGET, bytes with K, M or G, and ",huge"
+ * for hugepages: MMAL_POOL_BUDGET=48M,huge. Without it there is no limit.
+ *
+ * One arena per process. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "interface/vcos/vcos.h"
+#include "mmal.h"
+#include "mmal_pool.h"
+#include "mmal_queue.h"
+
+#define BUFFER_ARENA_MAX_POOLS 16
+#define BUFFER_ARENA_MAX_CHUNKS 64
+#define BUFFER_ARENA_MAX_BLOCKS 512
+#define BUFFER_ARENA_CHUNK (4u << 20)
+#define BUFFER_ARENA_HUGEPAGE (2u << 20)
+#define BUFFER_ARENA_LINE 64
+#define BUFFER_ARENA_PAGE 4096
+#define BUFFER_ARENA_HISTOGRAM 64   /* buffers out, for the median */
+
+typedef struct BUFFER_ARENA_POOL_T {
+    char name[32];
+    MMAL_PORT_T *port;              /* payloads from the port, NULL for the arena */
+    unsigned int num_min, num_wanted;
+    unsigned int num;               /* granted */
+    uint32_t size;
+    MMAL_POOL_T *pool;
+    unsigned int peak, samples;
+    unsigned int histogram[BUFFER_ARENA_HISTOGRAM];
+} BUFFER_ARENA_POOL_T;
+
+typedef struct BUFFER_ARENA_T {
+    VCOS_MUTEX_T lock;              /* payloads may be allocated from a callback */
+    size_t budget;                  /* payload bytes of all pools, 0 for no limit */
+    int hugepages;
+    struct {
+        uint8_t *base;
+        size_t size, used;
+        int huge;
+    } chunk[BUFFER_ARENA_MAX_CHUNKS];
+    unsigned int chunks;
+    struct {
+        uint8_t *data;
+        size_t size;
+        int free;
+    } block[BUFFER_ARENA_MAX_BLOCKS];
+    unsigned int blocks;
+    size_t mapped, in_use, peak;    /* arena bytes */
+    size_t committed, peak_committed;   /* payload bytes of the created pools */
+    BUFFER_ARENA_POOL_T pool[BUFFER_ARENA_MAX_POOLS];
+    unsigned int pools;
+} BUFFER_ARENA_T;
+
+static BUFFER_ARENA_T buffer_arena;
+
+/** budget in bytes (0 for none), hugepages to map the chunks with MAP_HUGETLB.
+ * Returns 0, -1 on failure. */
+static int buffer_arena_init(size_t budget, int hugepages)
+{
+    memset(&buffer_arena, 0, sizeof(buffer_arena));
+    buffer_arena.budget = budget;
+    buffer_arena.hugepages = hugepages;
+    return vcos_mutex_create(&buffer_arena.lock, "buffer arena") == VCOS_SUCCESS ? 0 : -1;
+}
+
+/** The budget of MMAL_POOL_BUDGET, if set. Returns 0, -1 (with a message) if it is malformed. */
+static int buffer_arena_init_from_env(void)
+{
+    const char *spec = getenv("MMAL_POOL_BUDGET");
+    const char *units = "KMG";
+    double budget = 0;
+    char *end = NULL;
+
+    if (spec) {
+        budget = strtod(spec, &end);
+        if (*end && strchr(units, *end & ~0x20)) {
+            budget *= 1 << (10 * (strchr(units, *end & ~0x20) - units + 1));
+            end++;
+        }
+        if (budget <= 0 || (*end && strcmp(end, ",huge"))) {
+            fprintf(stderr, "bad MMAL_POOL_BUDGET \"%s\", expected bytes with K, M or G and optionally ,huge\n", spec);
+            return -1;
+        }
+    }
+    return buffer_arena_init((size_t)budget, end && !strcmp(end, ",huge"));
+}
+
+/** Map a chunk for at least size bytes */
+static int buffer_arena_map(BUFFER_ARENA_T *a, size_t size)
+{
+    size_t length = size > BUFFER_ARENA_CHUNK ? size : BUFFER_ARENA_CHUNK;
+    void *base = MAP_FAILED;
+    int huge = 0;
+
+    if (a->chunks == BUFFER_ARENA_MAX_CHUNKS)
+        return -1;
+    length = (length + BUFFER_ARENA_HUGEPAGE - 1) & ~(size_t)(BUFFER_ARENA_HUGEPAGE - 1);
+#ifdef MAP_HUGETLB
+    if (a->hugepages) {
+        base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        huge = base != MAP_FAILED;
+    }
+#endif
+    if (base == MAP_FAILED) {
+        base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return -1;
+#ifdef MADV_HUGEPAGE
+        madvise(base, length, MADV_HUGEPAGE);
+#endif
+    }
+    a->chunk[a->chunks].base = (uint8_t *)base;
+    a->chunk[a->chunks].size = length;
+    a->chunk[a->chunks].used = 0;
+    a->chunk[a->chunks].huge = huge;
+    a->chunks++;
+    a->mapped += length;
+    return 0;
+}
+
+/** mmal_pool_create_with_allocator() allocator, context is the pool */
+static void *buffer_arena_alloc(void *context, uint32_t size)
+{
+    BUFFER_ARENA_T *a = &buffer_arena;
+    size_t align = size >= BUFFER_ARENA_PAGE ? BUFFER_ARENA_PAGE : BUFFER_ARENA_LINE;
+    size_t length = (size + BUFFER_ARENA_LINE - 1) & ~(size_t)(BUFFER_ARENA_LINE - 1);
+    uint8_t *data = NULL;
+    unsigned int i, best = BUFFER_ARENA_MAX_BLOCKS;
+
+    (void)context;
+    vcos_mutex_lock(&a->lock);
+    /* the smallest freed payload which fits and is aligned well enough */
+    for (i = 0; i < a->blocks; i++)
+        if (a->block[i].free && a->block[i].size >= length && !((uintptr_t)a->block[i].data & (align - 1)) &&
+            (best == BUFFER_ARENA_MAX_BLOCKS || a->block[i].size < a->block[best].size))
+            best = i;
+    if (best != BUFFER_ARENA_MAX_BLOCKS) {
+        a->block[best].free = 0;
+        data = a->block[best].data;
+        a->in_use += a->block[best].size;
+    } else if (a->blocks < BUFFER_ARENA_MAX_BLOCKS) {
+        size_t offset = 0;
+        if (a->chunks)
+            offset = (a->chunk[a->chunks - 1].used + align - 1) & ~(align - 1);
+        if ((!a->chunks || offset + length > a->chunk[a->chunks - 1].size) && buffer_arena_map(a, length) == 0)
+            offset = 0;
+        if (a->chunks && offset + length <= a->chunk[a->chunks - 1].size) {
+            data = a->chunk[a->chunks - 1].base + offset;
+            a->chunk[a->chunks - 1].used = offset + length;
+            a->block[a->blocks].data = data;
+            a->block[a->blocks].size = length;
+            a->block[a->blocks].free = 0;
+            a->blocks++;
+            a->in_use += length;
+        }
+    }
+    if (a->in_use > a->peak)
+        a->peak = a->in_use;
+    vcos_mutex_unlock(&a->lock);
+    return data;
+}
+
+static void buffer_arena_free(void *context, void *mem)
+{
+    BUFFER_ARENA_T *a = &buffer_arena;
+    unsigned int i;
+
+    (void)context;
+    vcos_mutex_lock(&a->lock);
+    for (i = 0; i < a->blocks; i++)
+        if (a->block[i].data == mem && !a->block[i].free) {
+            a->block[i].free = 1;
+            a->in_use -= a->block[i].size;
+            break;
+        }
+    vcos_mutex_unlock(&a->lock);
+}
+
+/** Declare a pool of num_min to num_wanted buffers of size bytes. port is the
+ * port with zero copy the payloads come from, NULL to carve them from the
+ * arena. Returns NULL if there are too many pools. */
+static BUFFER_ARENA_POOL_T *buffer_arena_pool_add(const char *name, MMAL_PORT_T *port, unsigned int num_min,
+                                                  unsigned int num_wanted, uint32_t size)
+{
+    BUFFER_ARENA_POOL_T *p;
+
+    if (buffer_arena.pools == BUFFER_ARENA_MAX_POOLS)
+        return NULL;
+    p = &buffer_arena.pool[buffer_arena.pools++];
+    memset(p, 0, sizeof(*p));
+    snprintf(p->name, sizeof(p->name), "%s", name);
+    p->port = port;
+    p->num_min = num_min ? num_min : 1;
+    p->num_wanted = num_wanted > p->num_min ? num_wanted : p->num_min;
+    p->size = size;
+    return p;
+}
+
+/** Share the budget among the declared pools which are not created yet.
+ * Returns 0, -1 if their minimums do not fit. */
+static int buffer_arena_plan(BUFFER_ARENA_T *a)
+{
+    size_t used = 0;
+    unsigned int i;
+
+    for (i = 0; i < a->pools; i++) {
+        BUFFER_ARENA_POOL_T *p = &a->pool[i];
+        if (!p->pool)
+            p->num = p->num_min;
+        used += (size_t)p->num * p->size;
+    }
+    if (a->budget && used > a->budget)
+        return -1;
+    for (;;) {
+        BUFFER_ARENA_POOL_T *best = NULL;
+        for (i = 0; i < a->pools; i++) {
+            BUFFER_ARENA_POOL_T *p = &a->pool[i];
+            if (p->pool || p->num >= p->num_wanted || (a->budget && used + p->size > a->budget))
+                continue;
+            /* the smallest share of what it wanted first */
+            if (!best || (uint64_t)p->num * best->num_wanted < (uint64_t)best->num * p->num_wanted)
+                best = p;
+        }
+        if (!best)
+            break;
+        best->num++;
+        used += best->size;
+    }
+    return 0;
+}
+
+/** Create a declared pool with the number of buffers it was granted (p->num).
+ * Returns NULL if its minimum does not fit into the budget or out of memory. */
+static MMAL_POOL_T *buffer_arena_pool_create(BUFFER_ARENA_POOL_T *p)
+{
+    BUFFER_ARENA_T *a = &buffer_arena;
+
+    if (!p || p->pool)
+        return p ? p->pool : NULL;
+    if (buffer_arena_plan(a) != 0) {
+        fprintf(stderr, "buffer budget of %.1f MB too small for the minimum of every pool, creating %s (%u x %u "
+                "bytes)\n", a->budget / 1048576.0, p->name, p->num_min, p->size);
+        return NULL;
+    }
+    if (p->port)
+        p->pool = mmal_port_pool_create(p->port, p->num, p->size);
+    else
+        p->pool = mmal_pool_create_with_allocator(p->num, p->size, p, buffer_arena_alloc, buffer_arena_free);
+    if (!p->pool)
+        return NULL;
+    a->committed += (size_t)p->num * p->size;
+    if (a->committed > a->peak_committed)
+        a->peak_committed = a->committed;
+    return p->pool;
+}
+
+/** Give the buffers back. The pool can be declared again with buffer_arena_pool_resize(). */
+static void buffer_arena_pool_destroy(BUFFER_ARENA_POOL_T *p)
+{
+    if (!p || !p->pool)
+        return;
+    if (p->port)
+        mmal_port_pool_destroy(p->port, p->pool);
+    else
+        mmal_pool_destroy(p->pool);
+    p->pool = NULL;
+    buffer_arena.committed -= (size_t)p->num * p->size;
+}
+
+/** New requirements for a destroyed pool, e.g. after a format change */
+static void buffer_arena_pool_resize(BUFFER_ARENA_POOL_T *p, unsigned int num_min, unsigned int num_wanted,
+                                     uint32_t size)
+{
+    p->num_min = num_min ? num_min : 1;
+    p->num_wanted = num_wanted > p->num_min ? num_wanted : p->num_min;
+    p->size = size;
+}
+
+/** Count the buffers every pool has out. Call regularly, e.g. once per frame. */
+static void buffer_arena_sample(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < buffer_arena.pools; i++) {
+        BUFFER_ARENA_POOL_T *p = &buffer_arena.pool[i];
+        unsigned int out;
+        if (!p->pool)
+            continue;
+        out = p->pool->headers_num - mmal_queue_length(p->pool->queue);
+        if (out > p->peak)
+            p->peak = out;
+        p->histogram[out < BUFFER_ARENA_HISTOGRAM ? out : BUFFER_ARENA_HISTOGRAM - 1]++;
+        p->samples++;
+    }
+}
+
+static void buffer_arena_print(FILE *file)
+{
+    BUFFER_ARENA_T *a = &buffer_arena;
+    unsigned int i, huge = 0;
+
+    for (i = 0; i < a->chunks; i++)
+        huge += a->chunk[i].huge;
+    if (a->budget)
+        fprintf(file, "buffer pools: budget %.1f MB, ", a->budget / 1048576.0);
+    else
+        fprintf(file, "buffer pools: no budget, ");
+    fprintf(file, "%.1f MB committed at most; arena %.1f MB mapped in %u chunks (%u hugepage), %.1f MB used at "
+            "most\n", a->peak_committed / 1048576.0, a->mapped / 1048576.0, a->chunks, huge, a->peak / 1048576.0);
+    for (i = 0; i < a->pools; i++) {
+        BUFFER_ARENA_POOL_T *p = &a->pool[i];
+        unsigned int median = 0, seen = 0;
+        while (median < BUFFER_ARENA_HISTOGRAM && (seen += p->histogram[median]) <= p->samples / 2)
+            median++;
+        fprintf(file, "  %-20s %2u of %2u wanted (min %u) x %u bytes = %.2f MB from the %s, out: peak %u (%.2f MB), "
+                "steady %u (%.2f MB)\n", p->name, p->num, p->num_wanted, p->num_min, p->size,
+                (double)p->num * p->size / 1048576.0, p->port ? "port" : "arena", p->peak,
+                (double)p->peak * p->size / 1048576.0, p->samples ? median : 0,
+                p->samples ? (double)median * p->size / 1048576.0 : 0.0);
+    }
+}
+
+/** Unmap the arena, after all pools are destroyed */
+static void buffer_arena_destroy(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < buffer_arena.chunks; i++)
+        munmap(buffer_arena.chunk[i].base, buffer_arena.chunk[i].size);
+    buffer_arena.chunks = 0;
+    buffer_arena.blocks = 0;
+    vcos_mutex_delete(&buffer_arena.lock);
+}
+
+#endif
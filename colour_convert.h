@@ -0,0 +1,603 @@
+#ifndef COLOUR_CONVERT_H
+#define COLOUR_CONVERT_H
+
+/* Colour-space conversion for decoded frames: I420 <-> NV12, I420 -> RGB24/RGBA
+ * and RGBA -> I420 (to feed the encoder), BT.601/BT.709, limited/full range.
+ *
+ * All conversions are done in 16 bit fixed point. The RGB kernels work on
+ * 8 pixels at a time with NEON (build with -mfpu=neon on the Pi) or SSE2
+ * intrinsics, the chroma (de)interleaving uses GCC vector shuffles. The per
+ * pixel reference functions do exactly the same integer arithmetic, including
+ * the 16 bit saturation, so the results are bit-exact (see the colour_convert
+ * benchmark). Without NEON or SSE2 the reference code is used.
+ *
+ * Frames are processed in pairs of rows (which share one chroma row), honouring
+ * the pitch of every plane, so any range of row pairs can be converted on its
+ * own. COLOUR_WORKERS_T uses this to split a frame across threads.
+ * Width and height must be even. Packed RGBA is assumed to be little endian. */
+
+#include <stdint.h>
+#include <string.h>
+#include "interface/vcos/vcos.h"
+#include "frame.h"
+#include "thread_roles.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+typedef enum {
+    COLOUR_MATRIX_BT601,
+    COLOUR_MATRIX_BT709,
+} COLOUR_MATRIX_T;
+
+typedef enum {
+    COLOUR_RANGE_LIMITED, /* Y 16..235, U/V 16..240 */
+    COLOUR_RANGE_FULL,    /* 0..255 */
+} COLOUR_RANGE_T;
+
+typedef enum {
+    COLOUR_I420_TO_NV12,
+    COLOUR_NV12_TO_I420,
+    COLOUR_I420_TO_RGB24,
+    COLOUR_I420_TO_RGBA,
+    COLOUR_RGBA_TO_I420,
+} COLOUR_CONVERSION_T;
+
+/** Fixed point conversion coefficients, 6 fractional bits for YUV -> RGB
+ * and 8 fractional bits for RGB -> YUV, so every product fits in 16 bits. */
+typedef struct COLOUR_COEFFS_T {
+    int16_t y_offset, y_scale;
+    int16_t v_to_r, u_to_g, v_to_g, u_to_b;
+    int16_t r_to_y, g_to_y, b_to_y;
+    int16_t r_to_u, g_to_u, b_to_u;
+    int16_t r_to_v, g_to_v, b_to_v;
+} COLOUR_COEFFS_T;
+
+typedef struct COLOUR_JOB_T {
+    COLOUR_CONVERSION_T conversion;
+    const FRAME_T *src;
+    FRAME_T *dst;
+    const COLOUR_COEFFS_T *coeffs; /* only needed for RGB conversions */
+} COLOUR_JOB_T;
+
+typedef uint8_t colour_bytes_t __attribute__((vector_size(16)));
+
+#define COLOUR_FIX(x, bits) ((int16_t)((x) * (1 << (bits)) + ((x) < 0 ? -0.5 : 0.5)))
+
+static void colour_coeffs_init(COLOUR_COEFFS_T *c, COLOUR_MATRIX_T matrix, COLOUR_RANGE_T range)
+{
+    double kr = matrix == COLOUR_MATRIX_BT709 ? 0.2126 : 0.299;
+    double kb = matrix == COLOUR_MATRIX_BT709 ? 0.0722 : 0.114;
+    double kg = 1.0 - kr - kb;
+    double ys = range == COLOUR_RANGE_LIMITED ? 219.0 / 255.0 : 1.0;
+    double cs = range == COLOUR_RANGE_LIMITED ? 224.0 / 255.0 : 1.0;
+
+    c->y_offset = range == COLOUR_RANGE_LIMITED ? 16 : 0;
+    c->y_scale = COLOUR_FIX(1.0 / ys, 6);
+    c->v_to_r = COLOUR_FIX(2.0 * (1.0 - kr) / cs, 6);
+    c->u_to_g = COLOUR_FIX(2.0 * (1.0 - kb) * kb / kg / cs, 6);
+    c->v_to_g = COLOUR_FIX(2.0 * (1.0 - kr) * kr / kg / cs, 6);
+    c->u_to_b = COLOUR_FIX(2.0 * (1.0 - kb) / cs, 6);
+
+    c->r_to_y = COLOUR_FIX(kr * ys, 8);
+    c->g_to_y = COLOUR_FIX(kg * ys, 8);
+    c->b_to_y = COLOUR_FIX(kb * ys, 8);
+    c->r_to_u = COLOUR_FIX(-kr / (2.0 * (1.0 - kb)) * cs, 8);
+    c->g_to_u = COLOUR_FIX(-kg / (2.0 * (1.0 - kb)) * cs, 8);
+    c->b_to_u = COLOUR_FIX(0.5 * cs, 8);
+    c->r_to_v = COLOUR_FIX(0.5 * cs, 8);
+    c->g_to_v = COLOUR_FIX(-kg / (2.0 * (1.0 - kr)) * cs, 8);
+    c->b_to_v = COLOUR_FIX(-kb / (2.0 * (1.0 - kr)) * cs, 8);
+}
+
+static inline uint8_t colour_clamp(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* 16 bit saturating add, as done by the SIMD instructions */
+static inline int16_t colour_sat16(int v)
+{
+    return v < -32768 ? -32768 : v > 32767 ? 32767 : v;
+}
+
+/* ---- per pixel reference ---- */
+
+static inline void colour_yuv_to_rgb_pixel(const COLOUR_COEFFS_T *c, int y, int u, int v, uint8_t *rgb)
+{
+    int16_t yy = (int16_t)((y - c->y_offset) * c->y_scale + 32);
+
+    u -= 128;
+    v -= 128;
+    rgb[0] = colour_clamp(colour_sat16(yy + v * c->v_to_r) >> 6);
+    rgb[1] = colour_clamp(colour_sat16(colour_sat16(yy - u * c->u_to_g) - v * c->v_to_g) >> 6);
+    rgb[2] = colour_clamp(colour_sat16(yy + u * c->u_to_b) >> 6);
+}
+
+static inline uint8_t colour_rgb_to_y_pixel(const COLOUR_COEFFS_T *c, int r, int g, int b)
+{
+    /* all terms are positive and the sum stays below 65536 */
+    return ((r * c->r_to_y + g * c->g_to_y + b * c->b_to_y + 128) >> 8) + c->y_offset;
+}
+
+static inline uint8_t colour_rgb_to_c_pixel(int r, int g, int b, int16_t cr, int16_t cg, int16_t cb)
+{
+    int16_t t = r * cr;
+
+    t = colour_sat16(t + g * cg);
+    t = colour_sat16(t + b * cb);
+    t = colour_sat16(t + 128);
+    return colour_clamp((t >> 8) + 128);
+}
+
+/* ---- row kernels: SIMD with the per pixel reference for the tail ---- */
+
+static void colour_yuv_to_rgb_row_ref(const COLOUR_COEFFS_T *c, const uint8_t *y, const uint8_t *u,
+                                      const uint8_t *v, uint8_t *dst, unsigned int bpp,
+                                      unsigned int from, unsigned int width)
+{
+    unsigned int x;
+
+    for (x = from; x < width; x++) {
+        colour_yuv_to_rgb_pixel(c, y[x], u[x / 2], v[x / 2], dst + x * bpp);
+        if (bpp == 4)
+            dst[x * 4 + 3] = 255;
+    }
+}
+
+static void colour_yuv_to_rgb_row(const COLOUR_COEFFS_T *c, const uint8_t *y, const uint8_t *u,
+                                  const uint8_t *v, uint8_t *dst, unsigned int bpp, unsigned int width)
+{
+    unsigned int x = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    int16x8_t yoff = vdupq_n_s16(c->y_offset), c128 = vdupq_n_s16(128), c32 = vdupq_n_s16(32);
+
+    for (; x + 8 <= width; x += 8) {
+        uint32_t cu, cv;
+        int16x8_t Y, U, V;
+        uint8x8x4_t px;
+
+        memcpy(&cu, u + x / 2, 4);
+        memcpy(&cv, v + x / 2, 4);
+        Y = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y + x)));
+        U = vreinterpretq_s16_u16(vmovl_u8(vzip_u8(vcreate_u8(cu), vcreate_u8(cu)).val[0]));
+        V = vreinterpretq_s16_u16(vmovl_u8(vzip_u8(vcreate_u8(cv), vcreate_u8(cv)).val[0]));
+
+        Y = vaddq_s16(vmulq_n_s16(vsubq_s16(Y, yoff), c->y_scale), c32);
+        U = vsubq_s16(U, c128);
+        V = vsubq_s16(V, c128);
+        px.val[0] = vqmovun_s16(vshrq_n_s16(vqaddq_s16(Y, vmulq_n_s16(V, c->v_to_r)), 6));
+        px.val[1] = vqmovun_s16(vshrq_n_s16(vqsubq_s16(vqsubq_s16(Y, vmulq_n_s16(U, c->u_to_g)),
+                                                       vmulq_n_s16(V, c->v_to_g)), 6));
+        px.val[2] = vqmovun_s16(vshrq_n_s16(vqaddq_s16(Y, vmulq_n_s16(U, c->u_to_b)), 6));
+        px.val[3] = vdup_n_u8(255);
+
+        if (bpp == 4) {
+            vst4_u8(dst + x * 4, px);
+        } else {
+            uint8x8x3_t rgb = { { px.val[0], px.val[1], px.val[2] } };
+            vst3_u8(dst + x * 3, rgb);
+        }
+    }
+#elif defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128(), yoff = _mm_set1_epi16(c->y_offset);
+    __m128i c128 = _mm_set1_epi16(128), c32 = _mm_set1_epi16(32), alpha = _mm_set1_epi8((char)255);
+    __m128i ys = _mm_set1_epi16(c->y_scale), vr = _mm_set1_epi16(c->v_to_r);
+    __m128i ug = _mm_set1_epi16(c->u_to_g), vg = _mm_set1_epi16(c->v_to_g), ub = _mm_set1_epi16(c->u_to_b);
+
+    for (; x + 8 <= width; x += 8) {
+        int32_t cu, cv;
+        __m128i Y, U, V, R, G, B, rg, ba, px[2];
+
+        memcpy(&cu, u + x / 2, 4);
+        memcpy(&cv, v + x / 2, 4);
+        Y = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y + x)), zero);
+        U = _mm_cvtsi32_si128(cu);
+        V = _mm_cvtsi32_si128(cv);
+        U = _mm_unpacklo_epi8(_mm_unpacklo_epi8(U, U), zero);
+        V = _mm_unpacklo_epi8(_mm_unpacklo_epi8(V, V), zero);
+
+        Y = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(Y, yoff), ys), c32);
+        U = _mm_sub_epi16(U, c128);
+        V = _mm_sub_epi16(V, c128);
+        R = _mm_srai_epi16(_mm_adds_epi16(Y, _mm_mullo_epi16(V, vr)), 6);
+        G = _mm_srai_epi16(_mm_subs_epi16(_mm_subs_epi16(Y, _mm_mullo_epi16(U, ug)),
+                                          _mm_mullo_epi16(V, vg)), 6);
+        B = _mm_srai_epi16(_mm_adds_epi16(Y, _mm_mullo_epi16(U, ub)), 6);
+
+        R = _mm_packus_epi16(R, R);
+        G = _mm_packus_epi16(G, G);
+        B = _mm_packus_epi16(B, B);
+        rg = _mm_unpacklo_epi8(R, G);
+        ba = _mm_unpacklo_epi8(B, alpha);
+        px[0] = _mm_unpacklo_epi16(rg, ba);
+        px[1] = _mm_unpackhi_epi16(rg, ba);
+
+        if (bpp == 4) {
+            _mm_storeu_si128((__m128i *)(dst + x * 4), px[0]);
+            _mm_storeu_si128((__m128i *)(dst + x * 4 + 16), px[1]);
+        } else {
+            /* no byte shuffle before SSSE3, drop the alpha bytes by hand */
+            const uint8_t *rgba = (const uint8_t *)px;
+            uint8_t *out = dst + x * 3;
+            unsigned int i;
+            for (i = 0; i < 8; i++, out += 3, rgba += 4) {
+                out[0] = rgba[0];
+                out[1] = rgba[1];
+                out[2] = rgba[2];
+            }
+        }
+    }
+#endif
+    colour_yuv_to_rgb_row_ref(c, y, u, v, dst, bpp, x, width);
+}
+
+static void colour_rgba_to_yuv_rows_ref(const COLOUR_COEFFS_T *c, const uint8_t *src0, const uint8_t *src1,
+                                        uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                                        unsigned int from, unsigned int width)
+{
+    unsigned int x;
+
+    for (x = from; x < width; x += 2) {
+        const uint8_t *a = src0 + x * 4, *b = src1 + x * 4;
+        int r = (a[0] + a[4] + b[0] + b[4] + 2) >> 2;
+        int g = (a[1] + a[5] + b[1] + b[5] + 2) >> 2;
+        int bl = (a[2] + a[6] + b[2] + b[6] + 2) >> 2;
+
+        y0[x] = colour_rgb_to_y_pixel(c, a[0], a[1], a[2]);
+        y0[x + 1] = colour_rgb_to_y_pixel(c, a[4], a[5], a[6]);
+        y1[x] = colour_rgb_to_y_pixel(c, b[0], b[1], b[2]);
+        y1[x + 1] = colour_rgb_to_y_pixel(c, b[4], b[5], b[6]);
+        u[x / 2] = colour_rgb_to_c_pixel(r, g, bl, c->r_to_u, c->g_to_u, c->b_to_u);
+        v[x / 2] = colour_rgb_to_c_pixel(r, g, bl, c->r_to_v, c->g_to_v, c->b_to_v);
+    }
+}
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static inline uint8x8_t colour_rgb_to_y_neon(const COLOUR_COEFFS_T *c, uint8x8x4_t px)
+{
+    uint16x8_t t = vmull_u8(px.val[0], vdup_n_u8(c->r_to_y));
+    t = vmlal_u8(t, px.val[1], vdup_n_u8(c->g_to_y));
+    t = vmlal_u8(t, px.val[2], vdup_n_u8(c->b_to_y));
+    t = vshrq_n_u16(vaddq_u16(t, vdupq_n_u16(128)), 8);
+    return vadd_u8(vmovn_u16(t), vdup_n_u8(c->y_offset));
+}
+
+static inline uint8x8_t colour_rgb_to_c_neon(int16x4_t r, int16x4_t g, int16x4_t b,
+                                             int16_t cr, int16_t cg, int16_t cb)
+{
+    int16x4_t t = vmul_n_s16(r, cr);
+    t = vqadd_s16(t, vmul_n_s16(g, cg));
+    t = vqadd_s16(t, vmul_n_s16(b, cb));
+    t = vqadd_s16(t, vdup_n_s16(128));
+    t = vadd_s16(vshr_n_s16(t, 8), vdup_n_s16(128));
+    return vqmovun_s16(vcombine_s16(t, t));
+}
+
+/* (sum of the 2x2 blocks + 2) / 4 for 8 pixels of two rows */
+static inline int16x4_t colour_average_neon(uint8x8_t a, uint8x8_t b)
+{
+    uint32x4_t s = vpaddlq_u16(vaddl_u8(a, b));
+    return vreinterpret_s16_u16(vmovn_u32(vshrq_n_u32(vaddq_u32(s, vdupq_n_u32(2)), 2)));
+}
+#elif defined(__SSE2__)
+/* split 8 RGBA pixels into 16 bit R, G, B vectors */
+static inline void colour_unpack_sse2(const uint8_t *src, __m128i *r, __m128i *g, __m128i *b)
+{
+    __m128i mask = _mm_set1_epi32(0xff);
+    __m128i p0 = _mm_loadu_si128((const __m128i *)src), p1 = _mm_loadu_si128((const __m128i *)(src + 16));
+
+    *r = _mm_packs_epi32(_mm_and_si128(p0, mask), _mm_and_si128(p1, mask));
+    *g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), mask), _mm_and_si128(_mm_srli_epi32(p1, 8), mask));
+    *b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), mask), _mm_and_si128(_mm_srli_epi32(p1, 16), mask));
+}
+
+static inline __m128i colour_rgb_to_y_sse2(const COLOUR_COEFFS_T *c, __m128i r, __m128i g, __m128i b)
+{
+    /* unsigned 16 bit arithmetic, the sum cannot overflow */
+    __m128i t = _mm_mullo_epi16(r, _mm_set1_epi16(c->r_to_y));
+    t = _mm_add_epi16(t, _mm_mullo_epi16(g, _mm_set1_epi16(c->g_to_y)));
+    t = _mm_add_epi16(t, _mm_mullo_epi16(b, _mm_set1_epi16(c->b_to_y)));
+    t = _mm_srli_epi16(_mm_add_epi16(t, _mm_set1_epi16(128)), 8);
+    return _mm_add_epi16(t, _mm_set1_epi16(c->y_offset));
+}
+
+static inline __m128i colour_rgb_to_c_sse2(__m128i r, __m128i g, __m128i b, int16_t cr, int16_t cg, int16_t cb)
+{
+    __m128i t = _mm_mullo_epi16(r, _mm_set1_epi16(cr));
+    t = _mm_adds_epi16(t, _mm_mullo_epi16(g, _mm_set1_epi16(cg)));
+    t = _mm_adds_epi16(t, _mm_mullo_epi16(b, _mm_set1_epi16(cb)));
+    t = _mm_adds_epi16(t, _mm_set1_epi16(128));
+    return _mm_add_epi16(_mm_srai_epi16(t, 8), _mm_set1_epi16(128));
+}
+
+/* (sum of the 2x2 blocks + 2) / 4, the 4 results are in the low lanes */
+static inline __m128i colour_average_sse2(__m128i a, __m128i b)
+{
+    __m128i s = _mm_madd_epi16(_mm_add_epi16(a, b), _mm_set1_epi16(1));
+    s = _mm_srli_epi32(_mm_add_epi32(s, _mm_set1_epi32(2)), 2);
+    return _mm_packs_epi32(s, s);
+}
+#endif
+
+static void colour_rgba_to_yuv_rows(const COLOUR_COEFFS_T *c, const uint8_t *src0, const uint8_t *src1,
+                                    uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, unsigned int width)
+{
+    unsigned int x = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; x + 8 <= width; x += 8) {
+        uint8x8x4_t p0 = vld4_u8(src0 + x * 4), p1 = vld4_u8(src1 + x * 4);
+        int16x4_t r = colour_average_neon(p0.val[0], p1.val[0]);
+        int16x4_t g = colour_average_neon(p0.val[1], p1.val[1]);
+        int16x4_t b = colour_average_neon(p0.val[2], p1.val[2]);
+
+        vst1_u8(y0 + x, colour_rgb_to_y_neon(c, p0));
+        vst1_u8(y1 + x, colour_rgb_to_y_neon(c, p1));
+        vst1_lane_u32((uint32_t *)(u + x / 2),
+                      vreinterpret_u32_u8(colour_rgb_to_c_neon(r, g, b, c->r_to_u, c->g_to_u, c->b_to_u)), 0);
+        vst1_lane_u32((uint32_t *)(v + x / 2),
+                      vreinterpret_u32_u8(colour_rgb_to_c_neon(r, g, b, c->r_to_v, c->g_to_v, c->b_to_v)), 0);
+    }
+#elif defined(__SSE2__)
+    for (; x + 8 <= width; x += 8) {
+        __m128i r0, g0, b0, r1, g1, b1, r, g, b, Y0, Y1, U, V;
+        int32_t cu, cv;
+
+        colour_unpack_sse2(src0 + x * 4, &r0, &g0, &b0);
+        colour_unpack_sse2(src1 + x * 4, &r1, &g1, &b1);
+        Y0 = colour_rgb_to_y_sse2(c, r0, g0, b0);
+        Y1 = colour_rgb_to_y_sse2(c, r1, g1, b1);
+        _mm_storel_epi64((__m128i *)(y0 + x), _mm_packus_epi16(Y0, Y0));
+        _mm_storel_epi64((__m128i *)(y1 + x), _mm_packus_epi16(Y1, Y1));
+
+        r = colour_average_sse2(r0, r1);
+        g = colour_average_sse2(g0, g1);
+        b = colour_average_sse2(b0, b1);
+        U = colour_rgb_to_c_sse2(r, g, b, c->r_to_u, c->g_to_u, c->b_to_u);
+        V = colour_rgb_to_c_sse2(r, g, b, c->r_to_v, c->g_to_v, c->b_to_v);
+        cu = _mm_cvtsi128_si32(_mm_packus_epi16(U, U));
+        cv = _mm_cvtsi128_si32(_mm_packus_epi16(V, V));
+        memcpy(u + x / 2, &cu, 4);
+        memcpy(v + x / 2, &cv, 4);
+    }
+#endif
+    colour_rgba_to_yuv_rows_ref(c, src0, src1, y0, y1, u, v, x, width);
+}
+
+static void colour_interleave_row_ref(const uint8_t *u, const uint8_t *v, uint8_t *uv, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        uv[2 * i] = u[i];
+        uv[2 * i + 1] = v[i];
+    }
+}
+
+static void colour_interleave_row(const uint8_t *u, const uint8_t *v, uint8_t *uv, unsigned int n)
+{
+    static const colour_bytes_t lo = { 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23 };
+    static const colour_bytes_t hi = { 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31 };
+    unsigned int i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        colour_bytes_t U, V, out[2];
+        memcpy(&U, u + i, 16);
+        memcpy(&V, v + i, 16);
+        out[0] = __builtin_shuffle(U, V, lo);
+        out[1] = __builtin_shuffle(U, V, hi);
+        memcpy(uv + 2 * i, out, 32);
+    }
+    colour_interleave_row_ref(u + i, v + i, uv + 2 * i, n - i);
+}
+
+static void colour_deinterleave_row_ref(const uint8_t *uv, uint8_t *u, uint8_t *v, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        u[i] = uv[2 * i];
+        v[i] = uv[2 * i + 1];
+    }
+}
+
+static void colour_deinterleave_row(const uint8_t *uv, uint8_t *u, uint8_t *v, unsigned int n)
+{
+    static const colour_bytes_t even = { 0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30 };
+    static const colour_bytes_t odd = { 1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31 };
+    unsigned int i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        colour_bytes_t in[2], U, V;
+        memcpy(in, uv + 2 * i, 32);
+        U = __builtin_shuffle(in[0], in[1], even);
+        V = __builtin_shuffle(in[0], in[1], odd);
+        memcpy(u + i, &U, 16);
+        memcpy(v + i, &V, 16);
+    }
+    colour_deinterleave_row_ref(uv + 2 * i, u + i, v + i, n - i);
+}
+
+/* ---- frame level ---- */
+
+static void colour_convert_rows_impl(const COLOUR_JOB_T *job, unsigned int first, unsigned int last, int reference)
+{
+    const FRAME_T *s = job->src;
+    FRAME_T *d = job->dst;
+    unsigned int width = s->width, row;
+
+    for (row = first & ~1u; row < last; row += 2) {
+        const uint8_t *sy0 = s->plane[0] + row * s->pitch[0], *sy1 = sy0 + s->pitch[0];
+        uint8_t *dy0 = d->plane[0] + row * d->pitch[0], *dy1 = dy0 + d->pitch[0];
+        unsigned int c = row / 2;
+
+        switch (job->conversion) {
+        case COLOUR_I420_TO_NV12:
+            memcpy(dy0, sy0, width);
+            memcpy(dy1, sy1, width);
+            (reference ? colour_interleave_row_ref : colour_interleave_row)(
+                s->plane[1] + c * s->pitch[1], s->plane[2] + c * s->pitch[2],
+                d->plane[1] + c * d->pitch[1], width / 2);
+            break;
+        case COLOUR_NV12_TO_I420:
+            memcpy(dy0, sy0, width);
+            memcpy(dy1, sy1, width);
+            (reference ? colour_deinterleave_row_ref : colour_deinterleave_row)(
+                s->plane[1] + c * s->pitch[1], d->plane[1] + c * d->pitch[1],
+                d->plane[2] + c * d->pitch[2], width / 2);
+            break;
+        case COLOUR_I420_TO_RGB24:
+        case COLOUR_I420_TO_RGBA: {
+            unsigned int bpp = job->conversion == COLOUR_I420_TO_RGBA ? 4 : 3;
+            const uint8_t *u = s->plane[1] + c * s->pitch[1], *v = s->plane[2] + c * s->pitch[2];
+            if (reference) {
+                colour_yuv_to_rgb_row_ref(job->coeffs, sy0, u, v, dy0, bpp, 0, width);
+                colour_yuv_to_rgb_row_ref(job->coeffs, sy1, u, v, dy1, bpp, 0, width);
+            } else {
+                colour_yuv_to_rgb_row(job->coeffs, sy0, u, v, dy0, bpp, width);
+                colour_yuv_to_rgb_row(job->coeffs, sy1, u, v, dy1, bpp, width);
+            }
+            break;
+        }
+        case COLOUR_RGBA_TO_I420: {
+            uint8_t *u = d->plane[1] + c * d->pitch[1], *v = d->plane[2] + c * d->pitch[2];
+            if (reference)
+                colour_rgba_to_yuv_rows_ref(job->coeffs, sy0, sy1, dy0, dy1, u, v, 0, width);
+            else
+                colour_rgba_to_yuv_rows(job->coeffs, sy0, sy1, dy0, dy1, u, v, width);
+            break;
+        }
+        }
+    }
+}
+
+/** Convert rows [first, last) of the frame. first is rounded down to even. */
+static void colour_convert_rows(const COLOUR_JOB_T *job, unsigned int first, unsigned int last)
+{
+    colour_convert_rows_impl(job, first, last, 0);
+}
+
+static void colour_convert(const COLOUR_JOB_T *job)
+{
+    colour_convert_rows_impl(job, 0, job->src->height, 0);
+}
+
+/** Scalar per pixel reference, used to verify the vector kernels */
+static void colour_convert_ref(const COLOUR_JOB_T *job)
+{
+    colour_convert_rows_impl(job, 0, job->src->height, 1);
+}
+
+/* ---- multithreaded row split ---- */
+
+#define COLOUR_MAX_WORKERS 8
+
+struct COLOUR_WORKERS_T;
+
+typedef struct COLOUR_WORKER_T {
+    struct COLOUR_WORKERS_T *pool;
+    unsigned int index;
+    VCOS_THREAD_T thread;
+    VCOS_SEMAPHORE_T start;
+} COLOUR_WORKER_T;
+
+/** A set of persistent threads which each convert one band of row pairs.
+ * The calling thread converts the last band itself. */
+typedef struct COLOUR_WORKERS_T {
+    unsigned int count;
+    COLOUR_WORKER_T worker[COLOUR_MAX_WORKERS];
+    VCOS_SEMAPHORE_T done;
+    const COLOUR_JOB_T *job;
+    int quit;
+} COLOUR_WORKERS_T;
+
+static void colour_band(const COLOUR_JOB_T *job, unsigned int band, unsigned int bands,
+                        unsigned int *first, unsigned int *last)
+{
+    unsigned int pairs = (job->src->height + 1) / 2;
+    *first = pairs * band / bands * 2;
+    *last = pairs * (band + 1) / bands * 2;
+}
+
+static void *colour_worker_thread(void *arg)
+{
+    COLOUR_WORKER_T *w = (COLOUR_WORKER_T *)arg;
+    unsigned int first, last;
+
+    thread_role_enter(THREAD_ROLE_WORKER, "colour worker");
+    for (;;) {
+        vcos_semaphore_wait(&w->start);
+        if (w->pool->quit)
+            break;
+        colour_band(w->pool->job, w->index, w->pool->count + 1, &first, &last);
+        colour_convert_rows(w->pool->job, first, last);
+        vcos_semaphore_post(&w->pool->done);
+    }
+    thread_role_leave();
+    return NULL;
+}
+
+/** Start threads-1 helper threads (the caller is the last one). Returns 0 on success. */
+static int colour_workers_create(COLOUR_WORKERS_T *pool, unsigned int threads)
+{
+    unsigned int i;
+
+    memset(pool, 0, sizeof(*pool));
+    if (threads < 1)
+        threads = 1;
+    if (threads > COLOUR_MAX_WORKERS + 1)
+        threads = COLOUR_MAX_WORKERS + 1;
+    if (vcos_semaphore_create(&pool->done, "colour done", 0) != VCOS_SUCCESS)
+        return -1;
+
+    for (i = 0; i < threads - 1; i++) {
+        COLOUR_WORKER_T *w = &pool->worker[i];
+        w->pool = pool;
+        w->index = i;
+        if (vcos_semaphore_create(&w->start, "colour start", 0) != VCOS_SUCCESS)
+            return -1;
+        if (vcos_thread_create(&w->thread, "colour worker", NULL, colour_worker_thread, w) != VCOS_SUCCESS) {
+            vcos_semaphore_delete(&w->start);
+            return -1;
+        }
+        pool->count++;
+    }
+    return 0;
+}
+
+/** Convert a whole frame, split into bands across all threads */
+static void colour_workers_run(COLOUR_WORKERS_T *pool, const COLOUR_JOB_T *job)
+{
+    unsigned int i, first, last;
+
+    pool->job = job;
+    for (i = 0; i < pool->count; i++)
+        vcos_semaphore_post(&pool->worker[i].start);
+
+    colour_band(job, pool->count, pool->count + 1, &first, &last);
+    colour_convert_rows(job, first, last);
+
+    for (i = 0; i < pool->count; i++)
+        vcos_semaphore_wait(&pool->done);
+}
+
+static void colour_workers_destroy(COLOUR_WORKERS_T *pool)
+{
+    unsigned int i;
+
+    pool->quit = 1;
+    for (i = 0; i < pool->count; i++) {
+        vcos_semaphore_post(&pool->worker[i].start);
+        vcos_thread_join(&pool->worker[i].thread, NULL);
+        vcos_semaphore_delete(&pool->worker[i].start);
+    }
+    vcos_semaphore_delete(&pool->done);
+    pool->count = 0;
+}
+
+#endif
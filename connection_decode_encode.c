@@ -8,6 +8,8 @@
 #include "util/mmal_util_params.h"
 #include <stdio.h>
 #include "interface/vcos/vcos.h"
+#include "event_loop.h"
+#include "metrics.h"
 
 
 #include<arpa/inet.h>
@@ -38,9 +40,13 @@ static FILE *dest_file;
 
 /** Context for our application */
 static struct CONTEXT_T {
-    VCOS_SEMAPHORE_T semaphore;
+    EVENT_LOOP_T loop;
+    EVENT_SOURCE_T wake;
     MMAL_QUEUE_T *queue_encoded;
     MMAL_STATUS_T status;
+    METRICS_T metrics; //served when MMAL_METRICS is set to a port or socket path
+    METRICS_PORT_T metrics_decoder_in, metrics_encoder_out, metrics_written;
+    METRICS_EVENTS_T metrics_decoder_events;
 } context;
 
 
@@ -68,7 +74,7 @@ static void decoder_input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buff
     mmal_buffer_header_release(buffer);
 
     /* Kick the processing thread */
-    vcos_semaphore_post(&ctx->semaphore);
+    event_loop_notify(&ctx->wake);
 
     //fprintf(stderr,"decoder input callback\n");
 }
@@ -80,22 +86,33 @@ static void encoder_output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
 {
     struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
 
+    metrics_port_buffer(&ctx->metrics, &ctx->metrics_encoder_out, buffer);
     /* Queue the encoded video frame */
     mmal_queue_put(ctx->queue_encoded, buffer);
 
     /* Kick the processing thread */
-    vcos_semaphore_post(&ctx->semaphore);
+    event_loop_notify(&ctx->wake);
 
     //fprintf(stderr,"encoder output callback\n");
 }
 
 
+/** Called by the event loop after one of the callbacks has kicked it */
+static void wake_handler(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    MMAL_PARAM_UNUSED(loop);
+    MMAL_PARAM_UNUSED(source);
+    MMAL_PARAM_UNUSED(events);
+    /* nothing to do, main() looks at all queues after every wake-up */
+}
+
 /** Callback from the control port.
  * Component is sending us an event. */
 static void decoder_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
     struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
 
+    metrics_event(&ctx->metrics, &ctx->metrics_decoder_events, buffer);
     switch (buffer->cmd)
     {
     case MMAL_EVENT_EOS:
@@ -127,7 +144,25 @@ int main(int argc, char* argv[]) {
     int framenr=0;
 
     bcm_host_init();
-    vcos_semaphore_create(&context.semaphore, "example", 1);
+    /* The callbacks only wake the main loop, the work is done below */
+    if (event_loop_create(&context.loop) != 0 ||
+        event_loop_add_notifier(&context.loop, &context.wake, wake_handler, &context) != 0) {
+        fprintf(stderr, "failed to create event loop\n");
+        return -1;
+    }
+    event_loop_notify(&context.wake);
+
+    metrics_init(&context.metrics, 0);
+    if (metrics_register_port(&context.metrics, &context.metrics_decoder_in, "decoder_in") ||
+        metrics_register_port(&context.metrics, &context.metrics_encoder_out, "encoder_out") ||
+        metrics_register_port(&context.metrics, &context.metrics_written, "written") ||
+        metrics_register_events(&context.metrics, &context.metrics_decoder_events, "decoder") ||
+        metrics_register_pool(&context.metrics, "decoder_in", &decoder_pool_in) ||
+        metrics_register_pool(&context.metrics, "encoder_out", &encoder_pool_out) ||
+        metrics_serve_from_env(&context.metrics, &context.loop)) {
+        fprintf(stderr, "failed to set up metrics\n");
+        return -1;
+    }
 
     SOURCE_OPEN("test.h264_2")
     DEST_OPEN("out.h264")
@@ -224,10 +259,14 @@ int main(int argc, char* argv[]) {
     while(eos_received == MMAL_FALSE)
     {
         /* Wait for buffer headers to be available on either the decoder input or the encoder output port */
-        vcos_semaphore_wait(&context.semaphore);
+        /* Wake-ups are coalesced, so handle everything which is available */
+        if (event_loop_run_once(&context.loop, -1) < 0) {
+            fprintf(stderr, "event loop failed\n");
+            break;
+        }
 
         /* Send data to decode to the input port of the video decoder */
-        if ((buffer = mmal_queue_get(decoder_pool_in->queue)) != NULL)
+        while (!eos_sent && (buffer = mmal_queue_get(decoder_pool_in->queue)) != NULL)
         {
             SOURCE_READ_DATA_INTO_BUFFER(buffer);
             if(!buffer->length) eos_sent = MMAL_TRUE;
@@ -235,6 +274,7 @@ int main(int argc, char* argv[]) {
             buffer->flags = buffer->length ? 0 : MMAL_BUFFER_HEADER_FLAG_EOS;
             buffer->pts = buffer->dts = MMAL_TIME_UNKNOWN;
             //fprintf(stderr, "sending %i bytes\n", (int)buffer->length);
+            metrics_port_buffer(&context.metrics, &context.metrics_decoder_in, buffer);
             status = mmal_port_send_buffer(decoder->input[0], buffer);
             CHECK_STATUS(status, "failed to send buffer");
         }
@@ -256,6 +296,7 @@ int main(int argc, char* argv[]) {
             else
             {
                 DEST_WRITE_DATA_INTO_FILE(buffer->data, buffer->length);
+                metrics_port_buffer(&context.metrics, &context.metrics_written, buffer);
                 fprintf(stderr, "encoded frame %u (flags %x, length %u)\n",framenr++, buffer->flags, buffer->length);
             }
             mmal_buffer_header_release(buffer);
@@ -296,6 +337,13 @@ error:
     if (encoder)
         mmal_component_release(encoder);
 
+    //after the components, whose callbacks notify the loop
+    fprintf(stderr, "event loop: %u waits, %u notifications, %u eventfd writes\n",
+            context.loop.waits, context.wake.notified, context.wake.writes);
+    metrics_stop(&context.metrics);
+    event_loop_remove(&context.loop, &context.wake);
+    event_loop_destroy(&context.loop);
+
     return status == MMAL_SUCCESS ? 0 : -1;
 
 }
@@ -0,0 +1,169 @@
+#ifndef CONTROL_SOCKET_H
+#define CONTROL_SOCKET_H
+
+/* Line based control socket on the event loop (event_loop.h).
+ *
+ * Listens on a unix domain socket. Every line a client sends is passed to the
+ * command handler, whose reply is sent back. Try it with
+ *   echo stats | socat - UNIX-CONNECT:<path>
+ * Replies are short, so they are written without waiting for EPOLLOUT. */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "event_loop.h"
+
+#define CONTROL_SOCKET_CLIENTS 4
+#define CONTROL_SOCKET_LINE 128
+
+struct CONTROL_SOCKET_T;
+
+/** Handle one command (without the line end), write up to size bytes of reply */
+typedef void (*CONTROL_SOCKET_CB_T)(struct CONTROL_SOCKET_T *control, const char *command,
+                                    char *reply, size_t size);
+
+typedef struct CONTROL_CLIENT_T {
+    struct CONTROL_SOCKET_T *control;
+    EVENT_SOURCE_T source;      /* source.fd < 0 when the slot is free */
+    char line[CONTROL_SOCKET_LINE];
+    size_t length;
+} CONTROL_CLIENT_T;
+
+typedef struct CONTROL_SOCKET_T {
+    EVENT_LOOP_T *loop;
+    EVENT_SOURCE_T listener;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    CONTROL_SOCKET_CB_T cb;
+    void *userdata;
+    CONTROL_CLIENT_T client[CONTROL_SOCKET_CLIENTS];
+    unsigned int commands;
+} CONTROL_SOCKET_T;
+
+static void control_client_close(CONTROL_CLIENT_T *client)
+{
+    int fd = client->source.fd;
+
+    event_loop_remove(client->control->loop, &client->source);
+    close(fd);
+    client->source.fd = -1;
+}
+
+static void control_client_handler(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    CONTROL_CLIENT_T *client = (CONTROL_CLIENT_T *)source->userdata;
+    CONTROL_SOCKET_T *control = client->control;
+    char reply[1024], *end;
+    ssize_t got;
+
+    (void)loop;
+    (void)events;
+    got = read(source->fd, client->line + client->length, sizeof(client->line) - 1 - client->length);
+    if (got <= 0) {
+        if (got < 0 && errno == EAGAIN)
+            return;
+        control_client_close(client);
+        return;
+    }
+    client->length += got;
+    client->line[client->length] = 0;
+
+    while ((end = strchr(client->line, '\n')) != NULL) {
+        *end = 0;
+        if (end > client->line && end[-1] == '\r')
+            end[-1] = 0;
+        reply[0] = 0;
+        control->commands++;
+        control->cb(control, client->line, reply, sizeof(reply));
+        /* EPIPE if the client went before the reply: just another disconnect */
+        if (send(source->fd, reply, strlen(reply), MSG_NOSIGNAL) < 0) {
+            control_client_close(client);
+            return;
+        }
+        client->length -= end + 1 - client->line;
+        memmove(client->line, end + 1, client->length + 1);
+    }
+    if (client->length == sizeof(client->line) - 1)
+        control_client_close(client); /* line too long */
+}
+
+static void control_listener_handler(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    CONTROL_SOCKET_T *control = (CONTROL_SOCKET_T *)source->userdata;
+    unsigned int i;
+    int fd;
+
+    (void)events;
+    fd = accept(source->fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    for (i = 0; i < CONTROL_SOCKET_CLIENTS; i++) {
+        CONTROL_CLIENT_T *client = &control->client[i];
+        if (client->source.fd >= 0)
+            continue;
+        client->control = control;
+        client->length = 0;
+        if (event_loop_add_fd(loop, &client->source, fd, EPOLLIN, control_client_handler, client) == 0)
+            return;
+        client->source.fd = -1;
+        break;
+    }
+    close(fd); /* too many clients */
+}
+
+/** Listen on the unix socket path (replacing a stale socket file).
+ * Returns 0 on success. */
+static int control_socket_create(CONTROL_SOCKET_T *control, EVENT_LOOP_T *loop, const char *path,
+                                 CONTROL_SOCKET_CB_T cb, void *userdata)
+{
+    struct sockaddr_un addr;
+    unsigned int i;
+    int fd;
+
+    memset(control, 0, sizeof(*control));
+    control->loop = loop;
+    control->cb = cb;
+    control->userdata = userdata;
+    control->listener.fd = -1;
+    for (i = 0; i < CONTROL_SOCKET_CLIENTS; i++)
+        control->client[i].source.fd = -1;
+    if (strlen(path) >= sizeof(control->path))
+        return -1;
+    strcpy(control->path, path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, CONTROL_SOCKET_CLIENTS) != 0 ||
+        event_loop_add_fd(loop, &control->listener, fd, EPOLLIN, control_listener_handler, control) != 0) {
+        close(fd);
+        control->listener.fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void control_socket_destroy(CONTROL_SOCKET_T *control)
+{
+    unsigned int i;
+    int fd = control->listener.fd;
+
+    for (i = 0; i < CONTROL_SOCKET_CLIENTS; i++)
+        if (control->client[i].source.fd >= 0)
+            control_client_close(&control->client[i]);
+    if (fd >= 0) {
+        event_loop_remove(control->loop, &control->listener);
+        close(fd);
+        unlink(control->path);
+    }
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef DECODER_RECOVERY_H
+#define DECODER_RECOVERY_H
+
+/* Recovery from decoder errors (a corrupt packet) without restarting the
+ * process or recreating components and pools.
+ *
+ * The control callback only records the error and wakes the main loop. The
+ * main loop then calls decoder_recovery_start(): both decoder ports are
+ * flushed, which hands every buffer back through the usual callbacks (output
+ * buffers come back empty), and the input is discarded up to the next IDR
+ * carrying SPS and PPS (decoder_recovery_skip()), so the decoder starts again
+ * from a clean reference. If the stream never has SPS/PPS in front of its
+ * IDRs (they came as extradata), any IDR will do.
+ *
+ * The recovery time runs from the error to the first frame decoded after it
+ * (decoder_recovery_frame(), from the output callback). */
+
+#include <stdio.h>
+#include <stdint.h>
+#include "interface/vcos/vcos.h"
+#include "mmal.h"
+#include "h264_nal.h"
+
+typedef struct DECODER_RECOVERY_T {
+    int error;                      /* set by the control callback, taken by the main loop */
+    MMAL_STATUS_T status;
+    uint64_t error_us;
+    int resyncing;                  /* discarding input up to the next IDR */
+    int waiting;                    /* resynced, waiting for the first frame */
+    int idr_params;                 /* the IDRs of the stream come with SPS/PPS */
+    unsigned int errors, recoveries, aus_discarded, recovered;
+    uint64_t total_us, max_us;
+} DECODER_RECOVERY_T;
+
+/** From the control callback */
+static void decoder_recovery_error(DECODER_RECOVERY_T *r, MMAL_STATUS_T status)
+{
+    r->status = status;
+    r->errors++;
+    if (!__atomic_load_n(&r->error, __ATOMIC_ACQUIRE)) {
+        r->error_us = vcos_getmicrosecs64();
+        __atomic_store_n(&r->error, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static int decoder_recovery_pending(DECODER_RECOVERY_T *r)
+{
+    return __atomic_load_n(&r->error, __ATOMIC_ACQUIRE);
+}
+
+/** Flush the decoder and start discarding input. From the main loop, with the
+ * ports enabled. */
+static MMAL_STATUS_T decoder_recovery_start(DECODER_RECOVERY_T *r, MMAL_COMPONENT_T *decoder)
+{
+    MMAL_STATUS_T status = mmal_port_flush(decoder->input[0]);
+
+    if (status == MMAL_SUCCESS)
+        status = mmal_port_flush(decoder->output[0]);
+    r->resyncing = 1;
+    __atomic_store_n(&r->waiting, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->error, 0, __ATOMIC_RELEASE);
+    r->recoveries++;
+    return status;
+}
+
+/** Whether to drop the access unit instead of sending it to the decoder.
+ * Called for every access unit. */
+static int decoder_recovery_skip(DECODER_RECOVERY_T *r, const H264_AU_T *au)
+{
+    int params = (au->nal_types & (1u << H264_NAL_SPS)) && (au->nal_types & (1u << H264_NAL_PPS));
+
+    if (!r->resyncing) {
+        if (au->keyframe)
+            r->idr_params = params;
+        return 0;
+    }
+    if (au->keyframe && (params || !r->idr_params)) {
+        r->resyncing = 0;
+        __atomic_store_n(&r->waiting, 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+    r->aus_discarded++;
+    return 1;
+}
+
+/** From the output callback, for every decoded frame */
+static void decoder_recovery_frame(DECODER_RECOVERY_T *r)
+{
+    int waiting = 1;
+    uint64_t us;
+
+    if (!__atomic_compare_exchange_n(&r->waiting, &waiting, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return;
+    us = vcos_getmicrosecs64() - r->error_us;
+    r->total_us += us;
+    if (us > r->max_us)
+        r->max_us = us;
+    r->recovered++;
+}
+
+static void decoder_recovery_print(const DECODER_RECOVERY_T *r, FILE *file)
+{
+    fprintf(file, "decoder errors: %u (last %s), %u recoveries, %u access units discarded, recovered in %.1f ms avg, "
+            "%.1f ms max (%u)\n", r->errors, mmal_status_to_string(r->status), r->recoveries, r->aus_discarded,
+            r->recovered ? r->total_us / 1e3 / r->recovered : 0.0, r->max_us / 1e3, r->recovered);
+}
+
+#endif
@@ -0,0 +1,377 @@
+#include "bcm_host.h"
+#include "mmal.h"
+#include "util/mmal_default_components.h"
+#include "util/mmal_util.h"
+#include "util/mmal_util_params.h"
+#include "interface/vcos/vcos.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "y4m.h"
+#include "event_loop.h"
+#include "metrics.h"
+
+#define CHECK_STATUS(status, msg) if (status != MMAL_SUCCESS) { fprintf(stderr, msg"\n"); goto error; }
+
+static const int MAX_BITRATE_LEVEL4 = 25000000; // 25Mbits/s
+
+/** Context for our application */
+static struct CONTEXT_T {
+    EVENT_LOOP_T loop;
+    EVENT_SOURCE_T wake;
+    MMAL_QUEUE_T *queue_encoded;
+    MMAL_STATUS_T status;
+    METRICS_T metrics; //served when MMAL_METRICS is set to a port or socket path
+    METRICS_PORT_T metrics_encoder_in, metrics_encoder_out;
+    METRICS_EVENTS_T metrics_encoder_events;
+} context;
+
+
+/** Callback from the control port.
+ * Component is sending us an event. */
+static void control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
+
+    metrics_event(&ctx->metrics, &ctx->metrics_encoder_events, buffer);
+    if (buffer->cmd == MMAL_EVENT_ERROR)
+        ctx->status = *(MMAL_STATUS_T *)buffer->data;
+    mmal_buffer_header_release(buffer);
+    event_loop_notify(&ctx->wake);
+}
+
+/** Callback from the encoder input port.
+ * The frame has been encoded (or copied), the buffer header can be used again. */
+static void encoder_input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
+
+    mmal_buffer_header_release(buffer);
+    event_loop_notify(&ctx->wake);
+}
+
+/** Callback from the encoder output port.
+ * Buffer has been produced by the port and is available for processing. */
+static void encoder_output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
+
+    metrics_port_buffer(&ctx->metrics, &ctx->metrics_encoder_out, buffer);
+    mmal_queue_put(ctx->queue_encoded, buffer);
+    event_loop_notify(&ctx->wake);
+}
+
+/** Called by the event loop after one of the callbacks has kicked it */
+static void wake_handler(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    MMAL_PARAM_UNUSED(loop);
+    MMAL_PARAM_UNUSED(source);
+    MMAL_PARAM_UNUSED(events);
+    /* nothing to do, main() looks at all queues after every wake-up */
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-w width -h height [-r fps]] [-b bitrate] [-g intraperiod] [-n frames] [-l loops] [-c] "
+                    "[-o out.h264] file.y4m|file.yuv\n"
+                    "  -w/-h/-r  size and frame rate of a raw I420 file (a .y4m file has them in its header)\n"
+                    "  -b  bits per second (default %d)\n"
+                    "  -g  frames between I-frames\n"
+                    "  -n  stop after this many frames\n"
+                    "  -l  go through the file this many times, for clips too short to measure\n"
+                    "  -c  always copy the frames into VideoCore buffers, even when the size is aligned\n"
+                    "  -o  write the stream, by default it is only counted\n", name, MAX_BITRATE_LEVEL4);
+}
+
+int main(int argc, char* argv[])
+{
+    MMAL_STATUS_T status = MMAL_EINVAL;
+    MMAL_COMPONENT_T *encoder = NULL;
+    MMAL_POOL_T *pool_in = NULL, *pool_out = NULL;
+    MMAL_ES_FORMAT_T *format;
+    MMAL_BOOL_T eos_sent = MMAL_FALSE, eos_received = MMAL_FALSE;
+    MMAL_BUFFER_HEADER_T *buffer;
+    Y4M_READER_T reader;
+    FILE *dest_file = NULL;
+    const char *filename, *output = NULL;
+    unsigned int raw_width = 0, raw_height = 0, max_frames = 0, loops = 1, loop = 1;
+    unsigned int pitch, aligned_height, frames_in = 0, frames_out = 0, keyframes = 0;
+    int fps = 0, bitrate = MAX_BITRATE_LEVEL4, intraperiod = 0, copy = 0, opt;
+    uint64_t start_time = 0, copy_us = 0, bytes_out = 0;
+    double seconds, video_seconds;
+    struct rusage rusage;
+
+    while ((opt = getopt(argc, argv, "w:h:r:b:g:n:l:co:")) != -1) {
+        switch (opt) {
+        case 'w':
+            raw_width = atoi(optarg);
+            break;
+        case 'h':
+            raw_height = atoi(optarg);
+            break;
+        case 'r':
+            fps = atoi(optarg);
+            break;
+        case 'b':
+            bitrate = atoi(optarg);
+            break;
+        case 'g':
+            intraperiod = atoi(optarg);
+            break;
+        case 'n':
+            max_frames = atoi(optarg);
+            break;
+        case 'l':
+            loops = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'c':
+            copy = 1;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return -1;
+    }
+    filename = argv[optind];
+
+    if (y4m_open(&reader, filename, raw_width, raw_height, fps) != 0) {
+        fprintf(stderr, "could not open %s (a raw file needs -w and -h)\n", filename);
+        return -1;
+    }
+    pitch = VCOS_ALIGN_UP(reader.width, 32);
+    aligned_height = VCOS_ALIGN_UP(reader.height, 16);
+    /* an aligned frame already has the layout of the port, send it straight from the mapping */
+    if (pitch != reader.width || aligned_height != reader.height)
+        copy = 1;
+    fprintf(stderr, "%s: %ux%u at %d/%d fps, %s\n", filename, reader.width, reader.height,
+            reader.fps_num, reader.fps_den, copy ? "copied into VideoCore buffers" : "sent from the mapping");
+
+    bcm_host_init();
+    /* The callbacks only wake the main loop, the work is done below */
+    if (event_loop_create(&context.loop) != 0 ||
+        event_loop_add_notifier(&context.loop, &context.wake, wake_handler, &context) != 0) {
+        fprintf(stderr, "failed to create event loop\n");
+        y4m_close(&reader);
+        return -1;
+    }
+
+    metrics_init(&context.metrics, 0);
+    if (metrics_register_port(&context.metrics, &context.metrics_encoder_in, "encoder_in") ||
+        metrics_register_port(&context.metrics, &context.metrics_encoder_out, "encoder_out") ||
+        metrics_register_events(&context.metrics, &context.metrics_encoder_events, "encoder") ||
+        metrics_register_pool(&context.metrics, "encoder_in", &pool_in) ||
+        metrics_register_pool(&context.metrics, "encoder_out", &pool_out) ||
+        metrics_serve_from_env(&context.metrics, &context.loop)) {
+        fprintf(stderr, "failed to set up metrics\n");
+        goto error;
+    }
+
+    if (output && !(dest_file = fopen(output, "wb"))) {
+        fprintf(stderr, "could not open %s\n", output);
+        goto error;
+    }
+
+    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &encoder);
+    CHECK_STATUS(status, "failed to create encoder");
+
+    encoder->control->userdata = (struct MMAL_PORT_USERDATA_T *)(void *)&context;
+    status = mmal_port_enable(encoder->control, control_callback);
+    CHECK_STATUS(status, "failed to enable control port");
+
+    /* Copied frames go into shared buffers. Frames sent from the mapping are
+     * transferred by VCHIQ, which needs zero copy to be off. */
+    status = mmal_port_parameter_set_boolean(encoder->input[0], MMAL_PARAMETER_ZERO_COPY, copy ? MMAL_TRUE : MMAL_FALSE);
+    CHECK_STATUS(status, "failed to set zero copy on encoder input");
+    status = mmal_port_parameter_set_boolean(encoder->output[0], MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+    CHECK_STATUS(status, "failed to set zero copy on encoder output");
+
+    /* The encoder is configured from the Y4M header, the padding is cropped away */
+    format = encoder->input[0]->format;
+    format->type = MMAL_ES_TYPE_VIDEO;
+    format->encoding = MMAL_ENCODING_I420;
+    format->es->video.width = pitch;
+    format->es->video.height = aligned_height;
+    format->es->video.crop.x = 0;
+    format->es->video.crop.y = 0;
+    format->es->video.crop.width = reader.width;
+    format->es->video.crop.height = reader.height;
+    format->es->video.frame_rate.num = reader.fps_num;
+    format->es->video.frame_rate.den = reader.fps_den;
+    format->es->video.par.num = reader.par_num;
+    format->es->video.par.den = reader.par_den;
+    status = mmal_port_format_commit(encoder->input[0]);
+    CHECK_STATUS(status, "failed to commit encoder input format");
+
+    format = encoder->output[0]->format;
+    format->type = MMAL_ES_TYPE_VIDEO;
+    format->encoding = MMAL_ENCODING_H264;
+    format->bitrate = bitrate;
+    format->es->video.frame_rate.num = reader.fps_num;
+    format->es->video.frame_rate.den = reader.fps_den;
+    status = mmal_port_format_commit(encoder->output[0]);
+    CHECK_STATUS(status, "failed to commit encoder output format");
+
+    MMAL_PARAMETER_VIDEO_PROFILE_T param;
+    param.hdr.id = MMAL_PARAMETER_PROFILE;
+    param.hdr.size = sizeof(param);
+    param.profile[0].level = MMAL_VIDEO_LEVEL_H264_4;
+    param.profile[0].profile = MMAL_VIDEO_PROFILE_H264_HIGH;
+    status = mmal_port_parameter_set(encoder->output[0], &param.hdr);
+    CHECK_STATUS(status, "unable to set encoder output profile");
+
+    if (intraperiod > 0) {
+        status = mmal_port_parameter_set_uint32(encoder->output[0], MMAL_PARAMETER_INTRAPERIOD, intraperiod);
+        CHECK_STATUS(status, "unable to set encoder intra period");
+    }
+
+    /* a few frames in flight keep the encoder busy while the next one is prepared */
+    encoder->input[0]->buffer_num = encoder->input[0]->buffer_num_recommended > 3 ?
+                                    encoder->input[0]->buffer_num_recommended : 3;
+    encoder->input[0]->buffer_size = encoder->input[0]->buffer_size_recommended > pitch * aligned_height * 3 / 2 ?
+                                     encoder->input[0]->buffer_size_recommended : pitch * aligned_height * 3 / 2;
+    encoder->output[0]->buffer_num = encoder->output[0]->buffer_num_recommended;
+    encoder->output[0]->buffer_size = encoder->output[0]->buffer_size_recommended;
+
+    /* Headers without payload when the frames are sent from the mapping */
+    pool_in = mmal_port_pool_create(encoder->input[0], encoder->input[0]->buffer_num,
+                                    copy ? encoder->input[0]->buffer_size : 0);
+    pool_out = mmal_port_pool_create(encoder->output[0], encoder->output[0]->buffer_num,
+                                     encoder->output[0]->buffer_size);
+    context.queue_encoded = mmal_queue_create();
+    if (!pool_in || !pool_out || !context.queue_encoded) {
+        status = MMAL_ENOMEM;
+        CHECK_STATUS(status, "failed to create pools");
+    }
+
+    encoder->input[0]->userdata = (struct MMAL_PORT_USERDATA_T *)(void *)&context;
+    encoder->output[0]->userdata = (struct MMAL_PORT_USERDATA_T *)(void *)&context;
+    status = mmal_port_enable(encoder->input[0], encoder_input_callback);
+    CHECK_STATUS(status, "failed to enable encoder input port");
+    status = mmal_port_enable(encoder->output[0], encoder_output_callback);
+    CHECK_STATUS(status, "failed to enable encoder output port");
+
+    fprintf(stderr, "start encoding\n");
+    start_time = vcos_getmicrosecs64();
+    event_loop_notify(&context.wake);
+    while (eos_received == MMAL_FALSE)
+    {
+        if (event_loop_run_once(&context.loop, -1) < 0) {
+            fprintf(stderr, "event loop failed\n");
+            break;
+        }
+        if (context.status != MMAL_SUCCESS) {
+            fprintf(stderr, "encoder error: %s\n", mmal_status_to_string(context.status));
+            status = context.status;
+            break;
+        }
+
+        /* receive encoded frames, first so their buffers can go straight back to the encoder */
+        while ((buffer = mmal_queue_get(context.queue_encoded)) != NULL)
+        {
+            eos_received = buffer->flags & MMAL_BUFFER_HEADER_FLAG_EOS;
+            if (!buffer->cmd && buffer->length) {
+                if (dest_file)
+                    fwrite(buffer->data + buffer->offset, 1, buffer->length, dest_file);
+                bytes_out += buffer->length;
+                if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END && !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)) {
+                    frames_out++;
+                    if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)
+                        keyframes++;
+                }
+            }
+            mmal_buffer_header_release(buffer);
+        }
+
+        /* Send empty buffers to the output port of the encoder */
+        while ((buffer = mmal_queue_get(pool_out->queue)) != NULL)
+        {
+            status = mmal_port_send_buffer(encoder->output[0], buffer);
+            CHECK_STATUS(status, "failed to send buffer");
+        }
+
+        /* Send the next frames */
+        while (!eos_sent && (buffer = mmal_queue_get(pool_in->queue)) != NULL)
+        {
+            const uint8_t *frame = max_frames && frames_in == max_frames ? NULL : y4m_next_frame(&reader);
+
+            if (!frame && loop < loops && reader.frames) {
+                loop++;
+                y4m_rewind(&reader);
+                frame = y4m_next_frame(&reader);
+            }
+            if (!frame) {
+                buffer->length = 0;
+                buffer->flags = MMAL_BUFFER_HEADER_FLAG_EOS;
+                buffer->pts = buffer->dts = MMAL_TIME_UNKNOWN;
+                eos_sent = MMAL_TRUE;
+            } else {
+                if (copy) {
+                    uint64_t copy_start = vcos_getmicrosecs64();
+                    y4m_copy_i420(buffer->data, pitch, aligned_height, frame, reader.width, reader.height);
+                    copy_us += vcos_getmicrosecs64() - copy_start;
+                    buffer->length = pitch * aligned_height * 3 / 2;
+                } else {
+                    /* the encoder only reads it */
+                    buffer->data = (uint8_t *)frame;
+                    buffer->alloc_size = buffer->length = reader.frame_size;
+                }
+                buffer->offset = 0;
+                buffer->flags = MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+                buffer->pts = buffer->dts = (int64_t)frames_in * 1000000 * reader.fps_den / reader.fps_num;
+                frames_in++;
+            }
+            metrics_port_buffer(&context.metrics, &context.metrics_encoder_in, buffer);
+            status = mmal_port_send_buffer(encoder->input[0], buffer);
+            CHECK_STATUS(status, "failed to send buffer");
+        }
+    }
+
+    seconds = (vcos_getmicrosecs64() - start_time) / 1e6;
+    video_seconds = (double)frames_out * reader.fps_den / reader.fps_num;
+    fprintf(stderr, "stop encoding\n");
+    getrusage(RUSAGE_SELF, &rusage);
+    fprintf(stderr, "encoded %u of %u frames in %.2f s: %.1f fps (%.2fx real time)\n", frames_out, frames_in,
+            seconds, frames_out / seconds, video_seconds / seconds);
+    fprintf(stderr, "output: %.0f kbit/s, %u I-frames, avg %.1f kB per frame\n",
+            video_seconds > 0 ? bytes_out * 8 / video_seconds / 1000 : 0.0, keyframes,
+            frames_out ? bytes_out / 1000.0 / frames_out : 0.0);
+    fprintf(stderr, "input: %.1f MB/s of I420, %s\n", (double)frames_in * reader.frame_size / seconds / 1e6,
+            copy ? "copied" : "sent from the mapping");
+    if (copy && frames_in)
+        fprintf(stderr, "copy: %.2f ms/frame, %.0f MB/s\n", copy_us / 1e3 / frames_in,
+                copy_us ? (double)frames_in * reader.frame_size / copy_us : 0.0);
+    fprintf(stderr, "%.2f s user, %.2f s system\n", rusage.ru_utime.tv_sec + rusage.ru_utime.tv_usec / 1e6,
+            rusage.ru_stime.tv_sec + rusage.ru_stime.tv_usec / 1e6);
+
+    mmal_port_disable(encoder->input[0]);
+    mmal_port_disable(encoder->output[0]);
+    mmal_port_disable(encoder->control);
+
+error:
+    if (pool_in)
+        mmal_port_pool_destroy(encoder->input[0], pool_in);
+    if (pool_out)
+        mmal_port_pool_destroy(encoder->output[0], pool_out);
+    if (encoder)
+        mmal_component_release(encoder);
+    //after the encoder, whose callbacks notify the loop
+    metrics_stop(&context.metrics);
+    event_loop_remove(&context.loop, &context.wake);
+    event_loop_destroy(&context.loop);
+    if (context.queue_encoded)
+        mmal_queue_destroy(context.queue_encoded);
+    if (dest_file)
+        fclose(dest_file);
+    y4m_close(&reader);
+
+    return status == MMAL_SUCCESS ? 0 : -1;
+}
@@ -0,0 +1,232 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+/* Single threaded epoll reactor for the examples.
+ *
+ * MMAL callbacks run on threads owned by MMAL. Instead of posting a semaphore
+ * they call event_loop_notify() on a notifier (an eventfd), so the thread
+ * running the pipeline can wait for MMAL buffers, sockets, pipes and timers in
+ * one epoll_wait and needs no extra threads for network or control I/O.
+ *
+ * Notifications are coalesced: while a notifier is pending, further
+ * event_loop_notify() calls do not touch the eventfd, so a burst of callbacks
+ * costs one write and one wake-up. The handler must therefore deal with
+ * everything that is ready, not with one buffer per call.
+ *
+ * Regular files cannot be watched with epoll (they are always ready), read
+ * them from a notifier or timer handler. Linux only. */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#define EVENT_LOOP_MAX_EVENTS 16
+
+typedef enum {
+    EVENT_SOURCE_FD,
+    EVENT_SOURCE_TIMER,
+    EVENT_SOURCE_NOTIFIER,
+} EVENT_SOURCE_TYPE_T;
+
+struct EVENT_LOOP_T;
+struct EVENT_SOURCE_T;
+
+/** events are the EPOLL* flags for fd sources, 0 for timers and notifiers */
+typedef void (*EVENT_LOOP_CB_T)(struct EVENT_LOOP_T *loop, struct EVENT_SOURCE_T *source, uint32_t events);
+
+typedef struct EVENT_SOURCE_T {
+    EVENT_SOURCE_TYPE_T type;
+    int fd;
+    EVENT_LOOP_CB_T cb;
+    void *userdata;
+
+    int pending;                /* notifier: eventfd written and not yet dispatched */
+    unsigned int dispatched;    /* handler calls */
+    unsigned int notified;      /* notifier: event_loop_notify() calls */
+    unsigned int writes;        /* notifier: eventfd writes, the rest was coalesced */
+} EVENT_SOURCE_T;
+
+typedef struct EVENT_LOOP_T {
+    int epoll_fd;
+    int quit;
+    unsigned int waits;         /* epoll_wait calls */
+} EVENT_LOOP_T;
+
+static int event_loop_create(EVENT_LOOP_T *loop)
+{
+    memset(loop, 0, sizeof(*loop));
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return loop->epoll_fd < 0 ? -1 : 0;
+}
+
+static void event_loop_destroy(EVENT_LOOP_T *loop)
+{
+    if (loop->epoll_fd >= 0)
+        close(loop->epoll_fd);
+    loop->epoll_fd = -1;
+}
+
+static int event_loop_watch(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = source;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &ev);
+}
+
+static void event_source_init(EVENT_SOURCE_T *source, EVENT_SOURCE_TYPE_T type, int fd,
+                              EVENT_LOOP_CB_T cb, void *userdata)
+{
+    memset(source, 0, sizeof(*source));
+    source->type = type;
+    source->fd = fd;
+    source->cb = cb;
+    source->userdata = userdata;
+}
+
+/** Watch a socket, pipe or other pollable fd. The fd stays owned by the caller.
+ * Returns 0 on success. */
+static int event_loop_add_fd(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, int fd, uint32_t events,
+                             EVENT_LOOP_CB_T cb, void *userdata)
+{
+    event_source_init(source, EVENT_SOURCE_FD, fd, cb, userdata);
+    return event_loop_watch(loop, source, events);
+}
+
+/** Change the EPOLL* flags of an fd source, e.g. to wait for EPOLLOUT only while there is data to send */
+static int event_loop_modify_fd(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = source;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, source->fd, &ev);
+}
+
+/** Periodic timer, first expiry after interval_us. Returns 0 on success. */
+static int event_loop_add_timer(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint64_t interval_us,
+                                EVENT_LOOP_CB_T cb, void *userdata)
+{
+    struct itimerspec spec;
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    event_source_init(source, EVENT_SOURCE_TIMER, fd, cb, userdata);
+    spec.it_interval.tv_sec = interval_us / 1000000;
+    spec.it_interval.tv_nsec = interval_us % 1000000 * 1000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(fd, 0, &spec, NULL) != 0 || event_loop_watch(loop, source, EPOLLIN) != 0) {
+        close(fd);
+        source->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/** Notifier which can be triggered from any thread with event_loop_notify().
+ * Returns 0 on success. */
+static int event_loop_add_notifier(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source,
+                                   EVENT_LOOP_CB_T cb, void *userdata)
+{
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    event_source_init(source, EVENT_SOURCE_NOTIFIER, fd, cb, userdata);
+    if (event_loop_watch(loop, source, EPOLLIN) != 0) {
+        close(fd);
+        source->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/** Stop watching the source. Timer and notifier fds are closed. */
+static void event_loop_remove(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source)
+{
+    if (source->fd < 0)
+        return;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+    if (source->type != EVENT_SOURCE_FD)
+        close(source->fd);
+    source->fd = -1;
+}
+
+/** Wake the loop and have the notifier's handler called. Safe to call from
+ * any thread, including MMAL callbacks. */
+static void event_loop_notify(EVENT_SOURCE_T *source)
+{
+    uint64_t one = 1;
+
+    __atomic_fetch_add(&source->notified, 1, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&source->pending, 1, __ATOMIC_ACQ_REL))
+        return;
+    __atomic_fetch_add(&source->writes, 1, __ATOMIC_RELAXED);
+    if (write(source->fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        __atomic_store_n(&source->pending, 0, __ATOMIC_RELEASE);
+}
+
+static void event_loop_dispatch(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    uint64_t value;
+
+    switch (source->type) {
+    case EVENT_SOURCE_NOTIFIER:
+        /* clear before the handler runs: whatever is signalled from now on
+         * needs another round */
+        if (read(source->fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+            return;
+        __atomic_store_n(&source->pending, 0, __ATOMIC_SEQ_CST);
+        events = 0;
+        break;
+    case EVENT_SOURCE_TIMER:
+        if (read(source->fd, &value, sizeof(value)) < 0)
+            return;
+        events = 0;
+        break;
+    default:
+        break;
+    }
+    source->dispatched++;
+    source->cb(loop, source, events);
+}
+
+/** Wait at most timeout_ms (-1: forever) and dispatch what is ready.
+ * Returns the number of sources dispatched, -1 on error. */
+static int event_loop_run_once(EVENT_LOOP_T *loop, int timeout_ms)
+{
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    int n, i;
+
+    loop->waits++;
+    n = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout_ms);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+    for (i = 0; i < n && !loop->quit; i++)
+        event_loop_dispatch(loop, (EVENT_SOURCE_T *)events[i].data.ptr, events[i].events);
+    return n;
+}
+
+/** Run until event_loop_stop() is called from a handler. Returns 0, or -1 on error. */
+static int event_loop_run(EVENT_LOOP_T *loop)
+{
+    while (!loop->quit)
+        if (event_loop_run_once(loop, -1) < 0)
+            return -1;
+    return 0;
+}
+
+static void event_loop_stop(EVENT_LOOP_T *loop)
+{
+    loop->quit = 1;
+}
+
+#endif
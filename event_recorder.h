@@ -0,0 +1,277 @@
+#ifndef EVENT_RECORDER_H
+#define EVENT_RECORDER_H
+
+/* Pre-event recording: the last seconds of encoded video are kept in memory and
+ * only written to a file when something happens.
+ *
+ * Everything the encoder produces goes into a byte ring of fixed size, with
+ * an index of the access units in it (position, size, arrival time, keyframe).
+ * Old access units are evicted as new ones come in, so memory is bounded and
+ * nothing is allocated per frame. event_recorder_trigger() opens a new file,
+ * writes the codec config (SPS/PPS) and everything from the last keyframe at
+ * or before the start of the pre-roll window (at most two write() calls, the
+ * ring may wrap), then keeps writing the live stream, one whole access unit
+ * at a time, until the post-roll time has passed. A trigger during a
+ * recording extends it.
+ *
+ * The ring has to hold the pre-roll plus one GOP, at the highest bitrate.
+ * All calls from one thread. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EVENT_RECORDER_KEYFRAME 0x1     /* access unit starts with an IDR */
+#define EVENT_RECORDER_FRAME_END 0x2    /* last piece of the access unit */
+#define EVENT_RECORDER_CONFIG 0x4       /* SPS/PPS, kept apart and written at the start of every file */
+#define EVENT_RECORDER_MAX_CONFIG 1024
+
+typedef struct EVENT_RECORDER_AU_T {
+    uint64_t pos;               /* of the first byte, counted from the start of the stream */
+    uint32_t size;
+    uint32_t keyframe;
+    uint64_t time_us;           /* arrival */
+} EVENT_RECORDER_AU_T;
+
+typedef struct EVENT_RECORDER_T {
+    uint8_t *data;
+    size_t capacity;
+    uint64_t head;              /* bytes appended so far */
+    EVENT_RECORDER_AU_T *au;
+    unsigned int max_aus, first, count;
+    int open;                   /* the newest access unit is still being appended to */
+    int skipping;               /* the access unit being appended was dropped, until its last piece */
+    uint8_t config[EVENT_RECORDER_MAX_CONFIG];
+    size_t config_size;
+    uint64_t preroll_us, postroll_us;
+
+    const char *prefix;         /* files are <prefix>NNN.h264 */
+    int fd;                     /* recording while >= 0 */
+    uint64_t stop_us;           /* close before the first access unit after this */
+
+    unsigned int events, evicted, too_big;
+    uint64_t dump_bytes, dump_us, max_dump_us;  /* of the last trigger, and the worst */
+    double dump_seconds;        /* pre-roll actually written by the last trigger */
+} EVENT_RECORDER_T;
+
+static uint64_t event_recorder_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Ring of bytes bytes and up to max_aus access units. Returns 0 on success. */
+static int event_recorder_create(EVENT_RECORDER_T *rec, size_t bytes, unsigned int max_aus,
+                                 unsigned int preroll_ms, unsigned int postroll_ms, const char *prefix)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->fd = -1;
+    rec->data = (uint8_t *)malloc(bytes);
+    rec->au = (EVENT_RECORDER_AU_T *)malloc(max_aus * sizeof(*rec->au));
+    if (!rec->data || !rec->au) {
+        free(rec->data);
+        free(rec->au);
+        rec->data = NULL;
+        rec->au = NULL;
+        return -1;
+    }
+    rec->capacity = bytes;
+    rec->max_aus = max_aus;
+    rec->preroll_us = preroll_ms * 1000ull;
+    rec->postroll_us = postroll_ms * 1000ull;
+    rec->prefix = prefix;
+    return 0;
+}
+
+static void event_recorder_close(EVENT_RECORDER_T *rec)
+{
+    if (rec->fd < 0)
+        return;
+    close(rec->fd);
+    rec->fd = -1;
+}
+
+static void event_recorder_destroy(EVENT_RECORDER_T *rec)
+{
+    event_recorder_close(rec);
+    free(rec->data);
+    free(rec->au);
+    rec->data = NULL;
+    rec->au = NULL;
+}
+
+static int event_recorder_write_all(int fd, const uint8_t *data, size_t size)
+{
+    while (size) {
+        ssize_t done = write(fd, data, size);
+        if (done <= 0)
+            return -1;
+        data += done;
+        size -= done;
+    }
+    return 0;
+}
+
+/** Write ring bytes [from, to) */
+static int event_recorder_write_ring(EVENT_RECORDER_T *rec, uint64_t from, uint64_t to)
+{
+    size_t start = from % rec->capacity, size = to - from, first = rec->capacity - start;
+
+    if (size <= first)
+        return event_recorder_write_all(rec->fd, rec->data + start, size);
+    return event_recorder_write_all(rec->fd, rec->data + start, first) ||
+           event_recorder_write_all(rec->fd, rec->data, size - first);
+}
+
+static EVENT_RECORDER_AU_T *event_recorder_au(const EVENT_RECORDER_T *rec, unsigned int i)
+{
+    return &rec->au[(rec->first + i) % rec->max_aus];
+}
+
+static void event_recorder_evict(EVENT_RECORDER_T *rec)
+{
+    rec->first = (rec->first + 1) % rec->max_aus;
+    rec->count--;
+    rec->evicted++;
+}
+
+/** Append a buffer from the encoder. time_us is CLOCK_MONOTONIC
+ * (event_recorder_now_us()), flags EVENT_RECORDER_*. */
+static void event_recorder_add(EVENT_RECORDER_T *rec, const uint8_t *data, size_t size, unsigned int flags,
+                               uint64_t time_us)
+{
+    EVENT_RECORDER_AU_T *au;
+    size_t start, first;
+
+    if (flags & EVENT_RECORDER_CONFIG) {
+        if (size <= sizeof(rec->config)) {
+            memcpy(rec->config, data, size);
+            rec->config_size = size;
+        }
+        if (rec->fd >= 0 && event_recorder_write_all(rec->fd, data, size) != 0)
+            event_recorder_close(rec);
+        return;
+    }
+    if (rec->skipping) {
+        rec->skipping = !(flags & EVENT_RECORDER_FRAME_END);
+        return;
+    }
+
+    if (!rec->open) {
+        /* a new access unit: the recording ends at a frame boundary */
+        if (rec->fd >= 0 && time_us >= rec->stop_us)
+            event_recorder_close(rec);
+        if (rec->count == rec->max_aus)
+            event_recorder_evict(rec);
+        au = event_recorder_au(rec, rec->count++);
+        au->pos = rec->head;
+        au->size = 0;
+        au->keyframe = !!(flags & EVENT_RECORDER_KEYFRAME);
+        au->time_us = time_us;
+        rec->open = 1;
+    }
+    au = event_recorder_au(rec, rec->count - 1);
+    if (au->size + size > rec->capacity / 2) {
+        /* cannot be kept, and would push everything else out: drop the whole access unit,
+         * nothing of it was written to a recording yet */
+        rec->too_big++;
+        rec->head = au->pos;
+        rec->count--;
+        rec->open = 0;
+        rec->skipping = !(flags & EVENT_RECORDER_FRAME_END);
+        return;
+    }
+
+    /* make room */
+    while (rec->count > 1 && rec->head + size - event_recorder_au(rec, 0)->pos > rec->capacity)
+        event_recorder_evict(rec);
+
+    start = rec->head % rec->capacity;
+    first = rec->capacity - start;
+    if (size <= first) {
+        memcpy(rec->data + start, data, size);
+    } else {
+        memcpy(rec->data + start, data, first);
+        memcpy(rec->data, data + first, size - first);
+    }
+    rec->head += size;
+    au->size += size;
+    if (!(flags & EVENT_RECORDER_FRAME_END))
+        return;
+    rec->open = 0;
+    /* complete, so a recording never gets part of an access unit */
+    if (rec->fd >= 0 && event_recorder_write_ring(rec, au->pos, rec->head) != 0)
+        event_recorder_close(rec);
+}
+
+/** Start (or extend) a recording. Returns 0 on success. */
+static int event_recorder_trigger(EVENT_RECORDER_T *rec)
+{
+    uint64_t start_us = event_recorder_now_us(), now = start_us;
+    char path[256];
+    unsigned int i, from = 0;
+    int found = 0;
+
+    if (rec->fd >= 0) {
+        rec->stop_us = now + rec->postroll_us;
+        return 0;
+    }
+
+    /* the last keyframe at or before the start of the window, else the first one in the ring */
+    for (i = 0; i < rec->count; i++) {
+        EVENT_RECORDER_AU_T *au = event_recorder_au(rec, i);
+        if (!au->keyframe)
+            continue;
+        if (!found || au->time_us + rec->preroll_us <= now)
+            from = i;
+        found = 1;
+        if (au->time_us + rec->preroll_us > now)
+            break;
+    }
+
+    snprintf(path, sizeof(path), "%s%03u.h264", rec->prefix, rec->events);
+    rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (rec->fd < 0)
+        return -1;
+    rec->events++;
+    rec->stop_us = now + rec->postroll_us;
+    rec->dump_bytes = 0;
+    rec->dump_seconds = 0;
+
+    if (rec->config_size && event_recorder_write_all(rec->fd, rec->config, rec->config_size) != 0) {
+        event_recorder_close(rec);
+        return -1;
+    }
+    if (found) {
+        /* up to the last complete access unit, an open one is written when it is complete */
+        uint64_t pos = event_recorder_au(rec, from)->pos;
+        uint64_t end = rec->open ? event_recorder_au(rec, rec->count - 1)->pos : rec->head;
+        if (end > pos && event_recorder_write_ring(rec, pos, end) != 0) {
+            event_recorder_close(rec);
+            return -1;
+        }
+        rec->dump_bytes = end - pos;
+        rec->dump_seconds = (now - event_recorder_au(rec, from)->time_us) / 1e6;
+    }
+    rec->dump_us = event_recorder_now_us() - start_us;
+    if (rec->dump_us > rec->max_dump_us)
+        rec->max_dump_us = rec->dump_us;
+    return 0;
+}
+
+static void event_recorder_print(const EVENT_RECORDER_T *rec, FILE *file)
+{
+    fprintf(file, "event recorder: %u events, last pre-roll %.1f s (%.1f MB) written in %.2f ms, worst %.2f ms, "
+            "%.1f s in the ring, %u access units evicted, %u too big\n",
+            rec->events, rec->dump_seconds, rec->dump_bytes / 1e6, rec->dump_us / 1e3, rec->max_dump_us / 1e3,
+            rec->count > 1 ? (event_recorder_au(rec, rec->count - 1)->time_us -
+                              event_recorder_au(rec, 0)->time_us) / 1e6 : 0,
+            rec->evicted, rec->too_big);
+}
+
+#endif
@@ -32,6 +32,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "util/mmal_util.h"
 #include "interface/vcos/vcos.h"
 #include <stdio.h>
+#include "event_loop.h"
+#include "metrics.h"
 
 #define CHECK_STATUS(status, msg) if (status != MMAL_SUCCESS) { fprintf(stderr, msg"\n"); goto error; }
 
@@ -53,9 +55,13 @@ static FILE *source_file;
 
 /** Context for our application */
 static struct CONTEXT_T {
-   VCOS_SEMAPHORE_T semaphore;
+   EVENT_LOOP_T loop;
+   EVENT_SOURCE_T wake;
    MMAL_QUEUE_T *queue;
    MMAL_STATUS_T status;
+   METRICS_T metrics; /* served when MMAL_METRICS is set to a port or socket path */
+   METRICS_PORT_T metrics_in, metrics_out;
+   METRICS_EVENTS_T metrics_events;
 } context;
 
 static void log_video_format(MMAL_ES_FORMAT_T *format)
@@ -70,12 +76,22 @@ static void log_video_format(MMAL_ES_FORMAT_T *format)
             format->es->video.crop.width, format->es->video.crop.height);
 }
 
+/** Called by the event loop after one of the callbacks below has been kicked */
+static void wake_handler(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+   MMAL_PARAM_UNUSED(loop);
+   MMAL_PARAM_UNUSED(source);
+   MMAL_PARAM_UNUSED(events);
+   /* nothing to do, main() looks at all queues after every wake-up */
+}
+
 /** Callback from the control port.
  * Component is sending us an event. */
 static void control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
    struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
 
+   metrics_event(&ctx->metrics, &ctx->metrics_events, buffer);
    switch (buffer->cmd)
    {
    case MMAL_EVENT_EOS:
@@ -93,7 +109,7 @@ static void control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
    mmal_buffer_header_release(buffer);
 
    /* Kick the processing thread */
-   vcos_semaphore_post(&ctx->semaphore);
+   event_loop_notify(&ctx->wake);
 }
 
 /** Callback from the input port.
@@ -106,7 +122,7 @@ static void input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
    mmal_buffer_header_release(buffer);
 
    /* Kick the processing thread */
-   vcos_semaphore_post(&ctx->semaphore);
+   event_loop_notify(&ctx->wake);
 }
 
 /** Callback from the output port.
@@ -119,7 +135,7 @@ static void output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
    mmal_queue_put(ctx->queue, buffer);
 
    /* Kick the processing thread */
-   vcos_semaphore_post(&ctx->semaphore);
+   event_loop_notify(&ctx->wake);
 }
 
 int main(int argc, char **argv)
@@ -138,7 +154,26 @@ int main(int argc, char **argv)
 
    bcm_host_init();
 
-   vcos_semaphore_create(&context.semaphore, "example", 1);
+   /* The callbacks only wake the main loop, the work is done below */
+   if (event_loop_create(&context.loop) != 0 ||
+       event_loop_add_notifier(&context.loop, &context.wake, wake_handler, &context) != 0)
+   {
+      fprintf(stderr, "failed to create event loop\n");
+      return -1;
+   }
+   event_loop_notify(&context.wake);
+
+   metrics_init(&context.metrics, 0);
+   if (metrics_register_port(&context.metrics, &context.metrics_in, "decoder_in") ||
+       metrics_register_port(&context.metrics, &context.metrics_out, "decoder_out") ||
+       metrics_register_events(&context.metrics, &context.metrics_events, "decoder") ||
+       metrics_register_pool(&context.metrics, "decoder_in", &pool_in) ||
+       metrics_register_pool(&context.metrics, "decoder_out", &pool_out) ||
+       metrics_serve_from_env(&context.metrics, &context.loop))
+   {
+      fprintf(stderr, "failed to set up metrics\n");
+      return -1;
+   }
 
    SOURCE_OPEN(argv[1]);
 
@@ -252,8 +287,13 @@ int main(int argc, char **argv)
    {
       MMAL_BUFFER_HEADER_T *buffer;
 
-      /* Wait for buffer headers to be available on either of the decoder ports */
-      vcos_semaphore_wait(&context.semaphore);
+      /* Wait for buffer headers to be available on either of the decoder ports.
+       * Wake-ups are coalesced, so handle everything which is available */
+      if (event_loop_run_once(&context.loop, -1) < 0)
+      {
+         fprintf(stderr, "event loop failed\n");
+         break;
+      }
 
       /* Check for errors */
       if (context.status != MMAL_SUCCESS)
@@ -263,7 +303,7 @@ int main(int argc, char **argv)
       }
 
       /* Send data to decode to the input port of the video decoder */
-      if (!eos_sent && (buffer = mmal_queue_get(pool_in->queue)) != NULL)
+      while (!eos_sent && (buffer = mmal_queue_get(pool_in->queue)) != NULL)
       {
          SOURCE_READ_DATA_INTO_BUFFER(buffer);
          if(!buffer->length) eos_sent = MMAL_TRUE;
@@ -271,6 +311,7 @@ int main(int argc, char **argv)
          buffer->flags = buffer->length ? 0 : MMAL_BUFFER_HEADER_FLAG_EOS;
          buffer->pts = buffer->dts = MMAL_TIME_UNKNOWN;
          fprintf(stderr, "sending %i bytes\n", (int)buffer->length);
+         metrics_port_buffer(&context.metrics, &context.metrics_in, buffer);
          status = mmal_port_send_buffer(decoder->input[0], buffer);
          CHECK_STATUS(status, "failed to send buffer");
       }
@@ -286,6 +327,7 @@ int main(int argc, char **argv)
 
          if (buffer->cmd)
          {
+            metrics_event(&context.metrics, &context.metrics_events, buffer);
             fprintf(stderr, "received event %4.4s\n", (char *)&buffer->cmd);
             if (buffer->cmd == MMAL_EVENT_FORMAT_CHANGED)
             {
@@ -313,9 +355,8 @@ int main(int argc, char **argv)
                   MMAL_BUFFER_HEADER_T *buf;
                   fprintf(stderr, "Wait for buffers to be returned. Have %d of %d buffers\n",
                         mmal_queue_length(pool_out->queue), pool_out->headers_num);
-                  vcos_semaphore_wait(&context.semaphore);
-                  fprintf(stderr, "Got semaphore\n");
-                  buf = mmal_queue_get(context.queue);
+                  buf = mmal_queue_wait(context.queue);
+                  fprintf(stderr, "Got buffer\n");
                   mmal_buffer_header_release(buf);
                }
                fprintf(stderr, "Got all buffers\n");
@@ -337,7 +378,10 @@ int main(int argc, char **argv)
 
          }
          else
+         {
+            metrics_port_buffer(&context.metrics, &context.metrics_out, buffer);
             fprintf(stderr, "decoded frame (flags %x)\n", buffer->flags);
+         }
          mmal_buffer_header_release(buffer);
       }
 
@@ -370,7 +414,11 @@ int main(int argc, char **argv)
       mmal_queue_destroy(context.queue);
 
    SOURCE_CLOSE();
-   vcos_semaphore_delete(&context.semaphore);
+   fprintf(stderr, "event loop: %u waits, %u notifications, %u eventfd writes\n",
+           context.loop.waits, context.wake.notified, context.wake.writes);
+   metrics_stop(&context.metrics);
+   event_loop_remove(&context.loop, &context.wake);
+   event_loop_destroy(&context.loop);
    return status == MMAL_SUCCESS ? 0 : -1;
 }
 
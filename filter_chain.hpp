@@ -0,0 +1,233 @@
+#ifndef FILTER_CHAIN_HPP
+#define FILTER_CHAIN_HPP
+
+/* Per-pixel filters on decoded frames, fused at compile time.
+ *
+ * Running draw_overlay, brightness/contrast, privacy masks and so on one after
+ * the other streams the whole frame through memory once per filter (a 1080p
+ * I420 frame is 3 MB, far more than the L2 cache). FilterChain<Format,
+ * Filters...> instead walks every plane once, in tiles of FILTER_TILE pixels
+ * of a row, and applies all filters to a tile while it is in L1:
+ *
+ *     FilterChain<I420, BrightnessContrast, PrivacyMask, ChessOverlay> chain;
+ *     std::get<PrivacyMask>(chain.filters) = PrivacyMask(100, 100, 320, 240);
+ *     chain.run(&frame);
+ *
+ * A filter is a struct with
+ *
+ *     template <class Plane> void apply(uint8_t *p, int y, int x0, int x1) const;
+ *
+ * which processes bytes [x0, x1) of row y of a plane, p pointing at byte x0.
+ * Plane is a compile-time description of the plane (luma or chroma,
+ * subsampling, interleaved U/V), so the calls are specialised per format and
+ * filters skip planes they do not touch with `if constexpr`. y, x0 and x1 are
+ * per plane (halved for I420/NV12 chroma, x in bytes); a filter set up in luma
+ * pixels converts its own coordinates with Plane::x()/y().
+ * Keep the inner loops simple (no table lookups, no calls) or write them with
+ * vector types, as BrightnessContrast does. */
+
+#include <stdint.h>
+#include <string.h>
+#include <tuple>
+#include <utility>
+#include "frame.h"
+
+#define FILTER_TILE 512
+
+typedef uint8_t filter_bytes_t __attribute__((vector_size(16)));
+typedef int16_t filter_shorts_t __attribute__((vector_size(32)));
+
+#define FILTER_BLACK_LUMA 16
+#define FILTER_NEUTRAL_CHROMA 128
+
+template <int Index, bool Luma, int Shift, int Interleave>
+struct FilterPlane {
+    static constexpr int index = Index;
+    static constexpr bool luma = Luma;
+    static constexpr int shift = Shift;           /* subsampling, both directions */
+    static constexpr int interleave = Interleave; /* bytes per pixel, 2 for NV12 U/V */
+
+    /** luma coordinate to byte offset / row in this plane */
+    static constexpr int x(int luma_x) { return (luma_x >> Shift) * Interleave; }
+    static constexpr int y(int luma_y) { return luma_y >> Shift; }
+};
+
+struct I420 {
+    typedef std::tuple<FilterPlane<0, true, 0, 1>, FilterPlane<1, false, 1, 1>, FilterPlane<2, false, 1, 1> > planes;
+};
+
+struct NV12 {
+    typedef std::tuple<FilterPlane<0, true, 0, 1>, FilterPlane<1, false, 1, 2> > planes;
+};
+
+/** Set a rectangle (in luma pixels) to a flat colour */
+template <class Plane>
+static inline void filter_fill_span(uint8_t *p, int y, int x0, int x1, int rx, int ry, int rw, int rh,
+                                    uint8_t luma, uint8_t chroma)
+{
+    int from = Plane::x(rx), to = Plane::x(rx + rw);
+
+    if (y < Plane::y(ry) || y >= Plane::y(ry + rh))
+        return;
+    if (from < x0)
+        from = x0;
+    if (to > x1)
+        to = x1;
+    if (from < to)
+        memset(p + from - x0, Plane::luma ? luma : chroma, to - from);
+}
+
+/** v' = (v - 16) * contrast / 256 + 16 + brightness, luma only. Contrast 0..512. */
+struct BrightnessContrast {
+    int brightness = 0;
+    int contrast = 256;
+
+    BrightnessContrast() {}
+    BrightnessContrast(int brightness, int contrast) : brightness(brightness), contrast(contrast) {}
+
+    template <class Plane>
+    void apply(uint8_t *p, int, int x0, int x1) const
+    {
+        if constexpr (Plane::luma) {
+            /* 16 bit lanes: contrast in 1/64 steps up to 2.0 keeps (v - 16) * c in range */
+            const int c = (contrast > 512 ? 512 : contrast < 0 ? 0 : contrast) >> 2;
+            const int offset = FILTER_BLACK_LUMA + brightness, n = x1 - x0;
+            int i = 0;
+            if (c == 64 && brightness == 0)
+                return;
+            for (; i + 16 <= n; i += 16) {
+                filter_bytes_t b;
+                memcpy(&b, p + i, sizeof(b));
+                filter_shorts_t v = __builtin_convertvector(b, filter_shorts_t);
+                v = ((v - FILTER_BLACK_LUMA) * (int16_t)c >> 6) + (int16_t)offset;
+                v = v < 0 ? 0 : v;
+                v = v > 255 ? 255 : v;
+                b = __builtin_convertvector(v, filter_bytes_t);
+                memcpy(p + i, &b, sizeof(b));
+            }
+            for (; i < n; i++) {
+                int v = (((int)p[i] - FILTER_BLACK_LUMA) * c >> 6) + offset;
+                p[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+            }
+        }
+    }
+};
+
+/** Black out a rectangle, e.g. a neighbour's window */
+struct PrivacyMask {
+    int x = 0, y = 0, width = 0, height = 0;
+
+    PrivacyMask() {}
+    PrivacyMask(int x, int y, int width, int height) : x(x), y(y), width(width), height(height) {}
+
+    template <class Plane>
+    void apply(uint8_t *p, int row, int x0, int x1) const
+    {
+        filter_fill_span<Plane>(p, row, x0, x1, x, y, width, height, FILTER_BLACK_LUMA, FILTER_NEUTRAL_CHROMA);
+    }
+};
+
+/** Black everything outside the rectangle (letterbox / pillarbox) */
+struct CropFill {
+    int x = 0, y = 0, width = 0, height = 0;    /* width 0: disabled */
+    int frame_width = 0, frame_height = 0;
+
+    CropFill() {}
+    CropFill(int x, int y, int width, int height, int frame_width, int frame_height)
+        : x(x), y(y), width(width), height(height), frame_width(frame_width), frame_height(frame_height) {}
+
+    template <class Plane>
+    void apply(uint8_t *p, int row, int x0, int x1) const
+    {
+        if (!width)
+            return;
+        /* top and bottom bars, then left and right of the picture */
+        filter_fill_span<Plane>(p, row, x0, x1, 0, 0, frame_width, y, FILTER_BLACK_LUMA, FILTER_NEUTRAL_CHROMA);
+        filter_fill_span<Plane>(p, row, x0, x1, 0, y + height, frame_width, frame_height - y - height,
+                                FILTER_BLACK_LUMA, FILTER_NEUTRAL_CHROMA);
+        filter_fill_span<Plane>(p, row, x0, x1, 0, y, x, height, FILTER_BLACK_LUMA, FILTER_NEUTRAL_CHROMA);
+        filter_fill_span<Plane>(p, row, x0, x1, x + width, y, frame_width - x - width, height,
+                                FILTER_BLACK_LUMA, FILTER_NEUTRAL_CHROMA);
+    }
+};
+
+/** The chess board pattern of draw_overlay() in manual_decode_overlay_encode, luma only */
+struct ChessOverlay {
+    int x = 0, y = 0, width = 0, height = 0;
+
+    ChessOverlay() {}
+    ChessOverlay(int x, int y, int width, int height) : x(x), y(y), width(width), height(height) {}
+
+    template <class Plane>
+    void apply(uint8_t *p, int row, int x0, int x1) const
+    {
+        if constexpr (Plane::luma) {
+            int from = x > x0 ? x : x0, to = x + width < x1 ? x + width : x1;
+            if (row < y || row >= y + height)
+                return;
+            for (int i = from; i < to; i++)
+                p[i - x0] = (i & 2) || (row & 2) ? 0 : 255;
+        }
+    }
+};
+
+template <class Format, class... Filters>
+class FilterChain {
+public:
+    std::tuple<Filters...> filters;
+
+    FilterChain() {}
+    explicit FilterChain(Filters... f) : filters(f...) {}
+
+    /** All filters in one pass over the frame */
+    void run(const FRAME_T *frame) const
+    {
+        run_planes(frame, std::make_index_sequence<std::tuple_size<typename Format::planes>::value>());
+    }
+
+    /** Every filter in a pass of its own, as they would run without the chain.
+     * Same result as run(), for comparison. */
+    void run_sequential(const FRAME_T *frame) const
+    {
+        run_each(frame, std::index_sequence_for<Filters...>());
+    }
+
+private:
+    template <class Plane, class... Fs>
+    static void run_plane(const FRAME_T *frame, const Fs &...fs)
+    {
+        const int width = Plane::x(frame->width), height = Plane::y(frame->height);
+        uint8_t *base = frame->plane[Plane::index];
+
+        for (int y = 0; y < height; y++) {
+            uint8_t *row = base + (size_t)y * frame->pitch[Plane::index];
+            for (int x0 = 0; x0 < width; x0 += FILTER_TILE) {
+                const int x1 = x0 + FILTER_TILE < width ? x0 + FILTER_TILE : width;
+                (fs.template apply<Plane>(row + x0, y, x0, x1), ...);
+            }
+        }
+    }
+
+    template <size_t... P>
+    void run_planes(const FRAME_T *frame, std::index_sequence<P...>) const
+    {
+        (std::apply([frame](const Filters &...fs) {
+             run_plane<typename std::tuple_element<P, typename Format::planes>::type>(frame, fs...);
+         }, filters), ...);
+    }
+
+    template <class F, size_t... P>
+    static void run_one(const FRAME_T *frame, const F &filter, std::index_sequence<P...>)
+    {
+        (run_plane<typename std::tuple_element<P, typename Format::planes>::type>(frame, filter), ...);
+    }
+
+    template <size_t... I>
+    void run_each(const FRAME_T *frame, std::index_sequence<I...>) const
+    {
+        (run_one(frame, std::get<I>(filters),
+                 std::make_index_sequence<std::tuple_size<typename Format::planes>::value>()), ...);
+    }
+};
+
+#endif
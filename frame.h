@@ -0,0 +1,59 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Describes the planes of a frame living in some buffer.
+ * The decoder delivers I420 planes back to back, each padded to the aligned
+ * port size (width a multiple of 32, height a multiple of 16). width/height
+ * hold the visible (crop) size, pitch the distance between two lines. */
+typedef struct FRAME_T {
+    uint8_t *plane[3];
+    unsigned int pitch[3];
+    unsigned int width, height;
+} FRAME_T;
+
+/** Fill in a FRAME_T for an I420 buffer with the given aligned pitch/height
+ * and visible width/height. */
+static inline void frame_init_i420(FRAME_T *frame, uint8_t *data,
+                                   unsigned int pitch, unsigned int aligned_height,
+                                   unsigned int width, unsigned int height)
+{
+    frame->plane[0] = data;
+    frame->plane[1] = data + pitch * aligned_height;
+    frame->plane[2] = frame->plane[1] + (pitch / 2) * (aligned_height / 2);
+    frame->pitch[0] = pitch;
+    frame->pitch[1] = frame->pitch[2] = pitch / 2;
+    frame->width = width;
+    frame->height = height;
+}
+
+/** Fill in a FRAME_T for an NV12 buffer: a full resolution luma plane followed
+ * by one half resolution plane of interleaved U/V samples (plane[2] is unused). */
+static inline void frame_init_nv12(FRAME_T *frame, uint8_t *data,
+                                   unsigned int pitch, unsigned int aligned_height,
+                                   unsigned int width, unsigned int height)
+{
+    frame->plane[0] = data;
+    frame->plane[1] = data + pitch * aligned_height;
+    frame->plane[2] = NULL;
+    frame->pitch[0] = frame->pitch[1] = pitch;
+    frame->pitch[2] = 0;
+    frame->width = width;
+    frame->height = height;
+}
+
+/** Fill in a FRAME_T for packed pixels (RGB24, RGBA), pitch is in bytes. */
+static inline void frame_init_packed(FRAME_T *frame, uint8_t *data, unsigned int pitch,
+                                     unsigned int width, unsigned int height)
+{
+    frame->plane[0] = data;
+    frame->plane[1] = frame->plane[2] = NULL;
+    frame->pitch[0] = pitch;
+    frame->pitch[1] = frame->pitch[2] = 0;
+    frame->width = width;
+    frame->height = height;
+}
+
+#endif
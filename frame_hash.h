@@ -0,0 +1,255 @@
+#ifndef FRAME_HASH_H
+#define FRAME_HASH_H
+
+/* Per frame checksums of decoded and encoded video, to see whether a firmware
+ * upgrade or a pipeline change altered the output without keeping the video.
+ *
+ * A decoded frame gets a CRC32C per I420 plane over the visible pixels only,
+ * row by row, so neither the stride nor the padding rows of the port format
+ * count. An encoded frame gets one CRC32C over all its buffers, up to the one
+ * with FRAME_END; SPS/PPS buffers count towards the frame after them.
+ *
+ * The CRC uses the crc32c instructions when the CPU has them: picked at run
+ * time on x86 (SSE4.2) and 64-bit ARM (the CRC extension of a Pi 3, 4 or 5),
+ * at compile time elsewhere (-march=armv8-a+crc for 32-bit Pi OS). Slicing
+ * by 8 tables otherwise. frame_hash_impl() says which one is used, see the
+ * hash benchmark for the cost at 1080p.
+ *
+ * FRAME_HASH_LOG_T writes one line per frame:
+ *   D <frame> <width>x<height> <crc Y> <crc U> <crc V>
+ *   E <frame> <bytes> <crc>
+ * Decoded and encoded frames are numbered separately, in the order they come
+ * out; the two kinds may be logged from different threads. hash_compare.c
+ * finds the first frame two logs differ in. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "frame.h"
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define FRAME_HASH_ARM 1
+#define FRAME_HASH_TARGET
+#elif defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#define FRAME_HASH_ARM 1
+#define FRAME_HASH_TARGET __attribute__((target("+crc")))
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define FRAME_HASH_DETECT() ((getauxval(AT_HWCAP) & HWCAP_CRC32) != 0)
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define FRAME_HASH_X86 1
+#define FRAME_HASH_TARGET
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define FRAME_HASH_X86 1
+#define FRAME_HASH_TARGET __attribute__((target("sse4.2")))
+#define FRAME_HASH_DETECT() __builtin_cpu_supports("sse4.2")
+#endif
+
+#define FRAME_HASH_POLY 0x82f63b78u     /* Castagnoli, reflected */
+
+static uint32_t frame_hash_table[8][256];
+static int frame_hash_hw;                   /* the crc32c instructions are used */
+
+/** Build the tables and look for the crc32c instructions. Call once before
+ * the first CRC. */
+static void frame_hash_init(void)
+{
+    unsigned int i, j;
+
+#if defined(FRAME_HASH_DETECT)
+    frame_hash_hw = FRAME_HASH_DETECT();
+#elif defined(FRAME_HASH_ARM) || defined(FRAME_HASH_X86)
+    frame_hash_hw = 1;
+#endif
+
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ FRAME_HASH_POLY : crc >> 1;
+        frame_hash_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+        for (j = 1; j < 8; j++)
+            frame_hash_table[j][i] = (frame_hash_table[j - 1][i] >> 8) ^ frame_hash_table[0][frame_hash_table[j - 1][i] & 0xff];
+}
+
+#if defined(FRAME_HASH_ARM) || defined(FRAME_HASH_X86)
+FRAME_HASH_TARGET static uint32_t frame_hash_crc32c_hw(uint32_t crc, const uint8_t *p, size_t size)
+{
+#if defined(FRAME_HASH_ARM)
+    while (size && ((uintptr_t)p & 7)) {
+        crc = __crc32cb(crc, *p++);
+        size--;
+    }
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+    while (size--)
+        crc = __crc32cb(crc, *p++);
+#else
+    while (size && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        size--;
+    }
+#if defined(__x86_64__)
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = (uint32_t)_mm_crc32_u64(crc, v);
+    }
+#endif
+    for (; size >= 4; p += 4, size -= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        crc = _mm_crc32_u32(crc, v);
+    }
+    while (size--)
+        crc = _mm_crc32_u8(crc, *p++);
+#endif
+    return crc;
+}
+#endif
+
+/** CRC32C of size bytes, continuing crc (0 to start) */
+static uint32_t frame_hash_crc32c(uint32_t crc, const uint8_t *p, size_t size)
+{
+    crc = ~crc;
+#if defined(FRAME_HASH_ARM) || defined(FRAME_HASH_X86)
+    if (frame_hash_hw)
+        return ~frame_hash_crc32c_hw(crc, p, size);
+#endif
+    while (size && ((uintptr_t)p & 3)) {
+        crc = (crc >> 8) ^ frame_hash_table[0][(crc ^ *p++) & 0xff];
+        size--;
+    }
+    /* slicing by 8: two little endian words at a time */
+    for (; size >= 8; p += 8, size -= 8) {
+        uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = frame_hash_table[7][lo & 0xff] ^ frame_hash_table[6][(lo >> 8) & 0xff] ^
+              frame_hash_table[5][(lo >> 16) & 0xff] ^ frame_hash_table[4][lo >> 24] ^
+              frame_hash_table[3][hi & 0xff] ^ frame_hash_table[2][(hi >> 8) & 0xff] ^
+              frame_hash_table[1][(hi >> 16) & 0xff] ^ frame_hash_table[0][hi >> 24];
+    }
+    while (size--)
+        crc = (crc >> 8) ^ frame_hash_table[0][(crc ^ *p++) & 0xff];
+    return ~crc;
+}
+
+static const char *frame_hash_impl(void)
+{
+#if defined(FRAME_HASH_ARM)
+    if (frame_hash_hw)
+        return "crc32c instructions (ARMv8)";
+#elif defined(FRAME_HASH_X86)
+    if (frame_hash_hw)
+        return "crc32c instructions (SSE4.2)";
+#endif
+    return "crc32c tables";
+}
+
+/** CRC32C of each visible I420 plane of the frame */
+static void frame_hash_planes(const FRAME_T *frame, uint32_t crc[3])
+{
+    unsigned int plane, y;
+
+    for (plane = 0; plane < 3; plane++) {
+        unsigned int width = plane ? (frame->width + 1) / 2 : frame->width;
+        unsigned int height = plane ? (frame->height + 1) / 2 : frame->height;
+        const uint8_t *row = frame->plane[plane];
+
+        crc[plane] = 0;
+        for (y = 0; y < height; y++, row += frame->pitch[plane])
+            crc[plane] = frame_hash_crc32c(crc[plane], row, width);
+    }
+}
+
+typedef struct FRAME_HASH_LOG_T {
+    FILE *file;
+    unsigned int decoded, encoded;      /* frames logged */
+    uint64_t decoded_ns, encoded_ns;    /* spent hashing */
+    uint64_t decoded_bytes, encoded_bytes;
+    uint32_t crc;                       /* of the encoded frame so far */
+    uint64_t frame_bytes;
+} FRAME_HASH_LOG_T;
+
+static uint64_t frame_hash_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Returns 0, -1 if the file cannot be written */
+static int frame_hash_log_open(FRAME_HASH_LOG_T *log, const char *path)
+{
+    memset(log, 0, sizeof(*log));
+    frame_hash_init();
+    if (!(log->file = fopen(path, "w")))
+        return -1;
+    fprintf(log->file, "# frame hashes, crc32c\n");
+    return 0;
+}
+
+static void frame_hash_log_decoded(FRAME_HASH_LOG_T *log, const FRAME_T *frame)
+{
+    uint64_t start = frame_hash_now_ns();
+    uint32_t crc[3];
+
+    frame_hash_planes(frame, crc);
+    log->decoded_ns += frame_hash_now_ns() - start;
+    log->decoded_bytes += (uint64_t)frame->width * frame->height * 3 / 2;
+    fprintf(log->file, "D %u %ux%u %08x %08x %08x\n", log->decoded++, frame->width, frame->height, crc[0], crc[1],
+            crc[2]);
+}
+
+/** A buffer of encoded data, frame_end if it is the last one of a frame */
+static void frame_hash_log_encoded(FRAME_HASH_LOG_T *log, const uint8_t *data, size_t size, int frame_end)
+{
+    uint64_t start = frame_hash_now_ns();
+
+    log->crc = frame_hash_crc32c(log->crc, data, size);
+    log->encoded_ns += frame_hash_now_ns() - start;
+    log->frame_bytes += size;
+    log->encoded_bytes += size;
+    if (!frame_end)
+        return;
+    fprintf(log->file, "E %u %llu %08x\n", log->encoded++, (unsigned long long)log->frame_bytes, log->crc);
+    log->crc = 0;
+    log->frame_bytes = 0;
+}
+
+/** Writes what is left of an encoded frame. Returns 0, -1 on write errors. */
+static int frame_hash_log_close(FRAME_HASH_LOG_T *log)
+{
+    int error;
+
+    if (!log->file)
+        return 0;
+    if (log->frame_bytes)
+        frame_hash_log_encoded(log, NULL, 0, 1);
+    error = ferror(log->file);
+    error |= fclose(log->file);
+    log->file = NULL;
+    return error ? -1 : 0;
+}
+
+static void frame_hash_log_print(const FRAME_HASH_LOG_T *log, FILE *file)
+{
+    fprintf(file, "frame hashes (%s): %u decoded frames, %.3f ms/frame (%.0f MB/s), %u encoded frames, %.3f ms/frame\n",
+            frame_hash_impl(), log->decoded, log->decoded ? log->decoded_ns / 1e6 / log->decoded : 0,
+            log->decoded_ns ? log->decoded_bytes * 1e3 / log->decoded_ns : 0, log->encoded,
+            log->encoded ? log->encoded_ns / 1e6 / log->encoded : 0);
+}
+
+#endif
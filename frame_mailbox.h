@@ -0,0 +1,106 @@
+#ifndef FRAME_MAILBOX_H
+#define FRAME_MAILBOX_H
+
+/* Latest-frame-wins handoff of small I420 frames to a slower consumer (a
+ * preview window).
+ *
+ * Three slots: the producer writes into the back slot, the consumer reads the
+ * front slot, and the middle slot is swapped with either of them by one atomic
+ * exchange. Posting a frame never waits: if the consumer has not taken the
+ * previous frame yet, that frame is overwritten and counted as dropped. Taking
+ * never waits either and returns NULL when nothing new has been posted. The
+ * front slot stays untouched until the next take, so the consumer can use the
+ * pixels in place (e.g. wrapped in a QImage).
+ *
+ * One producer thread and one consumer thread. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "interface/vcos/vcos.h"
+#include "frame.h"
+
+#define FRAME_MAILBOX_SLOTS 3
+#define FRAME_MAILBOX_FRESH 0x4     /* in middle: the slot holds a frame not taken yet */
+
+typedef struct FRAME_MAILBOX_T {
+    FRAME_T slot[FRAME_MAILBOX_SLOTS];
+    int64_t pts[FRAME_MAILBOX_SLOTS];
+    uint64_t posted_us[FRAME_MAILBOX_SLOTS];
+    uint8_t *data;
+    unsigned int width, height;
+
+    unsigned int back;          /* producer only */
+    unsigned int middle;        /* shared, slot index | FRAME_MAILBOX_FRESH */
+    unsigned int front;         /* consumer only */
+
+    unsigned int posted;        /* producer only */
+    unsigned int dropped;       /* producer only: posted frames overwritten before they were taken */
+    unsigned int taken;         /* consumer only */
+} FRAME_MAILBOX_T;
+
+/** Slots of width x height (both even). Returns 0 on success. */
+static int frame_mailbox_create(FRAME_MAILBOX_T *mb, unsigned int width, unsigned int height)
+{
+    size_t size = (size_t)width * height * 3 / 2;
+    unsigned int i;
+
+    memset(mb, 0, sizeof(*mb));
+    mb->data = (uint8_t *)malloc(size * FRAME_MAILBOX_SLOTS);
+    if (!mb->data)
+        return -1;
+    for (i = 0; i < FRAME_MAILBOX_SLOTS; i++)
+        frame_init_i420(&mb->slot[i], mb->data + i * size, width, height, width, height);
+    mb->width = width;
+    mb->height = height;
+    mb->back = 0;
+    mb->middle = 1;
+    mb->front = 2;
+    return 0;
+}
+
+static void frame_mailbox_destroy(FRAME_MAILBOX_T *mb)
+{
+    free(mb->data);
+    mb->data = NULL;
+}
+
+/** Producer: the slot to write the next frame into */
+static FRAME_T *frame_mailbox_back(FRAME_MAILBOX_T *mb)
+{
+    return &mb->slot[mb->back];
+}
+
+/** Producer: publish the back slot. Never blocks. */
+static void frame_mailbox_post(FRAME_MAILBOX_T *mb, int64_t pts)
+{
+    unsigned int old;
+
+    mb->pts[mb->back] = pts;
+    mb->posted_us[mb->back] = vcos_getmicrosecs64();
+    old = __atomic_exchange_n(&mb->middle, mb->back | FRAME_MAILBOX_FRESH, __ATOMIC_ACQ_REL);
+    if (old & FRAME_MAILBOX_FRESH)
+        mb->dropped++;
+    mb->back = old & ~FRAME_MAILBOX_FRESH;
+    mb->posted++;
+}
+
+/** Consumer: the latest frame if one was posted since the last call, else NULL.
+ * It stays valid until the next call. posted_us may be NULL. */
+static const FRAME_T *frame_mailbox_take(FRAME_MAILBOX_T *mb, int64_t *pts, uint64_t *posted_us)
+{
+    unsigned int old;
+
+    if (!(__atomic_load_n(&mb->middle, __ATOMIC_ACQUIRE) & FRAME_MAILBOX_FRESH))
+        return NULL;
+    old = __atomic_exchange_n(&mb->middle, mb->front, __ATOMIC_ACQ_REL);
+    mb->front = old & ~FRAME_MAILBOX_FRESH;
+    mb->taken++;
+    if (pts)
+        *pts = mb->pts[mb->front];
+    if (posted_us)
+        *posted_us = mb->posted_us[mb->front];
+    return &mb->slot[mb->front];
+}
+
+#endif
@@ -0,0 +1,355 @@
+#ifndef GOP_SPLICE_H
+#define GOP_SPLICE_H
+
+/* Smart transcoding: only the GOPs which overlap an overlay window go through
+ * the decoder and encoder, the others are copied to the output untouched.
+ *
+ * splice_read_gop() collects the access units from one IDR up to the next. A
+ * GOP is re-encoded when any of its frames lies in a window (the whole GOP,
+ * its P-frames need the IDR), else it is passed through. The encoder lags
+ * behind, so a passed through GOP is queued and written by splice_add_encoded()
+ * in front of the first encoded frame which comes after it (by pts), or at the
+ * end, or as soon as nothing before it is left in the decoder or encoder.
+ * Frames the decoder drops or holds back do not upset the order. The queue
+ * holds what is read while the encoder finishes the GOP before; it is bounded
+ * (splice_queue_full()), the reader waits for it to be written.
+ *
+ * Splice points are always IDRs, each segment with its own SPS/PPS in front:
+ * the encoder repeats its parameter sets at every IDR (inline headers) and is
+ * asked for an IDR at the first frame after a gap, and a GOP of the source
+ * which does not carry its SPS/PPS gets the ones in effect put in front. The
+ * two sets may differ in profile, level and everything else an IDR allows to
+ * change; the picture size is the same because the encoder gets the decoded
+ * frames. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "h264_nal.h"
+
+#define SPLICE_KEYFRAME 0x1         /* encoded buffer of an IDR */
+#define SPLICE_CONFIG 0x4           /* SPS/PPS */
+#define SPLICE_MAX_WINDOWS 32
+#define SPLICE_MAX_PARAMS 1024
+#define SPLICE_MAX_QUEUED (32 << 20)    /* read-ahead of passed through GOPs, bytes */
+#define SPLICE_MAX_QUEUED_GOPS 8        /* and GOPs */
+
+typedef struct SPLICE_GOP_T {
+    uint8_t *data;
+    size_t size, alloc;
+    size_t *au_end;                 /* end of every access unit in data */
+    unsigned int aus, au_alloc;
+    unsigned int first_frame;       /* index of the first access unit in the stream */
+    int idr;                        /* starts with an IDR, all but a leading partial GOP */
+    int transcode;
+    struct SPLICE_GOP_T *next;
+} SPLICE_GOP_T;
+
+typedef struct SPLICE_T {
+    struct {
+        unsigned int first, last;   /* frames, last not included */
+    } window[SPLICE_MAX_WINDOWS];
+    unsigned int windows;
+
+    unsigned int frames_read;
+    SPLICE_GOP_T *next;             /* started by the IDR which ended the last GOP */
+    int eof;
+    uint8_t params[SPLICE_MAX_PARAMS];  /* last SPS and PPS of the source */
+    size_t params_size;
+
+    SPLICE_GOP_T *queue_head, *queue_tail;  /* passed through, waiting for the encoder */
+    size_t queued, max_queued;
+    unsigned int queued_gops;
+    uint8_t config[SPLICE_MAX_PARAMS];      /* SPS/PPS of the encoder, held until the next frame */
+    size_t config_size;
+    int after_gap;                  /* a passed through GOP was written last */
+
+    unsigned int gops_transcoded, gops_passed, frames_transcoded, frames_passed, params_inserted;
+    unsigned int splices, splices_not_idr;
+    uint64_t bytes_passed, bytes_encoded;
+} SPLICE_T;
+
+static void splice_init(SPLICE_T *s)
+{
+    memset(s, 0, sizeof(*s));
+}
+
+/** Add windows given as "start-end[,start-end...]" in seconds. Returns 0 on success. */
+static int splice_add_windows(SPLICE_T *s, const char *spec, unsigned int fps)
+{
+    while (*spec) {
+        double start, end;
+        int used;
+        if (s->windows == SPLICE_MAX_WINDOWS || sscanf(spec, "%lf-%lf%n", &start, &end, &used) != 2 ||
+            start < 0 || end <= start)
+            return -1;
+        s->window[s->windows].first = start * fps;
+        s->window[s->windows].last = end * fps + 0.999;
+        s->windows++;
+        spec += used;
+        if (*spec == ',')
+            spec++;
+        else if (*spec)
+            return -1;
+    }
+    return 0;
+}
+
+static int splice_in_window(const SPLICE_T *s, unsigned int frame)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->windows; i++)
+        if (frame >= s->window[i].first && frame < s->window[i].last)
+            return 1;
+    return 0;
+}
+
+static int splice_overlaps_window(const SPLICE_T *s, unsigned int first, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->windows; i++)
+        if (first < s->window[i].last && s->window[i].first < first + count)
+            return 1;
+    return 0;
+}
+
+static void splice_gop_free(SPLICE_GOP_T *gop)
+{
+    if (!gop)
+        return;
+    free(gop->data);
+    free(gop->au_end);
+    free(gop);
+}
+
+/** Add data to the GOP, ending an access unit with au_end */
+static int splice_gop_append(SPLICE_GOP_T *gop, const uint8_t *data, size_t size, int au_end)
+{
+    if (gop->size + size > gop->alloc) {
+        size_t alloc = (gop->size + size) * 2;
+        uint8_t *grown = (uint8_t *)realloc(gop->data, alloc);
+        if (!grown)
+            return -1;
+        gop->data = grown;
+        gop->alloc = alloc;
+    }
+    if (au_end && gop->aus == gop->au_alloc) {
+        unsigned int alloc = gop->au_alloc * 2 + 32;
+        size_t *grown = (size_t *)realloc(gop->au_end, alloc * sizeof(*grown));
+        if (!grown)
+            return -1;
+        gop->au_end = grown;
+        gop->au_alloc = alloc;
+    }
+    memcpy(gop->data + gop->size, data, size);
+    gop->size += size;
+    if (au_end)
+        gop->au_end[gop->aus++] = gop->size;
+    return 0;
+}
+
+/** Access unit i of the GOP */
+static const uint8_t *splice_gop_au(const SPLICE_GOP_T *gop, unsigned int i, size_t *size)
+{
+    size_t start = i ? gop->au_end[i - 1] : 0;
+
+    *size = gop->au_end[i] - start;
+    return gop->data + start;
+}
+
+/** Remember the SPS and PPS of the access unit: a new SPS replaces all, a PPS on its own is added */
+static void splice_keep_params(SPLICE_T *s, const H264_AU_T *au)
+{
+    size_t pos = h264_find_start_code(au->data, 0, au->size);
+
+    if (!(au->nal_types & (1u << H264_NAL_SPS | 1u << H264_NAL_PPS)))
+        return;
+    if (au->nal_types & (1u << H264_NAL_SPS))
+        s->params_size = 0;
+    while (pos < au->size) {
+        size_t end = h264_find_start_code(au->data, pos + 3, au->size);
+        unsigned int header = au->data[pos + 2] == 1 ? 3 : 4, type;
+        if (pos + header >= au->size)
+            break;
+        type = au->data[pos + header] & 0x1f;
+        if ((type == H264_NAL_SPS || type == H264_NAL_PPS) && s->params_size + end - pos <= SPLICE_MAX_PARAMS) {
+            memcpy(s->params + s->params_size, au->data + pos, end - pos);
+            s->params_size += end - pos;
+        }
+        pos = end;
+    }
+}
+
+/** A GOP beginning with the access unit. An IDR without SPS/PPS in front
+ * gets the ones in effect, so that it can follow anything in the output. */
+static SPLICE_GOP_T *splice_gop_start(SPLICE_T *s, const H264_AU_T *au)
+{
+    SPLICE_GOP_T *gop = (SPLICE_GOP_T *)calloc(1, sizeof(*gop));
+
+    if (!gop)
+        return NULL;
+    gop->first_frame = s->frames_read;
+    gop->idr = au->keyframe;
+    if (gop->idr && !(au->nal_types & (1u << H264_NAL_SPS)) && s->params_size) {
+        if (splice_gop_append(gop, s->params, s->params_size, 0) != 0) {
+            splice_gop_free(gop);
+            return NULL;
+        }
+        s->params_inserted++;
+    }
+    if (splice_gop_append(gop, au->data, au->size, 1) != 0) {
+        splice_gop_free(gop);
+        return NULL;
+    }
+    return gop;
+}
+
+/** The next GOP of the source, decided whether it is re-encoded. NULL at the
+ * end of the stream (or when out of memory, which also ends it). */
+static SPLICE_GOP_T *splice_read_gop(SPLICE_T *s, H264_READER_T *reader)
+{
+    SPLICE_GOP_T *gop = s->next;
+    H264_AU_T au;
+
+    s->next = NULL;
+    while (!s->eof) {
+        if (!h264_reader_next_au(reader, &au)) {
+            s->eof = 1;
+            break;
+        }
+        splice_keep_params(s, &au);
+        if (!gop || au.keyframe) {
+            /* an IDR begins the next GOP */
+            SPLICE_GOP_T *started = splice_gop_start(s, &au);
+            if (!started) {
+                s->eof = 1;
+                break;
+            }
+            s->frames_read++;
+            if (gop) {
+                s->next = started;
+                break;
+            }
+            gop = started;
+        } else if (splice_gop_append(gop, au.data, au.size, 1) != 0) {
+            s->eof = 1;
+            break;
+        } else {
+            s->frames_read++;
+        }
+    }
+    if (!gop)
+        return NULL;
+
+    gop->transcode = splice_overlaps_window(s, gop->first_frame, gop->aus);
+    if (gop->transcode) {
+        s->gops_transcoded++;
+        s->frames_transcoded += gop->aus;
+    } else {
+        s->gops_passed++;
+        s->frames_passed += gop->aus;
+    }
+    return gop;
+}
+
+/** Queue a passed through GOP until the encoder has caught up with it */
+static void splice_queue(SPLICE_T *s, SPLICE_GOP_T *gop)
+{
+    gop->next = NULL;
+    if (s->queue_tail)
+        s->queue_tail->next = gop;
+    else
+        s->queue_head = gop;
+    s->queue_tail = gop;
+    s->queued += gop->size;
+    s->queued_gops++;
+    if (s->queued > s->max_queued)
+        s->max_queued = s->queued;
+}
+
+/** Whether to stop reading until queued GOPs have been written */
+static int splice_queue_full(const SPLICE_T *s)
+{
+    return s->queued >= SPLICE_MAX_QUEUED || s->queued_gops >= SPLICE_MAX_QUEUED_GOPS;
+}
+
+/** Write the queued GOPs which start at or before frame (all of them if frame
+ * is negative). Returns 0, -1 on write errors. */
+static int splice_write_queued(SPLICE_T *s, int64_t frame, FILE *file)
+{
+    int error = 0;
+
+    while (s->queue_head && (frame < 0 || s->queue_head->first_frame <= frame)) {
+        SPLICE_GOP_T *gop = s->queue_head;
+        error |= fwrite(gop->data, 1, gop->size, file) != gop->size;
+        s->bytes_passed += gop->size;
+        s->queued -= gop->size;
+        s->queued_gops--;
+        s->after_gap = 1;
+        if (!(s->queue_head = gop->next))
+            s->queue_tail = NULL;
+        splice_gop_free(gop);
+    }
+    return error ? -1 : 0;
+}
+
+/** Write a buffer from the encoder, frame being its frame number (from the
+ * pts, negative if unknown). Returns 0, -1 on write errors. */
+static int splice_add_encoded(SPLICE_T *s, const uint8_t *data, size_t size, unsigned int flags, int64_t frame,
+                              FILE *file)
+{
+    int error = 0;
+
+    if ((flags & SPLICE_CONFIG) && s->config_size + size <= SPLICE_MAX_PARAMS) {
+        /* it belongs to the next frame, which may come after a queued GOP */
+        memcpy(s->config + s->config_size, data, size);
+        s->config_size += size;
+        return 0;
+    }
+    if (!size)
+        return 0;                   /* the EOS buffer, not a splice */
+    if (frame >= 0)
+        error |= splice_write_queued(s, frame, file);
+    if (s->after_gap) {
+        s->splices++;
+        if (!(flags & SPLICE_KEYFRAME))
+            s->splices_not_idr++;
+        s->after_gap = 0;
+    }
+    if (s->config_size) {
+        error |= fwrite(s->config, 1, s->config_size, file) != s->config_size;
+        s->bytes_encoded += s->config_size;
+        s->config_size = 0;
+    }
+    error |= fwrite(data, 1, size, file) != size;
+    s->bytes_encoded += size;
+    return error ? -1 : 0;
+}
+
+static void splice_destroy(SPLICE_T *s)
+{
+    while (s->queue_head) {
+        SPLICE_GOP_T *gop = s->queue_head;
+        s->queue_head = gop->next;
+        splice_gop_free(gop);
+    }
+    s->queue_tail = NULL;
+    splice_gop_free(s->next);
+    s->next = NULL;
+}
+
+static void splice_print(const SPLICE_T *s, FILE *file)
+{
+    fprintf(file, "smart transcode: %u GOPs (%u frames, %.1f MB) re-encoded, %u GOPs (%u frames, %.1f MB) passed "
+            "through, SPS/PPS inserted %u times, %.1f MB queued at most\n", s->gops_transcoded, s->frames_transcoded,
+            s->bytes_encoded / 1e6, s->gops_passed, s->frames_passed, s->bytes_passed / 1e6, s->params_inserted,
+            s->max_queued / 1e6);
+    if (s->splices_not_idr)
+        fprintf(file, "smart transcode: %u of %u splices into encoded video did not start with an IDR\n",
+                s->splices_not_idr, s->splices);
+}
+
+#endif
@@ -4,7 +4,12 @@
 #include "util/mmal_default_components.h"
 #include "util/mmal_util_params.h"
 #include <stdio.h>
+#include <unistd.h>
 #include "interface/vcos/vcos.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "sps_rewrite.h"
+#include "buffer_arena.h"
 
 
 
@@ -15,6 +20,7 @@ static uint8_t codec_header_bytes[128];
 static unsigned int codec_header_bytes_size = sizeof(codec_header_bytes);
 
 static FILE *source_file;
+static H264_READER_T reader; //with -R the input is split into NAL units
 
 /* Macros abstracting the I/O, just to make the example code clearer */
 #define SOURCE_OPEN(uri) \
@@ -29,11 +35,66 @@ static FILE *source_file;
 
 /** Context for our application */
 static struct CONTEXT_T {
-    VCOS_SEMAPHORE_T semaphore;
+    EVENT_LOOP_T loop;
+    EVENT_SOURCE_T wake;
     MMAL_QUEUE_T *queue;
     MMAL_STATUS_T status;
+    METRICS_T metrics; //served when MMAL_METRICS is set to a port or socket path
+    METRICS_PORT_T metrics_in;
+    METRICS_EVENTS_T metrics_events;
+    int rewrite_sps; //-R: tell the decoder not to hold pictures back for reordering
+    unsigned int sps_rewritten;
 } context;
 
+static struct {
+    H264_NAL_T nal;
+    size_t sent;
+    int pending; //nal is not completely sent yet
+} input;
+
+/** With -R: fill the buffer with NAL units, every SPS rewritten by sps_rewrite.h */
+static void read_nal_units(struct CONTEXT_T *ctx, MMAL_BUFFER_HEADER_T *buffer)
+{
+    buffer->length = 0;
+    buffer->offset = 0;
+    buffer->pts = buffer->dts = MMAL_TIME_UNKNOWN;
+    while (buffer->length < buffer->alloc_size) {
+        size_t length;
+
+        if (!input.pending) {
+            if (!h264_reader_next_nal(&reader, &input.nal))
+                break;
+            input.pending = 1;
+            input.sent = 0;
+            //past the slices checked up front
+            if (ctx->rewrite_sps && sps_slice_reorders(input.nal.data, input.nal.size)) {
+                fprintf(stderr, "stream has B-frames, SPS no longer rewritten\n");
+                ctx->rewrite_sps = 0;
+            }
+        }
+        if (ctx->rewrite_sps && input.nal.type == H264_NAL_SPS && !input.sent) {
+            size_t written = sps_rewrite_nal(input.nal.data, input.nal.size, buffer->data + buffer->length,
+                                             buffer->alloc_size - buffer->length);
+            if (written) {
+                buffer->length += written;
+                input.pending = 0;
+                ctx->sps_rewritten++;
+                continue;
+            }
+            if (buffer->length)
+                break; //try again in an empty buffer
+        }
+        length = input.nal.size - input.sent;
+        if (length > buffer->alloc_size - buffer->length)
+            length = buffer->alloc_size - buffer->length;
+        memcpy(buffer->data + buffer->length, input.nal.data + input.sent, length);
+        buffer->length += length;
+        input.sent += length;
+        if (input.sent == input.nal.size)
+            input.pending = 0;
+    }
+}
+
 /** Callback from the decoder input port.
  * Buffer has been consumed and is available to be used again. */
 static void input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
@@ -44,17 +105,27 @@ static void input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
     mmal_buffer_header_release(buffer);
 
     /* Kick the processing thread */
-    vcos_semaphore_post(&ctx->semaphore);
+    event_loop_notify(&ctx->wake);
 
     //fprintf(stderr,"decoder input callback\n");
 }
 
+/** Called by the event loop after one of the callbacks has kicked it */
+static void wake_handler(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    MMAL_PARAM_UNUSED(loop);
+    MMAL_PARAM_UNUSED(source);
+    MMAL_PARAM_UNUSED(events);
+    /* nothing to do, main() looks at all queues after every wake-up */
+}
+
 /** Callback from the control port.
  * Component is sending us an event. */
 static void control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
    struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
 
+   metrics_event(&ctx->metrics, &ctx->metrics_events, buffer);
    switch (buffer->cmd)
    {
    case MMAL_EVENT_EOS:
@@ -80,15 +151,62 @@ int main(int argc, char* argv[]) {
     MMAL_GRAPH_T *graph = 0;
     MMAL_COMPONENT_T *decoder = 0, *renderer=0;
     MMAL_POOL_T *pool_in = 0;
+    BUFFER_ARENA_POOL_T *arena_in = 0;
     MMAL_ES_FORMAT_T * format_in=0;
     MMAL_PARAMETER_BOOLEAN_T zc;
     MMAL_BOOL_T eos_sent = MMAL_FALSE;
+    const char *source = "test.h264_2";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "R")) != -1) {
+        switch (opt) {
+        case 'R':
+            context.rewrite_sps = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-R] [file.h264]\n"
+                            "  -R  rewrite the SPS to max_num_reorder_frames=0, for streams without B-frames\n", argv[0]);
+            return -1;
+        }
+    }
+    if (optind < argc)
+        source = argv[optind];
 
 
     bcm_host_init();
-    vcos_semaphore_create(&context.semaphore, "example", 1);
+    /* The callbacks only wake the main loop, the work is done below */
+    if (event_loop_create(&context.loop) != 0 ||
+        event_loop_add_notifier(&context.loop, &context.wake, wake_handler, &context) != 0) {
+        fprintf(stderr, "failed to create event loop\n");
+        return -1;
+    }
+    event_loop_notify(&context.wake);
+    //MMAL_POOL_BUDGET limits the buffer memory
+    if (buffer_arena_init_from_env() != 0)
+        return -1;
+
+    //the decoder output goes straight to the renderer, only the input is seen here
+    metrics_init(&context.metrics, 0);
+    if (metrics_register_port(&context.metrics, &context.metrics_in, "decoder_in") ||
+        metrics_register_events(&context.metrics, &context.metrics_events, "decoder") ||
+        metrics_register_pool(&context.metrics, "decoder_in", &pool_in) ||
+        metrics_serve_from_env(&context.metrics, &context.loop)) {
+        fprintf(stderr, "failed to set up metrics\n");
+        return -1;
+    }
 
-    SOURCE_OPEN("test.h264_2")
+    SOURCE_OPEN(source)
+    //with B-frames the decoder has to reorder, the SPS must say so
+    if (context.rewrite_sps) {
+        int reorders = sps_stream_reorders(source_file, SPS_SCAN_SLICES);
+        if (reorders) {
+            fprintf(stderr, reorders > 0 ? "%s has B-frames, SPS not rewritten\n" :
+                                           "%s cannot be checked for B-frames, SPS not rewritten\n", source);
+            context.rewrite_sps = 0;
+        }
+    }
+    if (context.rewrite_sps && h264_reader_init(&reader, source_file) != 0)
+        goto error;
 
 
     /* Create the graph */
@@ -135,11 +253,16 @@ int main(int argc, char* argv[]) {
 
 
     SOURCE_READ_CODEC_CONFIG_DATA(codec_header_bytes, codec_header_bytes_size);
-    status = mmal_format_extradata_alloc(format_in, codec_header_bytes_size);
+    status = mmal_format_extradata_alloc(format_in, codec_header_bytes_size + SPS_REWRITE_GROWTH);
     CHECK_STATUS(status, "failed to allocate extradata");
-    format_in->extradata_size = codec_header_bytes_size;
-    if (format_in->extradata_size)
+    format_in->extradata_size = 0;
+    if (context.rewrite_sps)
+      format_in->extradata_size = sps_rewrite_buffer(codec_header_bytes, codec_header_bytes_size, format_in->extradata,
+                                                     codec_header_bytes_size + SPS_REWRITE_GROWTH, &context.sps_rewritten);
+    if (!format_in->extradata_size && codec_header_bytes_size) {
+      format_in->extradata_size = codec_header_bytes_size;
       memcpy(format_in->extradata, codec_header_bytes, format_in->extradata_size);
+    }
 
 
     status = mmal_port_format_commit(decoder->input[0]);
@@ -155,7 +278,13 @@ int main(int argc, char* argv[]) {
     decoder->output[0]->buffer_num = decoder->output[0]->buffer_num_min;
     decoder->output[0]->buffer_size = decoder->output[0]->buffer_size_min;
 
-    pool_in = mmal_pool_create(decoder->input[0]->buffer_num,decoder->input[0]->buffer_size);
+    //without zero copy the input buffers are plain CPU memory, carved from the arena
+    arena_in = buffer_arena_pool_add("decoder_in", NULL, decoder->input[0]->buffer_num_min,
+                                     decoder->input[0]->buffer_num, decoder->input[0]->buffer_size);
+    pool_in = buffer_arena_pool_create(arena_in);
+    status = pool_in ? MMAL_SUCCESS : MMAL_ENOMEM;
+    CHECK_STATUS(status, "failed to create input pool");
+    decoder->input[0]->buffer_num = pool_in->headers_num;
 
     context.queue = mmal_queue_create();
 
@@ -181,17 +310,27 @@ int main(int argc, char* argv[]) {
         MMAL_BUFFER_HEADER_T *buffer;
 
         /* Wait for buffer headers to be available on either the decoder input or the encoder output port */
-        vcos_semaphore_wait(&context.semaphore);
+        /* Wake-ups are coalesced, so handle everything which is available */
+        if (event_loop_run_once(&context.loop, -1) < 0) {
+            fprintf(stderr, "event loop failed\n");
+            break;
+        }
+        buffer_arena_sample();
 
         /* Send data to decode to the input port of the video decoder */
-        if ((buffer = mmal_queue_get(pool_in->queue)) != NULL)
+        while (!eos_sent && (buffer = mmal_queue_get(pool_in->queue)) != NULL)
         {
-            SOURCE_READ_DATA_INTO_BUFFER(buffer);
+            if (context.rewrite_sps)
+                read_nal_units(&context, buffer);
+            else {
+                SOURCE_READ_DATA_INTO_BUFFER(buffer);
+            }
             if(!buffer->length) eos_sent = MMAL_TRUE;
 
              buffer->flags = buffer->length ? 0 : MMAL_BUFFER_HEADER_FLAG_EOS;
              buffer->pts = buffer->dts = MMAL_TIME_UNKNOWN;
              //fprintf(stderr, "sending %i bytes\n", (int)buffer->length);
+             metrics_port_buffer(&context.metrics, &context.metrics_in, buffer);
              status = mmal_port_send_buffer(decoder->input[0], buffer);
             CHECK_STATUS(status, "failed to send buffer");
         }
@@ -199,6 +338,9 @@ int main(int argc, char* argv[]) {
 
     /* Stop decoding */
     fprintf(stderr, "stop decoding\n");
+    if (context.sps_rewritten)
+        fprintf(stderr, "SPS rewritten %u times (extradata included)\n", context.sps_rewritten);
+    buffer_arena_print(stderr);
 
     /* Stop everything. Not strictly necessary since mmal_component_destroy()
        * will do that anyway */
@@ -210,6 +352,14 @@ int main(int argc, char* argv[]) {
     mmal_graph_disable(graph);
 
 error:
+    fprintf(stderr, "event loop: %u waits, %u notifications, %u eventfd writes\n",
+            context.loop.waits, context.wake.notified, context.wake.writes);
+    metrics_stop(&context.metrics);
+    event_loop_remove(&context.loop, &context.wake);
+    event_loop_destroy(&context.loop);
+    h264_reader_free(&reader);
+    SOURCE_CLOSE();
+
     /* Cleanup everything */
     if (decoder)
         mmal_component_release(decoder);
@@ -217,6 +367,8 @@ error:
         mmal_component_release(renderer);
     if (graph)
         mmal_graph_destroy(graph);
+    buffer_arena_pool_destroy(arena_in);
+    buffer_arena_destroy();
 
     return status == MMAL_SUCCESS ? 0 : -1;
 
@@ -0,0 +1,196 @@
+#ifndef H264_NAL_H
+#define H264_NAL_H
+
+/* Minimal H.264 Annex B parser: splits a byte stream read from a file into
+ * NAL units and access units, so the examples can feed the decoder one frame
+ * at a time and look at the NAL headers on the way. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define H264_NAL_SLICE        1
+#define H264_NAL_IDR          5
+#define H264_NAL_SEI          6
+#define H264_NAL_SPS          7
+#define H264_NAL_PPS          8
+#define H264_NAL_AUD          9
+
+#define H264_READ_CHUNK (64 * 1024)
+
+typedef struct H264_NAL_T {
+    const uint8_t *data;   /* start code included */
+    size_t size;
+    unsigned int header;   /* offset of the NAL header byte in data */
+    unsigned int type;
+    unsigned int ref_idc;
+} H264_NAL_T;
+
+typedef struct H264_AU_T {
+    const uint8_t *data;   /* all NAL units of the access unit, start codes included */
+    size_t size;
+    uint32_t nal_types;    /* bit n is set if a NAL unit of type n is present */
+    unsigned int ref_idc;  /* highest nal_ref_idc of its slices, 0 for non-reference pictures */
+    int keyframe;          /* contains an IDR slice */
+} H264_AU_T;
+
+typedef struct H264_READER_T {
+    FILE *file;
+    uint8_t *buf;
+    size_t alloc, len;
+    size_t mark;           /* data before mark may be discarded when reading more */
+    size_t pos;            /* start of the next NAL unit */
+    int eof;
+} H264_READER_T;
+
+static int h264_reader_init(H264_READER_T *r, FILE *file)
+{
+    memset(r, 0, sizeof(*r));
+    r->file = file;
+    r->alloc = 4 * H264_READ_CHUNK;
+    r->buf = (uint8_t *)malloc(r->alloc);
+    return r->buf ? 0 : -1;
+}
+
+static void h264_reader_free(H264_READER_T *r)
+{
+    free(r->buf);
+    r->buf = NULL;
+}
+
+/** Offset of the next 00 00 01 start code in [from, len), or len if there is none.
+ * A leading zero byte (4 byte start code) is included in the start code. */
+static size_t h264_find_start_code(const uint8_t *buf, size_t from, size_t len)
+{
+    size_t i;
+
+    for (i = from; i + 2 < len; i++) {
+        if (buf[i + 2] > 1) {
+            i += 2;
+        } else if (!buf[i] && !buf[i + 1] && buf[i + 2] == 1) {
+            return (i > from && !buf[i - 1]) ? i - 1 : i;
+        }
+    }
+    return len;
+}
+
+/** Read more of the file, discarding data before the mark. Returns 0 at the end of the file. */
+static int h264_reader_fill(H264_READER_T *r)
+{
+    size_t got;
+
+    if (r->eof)
+        return 0;
+    if (r->mark) {
+        memmove(r->buf, r->buf + r->mark, r->len - r->mark);
+        r->len -= r->mark;
+        r->pos -= r->mark;
+        r->mark = 0;
+    }
+    if (r->alloc - r->len < H264_READ_CHUNK) {
+        uint8_t *buf = (uint8_t *)realloc(r->buf, r->alloc * 2);
+        if (!buf) {
+            r->eof = 1;
+            return 0;
+        }
+        r->buf = buf;
+        r->alloc *= 2;
+    }
+    got = fread(r->buf + r->len, 1, r->alloc - r->len, r->file);
+    r->len += got;
+    if (!got)
+        r->eof = 1;
+    return got != 0;
+}
+
+/** Parse the NAL unit at the read position without consuming it.
+ * Returns 0 at the end of the stream. nal->data is valid until the next read. */
+static int h264_reader_peek_nal(H264_READER_T *r, H264_NAL_T *nal)
+{
+    size_t start, end;
+
+    /* find the start code and NAL header, skipping anything in front of them */
+    while ((start = h264_find_start_code(r->buf, r->pos, r->len)) + 4 > r->len) {
+        if (start == r->len && r->mark == r->pos && r->len - r->pos > 3)
+            r->mark = r->pos = r->len - 3;
+        if (!h264_reader_fill(r))
+            return 0;
+    }
+    r->pos = start;
+
+    /* the NAL unit ends where the next one starts */
+    while ((end = h264_find_start_code(r->buf, r->pos + 3, r->len)) == r->len) {
+        if (!h264_reader_fill(r)) {
+            end = r->len; /* the data may have moved */
+            break;
+        }
+    }
+
+    nal->data = r->buf + r->pos;
+    nal->size = end - r->pos;
+    nal->header = nal->data[2] == 1 ? 3 : 4;
+    nal->type = nal->data[nal->header] & 0x1f;
+    nal->ref_idc = (nal->data[nal->header] >> 5) & 3;
+    return 1;
+}
+
+/** Read the next NAL unit. Returns 0 at the end of the stream. */
+static int h264_reader_next_nal(H264_READER_T *r, H264_NAL_T *nal)
+{
+    r->mark = r->pos;
+    if (!h264_reader_peek_nal(r, nal))
+        return 0;
+    r->pos += nal->size;
+    return 1;
+}
+
+static int h264_nal_is_slice(const H264_NAL_T *nal)
+{
+    return nal->type == H264_NAL_SLICE || nal->type == H264_NAL_IDR;
+}
+
+/** first_mb_in_slice is ue(v) coded, it is 0 if the first bit is set */
+static int h264_nal_first_slice(const H264_NAL_T *nal)
+{
+    return nal->size > nal->header + 1 && (nal->data[nal->header + 1] & 0x80);
+}
+
+/** Whether the NAL unit starts a new access unit after a picture has been seen (7.4.1.2.3) */
+static int h264_nal_starts_au(const H264_NAL_T *nal)
+{
+    return (nal->type >= H264_NAL_SEI && nal->type <= H264_NAL_AUD) ||
+           (nal->type >= 14 && nal->type <= 18) ||
+           (h264_nal_is_slice(nal) && h264_nal_first_slice(nal));
+}
+
+/** Read the next access unit (one coded picture plus the parameter sets and
+ * SEI in front of it). Returns 0 at the end of the stream. */
+static int h264_reader_next_au(H264_READER_T *r, H264_AU_T *au)
+{
+    H264_NAL_T nal;
+    int have_slice = 0;
+
+    memset(au, 0, sizeof(*au));
+    r->mark = r->pos;
+    while (h264_reader_peek_nal(r, &nal)) {
+        if (have_slice && h264_nal_starts_au(&nal))
+            break;
+        if (h264_nal_is_slice(&nal)) {
+            have_slice = 1;
+            if (nal.ref_idc > au->ref_idc)
+                au->ref_idc = nal.ref_idc;
+            if (nal.type == H264_NAL_IDR)
+                au->keyframe = 1;
+        }
+        au->nal_types |= 1u << nal.type;
+        r->pos += nal.size;
+    }
+    if (r->pos == r->mark)
+        return 0;
+    au->data = r->buf + r->mark;
+    au->size = r->pos - r->mark;
+    return 1;
+}
+
+#endif
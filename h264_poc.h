@@ -0,0 +1,168 @@
+#ifndef H264_POC_H
+#define H264_POC_H
+
+/* Presentation order of H.264 access units from the picture order count, so
+ * timestamps given to the decoder follow the order it outputs the frames in,
+ * also on streams with B-frames.
+ *
+ * The frame number of an access unit is the frame number of the last IDR
+ * (which is shown before everything decoded after it) plus the distance of
+ * its POC from the POC of the IDR, at two POC per frame as encoders write it
+ * for progressive video. The SPS is taken from the stream; before the first
+ * SPS and IDR, and with pic_order_cnt_type 1, the frame number is unknown.
+ * With pic_order_cnt_type 2 frames are shown in decoding order. */
+
+#include <stdint.h>
+#include <string.h>
+#include "h264_nal.h"
+#include "sps_rewrite.h"
+
+typedef struct H264_POC_T {
+    int sps;                        /* an SPS was parsed */
+    unsigned int separate_colour_plane, log2_max_frame_num, type, log2_max_lsb, frame_mbs_only;
+    int idr;                        /* an IDR was seen */
+    int64_t idr_frame, idr_poc;
+    int32_t prev_msb, prev_lsb;     /* of the last reference picture */
+} H264_POC_T;
+
+static int32_t h264_poc_read_se(SPS_BITS_T *b)
+{
+    uint32_t code = sps_read_ue(b);
+
+    return code & 1 ? (int32_t)((code + 1) / 2) : -(int32_t)(code / 2);
+}
+
+static void h264_poc_parse_sps(H264_POC_T *p, const uint8_t *rbsp, size_t size)
+{
+    SPS_BITS_T b = { (uint8_t *)rbsp, size, 0, 0 };
+    unsigned int profile, chroma = 1, separate = 0, log2_max_frame_num, type, log2_max_lsb = 0, i, j;
+
+    profile = sps_read_bits(&b, 8);
+    sps_read_bits(&b, 16);                      /* constraint flags, level_idc */
+    sps_read_ue(&b);                            /* seq_parameter_set_id */
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 ||
+        profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138 ||
+        profile == 139 || profile == 134 || profile == 135) {
+        chroma = sps_read_ue(&b);
+        if (chroma == 3)
+            separate = sps_read_bit(&b);
+        sps_read_ue(&b);                        /* bit depths */
+        sps_read_ue(&b);
+        sps_read_bit(&b);                       /* qpprime_y_zero_transform_bypass_flag */
+        if (sps_read_bit(&b))                   /* seq_scaling_matrix_present_flag */
+            for (i = 0; i < (chroma != 3 ? 8u : 12u); i++) {
+                int32_t last = 8, next = 8;
+                if (!sps_read_bit(&b))
+                    continue;
+                for (j = 0; j < (i < 6 ? 16u : 64u) && next && !b.error; j++) {
+                    next = (last + h264_poc_read_se(&b) + 256) % 256;
+                    last = next ? next : last;
+                }
+            }
+    }
+    log2_max_frame_num = sps_read_ue(&b) + 4;
+    type = sps_read_ue(&b);
+    if (type == 0) {
+        log2_max_lsb = sps_read_ue(&b) + 4;
+    } else if (type == 1) {
+        uint32_t cycle;
+        sps_read_bit(&b);
+        h264_poc_read_se(&b);
+        h264_poc_read_se(&b);
+        cycle = sps_read_ue(&b);
+        for (i = 0; i < cycle && !b.error; i++)
+            h264_poc_read_se(&b);
+    }
+    sps_read_ue(&b);                            /* max_num_ref_frames */
+    sps_read_bit(&b);                           /* gaps_in_frame_num_value_allowed_flag */
+    sps_read_ue(&b);                            /* size in macroblocks */
+    sps_read_ue(&b);
+    p->frame_mbs_only = sps_read_bit(&b);
+    if (b.error || type > 2 || log2_max_frame_num > 16 || log2_max_lsb > 16)
+        return;
+    p->separate_colour_plane = separate;
+    p->log2_max_frame_num = log2_max_frame_num;
+    p->type = type;
+    p->log2_max_lsb = log2_max_lsb;
+    p->sps = 1;
+}
+
+/** Frame number of an access unit (Annex B) in presentation order; index is
+ * its number in decoding order, counted the same way for every access unit.
+ * Call for every access unit, in decoding order. Returns -1 if unknown. */
+static int64_t h264_poc_frame(H264_POC_T *p, const uint8_t *data, size_t size, unsigned int index)
+{
+    size_t pos = h264_find_start_code(data, 0, size);
+
+    while (pos < size) {
+        size_t end = h264_find_start_code(data, pos + 3, size);
+        unsigned int header = data[pos + 2] == 1 ? 3 : 4, type, ref;
+        uint8_t rbsp[SPS_REWRITE_MAX];
+        size_t len, limit;
+        SPS_BITS_T b = { rbsp, 0, 0, 0 };
+        int32_t lsb, msb, poc;
+
+        if (pos + header >= end) {
+            pos = end;
+            continue;
+        }
+        type = data[pos + header] & 0x1f;
+        ref = data[pos + header] >> 5 & 3;
+        len = end - pos - header - 1;
+        /* the fields needed are at the start of the slice header */
+        limit = type == H264_NAL_SPS ? sizeof(rbsp) : 64;
+        b.size = sps_unescape(data + pos + header + 1, len < limit ? len : limit, rbsp);
+        if (type == H264_NAL_SPS)
+            h264_poc_parse_sps(p, rbsp, b.size);
+        if (type != H264_NAL_SLICE && type != H264_NAL_IDR) {
+            pos = end;
+            continue;
+        }
+
+        if (type == H264_NAL_IDR) {
+            p->idr = 1;
+            p->idr_frame = index;
+        }
+        if (!p->sps || !p->idr || p->type == 1)
+            return -1;
+        if (p->type == 2)
+            return index;
+        sps_read_ue(&b);                        /* first_mb_in_slice */
+        sps_read_ue(&b);                        /* slice_type */
+        sps_read_ue(&b);                        /* pic_parameter_set_id */
+        if (p->separate_colour_plane)
+            sps_read_bits(&b, 2);
+        sps_read_bits(&b, p->log2_max_frame_num);
+        if (!p->frame_mbs_only && sps_read_bit(&b))     /* field_pic_flag */
+            sps_read_bit(&b);
+        if (type == H264_NAL_IDR)
+            sps_read_ue(&b);                    /* idr_pic_id */
+        lsb = (int32_t)sps_read_bits(&b, p->log2_max_lsb);
+        if (b.error)
+            return -1;
+
+        /* 8.2.1.1 */
+        if (type == H264_NAL_IDR) {
+            msb = 0;
+        } else {
+            int32_t max_lsb = 1 << p->log2_max_lsb;
+            if (lsb < p->prev_lsb && p->prev_lsb - lsb >= max_lsb / 2)
+                msb = p->prev_msb + max_lsb;
+            else if (lsb > p->prev_lsb && lsb - p->prev_lsb > max_lsb / 2)
+                msb = p->prev_msb - max_lsb;
+            else
+                msb = p->prev_msb;
+        }
+        poc = msb + lsb;
+        if (ref || type == H264_NAL_IDR) {
+            p->prev_msb = msb;
+            p->prev_lsb = lsb;
+        }
+        if (type == H264_NAL_IDR)
+            p->idr_poc = poc;
+        return p->idr_frame + (poc - p->idr_poc) / 2;
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,146 @@
+/* Compares two frame hash logs (frame_hash.h, MMAL_HASH=frames.log) and
+ * reports the first decoded and the first encoded frame which differ, so a
+ * firmware upgrade or a change of the pipeline can be checked against the
+ * log of a known good run instead of a copy of its output.
+ *
+ * Usage: ./hash_compare expected.log actual.log
+ * Exits with 0 if both logs have the same frames, 1 if not. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+typedef struct HASH_FRAME_T {
+    unsigned int width, height;     /* decoded: size, encoded: 0 */
+    unsigned long long bytes;       /* encoded */
+    uint32_t crc[3];                /* decoded: Y, U, V, encoded: crc[0] */
+} HASH_FRAME_T;
+
+typedef struct HASH_LOG_T {
+    const char *name;
+    HASH_FRAME_T *frames[2];        /* decoded, encoded; by frame number */
+    unsigned int count[2], alloc[2];
+} HASH_LOG_T;
+
+static const char *const hash_kind[2] = { "decoded", "encoded" };
+
+static int hash_add(HASH_LOG_T *log, int kind, unsigned int index, const HASH_FRAME_T *frame)
+{
+    if (index >= log->alloc[kind]) {
+        unsigned int alloc = index * 2 + 256;
+        HASH_FRAME_T *grown = (HASH_FRAME_T *)realloc(log->frames[kind], alloc * sizeof(*grown));
+        if (!grown)
+            return -1;
+        memset(grown + log->alloc[kind], 0, (alloc - log->alloc[kind]) * sizeof(*grown));
+        log->frames[kind] = grown;
+        log->alloc[kind] = alloc;
+    }
+    log->frames[kind][index] = *frame;
+    if (index >= log->count[kind])
+        log->count[kind] = index + 1;
+    return 0;
+}
+
+static int hash_read(HASH_LOG_T *log, const char *name)
+{
+    FILE *file = fopen(name, "r");
+    char line[256];
+    unsigned int number = 0;
+
+    memset(log, 0, sizeof(*log));
+    log->name = name;
+    if (!file) {
+        fprintf(stderr, "cannot open %s\n", name);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        HASH_FRAME_T frame;
+        unsigned int index;
+        int kind;
+
+        number++;
+        memset(&frame, 0, sizeof(frame));
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "D %u %ux%u %x %x %x", &index, &frame.width, &frame.height, &frame.crc[0], &frame.crc[1],
+                   &frame.crc[2]) == 6)
+            kind = 0;
+        else if (sscanf(line, "E %u %llu %x", &index, &frame.bytes, &frame.crc[0]) == 3)
+            kind = 1;
+        else {
+            fprintf(stderr, "%s:%u: not a frame hash\n", name, number);
+            fclose(file);
+            return -1;
+        }
+        if (hash_add(log, kind, index, &frame) != 0) {
+            fprintf(stderr, "out of memory\n");
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+static int hash_same(int kind, const HASH_FRAME_T *a, const HASH_FRAME_T *b)
+{
+    if (kind == 0)
+        return a->width == b->width && a->height == b->height && !memcmp(a->crc, b->crc, sizeof(a->crc));
+    return a->bytes == b->bytes && a->crc[0] == b->crc[0];
+}
+
+/** Returns 1 if the frames of this kind differ */
+static int hash_compare(int kind, const HASH_LOG_T *a, const HASH_LOG_T *b)
+{
+    unsigned int common = a->count[kind] < b->count[kind] ? a->count[kind] : b->count[kind];
+    unsigned int i, first = common, differ = 0;
+
+    if (!a->count[kind] && !b->count[kind])
+        return 0;
+    for (i = 0; i < common; i++) {
+        if (hash_same(kind, &a->frames[kind][i], &b->frames[kind][i]))
+            continue;
+        if (!differ++)
+            first = i;
+    }
+    printf("%s: %u and %u frames", hash_kind[kind], a->count[kind], b->count[kind]);
+    if (!differ) {
+        printf(", %s %u frames\n", a->count[kind] == b->count[kind] ? "identical over" : "the same over the first",
+               common);
+        return a->count[kind] != b->count[kind];
+    }
+    printf(", %u of %u differ, the first is frame %u\n", differ, common, first);
+    if (kind == 0) {
+        const HASH_FRAME_T *x = &a->frames[0][first], *y = &b->frames[0][first];
+        printf("  %s: %ux%u Y %08x U %08x V %08x\n", a->name, x->width, x->height, x->crc[0], x->crc[1], x->crc[2]);
+        printf("  %s: %ux%u Y %08x U %08x V %08x\n", b->name, y->width, y->height, y->crc[0], y->crc[1], y->crc[2]);
+    } else {
+        const HASH_FRAME_T *x = &a->frames[1][first], *y = &b->frames[1][first];
+        printf("  %s: %llu bytes %08x\n", a->name, x->bytes, x->crc[0]);
+        printf("  %s: %llu bytes %08x\n", b->name, y->bytes, y->crc[0]);
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    HASH_LOG_T a, b;
+    int differ;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s expected.log actual.log\n", argv[0]);
+        return 2;
+    }
+    if (hash_read(&a, argv[1]) != 0 || hash_read(&b, argv[2]) != 0)
+        return 2;
+    differ = hash_compare(0, &a, &b);
+    differ |= hash_compare(1, &a, &b);
+    if (!a.count[0] && !a.count[1] && !b.count[0] && !b.count[1])
+        printf("no frames in either log\n");
+    free(a.frames[0]);
+    free(a.frames[1]);
+    free(b.frames[0]);
+    free(b.frames[1]);
+    return differ;
+}
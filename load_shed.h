@@ -0,0 +1,92 @@
+#ifndef LOAD_SHED_H
+#define LOAD_SHED_H
+
+/* Load shedding in front of the decoder.
+ *
+ * When the stages after the decoder fall behind, the input stage drops access
+ * units before they are decoded instead of letting latency grow:
+ *
+ *   level 1: downstream depth >= threshold, drop non-reference pictures
+ *            (nal_ref_idc == 0). Nothing else depends on them.
+ *   level 2: depth >= 2 * threshold, drop everything up to the next IDR.
+ *            Once a reference picture has been dropped the rest of the GOP
+ *            cannot be decoded either, so this level always lasts until the
+ *            next keyframe, whatever happens to the depth in between.
+ *
+ * Dropped pictures keep their slot in the timeline (the caller derives
+ * timestamps from the access unit index), so the pictures that are decoded
+ * keep their original timestamps. */
+
+#include "h264_nal.h"
+
+#define LOAD_SHED_LEVELS 3
+
+typedef struct LOAD_SHED_T {
+    unsigned int threshold;                     /* 0 disables load shedding */
+    unsigned int level;                         /* level of the last decision */
+    int skip_to_idr;                            /* level 2 is active */
+
+    unsigned int seen[LOAD_SHED_LEVELS];        /* access units seen at each level */
+    unsigned int dropped[LOAD_SHED_LEVELS];     /* ... and dropped */
+    uint64_t dropped_bytes;
+    unsigned int max_depth;
+} LOAD_SHED_T;
+
+static void load_shed_init(LOAD_SHED_T *ls, unsigned int threshold)
+{
+    memset(ls, 0, sizeof(*ls));
+    ls->threshold = threshold;
+}
+
+/** Decide whether to drop the access unit, given the number of frames which
+ * are currently waiting or being worked on after the decoder. Returns 1 to drop. */
+static int load_shed_drop(LOAD_SHED_T *ls, const H264_AU_T *au, unsigned int depth)
+{
+    int drop;
+
+    if (depth > ls->max_depth)
+        ls->max_depth = depth;
+
+    if (au->keyframe)
+        ls->skip_to_idr = 0;
+    if (!ls->threshold)
+        ls->level = 0;
+    else if (ls->skip_to_idr || depth >= 2 * ls->threshold)
+        ls->level = 2;
+    else
+        ls->level = depth >= ls->threshold ? 1 : 0;
+
+    switch (ls->level) {
+    case 2:
+        /* keyframes always go through, they end the skipping */
+        drop = !au->keyframe;
+        if (drop)
+            ls->skip_to_idr = 1;
+        break;
+    case 1:
+        drop = au->ref_idc == 0;
+        break;
+    default:
+        drop = 0;
+        break;
+    }
+
+    ls->seen[ls->level]++;
+    if (drop) {
+        ls->dropped[ls->level]++;
+        ls->dropped_bytes += au->size;
+    }
+    return drop;
+}
+
+static void load_shed_print(const LOAD_SHED_T *ls, FILE *file)
+{
+    unsigned int l;
+
+    fprintf(file, "load shedding (threshold %u, max depth %u):", ls->threshold, ls->max_depth);
+    for (l = 0; l < LOAD_SHED_LEVELS; l++)
+        fprintf(file, " level %u: %u/%u dropped,", l, ls->dropped[l], ls->seen[l]);
+    fprintf(file, " %llu bytes not decoded\n", (unsigned long long)ls->dropped_bytes);
+}
+
+#endif
@@ -7,24 +7,53 @@
 #include "util/mmal_util.h"
 #include "util/mmal_util_params.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 #include "interface/vcos/vcos.h"
+#include "frame.h"
+#include "text_overlay.h"
+#include "scene_detect.h"
+#include "h264_nal.h"
+#include "load_shed.h"
+#include "spsc_queue.h"
+#include "event_loop.h"
+#include "control_socket.h"
+#include "shm_frame_ring.h"
+#include "event_recorder.h"
+#include "segmenter.h"
+#include "gop_splice.h"
+#include "sei_timestamp.h"
+#include "sps_rewrite.h"
+#include "h264_poc.h"
+#include "decoder_recovery.h"
+#include "metrics.h"
+#include "trace.h"
+#include "thread_roles.h"
+#include "frame_hash.h"
 
 static const int MAX_BITRATE_LEVEL4 = 25000000; // 25Mbits/s
 #define CHECK_STATUS(status, msg) if (status != MMAL_SUCCESS) { fprintf(stderr, msg"\n"); goto error; }
 
+static const int FRAME_RATE = 25;
+#define DECODE_LATENCY_SAMPLES 4096
+#define SMART_NUDGE_PTS (-1) //-W: decoded only to push held frames out, thrown away
+
 static FILE *source_file;
 static FILE *dest_file;
+static H264_READER_T reader;
 
 /* Macros abstracting the I/O, just to make the example code clearer */
 
 
 #define SOURCE_OPEN(uri) \
-    source_file = fopen(uri, "rb"); if (!source_file) goto error;
-#define SOURCE_READ_DATA_INTO_BUFFER(a) \
-    a->length = fread(a->data, 1, a->alloc_size - 128, source_file); \
-    a->offset = 0; a->pts = a->dts = MMAL_TIME_UNKNOWN
+    source_file = fopen(uri, "rb"); if (!source_file || h264_reader_init(&reader, source_file)) goto error;
 #define SOURCE_CLOSE() \
-    if (source_file) fclose(source_file)
+    if (source_file) { h264_reader_free(&reader); fclose(source_file); }
 
 #define DEST_OPEN(uri) \
     dest_file = fopen(uri, "wb"); if (!dest_file) goto error;
@@ -35,14 +64,85 @@ static FILE *dest_file;
 
 /** Context for our application */
 static struct CONTEXT_T {
-    VCOS_SEMAPHORE_T semaphore;
-    MMAL_QUEUE_T *queue_encoded;
+    EVENT_LOOP_T loop; //the main loop waits for everything in here
+    EVENT_SOURCE_T wake; //kicked by the callbacks below
+    EVENT_SOURCE_T status_timer;
+    CONTROL_SOCKET_T control;
+    int stop_requested; //by the control socket, stop reading input
+    SPSC_QUEUE_T queue_encoded; //encoder output callback -> main loop
+    SPSC_QUEUE_T decoder_free; //decoder input pool -> main loop
     MMAL_PORT_T* encoder_input_port;
     MMAL_PORT_T* encoder_output_port;
     MMAL_POOL_T * encoder_pool_in;
+    MMAL_POOL_T *encoder_pool_named; //main loop only: encoder_pool_in as last named for the trace
     MMAL_STATUS_T status;
+    TEXT_OVERLAY_T text_overlay;
+    const char *camera_id;
+    unsigned int frames_decoded;
+    uint64_t text_overlay_us; //time spent burning in the text, for all frames
+    int scene_detect_enabled;
+    SCENE_DETECT_T scene_detect;
+    unsigned int i_frames_requested;
+    unsigned int frames_in_encoder; //decoded frames sent to the encoder and not yet returned, atomic
+    unsigned int frames_encoded;
+    LOAD_SHED_T load_shed;
+    const char *publish_path; //unix socket handing out the frame ring
+    SHM_RING_PUBLISHER_T publisher; //decoded frames for other processes, decoder output callback only
+    int publishing;
+    unsigned int publish_rejected; //frames of another size than the ring's (after a format change)
+    EVENT_RECORDER_T recorder; //with -E, encoded video only reaches the disk on a trigger
+    int recording;
+    EVENT_SOURCE_T trigger_signal; //SIGUSR1 triggers the recorder
+    SEGMENTER_T segmenter; //with -H, encoded video goes into segments and a playlist
+    int segmenting;
+    METRICS_T metrics; //served when MMAL_METRICS is set to a port or socket path
+    METRICS_PORT_T metrics_decoder_in, metrics_decoder_out, metrics_encoder_out, metrics_written;
+    METRICS_EVENTS_T metrics_decoder_events, metrics_encoder_events;
+    const char *trace_path; //MMAL_TRACE: trace from the start and write it there at the end
+    int smart; //with -W, only GOPs overlapping an overlay window are re-encoded
+    SPLICE_T splice;
+    SPSC_QUEUE_T splice_points; //-W: first frames of re-encoded GOPs after passed through ones, main loop -> decoder output
+    int64_t splice_point; //the next one, decoder output only, -1 if none
+    unsigned int transcoded_end; //frame after the last re-encoded GOP read, main loop only
+    unsigned int splice_requests; //I-frames requested at splice points, decoder output only
+    unsigned int smart_sent; //-W: frames sent to the decoder, main loop only
+    unsigned int smart_decoded; //and decoded, atomic
+    uint8_t *nudge_au; //copy of the IDR sent as a nudge
+    size_t nudge_alloc;
+    int nudging; //a nudge is in the decoder
+    unsigned int nudge_before; //frames sent before it
+    unsigned int nudge_decoded; //frames decoded before it came out, atomic
+    int nudge_out; //it came out, atomic
+    unsigned int nudges;
+    int stamping; //with -L, every encoded picture carries its ingest time in a SEI
+    SEI_TS_RING_T stamps;
+    int rewrite_sps; //-R: the decoder is told not to hold pictures back for reordering
+    unsigned int sps_rewritten;
+    uint8_t *sps_au; //access unit with the rewritten SPS
+    size_t sps_au_alloc;
+    uint64_t decode_sent_us[64]; //when the last buffer of a frame was sent to the decoder, by frame number
+    uint32_t decode_first_us; //from sending the first frame to getting it decoded
+    uint32_t decode_latency_us[DECODE_LATENCY_SAMPLES]; //the same for the frames after it
+    unsigned int decode_latencies;
+    DECODER_RECOVERY_T recovery; //decoder errors are recovered from at the next IDR
+    FRAME_JITTER_T frame_jitter; //intervals between encoded frames, with and without MMAL_THREADS
+    FRAME_HASH_LOG_T hashes; //MMAL_HASH: CRCs of the decoded and encoded frames, see hash_compare
 } context;
 
+/** Access unit currently being sent to the decoder. It may need several buffers. */
+static struct {
+    H264_AU_T au;
+    size_t sent;
+    int64_t pts;
+    int64_t frame; //in presentation order, -1 if not known
+    unsigned int index; //number of access units read so far
+    H264_POC_T poc; //presentation order of the access units
+    SPLICE_GOP_T *gop; //with -W: GOP being re-encoded
+    unsigned int gop_au; //next access unit of it
+    int nudge; //with -W: the access unit is a nudge (smart_nudge())
+    MMAL_BUFFER_HEADER_T *held; //with -W: decoder input buffer left over while the read-ahead is full
+} input;
+
 static int framenr=0;
 
 static void log_video_format(MMAL_ES_FORMAT_T *format)
@@ -65,8 +165,11 @@ static void encoder_input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buff
 {
     struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
 
+    thread_role_enter(THREAD_ROLE_CALLBACK, NULL);
+    trace_callback(port, buffer);
     /* The encoder is done with the data, just recycle the buffer header into its pool */
-    mmal_buffer_header_release(buffer);
+    trace_buffer_header_release(buffer);
+    __sync_fetch_and_sub(&ctx->frames_in_encoder, 1);
 
     //fprintf(stderr,"encoder input callback\n");
 }
@@ -78,11 +181,24 @@ static void encoder_output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
 {
     struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
 
+    thread_role_enter(THREAD_ROLE_CALLBACK, NULL);
+    trace_callback(port, buffer);
+    if (buffer->cmd)
+        metrics_event(&ctx->metrics, &ctx->metrics_encoder_events, buffer);
+    else
+        metrics_port_buffer(&ctx->metrics, &ctx->metrics_encoder_out, buffer);
+
     /* Queue the encoded video frame so that we can grab it in the main loop*/
-    mmal_queue_put(ctx->queue_encoded, buffer);
+    if (spsc_queue_push(&ctx->queue_encoded, buffer) != 0) {
+        //cannot happen, the ring holds more than the pool
+        fprintf(stderr,"encoded queue full\n");
+        trace_buffer_header_release(buffer);
+        return;
+    }
+    trace_event(TRACE_PUT, &ctx->queue_encoded, buffer);
 
     /* Kick the processing thread */
-    vcos_semaphore_post(&ctx->semaphore);
+    event_loop_notify(&ctx->wake);
 
     //fprintf(stderr,"encoder output callback\n");
 }
@@ -93,17 +209,33 @@ static void encoder_output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
  * Buffer has been consumed and is available to be used again. */
 static void decoder_input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
-    struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
-
-    /* The decoder is done with the data, just recycle the buffer header into its pool */
-    mmal_buffer_header_release(buffer);
-
-    /* Kick the processing thread */
-    vcos_semaphore_post(&ctx->semaphore);
+    thread_role_enter(THREAD_ROLE_CALLBACK, NULL);
+    trace_callback(port, buffer);
+    /* The decoder is done with the data, just recycle the buffer header into its pool.
+     * decoder_pool_free_callback hands it on to the main loop. */
+    trace_buffer_header_release(buffer);
 
     //fprintf(stderr,"decoder input callback\n");
 }
 
+/** Callback from the decoder input pool. Buffer is available again. */
+static MMAL_BOOL_T decoder_pool_free_callback(MMAL_POOL_T *pool, MMAL_BUFFER_HEADER_T *buffer,
+   void *userdata)
+{
+   struct CONTEXT_T *ctx = (struct CONTEXT_T *)userdata;
+   MMAL_PARAM_UNUSED(pool);
+
+   thread_role_enter(THREAD_ROLE_CALLBACK, NULL);
+   /* if the ring is full the buffer goes back into the pool queue as usual */
+   if (spsc_queue_push(&ctx->decoder_free, buffer) != 0)
+      return MMAL_TRUE;
+   trace_event(TRACE_PUT, &ctx->decoder_free, buffer);
+
+   /* Kick the processing thread */
+   event_loop_notify(&ctx->wake);
+   return MMAL_FALSE;
+}
+
 
 
 /** Callback from the pool. Buffer is available. */
@@ -112,7 +244,7 @@ static MMAL_BOOL_T pool_buffer_available_callback(MMAL_POOL_T *pool, MMAL_BUFFER
 {
    MMAL_PARAM_UNUSED(userdata);
 
-   mmal_queue_put(pool->queue, buffer);
+   trace_queue_put(pool->queue, buffer);
 
    return 0;
 }
@@ -131,13 +263,98 @@ static void draw_overlay(MMAL_BUFFER_HEADER_T *frame) {
     }
 }
 
+/** Burn camera id, wall-clock time and frame number into the decoded frame */
+static void draw_text_overlay(struct CONTEXT_T *ctx, MMAL_BUFFER_HEADER_T *frame)
+{
+    MMAL_VIDEO_FORMAT_T *video = &ctx->encoder_input_port->format->es->video;
+    uint64_t start = vcos_getmicrosecs64();
+    char text[TEXT_OVERLAY_MAX_CHARS + 1], clock[24];
+    struct timeval tv;
+    struct tm tm;
+    FRAME_T planes;
+
+    gettimeofday(&tv, NULL);
+    localtime_r(&tv.tv_sec, &tm);
+    strftime(clock, sizeof(clock), "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(text, sizeof(text), "%s %s.%03d F%06u", ctx->camera_id, clock,
+             (int)(tv.tv_usec / 1000), ctx->frames_decoded++);
+
+    /* only the characters which changed since the last frame are re-rendered */
+    text_overlay_set_text(&ctx->text_overlay, text);
+
+    frame_init_i420(&planes, frame->data + frame->offset, video->width, video->height,
+                    video->crop.width ? video->crop.width : video->width,
+                    video->crop.height ? video->crop.height : video->height);
+    text_overlay_blit(&ctx->text_overlay, &planes);
+
+    ctx->text_overlay_us += vcos_getmicrosecs64() - start;
+}
+
+/** Look for a scene cut in the decoded frame (before anything is drawn on it)
+ * and ask the encoder to start a new GOP with it */
+static void detect_scene_cut(struct CONTEXT_T *ctx, MMAL_BUFFER_HEADER_T *frame)
+{
+    MMAL_VIDEO_FORMAT_T *video = &ctx->encoder_input_port->format->es->video;
+    FRAME_T planes;
+
+    frame_init_i420(&planes, frame->data + frame->offset, video->width, video->height,
+                    video->crop.width ? video->crop.width : video->width,
+                    video->crop.height ? video->crop.height : video->height);
+    if (!scene_detect_frame(&ctx->scene_detect, &planes))
+        return;
+
+    fprintf(stderr, "scene cut at frame %u (score %.1f, average %.1f)\n", ctx->scene_detect.frames - 1,
+            ctx->scene_detect.score, ctx->scene_detect.average);
+    if (mmal_port_parameter_set_boolean(ctx->encoder_output_port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME,
+                                        MMAL_TRUE) == MMAL_SUCCESS)
+        ctx->i_frames_requested++;
+    else
+        fprintf(stderr, "could not request I-frame\n");
+}
+
+/** Copy the decoded frame (before anything is drawn on it) into the shared
+ * memory ring. Never waits for the consumers. The ring keeps the size of the
+ * first format: the consumers have mapped it, so frames of another size after
+ * a format change are not published. */
+static void publish_frame(struct CONTEXT_T *ctx, MMAL_BUFFER_HEADER_T *frame)
+{
+    MMAL_VIDEO_FORMAT_T *video = &ctx->encoder_input_port->format->es->video;
+    FRAME_T planes;
+
+    frame_init_i420(&planes, frame->data + frame->offset, video->width, video->height,
+                    video->crop.width ? video->crop.width : video->width,
+                    video->crop.height ? video->crop.height : video->height);
+    if (planes.width != ctx->publisher.header->width || planes.height != ctx->publisher.header->height) {
+        if (!ctx->publish_rejected++)
+            fprintf(stderr, "frame ring is %ux%u, %ux%u frames are not published\n", ctx->publisher.header->width,
+                    ctx->publisher.header->height, planes.width, planes.height);
+        return;
+    }
+    shm_ring_publish(&ctx->publisher, &planes, frame->pts);
+}
+
+/** Log the CRCs of the decoded frame, before anything is drawn on it */
+static void hash_frame(struct CONTEXT_T *ctx, MMAL_BUFFER_HEADER_T *frame)
+{
+    MMAL_VIDEO_FORMAT_T *video = &ctx->encoder_input_port->format->es->video;
+    FRAME_T planes;
+
+    frame_init_i420(&planes, frame->data + frame->offset, video->width, video->height,
+                    video->crop.width ? video->crop.width : video->width,
+                    video->crop.height ? video->crop.height : video->height);
+    frame_hash_log_decoded(&ctx->hashes, &planes);
+}
+
 /** Callback from the decoder output port.
  * Buffer has been produced by the port and is available for processing. */
 static void decoder_output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
     struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
 
+    thread_role_enter(THREAD_ROLE_CALLBACK, NULL);
+    trace_callback(port, buffer);
     if (buffer->cmd) {
+        metrics_event(&ctx->metrics, &ctx->metrics_decoder_events, buffer);
         if (buffer->cmd != MMAL_EVENT_FORMAT_CHANGED) {
             fprintf(stderr,"unknown cmd: %u\n",buffer->cmd);
             return;
@@ -184,18 +401,108 @@ static void decoder_output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
         //create pool with corret buffer requirements
         ctx->encoder_pool_in =mmal_port_pool_create(ctx->encoder_input_port,ctx->encoder_input_port->buffer_num_recommended,ctx->encoder_input_port->buffer_size_recommended);
         mmal_pool_callback_set(ctx->encoder_pool_in, pool_buffer_available_callback, NULL);
+        //named from the main loop, the tracer's names are not locked
+
+        //scale the font with the picture: 2 at 720p, 4 at 1080p. Every format change
+        //re-creates it, the one of the previous format is freed first.
+        text_overlay_destroy(&ctx->text_overlay);
+        if (text_overlay_create(&ctx->text_overlay, event->format->es->video.crop.height / 270, 0) != 0) {
+          fprintf(stderr,"could not create text overlay\n");
+          return;
+        }
+        ctx->text_overlay.x = ctx->text_overlay.y = 16;
 
-        mmal_buffer_header_release(buffer);
+        //every 4th luma row is enough to see a cut and keeps the cost per frame low
+        if (ctx->scene_detect_enabled &&
+            scene_detect_create(&ctx->scene_detect, event->format->es->video.crop.width,
+                                event->format->es->video.crop.height, 4) != 0) {
+          fprintf(stderr,"could not create scene detector\n");
+          return;
+        }
+
+        //the consumers get the ring fd over the socket, accepted by the main loop
+        if (ctx->publish_path && !ctx->publishing) {
+          if (shm_ring_publisher_create(&ctx->publisher, 4, event->format->es->video.crop.width,
+                                        event->format->es->video.crop.height) != 0 ||
+              shm_ring_publisher_listen(&ctx->publisher, &ctx->loop, ctx->publish_path) != 0) {
+            fprintf(stderr,"could not publish frames on %s\n", ctx->publish_path);
+            shm_ring_publisher_destroy(&ctx->publisher);
+            return;
+          }
+          ctx->publishing = 1;
+        }
+
+        trace_buffer_header_release(buffer);
         fprintf(stderr,"Encoder enabled\n");
 
+    } else if (!buffer->length && !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_EOS)) {
+        //handed back empty by a flush, goes back into the pool
+        trace_buffer_header_release(buffer);
+    } else if (ctx->smart && buffer->pts == SMART_NUDGE_PTS) {
+        //everything sent before the nudge has come out or was dropped
+        __atomic_store_n(&ctx->nudge_decoded, __atomic_load_n(&ctx->smart_decoded, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+        __atomic_store_n(&ctx->nudge_out, 1, __ATOMIC_RELEASE);
+        trace_buffer_header_release(buffer);
+        event_loop_notify(&ctx->wake);
     } else {
-        draw_overlay(buffer);
-        ctx->status = mmal_port_send_buffer(ctx->encoder_input_port, buffer);
+        int overlay = 1;
+
+        metrics_port_buffer(&ctx->metrics, &ctx->metrics_decoder_out, buffer);
+        if (buffer->length)
+            decoder_recovery_frame(&ctx->recovery);
+        if (buffer->length && buffer->pts != MMAL_TIME_UNKNOWN) {
+            unsigned int frame = buffer->pts * FRAME_RATE / 1000000;
+            uint32_t latency = event_recorder_now_us() - ctx->decode_sent_us[frame % 64];
+            if (!ctx->decode_first_us)
+                ctx->decode_first_us = latency ? latency : 1;
+            else if (ctx->decode_latencies < DECODE_LATENCY_SAMPLES)
+                ctx->decode_latency_us[ctx->decode_latencies++] = latency;
+        }
+        if (ctx->smart && buffer->length) {
+            if (buffer->pts != MMAL_TIME_UNKNOWN) {
+                unsigned int frame = buffer->pts * FRAME_RATE / 1000000;
+                int splice = 0;
+                void *point;
+
+                //a passed through GOP goes in front of the first frame at or after a splice point,
+                //which must be an IDR; the splice points come in the order the GOPs were read
+                for (;;) {
+                    if (ctx->splice_point < 0 && (point = spsc_queue_pop(&ctx->splice_points)) != NULL)
+                        ctx->splice_point = (uintptr_t)point - 1;
+                    if (ctx->splice_point < 0 || ctx->splice_point > frame)
+                        break;
+                    splice = 1;
+                    ctx->splice_point = -1;
+                }
+                if (splice) {
+                    ctx->splice_requests++;
+                    if (mmal_port_parameter_set_boolean(ctx->encoder_output_port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME,
+                                                        MMAL_TRUE) != MMAL_SUCCESS)
+                        fprintf(stderr, "could not request I-frame at splice point\n");
+                }
+                overlay = splice_in_window(&ctx->splice, frame);
+            }
+            __atomic_fetch_add(&ctx->smart_decoded, 1, __ATOMIC_RELEASE);
+        }
+        if (ctx->hashes.file && buffer->length)
+            hash_frame(ctx, buffer);
+        //not the empty EOS buffer or the ones handed back by a flush, their pixels are stale
+        if (ctx->scene_detect_enabled && buffer->length)
+            detect_scene_cut(ctx, buffer);
+        if (ctx->publishing && buffer->length)
+            publish_frame(ctx, buffer);
+        if (overlay) {
+            draw_overlay(buffer);
+            draw_text_overlay(ctx, buffer);
+        }
+        __sync_fetch_and_add(&ctx->frames_in_encoder, 1);
+        ctx->status = trace_port_send_buffer(ctx->encoder_input_port, buffer);
         if (ctx->status != MMAL_SUCCESS)
         {
+            __sync_fetch_and_sub(&ctx->frames_in_encoder, 1);
             fprintf(stderr,"could not send buffer from decoder output to encoder input: %s\n",
                     mmal_status_to_string(ctx->status));
-            mmal_buffer_header_release(buffer);
+            trace_buffer_header_release(buffer);
             //mmal_event_error_send(connection->out->component, status);
         }
     }
@@ -216,26 +523,414 @@ static void decoder_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *bu
 {
     struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
 
+    thread_role_enter(THREAD_ROLE_CALLBACK, NULL);
+    trace_callback(port, buffer);
+    metrics_event(&ctx->metrics, &ctx->metrics_decoder_events, buffer);
     switch (buffer->cmd)
     {
     case MMAL_EVENT_EOS:
         /* Only sink component generate EOS events */
         break;
     case MMAL_EVENT_ERROR:
-        /* Something went wrong. Signal this to the application */
+        /* Something went wrong. The main loop flushes the decoder and resyncs at the next IDR */
         ctx->status = *(MMAL_STATUS_T *)buffer->data;
+        decoder_recovery_error(&ctx->recovery, ctx->status);
+        event_loop_notify(&ctx->wake);
         break;
     default:
         break;
     }
 
     /* Done with the event, recycle it */
-    mmal_buffer_header_release(buffer);
+    trace_buffer_header_release(buffer);
 
     fprintf(stderr,"control cb. status %s\n",mmal_status_to_string(ctx->status));
 }
 
 
+/** Frames past the decoder which have not left the pipeline yet: waiting for or
+ * inside the encoder, or encoded and not written yet */
+static unsigned int downstream_depth(struct CONTEXT_T *ctx)
+{
+    return __sync_fetch_and_add(&ctx->frames_in_encoder, 0) + spsc_queue_length(&ctx->queue_encoded);
+}
+
+/** With -L: write an encoded buffer, the first one of a picture with the latency SEI in it */
+static void write_stamped(struct CONTEXT_T *ctx, MMAL_BUFFER_HEADER_T *buffer, int picture_start)
+{
+    uint8_t sei[SEI_TS_MAX];
+    SEI_TS_T ts;
+
+    //nothing to stamp in an empty (EOS) buffer, it would only use up a sequence number
+    if (!picture_start || !buffer->length || (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) ||
+        buffer->pts == MMAL_TIME_UNKNOWN) {
+        DEST_WRITE_DATA_INTO_FILE(buffer->data + buffer->offset, buffer->length);
+        return;
+    }
+    sei_ts_emit(&ctx->stamps, buffer->pts * FRAME_RATE / 1000000, &ts);
+    sei_ts_write(dest_file, sei, sei_ts_build(sei, &ts), buffer->data + buffer->offset, buffer->length);
+}
+
+/** With -W: read GOPs until one has to be re-encoded, queueing the ones which
+ * are passed through */
+static void smart_read_ahead(struct CONTEXT_T *ctx)
+{
+    SPLICE_GOP_T *gop;
+
+    if (input.gop && input.gop_au == input.gop->aus) {
+        splice_gop_free(input.gop);
+        input.gop = NULL;
+    }
+    while (!input.gop && !ctx->splice.eof && !ctx->stop_requested && !splice_queue_full(&ctx->splice)) {
+        if (!(gop = splice_read_gop(&ctx->splice, &reader)))
+            break;
+        if (gop->transcode) {
+            //the encoder starts with an IDR, later ones are requested when the decoder gets there
+            if (gop->first_frame != ctx->transcoded_end &&
+                spsc_queue_push(&ctx->splice_points, (void *)(uintptr_t)(gop->first_frame + 1)) != 0)
+                fprintf(stderr, "too many splice points in flight, frame %u may not start with an IDR\n",
+                        gop->first_frame);
+            ctx->transcoded_end = gop->first_frame + gop->aus;
+            input.gop = gop;
+            input.gop_au = 0;
+        } else {
+            splice_queue(&ctx->splice, gop);
+        }
+    }
+}
+
+/** With -W: every frame sent to the decoder has been decoded, encoded and
+ * written, so the queued GOPs can follow */
+static int smart_idle(struct CONTEXT_T *ctx)
+{
+    unsigned int decoded = __atomic_load_n(&ctx->smart_decoded, __ATOMIC_ACQUIRE);
+
+    return decoded == ctx->smart_sent && ctx->frames_encoded == decoded && !spsc_queue_length(&ctx->queue_encoded);
+}
+
+/** With -W, from the main loop: write the queued GOPs as soon as nothing
+ * before them is left in the decoder or encoder, instead of waiting for the
+ * next re-encoded frame after them */
+static void smart_flush(struct CONTEXT_T *ctx)
+{
+    if (ctx->nudging && __atomic_load_n(&ctx->nudge_out, __ATOMIC_ACQUIRE)) {
+        unsigned int decoded = __atomic_load_n(&ctx->nudge_decoded, __ATOMIC_RELAXED);
+        //frames sent before the nudge which did not come out were dropped by the decoder
+        if (ctx->nudge_before > decoded)
+            ctx->smart_sent -= ctx->nudge_before - decoded;
+        ctx->nudging = 0;
+    }
+    if (ctx->splice.queue_head && smart_idle(ctx))
+        splice_write_queued(&ctx->splice, -1, dest_file);
+}
+
+/** With -W and the read-ahead full: a decoder which reorders holds the last
+ * frames of a re-encoded GOP back until more input comes, so the queue would
+ * never be written. Send it the IDR of the first queued GOP, which makes it
+ * output everything before; the picture is thrown away (SMART_NUDGE_PTS).
+ * Returns 1 if input.au is the nudge. */
+static int smart_nudge(struct CONTEXT_T *ctx)
+{
+    const uint8_t *data;
+    size_t size;
+
+    if (ctx->nudging || !ctx->splice.queue_head || !ctx->splice.queue_head->idr ||
+        __atomic_load_n(&ctx->smart_decoded, __ATOMIC_ACQUIRE) == ctx->smart_sent)
+        return 0;
+    data = splice_gop_au(ctx->splice.queue_head, 0, &size);
+    if (ctx->nudge_alloc < size) {
+        uint8_t *grown = (uint8_t *)realloc(ctx->nudge_au, size);
+        if (!grown)
+            return 0;
+        ctx->nudge_au = grown;
+        ctx->nudge_alloc = size;
+    }
+    //the queued GOP may be written and freed while the nudge is being sent
+    memcpy(ctx->nudge_au, data, size);
+    memset(&input.au, 0, sizeof(input.au));
+    input.au.data = ctx->nudge_au;
+    input.au.size = size;
+    input.au.keyframe = 1;
+    input.au.nal_types = 1u << H264_NAL_IDR | 1u << H264_NAL_SPS;
+    input.nudge = 1;
+    ctx->nudging = 1;
+    ctx->nudge_before = ctx->smart_sent;
+    __atomic_store_n(&ctx->nudge_out, 0, __ATOMIC_RELEASE);
+    ctx->nudges++;
+    return 1;
+}
+
+/** The next access unit for the decoder: from the file, or with -W from the
+ * GOP being re-encoded. Returns 0 at the end, -1 with -W while the read-ahead
+ * is full and nothing can be sent. */
+static int next_access_unit(struct CONTEXT_T *ctx)
+{
+    if (!ctx->smart)
+        return h264_reader_next_au(&reader, &input.au);
+    smart_read_ahead(ctx);
+    if (!input.gop) {
+        if (ctx->splice.eof || ctx->stop_requested)
+            return 0;
+        return smart_nudge(ctx) ? 1 : -1;
+    }
+    input.nudge = 0;
+    memset(&input.au, 0, sizeof(input.au));
+    input.au.data = splice_gop_au(input.gop, input.gop_au, &input.au.size);
+    input.au.keyframe = input.gop_au == 0 && input.gop->idr;
+    //timestamps come from the position in the stream, passed through GOPs leave a gap
+    input.index = input.gop->first_frame + input.gop_au++;
+    return 1;
+}
+
+/** With -R: point input.au at a copy with the SPS rewritten */
+static void rewrite_sps(struct CONTEXT_T *ctx)
+{
+    size_t size;
+
+    //past the slices checked up front
+    if (sps_slice_reorders(input.au.data, input.au.size)) {
+        fprintf(stderr, "stream has B-frames, SPS no longer rewritten\n");
+        ctx->rewrite_sps = 0;
+        return;
+    }
+    if (!(input.au.nal_types & (1u << H264_NAL_SPS)))
+        return;
+    if (ctx->sps_au_alloc < input.au.size + 4 * SPS_REWRITE_GROWTH) {
+        uint8_t *grown = (uint8_t *)realloc(ctx->sps_au, input.au.size + 4 * SPS_REWRITE_GROWTH);
+        if (!grown)
+            return;
+        ctx->sps_au = grown;
+        ctx->sps_au_alloc = input.au.size + 4 * SPS_REWRITE_GROWTH;
+    }
+    if ((size = sps_rewrite_buffer(input.au.data, input.au.size, ctx->sps_au, ctx->sps_au_alloc,
+                                   &ctx->sps_rewritten)) != 0) {
+        input.au.data = ctx->sps_au;
+        input.au.size = size;
+    }
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/** Fill the buffer with the next (part of an) access unit, dropping access
+ * units as long as the load shedding policy asks for it.
+ * Returns 0 at the end of the stream, -1 if it has to wait (-W). */
+static int read_access_unit(struct CONTEXT_T *ctx, MMAL_BUFFER_HEADER_T *buffer)
+{
+    size_t length;
+
+    while (input.sent == input.au.size) {
+        unsigned int level = ctx->load_shed.level;
+        int next;
+
+        if (ctx->stop_requested || (next = next_access_unit(ctx)) == 0)
+            return 0;
+        if (next < 0)
+            return -1;
+        if (ctx->rewrite_sps)
+            rewrite_sps(ctx);
+        input.sent = 0;
+        if (input.nudge) {
+            //not part of the output: no frame number, never skipped
+            input.pts = SMART_NUDGE_PTS;
+            break;
+        }
+        //timestamps in the order the decoder outputs the frames, dropped frames leave a gap
+        input.frame = h264_poc_frame(&input.poc, input.au.data, input.au.size, input.index++);
+        input.pts = input.frame >= 0 ? input.frame * 1000000 / FRAME_RATE : MMAL_TIME_UNKNOWN;
+        if (ctx->stamping && input.frame >= 0)
+            sei_ts_ingest(&ctx->stamps, input.frame);
+        if (decoder_recovery_skip(&ctx->recovery, &input.au) ||
+            load_shed_drop(&ctx->load_shed, &input.au, downstream_depth(ctx)))
+            input.sent = input.au.size;
+        if (ctx->load_shed.level != level)
+            fprintf(stderr, "load shedding level %u at frame %u\n", ctx->load_shed.level, input.index - 1);
+    }
+
+    length = input.au.size - input.sent;
+    if (length > buffer->alloc_size)
+        length = buffer->alloc_size;
+    memcpy(buffer->data, input.au.data + input.sent, length);
+    buffer->length = length;
+    buffer->offset = 0;
+    buffer->flags = input.sent == 0 ? MMAL_BUFFER_HEADER_FLAG_FRAME_START : 0;
+    input.sent += length;
+    if (input.sent == input.au.size) {
+        buffer->flags |= MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+        if (!input.nudge) {
+            if (input.frame >= 0)
+                ctx->decode_sent_us[input.frame % 64] = event_recorder_now_us();
+            ctx->smart_sent++;
+        }
+    }
+    if (input.au.keyframe)
+        buffer->flags |= MMAL_BUFFER_HEADER_FLAG_KEYFRAME;
+    buffer->pts = input.pts;
+    buffer->dts = MMAL_TIME_UNKNOWN;
+    return 1;
+}
+
+/** One line of pipeline status, for the status timer and the control socket */
+static void format_status(struct CONTEXT_T *ctx, char *text, size_t size)
+{
+    snprintf(text, size, "decoded %u, encoded %u, read %u, queued after decoder %u, load shedding level %u, %u scene cuts\n",
+             ctx->frames_decoded, ctx->frames_encoded, input.index, downstream_depth(ctx),
+             ctx->load_shed.level, ctx->scene_detect.cuts);
+}
+
+static void status_timer_handler(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    struct CONTEXT_T *ctx = (struct CONTEXT_T *)source->userdata;
+    char text[256];
+    MMAL_PARAM_UNUSED(loop);
+    MMAL_PARAM_UNUSED(events);
+
+    format_status(ctx, text, sizeof(text));
+    fputs(text, stderr);
+}
+
+static void control_command(CONTROL_SOCKET_T *control, const char *command, char *reply, size_t size)
+{
+    struct CONTEXT_T *ctx = (struct CONTEXT_T *)control->userdata;
+
+    if (!strcmp(command, "stats")) {
+        format_status(ctx, reply, size);
+    } else if (!strcmp(command, "idr")) {
+        MMAL_STATUS_T status = mmal_port_parameter_set_boolean(ctx->encoder_output_port,
+                                                               MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, MMAL_TRUE);
+        snprintf(reply, size, "%s\n", status == MMAL_SUCCESS ? "ok" : mmal_status_to_string(status));
+    } else if (!strcmp(command, "event") && ctx->recording) {
+        if (event_recorder_trigger(&ctx->recorder) == 0)
+            snprintf(reply, size, "recording event %u, pre-roll written in %.2f ms\n", ctx->recorder.events - 1,
+                     ctx->recorder.dump_us / 1000.0);
+        else
+            snprintf(reply, size, "could not write the event file\n");
+    } else if (!strcmp(command, "trace on") || !strcmp(command, "trace off")) {
+        trace_enable(!strcmp(command, "trace on"));
+        snprintf(reply, size, "tracing %s\n", trace_enabled() ? "on" : "off");
+    } else if (!strncmp(command, "trace ", 6)) {
+        //the rings are copied first, so tracing can go on meanwhile
+        int events = trace_write(command + 6);
+        if (events < 0)
+            snprintf(reply, size, "could not write %s\n", command + 6);
+        else
+            snprintf(reply, size, "%d events written to %s\n", events, command + 6);
+    } else if (!strcmp(command, "quit")) {
+        //finish what has been read so far and stop at the EOS
+        ctx->stop_requested = 1;
+        event_loop_notify(&ctx->wake);
+        snprintf(reply, size, "stopping\n");
+    } else {
+        snprintf(reply, size, "commands: stats, idr, %strace on|off|<file.json>, quit\n",
+                 ctx->recording ? "event, " : "");
+    }
+}
+
+/** SIGUSR1, e.g. from a motion sensor script: start an event recording */
+static void trigger_signal_handler(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    struct CONTEXT_T *ctx = (struct CONTEXT_T *)source->userdata;
+    struct signalfd_siginfo info;
+    MMAL_PARAM_UNUSED(loop);
+    MMAL_PARAM_UNUSED(events);
+
+    while (read(source->fd, &info, sizeof(info)) == sizeof(info)) {
+        if (event_recorder_trigger(&ctx->recorder) != 0)
+            fprintf(stderr, "could not write the event file\n");
+        else
+            fprintf(stderr, "event %u: %.1f s pre-roll (%.1f MB) written in %.2f ms\n", ctx->recorder.events - 1,
+                    ctx->recorder.dump_seconds, ctx->recorder.dump_bytes / 1e6, ctx->recorder.dump_us / 1000.0);
+    }
+}
+
+static int64_t sample_queue_encoded(void *userdata)
+{
+    return spsc_queue_length(&((struct CONTEXT_T *)userdata)->queue_encoded);
+}
+
+static int64_t sample_frames_in_encoder(void *userdata)
+{
+    return __sync_fetch_and_add(&((struct CONTEXT_T *)userdata)->frames_in_encoder, 0);
+}
+
+static int64_t sample_load_shed_level(void *userdata)
+{
+    return ((struct CONTEXT_T *)userdata)->load_shed.level;
+}
+
+static int64_t sample_load_shed_dropped(void *userdata)
+{
+    LOAD_SHED_T *ls = &((struct CONTEXT_T *)userdata)->load_shed;
+    int64_t dropped = 0;
+    unsigned int i;
+
+    for (i = 0; i < LOAD_SHED_LEVELS; i++)
+        dropped += ls->dropped[i];
+    return dropped;
+}
+
+static int64_t sample_scene_cuts(void *userdata)
+{
+    return ((struct CONTEXT_T *)userdata)->scene_detect.cuts;
+}
+
+/** Everything the metrics endpoint shows. The pools are sampled through
+ * pointers because they are created later. Returns 0 on success. */
+static int register_metrics(struct CONTEXT_T *ctx, MMAL_POOL_T **decoder_pool_in, MMAL_POOL_T **encoder_pool_out)
+{
+    METRICS_T *m = &ctx->metrics;
+
+    return metrics_register_port(m, &ctx->metrics_decoder_in, "decoder_in") ||
+           metrics_register_port(m, &ctx->metrics_decoder_out, "decoder_out") ||
+           metrics_register_port(m, &ctx->metrics_encoder_out, "encoder_out") ||
+           metrics_register_port(m, &ctx->metrics_written, "written") ||
+           metrics_register_events(m, &ctx->metrics_decoder_events, "decoder") ||
+           metrics_register_events(m, &ctx->metrics_encoder_events, "encoder") ||
+           metrics_register_pool(m, "decoder_in", decoder_pool_in) ||
+           metrics_register_pool(m, "encoder_in", &ctx->encoder_pool_in) ||
+           metrics_register_pool(m, "encoder_out", encoder_pool_out) ||
+           metrics_register_sampled(m, "pipeline_queue_depth{queue=\"encoded\"}",
+                                    "Buffers waiting in a queue between threads", sample_queue_encoded, ctx) < 0 ||
+           metrics_register_sampled(m, "pipeline_queue_depth{queue=\"in_encoder\"}",
+                                    "Buffers waiting in a queue between threads", sample_frames_in_encoder, ctx) < 0 ||
+           metrics_register_sampled(m, "pipeline_load_shed_level", "Current load shedding level",
+                                    sample_load_shed_level, ctx) < 0 ||
+           metrics_register_sampled(m, "pipeline_access_units_dropped", "Access units dropped before decoding",
+                                    sample_load_shed_dropped, ctx) < 0 ||
+           metrics_register_sampled(m, "pipeline_scene_cuts", "Scene cuts detected", sample_scene_cuts, ctx) < 0
+           ? -1 : 0;
+}
+
+/** An empty decoder input buffer: one handed over by decoder_pool_free_callback,
+ * else one which went back into the pool queue */
+static MMAL_BUFFER_HEADER_T *get_decoder_input(struct CONTEXT_T *ctx, MMAL_POOL_T *pool)
+{
+    MMAL_BUFFER_HEADER_T *buffer = input.held;
+
+    if (buffer) {
+        input.held = NULL;
+        return buffer;
+    }
+    buffer = spsc_queue_pop(&ctx->decoder_free);
+
+    if (!buffer)
+        return trace_queue_get(pool->queue);
+    trace_event(TRACE_GET, &ctx->decoder_free, buffer);
+    return buffer;
+}
+
+/** Called by the event loop after one of the callbacks has kicked it */
+static void wake_handler(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    MMAL_PARAM_UNUSED(loop);
+    MMAL_PARAM_UNUSED(source);
+    MMAL_PARAM_UNUSED(events);
+    //nothing to do, main() looks at all queues after every wake-up
+}
+
 int main(int argc, char* argv[]) {
 
     MMAL_STATUS_T status;
@@ -245,13 +940,191 @@ int main(int argc, char* argv[]) {
     MMAL_ES_FORMAT_T * format_in=NULL;
     MMAL_BOOL_T eos_sent = MMAL_FALSE, eos_received= MMAL_FALSE;
     MMAL_BUFFER_HEADER_T *buffer;
+    int opt, intraperiod = -1, write_delay_ms = 0, status_interval = 0;
+    const char *control_path = NULL;
+    unsigned int preroll_ms = 0, postroll_ms = 10000, segment_ms = 4000;
+    const char *playlist = NULL;
+    sigset_t trigger_mask;
+    unsigned int i_frames = 0;
+    struct rusage usage;
+    struct timeval start, end;
+    uint64_t bytes_encoded = 0, i_frame_bytes = 0, frame_bytes = 0;
+
+    context.camera_id = "CAM0";
+    load_shed_init(&context.load_shed, 0);
+    splice_init(&context.splice);
+    context.splice_point = -1;
+    while ((opt = getopt(argc, argv, "c:sg:l:D:C:T:P:E:H:W:LR")) != -1) {
+        switch (opt) {
+        case 'c':
+            context.camera_id = optarg;
+            break;
+        case 's':
+            context.scene_detect_enabled = 1;
+            break;
+        case 'g':
+            intraperiod = atoi(optarg);
+            break;
+        case 'l':
+            load_shed_init(&context.load_shed, atoi(optarg));
+            break;
+        case 'D':
+            write_delay_ms = atoi(optarg);
+            break;
+        case 'C':
+            control_path = optarg;
+            break;
+        case 'T':
+            status_interval = atoi(optarg);
+            break;
+        case 'P':
+            context.publish_path = optarg;
+            break;
+        case 'H': {
+            char *comma = strchr(optarg, ',');
+            if (comma) {
+                *comma = 0;
+                segment_ms = atof(comma + 1) * 1000;
+            }
+            playlist = optarg;
+            break;
+        }
+        case 'E': {
+            float preroll = 0, postroll = postroll_ms / 1000.0f;
+            sscanf(optarg, "%f,%f", &preroll, &postroll);
+            preroll_ms = preroll * 1000;
+            postroll_ms = postroll * 1000;
+            break;
+        }
+        case 'W':
+            if (splice_add_windows(&context.splice, optarg, FRAME_RATE) != 0) {
+                fprintf(stderr, "bad overlay windows %s\n", optarg);
+                return -1;
+            }
+            context.smart = 1;
+            break;
+        case 'L':
+            context.stamping = 1;
+            break;
+        case 'R':
+            context.rewrite_sps = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c camera-id] [-s] [-g intraperiod] [-l depth] [-D ms] [-C socket] [-T seconds] [-P socket] [-E preroll[,postroll]] [-H playlist.m3u8[,seconds]] [-W start-end[,start-end...]] [-L] [-R]\n"
+                            "  -s  insert I-frames at scene cuts (default GOP becomes 250 frames)\n"
+                            "  -l  drop frames before decoding when more than depth frames are queued after the decoder\n"
+                            "  -D  slow down writing every encoded buffer by ms, to try out -l\n"
+                            "  -C  accept commands (stats, idr, trace, quit) on a unix socket\n"
+                            "  -T  print the pipeline status every few seconds\n"
+                            "  -P  publish the decoded frames in shared memory, see shm_frame_consumer\n"
+                            "  -E  keep the last preroll seconds in memory instead of writing out.h264, write them\n"
+                            "      and the next postroll (default 10) seconds to event-NNN.h264 on SIGUSR1 or the\n"
+                            "      event command of -C\n"
+                            "  -H  write segments of about seconds (default 4) starting at IDRs instead of out.h264,\n"
+                            "      and a playlist of the last ones\n"
+                            "  -W  draw the overlays only from start to end (seconds), re-encode just the GOPs\n"
+                            "      touching these windows and copy the others from the input\n"
+                            "  -L  put a SEI with the ingest time into every encoded picture, see sei_latency\n"
+                            "  -R  rewrite the SPS to max_num_reorder_frames=0 (streams without B-frames), compare\n"
+                            "      the decode latency printed at the end with and without\n", argv[0]);
+            return -1;
+        }
+    }
+    //dropped, buffered or segmented frames would leave holes in the copied stream
+    if (context.smart && (context.load_shed.threshold || preroll_ms || playlist)) {
+        fprintf(stderr, "-W cannot be combined with -l, -E or -H\n");
+        return -1;
+    }
+    //the SEI is only written into out.h264
+    if (context.stamping && (preroll_ms || playlist || context.smart)) {
+        fprintf(stderr, "-L cannot be combined with -E, -H or -W\n");
+        return -1;
+    }
+    //with scene cut detection the regular I-frames are only needed for seeking, use a long GOP
+    if (intraperiod < 0 && context.scene_detect_enabled)
+        intraperiod = 250;
 
+    //before any thread is created, so that SIGUSR1 only ever reaches the signalfd
+    sigemptyset(&trigger_mask);
+    sigaddset(&trigger_mask, SIGUSR1);
+    if (preroll_ms)
+        sigprocmask(SIG_BLOCK, &trigger_mask, NULL);
 
     bcm_host_init();
-    vcos_semaphore_create(&context.semaphore, "example", 1);
+    //one thread waits for the MMAL callbacks, the timer and the control socket
+    if (event_loop_create(&context.loop) != 0 ||
+        event_loop_add_notifier(&context.loop, &context.wake, wake_handler, &context) != 0) {
+        fprintf(stderr, "failed to create event loop\n");
+        return -1;
+    }
+    //the rings are only allocated once tracing is switched on
+    trace_init(16384);
+    context.trace_path = getenv("MMAL_TRACE");
+    trace_enable(context.trace_path != NULL);
+    //MMAL_THREADS: pin the threads and set their priorities by role
+    if (thread_roles_init_from_env() != 0)
+        return -1;
+    //MMAL_HASH: log a CRC of every decoded and encoded frame there
+    if (getenv("MMAL_HASH") && frame_hash_log_open(&context.hashes, getenv("MMAL_HASH")) != 0) {
+        fprintf(stderr, "cannot write frame hashes to %s\n", getenv("MMAL_HASH"));
+        return -1;
+    }
+    metrics_init(&context.metrics, 0);
+    if (register_metrics(&context, &decoder_pool_in, &encoder_pool_out) != 0 ||
+        metrics_serve_from_env(&context.metrics, &context.loop) != 0) {
+        fprintf(stderr, "failed to set up metrics\n");
+        return -1;
+    }
+    if (status_interval > 0 &&
+        event_loop_add_timer(&context.loop, &context.status_timer, status_interval * 1000000ull,
+                             status_timer_handler, &context) != 0) {
+        fprintf(stderr, "failed to create status timer\n");
+        return -1;
+    }
+    if (control_path &&
+        control_socket_create(&context.control, &context.loop, control_path, control_command, &context) != 0) {
+        fprintf(stderr, "failed to listen on %s\n", control_path);
+        return -1;
+    }
+
+    if (preroll_ms) {
+        //pre-roll plus a GOP (to go back to an IDR) at the full bitrate, the encoder is set to 25 Mbit/s
+        unsigned int seconds = (preroll_ms + 999) / 1000 + (intraperiod > 0 ? (intraperiod + FRAME_RATE - 1) / FRAME_RATE : 10) + 1;
+        int fd;
+
+        if (event_recorder_create(&context.recorder, (size_t)MAX_BITRATE_LEVEL4 / 8 * seconds, FRAME_RATE * seconds,
+                                  preroll_ms, postroll_ms, "event-") != 0 ||
+            (fd = signalfd(-1, &trigger_mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 ||
+            event_loop_add_fd(&context.loop, &context.trigger_signal, fd, EPOLLIN, trigger_signal_handler, &context) != 0) {
+            fprintf(stderr, "failed to set up event recording\n");
+            return -1;
+        }
+        context.recording = 1;
+        fprintf(stderr, "event recording: %u s in %zu MB, kill -USR1 %d to trigger\n", seconds,
+                context.recorder.capacity >> 20, (int)getpid());
+    }
+
+    if (playlist) {
+        if (segmenter_create(&context.segmenter, playlist, segment_ms) != 0) {
+            fprintf(stderr, "failed to set up segmenting\n");
+            return -1;
+        }
+        context.segmenting = 1;
+    }
 
     SOURCE_OPEN("test.h264_2")
-    DEST_OPEN("out.h264")
+    //with B-frames the decoder has to reorder, the SPS must say so
+    if (context.rewrite_sps) {
+        int reorders = sps_stream_reorders(source_file, SPS_SCAN_SLICES);
+        if (reorders) {
+            fprintf(stderr, reorders > 0 ? "stream has B-frames, SPS not rewritten\n" :
+                                           "stream cannot be checked for B-frames, SPS not rewritten\n");
+            context.rewrite_sps = 0;
+        }
+    }
+    if (!context.recording && !context.segmenting) {
+        DEST_OPEN("out.h264")
+    }
 
 
     /* Create the components */
@@ -286,12 +1159,12 @@ int main(int argc, char* argv[]) {
     format_in->encoding = MMAL_ENCODING_H264;
     format_in->es->video.width = 1280;
     format_in->es->video.height = 720;
-    format_in->es->video.frame_rate.num = 25;
+    format_in->es->video.frame_rate.num = FRAME_RATE;
     format_in->es->video.frame_rate.den = 1;
     format_in->es->video.par.num = 1;
     format_in->es->video.par.den = 1;
-    /* If the data is known to be framed then the following flag should be set:*/
-    //format_in->flags |= MMAL_ES_FORMAT_FLAG_FRAMED;
+    /* We send whole access units (see read_access_unit), so the data is framed */
+    format_in->flags |= MMAL_ES_FORMAT_FLAG_FRAMED;
 
 
     status = mmal_port_format_commit(decoder->input[0]);
@@ -310,6 +1183,16 @@ int main(int argc, char* argv[]) {
     status = mmal_port_parameter_set(encoder->output[0], &param.hdr);
     CHECK_STATUS(status, "unable to set encoder output profile");
 
+    if (intraperiod > 0) {
+        status = mmal_port_parameter_set_uint32(encoder->output[0], MMAL_PARAMETER_INTRAPERIOD, intraperiod);
+        CHECK_STATUS(status, "unable to set encoder intra period");
+    }
+    if (context.smart) {
+        //every re-encoded piece has to start with its own SPS/PPS
+        status = mmal_port_parameter_set_boolean(encoder->output[0], MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER, MMAL_TRUE);
+        CHECK_STATUS(status, "unable to set encoder inline headers");
+    }
+
     decoder->input[0]->buffer_num = decoder->input[0]->buffer_num_min;
     decoder->input[0]->buffer_size = decoder->input[0]->buffer_size_min;
 
@@ -320,7 +1203,23 @@ int main(int argc, char* argv[]) {
     encoder_pool_out = mmal_port_pool_create(encoder->output[0], encoder->output[0]->buffer_num, encoder->output[0]->buffer_size);
 
 
-    context.queue_encoded = mmal_queue_create();
+    //both rings hold more than the pools behind them, so a push never fails
+    if (spsc_queue_create(&context.queue_encoded, 2 * encoder_pool_out->headers_num + 8) != 0 ||
+        spsc_queue_create(&context.decoder_free, decoder_pool_in->headers_num) ||
+        spsc_queue_create(&context.splice_points, 64)) {
+        status = MMAL_ENOMEM;
+        CHECK_STATUS(status, "failed to create queues");
+    }
+    mmal_pool_callback_set(decoder_pool_in, decoder_pool_free_callback, &context);
+    trace_name(decoder->input[0], "decoder_in");
+    trace_name(decoder->output[0], "decoder_out");
+    trace_name(encoder->input[0], "encoder_in");
+    trace_name(encoder->output[0], "encoder_out");
+    trace_name(decoder->control, "decoder_control");
+    trace_name(decoder_pool_in->queue, "decoder_in pool");
+    trace_name(encoder_pool_out->queue, "encoder_out pool");
+    trace_name(&context.decoder_free, "decoder_free");
+    trace_name(&context.queue_encoded, "encoded");
     context.encoder_pool_in = NULL; //pool cannot be allocated yet, because buffer requirements are not known yet. See decoder output callback
     context.encoder_input_port = encoder->input[0];
     context.encoder_output_port = encoder->output[0];
@@ -343,29 +1242,60 @@ int main(int argc, char* argv[]) {
 
     /* Start transcoding */
     fprintf(stderr, "start transcoding\n");
+    gettimeofday(&start, NULL);
+    //after the components and the segment writer are created, they would inherit the role
+    thread_role_enter(THREAD_ROLE_MAIN, "main");
 
+    event_loop_notify(&context.wake); //fill the decoder input right away
     while(eos_received == MMAL_FALSE)
     {
-        /* Wait for buffer headers to be available on either the decoder input or the encoder output port */
-        vcos_semaphore_wait(&context.semaphore);
+        /* Wait for buffer headers to be available on either the decoder input or the encoder output port,
+         * handling timer and control socket events on the way.
+         * One wake-up can stand for many buffers, so everything available is handled below */
+        if (event_loop_run_once(&context.loop, -1) < 0) {
+            fprintf(stderr, "event loop failed\n");
+            break;
+        }
+
+        if (decoder_recovery_pending(&context.recovery)) {
+            fprintf(stderr, "decoder error %s, resyncing at the next IDR\n", mmal_status_to_string(context.recovery.status));
+            status = decoder_recovery_start(&context.recovery, decoder);
+            CHECK_STATUS(status, "failed to flush the decoder");
+            input.sent = input.au.size; //the rest of the access unit is useless now
+        }
+
+        if (context.smart)
+            smart_flush(&context);
 
         /* Send data to decode to the input port of the video decoder */
-        if ((buffer = mmal_queue_get(decoder_pool_in->queue)) != NULL) //Get empty buffers from queue
+        while (!eos_sent && (buffer = get_decoder_input(&context, decoder_pool_in)) != NULL) //Get empty buffers
         {
-            SOURCE_READ_DATA_INTO_BUFFER(buffer);
-            if(!buffer->length) eos_sent = MMAL_TRUE;
-
-            buffer->flags = buffer->length ? 0 : MMAL_BUFFER_HEADER_FLAG_EOS;
-            buffer->pts = buffer->dts = MMAL_TIME_UNKNOWN;
+            int got = read_access_unit(&context, buffer);
+            if (got < 0) {
+                //-W: the read-ahead is full, try again once queued GOPs have been written
+                input.held = buffer;
+                break;
+            }
+            if (!got) {
+                buffer->length = 0;
+                buffer->flags = MMAL_BUFFER_HEADER_FLAG_EOS;
+                buffer->pts = buffer->dts = MMAL_TIME_UNKNOWN;
+                eos_sent = MMAL_TRUE;
+            }
             //fprintf(stderr, "sending %i bytes\n", (int)buffer->length);
-            status = mmal_port_send_buffer(decoder->input[0], buffer);
+            metrics_port_buffer(&context.metrics, &context.metrics_decoder_in, buffer);
+            status = trace_port_send_buffer(decoder->input[0], buffer);
             CHECK_STATUS(status, "failed to send buffer");
         }
+        //nothing to re-encode: the encoder is never set up and no EOS comes out of it
+        if (context.smart && eos_sent && !context.splice.gops_transcoded)
+            break;
 
 
         /* receive encoded frames and store them */
-        while ((buffer = mmal_queue_get(context.queue_encoded)) != NULL)
+        while ((buffer = spsc_queue_pop(&context.queue_encoded)) != NULL)
         {
+            trace_event(TRACE_GET, &context.queue_encoded, buffer);
             /* We have a frame, do something with it
                 * Once we're done with it, we release it. It will automatically go back
                 * to its original pool so it can be reused for a new video frame.
@@ -378,25 +1308,73 @@ int main(int argc, char* argv[]) {
             }
             else
             {
-                DEST_WRITE_DATA_INTO_FILE(buffer->data, buffer->length);
+                if (context.recording)
+                    event_recorder_add(&context.recorder, buffer->data + buffer->offset, buffer->length,
+                                       (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG ? EVENT_RECORDER_CONFIG : 0) |
+                                       (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME ? EVENT_RECORDER_KEYFRAME : 0) |
+                                       (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END ? EVENT_RECORDER_FRAME_END : 0),
+                                       event_recorder_now_us());
+                if (context.segmenting)
+                    segmenter_add(&context.segmenter, buffer->data + buffer->offset, buffer->length,
+                                  (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG ? SEGMENTER_CONFIG : 0) |
+                                  (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME ? SEGMENTER_KEYFRAME : 0) |
+                                  (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END ? SEGMENTER_FRAME_END : 0),
+                                  buffer->pts);
+                if (context.smart)
+                    splice_add_encoded(&context.splice, buffer->data + buffer->offset, buffer->length,
+                                       (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG ? SPLICE_CONFIG : 0) |
+                                       (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME ? SPLICE_KEYFRAME : 0),
+                                       buffer->pts != MMAL_TIME_UNKNOWN ? buffer->pts * FRAME_RATE / 1000000 : -1,
+                                       dest_file);
+                else if (context.stamping)
+                    write_stamped(&context, buffer, frame_bytes == 0);
+                else if (!context.recording && !context.segmenting)
+                    DEST_WRITE_DATA_INTO_FILE(buffer->data, buffer->length);
+                metrics_port_buffer(&context.metrics, &context.metrics_written, buffer);
+                if (context.hashes.file)
+                    frame_hash_log_encoded(&context.hashes, buffer->data + buffer->offset, buffer->length,
+                                           buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END);
+                if (write_delay_ms)
+                    vcos_sleep(write_delay_ms);
+                bytes_encoded += buffer->length;
+                if (!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)) {
+                    //a frame may be split across several buffers
+                    frame_bytes += buffer->length;
+                    if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) {
+                        context.frames_encoded++;
+                        frame_jitter_add(&context.frame_jitter);
+                        if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME) {
+                            i_frames++;
+                            i_frame_bytes += frame_bytes;
+                        }
+                        frame_bytes = 0;
+                    }
+                }
                 fprintf(stderr, "encoded frame %u (flags %x, length %u)\n",framenr++, buffer->flags, buffer->length);
             }
-            mmal_buffer_header_release(buffer);
+            trace_buffer_header_release(buffer);
         }
+        //-W: the frame just written may have been the last one the queued GOPs waited for
+        if (input.held && context.splice.queue_head && smart_idle(&context))
+            event_loop_notify(&context.wake);
 
         if(encoder->output[0]->is_enabled) { //do not send buffers until all ports and pools are created
+            if (context.encoder_pool_named != context.encoder_pool_in) {
+                trace_name(context.encoder_pool_in->queue, "encoder_in pool");
+                context.encoder_pool_named = context.encoder_pool_in;
+            }
 
             /* Send empty buffers to the output port of the decoder */
-            while((buffer = mmal_queue_get(context.encoder_pool_in->queue)) != NULL)
+            while((buffer = trace_queue_get(context.encoder_pool_in->queue)) != NULL)
             {
-                status =  mmal_port_send_buffer(decoder->output[0], buffer);
+                status = trace_port_send_buffer(decoder->output[0], buffer);
                 CHECK_STATUS(status, "failed to send empty buffer to decoder output\n");
             }
 
             /* Send empty buffers to the output port of the encoder */
-            while ((buffer = mmal_queue_get(encoder_pool_out->queue)) != NULL)
+            while ((buffer = trace_queue_get(encoder_pool_out->queue)) != NULL)
             {
-                status = mmal_port_send_buffer(encoder->output[0], buffer);
+                status = trace_port_send_buffer(encoder->output[0], buffer);
                 CHECK_STATUS(status, "failed to send empty buffer to encoder output\n");
             }
         }
@@ -417,15 +1395,116 @@ int main(int argc, char* argv[]) {
     mmal_port_disable(encoder->output[0]);
     fprintf(stderr, "done\n");
 
+    if (context.frames_decoded)
+        fprintf(stderr, "text overlay: %u frames, %.3f ms/frame, %lu glyphs redrawn\n",
+                context.frames_decoded, context.text_overlay_us / 1000.0 / context.frames_decoded,
+                context.text_overlay.glyphs_redrawn);
+    text_overlay_destroy(&context.text_overlay);
+
+    if (context.frames_encoded)
+        fprintf(stderr, "encoded: %u frames, %.0f kbit/s at 25fps, %u I-frames (avg %.1f kB), P-frames avg %.1f kB\n",
+                context.frames_encoded, bytes_encoded * 8.0 * 25 / context.frames_encoded / 1000, i_frames,
+                i_frames ? i_frame_bytes / 1000.0 / i_frames : 0,
+                context.frames_encoded > i_frames ?
+                (bytes_encoded - i_frame_bytes) / 1000.0 / (context.frames_encoded - i_frames) : 0);
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "event loop: %u waits, %u notifications, %u eventfd writes, %ld voluntary / %ld involuntary context switches\n",
+            context.loop.waits, context.wake.notified, context.wake.writes, usage.ru_nvcsw, usage.ru_nivcsw);
+    gettimeofday(&end, NULL);
+    //same format as manual_decode_overlay_encode_coro, to compare the two
+    fprintf(stderr, "%.2f s wall, %.2f s user, %.2f s system, %ld voluntary / %ld involuntary context switches\n",
+            (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6,
+            usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+            usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6, usage.ru_nvcsw, usage.ru_nivcsw);
+    frame_jitter_print(&context.frame_jitter, stderr);
+    thread_roles_print(stderr);
+    if (context.hashes.file) {
+        frame_hash_log_print(&context.hashes, stderr);
+        if (frame_hash_log_close(&context.hashes) != 0)
+            fprintf(stderr, "could not write the frame hashes to %s\n", getenv("MMAL_HASH"));
+    }
+    if (context.publishing) {
+        if (context.publisher.header->seq)
+            fprintf(stderr, "frame ring: %u frames published, %.3f ms/frame, %u consumers connected, %u frames of "
+                    "another size not published\n", context.publisher.header->seq,
+                    context.publisher.copy_us / 1000.0 / context.publisher.header->seq, context.publisher.consumers,
+                    context.publish_rejected);
+        shm_ring_publisher_destroy(&context.publisher);
+    }
+    if (context.recording)
+        event_recorder_print(&context.recorder, stderr);
+    if (context.segmenting) {
+        //finishes the last segment and the playlist
+        segmenter_destroy(&context.segmenter);
+        context.segmenting = 0;
+        segmenter_print(&context.segmenter, stderr);
+    }
+    if (context.load_shed.threshold)
+        load_shed_print(&context.load_shed, stderr);
+    if (context.recovery.errors)
+        decoder_recovery_print(&context.recovery, stderr);
+    if (context.decode_first_us) {
+        unsigned int n = context.decode_latencies;
+        qsort(context.decode_latency_us, n, sizeof(context.decode_latency_us[0]), compare_latency);
+        fprintf(stderr, "decode latency: first frame %.1f ms, then p50 %.1f ms, p99 %.1f ms over %u frames, SPS rewritten %u times\n",
+                context.decode_first_us / 1000.0, n ? context.decode_latency_us[n / 2] / 1000.0 : 0,
+                n ? context.decode_latency_us[n * 99 / 100] / 1000.0 : 0, n, context.sps_rewritten);
+    }
+    if (context.smart) {
+        //the GOPs after the last re-encoded one
+        splice_write_queued(&context.splice, -1, dest_file);
+        splice_print(&context.splice, stderr);
+        fprintf(stderr, "smart transcode: %u I-frames requested at splice points\n", context.splice_requests);
+        if (context.nudges)
+            fprintf(stderr, "smart transcode: %u IDRs sent to push held frames out of the decoder\n", context.nudges);
+    }
+    if (context.scene_detect_enabled) {
+        if (context.scene_detect.frames)
+            fprintf(stderr, "scene detect: %u frames, %.3f ms/frame, %u cuts, %u I-frames requested, max score %.1f\n",
+                    context.scene_detect.frames, context.scene_detect.us / 1000.0 / context.scene_detect.frames,
+                    context.scene_detect.cuts, context.i_frames_requested, context.scene_detect.max_score);
+        scene_detect_destroy(&context.scene_detect);
+    }
+
     SOURCE_CLOSE();
     DEST_CLOSE();
 
 error:
+    if (context.trace_path) {
+        int events = trace_write(context.trace_path);
+        if (events < 0)
+            fprintf(stderr, "could not write the trace to %s\n", context.trace_path);
+        else
+            fprintf(stderr, "trace: %d events written to %s\n", events, context.trace_path);
+    }
+
     /* Cleanup everything */
     if (decoder)
         mmal_component_release(decoder);
     if (encoder)
         mmal_component_release(encoder);
+    spsc_queue_destroy(&context.queue_encoded);
+    spsc_queue_destroy(&context.decoder_free);
+    spsc_queue_destroy(&context.splice_points);
+    splice_gop_free(input.gop);
+    splice_destroy(&context.splice);
+    free(context.sps_au);
+    free(context.nudge_au);
+    if (control_path)
+        control_socket_destroy(&context.control);
+    if (status_interval > 0)
+        event_loop_remove(&context.loop, &context.status_timer);
+    metrics_stop(&context.metrics);
+    if (context.recording) {
+        int fd = context.trigger_signal.fd;
+        event_loop_remove(&context.loop, &context.trigger_signal);
+        close(fd);
+        event_recorder_destroy(&context.recorder);
+    }
+    if (context.segmenting)
+        segmenter_destroy(&context.segmenter);
+    event_loop_remove(&context.loop, &context.wake);
+    event_loop_destroy(&context.loop);
 
     return status == MMAL_SUCCESS ? 0 : -1;
 
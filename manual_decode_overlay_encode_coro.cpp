@@ -0,0 +1,622 @@
+/* manual_decode_overlay_encode.c written as coroutines (mmal_coro.hpp).
+ *
+ * Same pipeline: test.h264_2 is decoded, the chess board and the camera id /
+ * timecode / frame number are drawn on every frame, and the result is encoded
+ * to out.h264. Every stage is a loop waiting for its buffers:
+ *
+ *   feed_decoder:   decoder input pool -> read access unit -> decoder input
+ *   process:        decoder output -> overlay -> encoder input
+ *   write_encoded:  encoder output -> out.h264
+ *   recycle (x2):   empty buffers -> decoder / encoder output
+ *
+ * The per-pixel work (brightness/contrast, privacy mask, letterbox fill and the
+ * chess board) is one fused FilterChain pass over the frame (filter_chain.hpp).
+ *
+ * The pipeline counters are served as for the C version when MMAL_METRICS is
+ * set (metrics.h), and MMAL_TRACE=<file.json> traces every buffer header
+ * (trace.h, through mmal_coro.hpp).
+ *
+ * With -p the frames are also shown in a Qt window (preview_sink.hpp); the
+ * pipeline then runs on a thread of its own and never waits for the window.
+ *
+ * The end-of-run statistics are printed in the same format as the C version,
+ * so running both on the same input compares them. */
+
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "util/mmal_default_components.h"
+#include "util/mmal_util_params.h"
+#include "mmal_coro.hpp"
+#include "frame.h"
+#include "text_overlay.h"
+#include "scene_detect.h"
+#include "h264_nal.h"
+#include "load_shed.h"
+#include "filter_chain.hpp"
+#include "preview_sink.hpp"
+#include "metrics.h"
+
+using namespace mmal_coro;
+
+static const int MAX_BITRATE_LEVEL4 = 25000000; // 25Mbits/s
+static const int FRAME_RATE = 25;
+
+typedef FilterChain<I420, BrightnessContrast, PrivacyMask, CropFill, ChessOverlay> OverlayFilters;
+
+class Pipeline {
+public:
+    Pipeline(FILE *source, FILE *dest, const char *camera_id, int scene_detect_enabled, int intraperiod,
+             unsigned int load_shed_threshold, const OverlayFilters &filters, PreviewSink *preview);
+    ~Pipeline();
+    void run();
+    void print_statistics();
+
+private:
+    Task control();
+    Task feed_decoder();
+    Task process();
+    Task process_frame(MMAL_BUFFER_HEADER_T *frame);
+    Task write_encoded();
+    Task recycle(Pool &pool, Port &port);
+    void configure_encoder(MMAL_ES_FORMAT_T *format);
+    int read_access_unit(MMAL_BUFFER_HEADER_T *buffer);
+    void draw_text_overlay(FRAME_T *planes);
+    void register_metrics();
+
+    /* declared first, destroyed last: the ports and pools below refer to them */
+    Executor executor;
+    Component decoder{MMAL_COMPONENT_DEFAULT_VIDEO_DECODER};
+    Component encoder{MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER};
+    Pool decoder_pool_in, encoder_pool_in, encoder_pool_out; //the encoder input pool feeds the decoder output
+    Port decoder_control, decoder_in, decoder_out, encoder_in, encoder_out; //destroyed before the pools
+
+    FILE *source, *dest;
+    H264_READER_T reader;
+    H264_AU_T au;
+    size_t sent = 0;
+    int64_t pts = 0;
+    unsigned int index = 0;
+
+    const char *camera_id;
+    TEXT_OVERLAY_T text_overlay;
+    int text_overlay_created = 0;
+    uint64_t text_overlay_us = 0;
+    OverlayFilters filters;
+    uint64_t filters_us = 0;
+    PreviewSink *preview;
+    int scene_detect_enabled;
+    SCENE_DETECT_T scene_detect;
+    unsigned int i_frames_requested = 0;
+    LOAD_SHED_T load_shed;
+
+    //every task runs on the executor thread, which also answers the scrapes
+    METRICS_T metrics;
+    METRICS_PORT_T metrics_decoder_in, metrics_decoder_out, metrics_encoder_out, metrics_written;
+    METRICS_EVENTS_T metrics_decoder_events, metrics_encoder_events;
+
+    unsigned int frames_decoded = 0, frames_to_encoder = 0, frames_encoded = 0, i_frames = 0;
+    uint64_t bytes_encoded = 0, i_frame_bytes = 0, frame_bytes = 0;
+    int framenr = 0;
+};
+
+Pipeline::Pipeline(FILE *source, FILE *dest, const char *camera_id, int scene_detect_enabled, int intraperiod,
+                   unsigned int load_shed_threshold, const OverlayFilters &filters, PreviewSink *preview)
+    : decoder_control(executor, decoder->control), decoder_in(executor, decoder.input()),
+      decoder_out(executor, decoder.output()), encoder_in(executor, encoder.input()),
+      encoder_out(executor, encoder.output()), source(source), dest(dest), camera_id(camera_id),
+      filters(filters), preview(preview), scene_detect_enabled(scene_detect_enabled)
+{
+    memset(&text_overlay, 0, sizeof(text_overlay));
+    memset(&scene_detect, 0, sizeof(scene_detect));
+    memset(&au, 0, sizeof(au));
+    load_shed_init(&load_shed, load_shed_threshold);
+    if (h264_reader_init(&reader, source))
+        throw Error(MMAL_ENOMEM, "h264_reader_init");
+
+    decoder_control.enable(Port::RECEIVE);
+
+    /* Enable zero-copy parameters on all ports */
+    check(mmal_port_parameter_set_boolean(decoder.input(), MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE), "zero copy");
+    check(mmal_port_parameter_set_boolean(encoder.output(), MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE), "zero copy");
+    check(mmal_port_parameter_set_boolean(decoder.output(), MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE), "zero copy");
+    check(mmal_port_parameter_set_boolean(encoder.input(), MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE), "zero copy");
+
+    /* Set format of video decoder input port, whole access units are sent */
+    MMAL_ES_FORMAT_T *format_in = decoder.input()->format;
+    format_in->type = MMAL_ES_TYPE_VIDEO;
+    format_in->encoding = MMAL_ENCODING_H264;
+    format_in->es->video.width = 1280;
+    format_in->es->video.height = 720;
+    format_in->es->video.frame_rate.num = FRAME_RATE;
+    format_in->es->video.frame_rate.den = 1;
+    format_in->es->video.par.num = 1;
+    format_in->es->video.par.den = 1;
+    format_in->flags |= MMAL_ES_FORMAT_FLAG_FRAMED;
+    check(mmal_port_format_commit(decoder.input()), "decoder input format");
+
+    MMAL_PARAMETER_VIDEO_PROFILE_T param;
+    param.hdr.id = MMAL_PARAMETER_PROFILE;
+    param.hdr.size = sizeof(param);
+    param.profile[0].level = MMAL_VIDEO_LEVEL_H264_4;
+    param.profile[0].profile = MMAL_VIDEO_PROFILE_H264_HIGH;
+    check(mmal_port_parameter_set(encoder.output(), &param.hdr), "encoder output profile");
+    if (intraperiod > 0)
+        check(mmal_port_parameter_set_uint32(encoder.output(), MMAL_PARAMETER_INTRAPERIOD, intraperiod),
+              "encoder intra period");
+
+    decoder.input()->buffer_num = decoder.input()->buffer_num_min;
+    decoder.input()->buffer_size = decoder.input()->buffer_size_min;
+    decoder.output()->buffer_num = decoder.output()->buffer_num_min;
+    decoder.output()->buffer_size = decoder.output()->buffer_size_min;
+
+    decoder_pool_in = Pool(executor, decoder.input(), decoder.input()->buffer_num, decoder.input()->buffer_size);
+    encoder_pool_out = Pool(executor, encoder.output(), encoder.output()->buffer_num, encoder.output()->buffer_size);
+
+    decoder_in.enable(Port::RELEASE);
+    decoder_out.enable(Port::RECEIVE);
+    //the encoder ports are enabled once the decoder output format is known, see process()
+
+    register_metrics();
+
+    executor.spawn(control());
+    executor.spawn(feed_decoder());
+    executor.spawn(process());
+    executor.spawn(write_encoded());
+}
+
+Pipeline::~Pipeline()
+{
+    /* Stop everything before the pools go away */
+    decoder_in.disable();
+    decoder_control.disable();
+    encoder_in.disable();
+    decoder_out.disable();
+    encoder_out.disable();
+    metrics_stop(&metrics);
+    executor.clear();
+    if (text_overlay_created)
+        text_overlay_destroy(&text_overlay);
+    if (scene_detect_enabled)
+        scene_detect_destroy(&scene_detect);
+    h264_reader_free(&reader);
+}
+
+/** Same names as in manual_decode_overlay_encode.c, so one dashboard fits both */
+void Pipeline::register_metrics()
+{
+    auto pool_free = [](void *userdata) -> int64_t {
+        const Pool *pool = static_cast<const Pool *>(userdata);
+        return *pool ? mmal_queue_length(pool->get()->queue) : 0;
+    };
+    auto pool_size = [](void *userdata) -> int64_t {
+        const Pool *pool = static_cast<const Pool *>(userdata);
+        return *pool ? pool->get()->headers_num : 0;
+    };
+    auto frames_in_encoder = [](void *userdata) -> int64_t {
+        const Pipeline *pipeline = static_cast<const Pipeline *>(userdata);
+        return pipeline->frames_to_encoder - pipeline->frames_encoded;
+    };
+    auto load_shed_level = [](void *userdata) -> int64_t {
+        return static_cast<const Pipeline *>(userdata)->load_shed.level;
+    };
+    struct { const char *label; Pool *pool; } pools[] = {
+        { "decoder_in", &decoder_pool_in }, { "encoder_in", &encoder_pool_in }, { "encoder_out", &encoder_pool_out },
+    };
+    metrics_init(&metrics, 0);
+    int failed = metrics_register_port(&metrics, &metrics_decoder_in, "decoder_in") ||
+                 metrics_register_port(&metrics, &metrics_decoder_out, "decoder_out") ||
+                 metrics_register_port(&metrics, &metrics_encoder_out, "encoder_out") ||
+                 metrics_register_port(&metrics, &metrics_written, "written") ||
+                 metrics_register_events(&metrics, &metrics_decoder_events, "decoder") ||
+                 metrics_register_events(&metrics, &metrics_encoder_events, "encoder");
+    char name[METRICS_NAME];
+
+    for (const auto &p : pools) {
+        snprintf(name, sizeof(name), "mmal_pool_free_buffers{pool=\"%s\"}", p.label);
+        failed |= metrics_register_sampled(&metrics, name, "Buffer headers waiting in the pool queue", pool_free, p.pool) < 0;
+        snprintf(name, sizeof(name), "mmal_pool_buffers{pool=\"%s\"}", p.label);
+        failed |= metrics_register_sampled(&metrics, name, "Buffer headers in the pool", pool_size, p.pool) < 0;
+    }
+    failed |= metrics_register_sampled(&metrics, "pipeline_queue_depth{queue=\"in_encoder\"}",
+                                       "Buffers waiting in a queue between threads", frames_in_encoder, this) < 0;
+    failed |= metrics_register_sampled(&metrics, "pipeline_load_shed_level", "Current load shedding level",
+                                       load_shed_level, this) < 0;
+    if (failed)
+        throw Error(MMAL_ENOSPC, "metrics registry");
+    if (metrics_serve_from_env(&metrics, executor.event_loop()) != 0)
+        throw Error(MMAL_EIO, "metrics_serve");
+}
+
+void Pipeline::run()
+{
+    fprintf(stderr, "start transcoding\n");
+    executor.run();
+    fprintf(stderr, "stop transcoding\n");
+}
+
+/** Events from the decoder */
+Task Pipeline::control()
+{
+    for (;;) {
+        Buffer event = co_await decoder_control.receive();
+        metrics_event(&metrics, &metrics_decoder_events, event.get());
+        fprintf(stderr, "control event %4.4s\n", (char *)&event->cmd);
+        if (event->cmd == MMAL_EVENT_ERROR)
+            throw Error(*(MMAL_STATUS_T *)event->data, "decoder");
+    }
+}
+
+/** Fill the buffer with the next (part of an) access unit, dropping access
+ * units as long as the load shedding policy asks for it.
+ * Returns 0 at the end of the stream. */
+int Pipeline::read_access_unit(MMAL_BUFFER_HEADER_T *buffer)
+{
+    size_t length;
+
+    while (sent == au.size) {
+        unsigned int level = load_shed.level;
+
+        if (!h264_reader_next_au(&reader, &au))
+            return 0;
+        sent = 0;
+        pts = (int64_t)index++ * 1000000 / FRAME_RATE;
+        //everything past the decoder runs on this thread, so the depth needs no atomics
+        if (load_shed_drop(&load_shed, &au, frames_to_encoder - frames_encoded))
+            sent = au.size;
+        if (load_shed.level != level)
+            fprintf(stderr, "load shedding level %u at frame %u\n", load_shed.level, index - 1);
+    }
+
+    length = au.size - sent;
+    if (length > buffer->alloc_size)
+        length = buffer->alloc_size;
+    memcpy(buffer->data, au.data + sent, length);
+    buffer->length = length;
+    buffer->offset = 0;
+    buffer->flags = sent == 0 ? MMAL_BUFFER_HEADER_FLAG_FRAME_START : 0;
+    sent += length;
+    if (sent == au.size)
+        buffer->flags |= MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+    if (au.keyframe)
+        buffer->flags |= MMAL_BUFFER_HEADER_FLAG_KEYFRAME;
+    buffer->pts = buffer->dts = pts;
+    return 1;
+}
+
+Task Pipeline::feed_decoder()
+{
+    for (;;) {
+        Buffer buffer = co_await decoder_pool_in.acquire();
+        if (!read_access_unit(buffer.get())) {
+            buffer->length = 0;
+            buffer->flags = MMAL_BUFFER_HEADER_FLAG_EOS;
+            buffer->pts = buffer->dts = MMAL_TIME_UNKNOWN;
+            metrics_port_buffer(&metrics, &metrics_decoder_in, buffer.get());
+            co_await decoder_in.send(std::move(buffer));
+            co_return;
+        }
+        metrics_port_buffer(&metrics, &metrics_decoder_in, buffer.get());
+        co_await decoder_in.send(std::move(buffer));
+    }
+}
+
+/** Hand empty buffers to an output port whenever the pool has some */
+Task Pipeline::recycle(Pool &pool, Port &port)
+{
+    for (;;)
+        co_await port.send(co_await pool.acquire());
+}
+
+/** Finish the encoder setup once the decoder has told us its output format */
+void Pipeline::configure_encoder(MMAL_ES_FORMAT_T *format)
+{
+    check(mmal_format_full_copy(encoder.input()->format, format), "copy decoder output format");
+    check(mmal_port_format_commit(encoder.input()), "encoder input format");
+    encoder.output()->format->bitrate = MAX_BITRATE_LEVEL4;
+    check(mmal_port_format_commit(encoder.output()), "encoder output format");
+
+    encoder_in.enable(Port::RELEASE);
+    encoder_out.enable(Port::RECEIVE);
+    encoder_pool_in = Pool(executor, encoder.input(), encoder.input()->buffer_num_recommended,
+                           encoder.input()->buffer_size_recommended);
+    executor.spawn(recycle(encoder_pool_in, decoder_out));
+    executor.spawn(recycle(encoder_pool_out, encoder_out));
+
+    //scale the font with the picture: 2 at 720p, 4 at 1080p
+    if (text_overlay_create(&text_overlay, format->es->video.crop.height / 270, 0) != 0)
+        throw Error(MMAL_ENOMEM, "text_overlay_create");
+    text_overlay_created = 1;
+    text_overlay.x = text_overlay.y = 16;
+
+    std::get<CropFill>(filters.filters).frame_width = format->es->video.crop.width;
+    std::get<CropFill>(filters.filters).frame_height = format->es->video.crop.height;
+
+    if (preview && preview->configure(format->es->video.crop.width, format->es->video.crop.height) != 0)
+        throw Error(MMAL_ENOMEM, "preview");
+
+    //every 4th luma row is enough to see a cut and keeps the cost per frame low
+    if (scene_detect_enabled &&
+        scene_detect_create(&scene_detect, format->es->video.crop.width, format->es->video.crop.height, 4) != 0)
+        throw Error(MMAL_ENOMEM, "scene_detect_create");
+    fprintf(stderr, "Encoder enabled\n");
+}
+
+void Pipeline::draw_text_overlay(FRAME_T *planes)
+{
+    uint64_t start = vcos_getmicrosecs64();
+    char text[TEXT_OVERLAY_MAX_CHARS + 1], clock[24];
+    struct timeval tv;
+    struct tm tm;
+
+    gettimeofday(&tv, NULL);
+    localtime_r(&tv.tv_sec, &tm);
+    strftime(clock, sizeof(clock), "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(text, sizeof(text), "%s %s.%03d F%06u", camera_id, clock, (int)(tv.tv_usec / 1000), frames_decoded++);
+    text_overlay_set_text(&text_overlay, text);
+    text_overlay_blit(&text_overlay, planes);
+    text_overlay_us += vcos_getmicrosecs64() - start;
+}
+
+/** Everything done to a decoded frame. A task of its own, started for every
+ * frame: its coroutine frame comes from the FramePool, not the heap. */
+Task Pipeline::process_frame(MMAL_BUFFER_HEADER_T *frame)
+{
+    MMAL_VIDEO_FORMAT_T *video = &encoder.input()->format->es->video;
+    FRAME_T planes;
+
+    frame_init_i420(&planes, frame->data + frame->offset, video->width, video->height,
+                    video->crop.width ? video->crop.width : video->width,
+                    video->crop.height ? video->crop.height : video->height);
+
+    if (scene_detect_enabled && scene_detect_frame(&scene_detect, &planes)) {
+        fprintf(stderr, "scene cut at frame %u (score %.1f, average %.1f)\n", scene_detect.frames - 1,
+                scene_detect.score, scene_detect.average);
+        if (mmal_port_parameter_set_boolean(encoder.output(), MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME,
+                                            MMAL_TRUE) == MMAL_SUCCESS)
+            i_frames_requested++;
+        else
+            fprintf(stderr, "could not request I-frame\n");
+    }
+
+    //all per-pixel filters in one pass, the chess board moves with the frame number
+    uint64_t start = vcos_getmicrosecs64();
+    std::get<ChessOverlay>(filters.filters) = ChessOverlay(framenr + 100, framenr + 200, 100, 100);
+    filters.run(&planes);
+    filters_us += vcos_getmicrosecs64() - start;
+
+    draw_text_overlay(&planes);
+    if (preview)
+        preview->submit(&planes, frame->pts);
+    co_return;
+}
+
+Task Pipeline::process()
+{
+    for (;;) {
+        Buffer buffer = co_await decoder_out.receive();
+
+        if (buffer->cmd)
+            metrics_event(&metrics, &metrics_decoder_events, buffer.get());
+        else
+            metrics_port_buffer(&metrics, &metrics_decoder_out, buffer.get());
+
+        if (buffer->cmd == MMAL_EVENT_FORMAT_CHANGED) {
+            MMAL_EVENT_FORMAT_CHANGED_T *event = mmal_event_format_changed_get(buffer.get());
+            if (!event)
+                throw Error(MMAL_EINVAL, "format change event");
+            configure_encoder(event->format);
+            continue;
+        }
+        if (buffer->cmd) {
+            fprintf(stderr, "unknown cmd: %u\n", buffer->cmd);
+            continue;
+        }
+
+        int eos = buffer->flags & MMAL_BUFFER_HEADER_FLAG_EOS;
+        if (buffer->length) {
+            co_await process_frame(buffer.get());
+            frames_to_encoder++;
+        }
+        //the EOS goes through the encoder as well, it ends write_encoded()
+        co_await encoder_in.send(std::move(buffer));
+        if (eos)
+            co_return;
+    }
+}
+
+Task Pipeline::write_encoded()
+{
+    for (;;) {
+        Buffer buffer = co_await encoder_out.receive();
+
+        if (buffer->cmd) {
+            metrics_event(&metrics, &metrics_encoder_events, buffer.get());
+            fprintf(stderr, "received event %4.4s\n", (char *)&buffer->cmd);
+            continue;
+        }
+        metrics_port_buffer(&metrics, &metrics_encoder_out, buffer.get());
+        fwrite(buffer->data, 1, buffer->length, dest);
+        metrics_port_buffer(&metrics, &metrics_written, buffer.get());
+        bytes_encoded += buffer->length;
+        if (!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)) {
+            //a frame may be split across several buffers
+            frame_bytes += buffer->length;
+            if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) {
+                frames_encoded++;
+                if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME) {
+                    i_frames++;
+                    i_frame_bytes += frame_bytes;
+                }
+                frame_bytes = 0;
+            }
+        }
+        fprintf(stderr, "encoded frame %u (flags %x, length %u)\n", framenr++, buffer->flags, buffer->length);
+        if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_EOS) {
+            //the recycle tasks never finish on their own
+            executor.stop();
+            co_return;
+        }
+    }
+}
+
+void Pipeline::print_statistics()
+{
+    if (frames_decoded)
+        fprintf(stderr, "text overlay: %u frames, %.3f ms/frame, %lu glyphs redrawn\n",
+                frames_decoded, text_overlay_us / 1000.0 / frames_decoded, text_overlay.glyphs_redrawn);
+    if (frames_encoded)
+        fprintf(stderr, "encoded: %u frames, %.0f kbit/s at 25fps, %u I-frames (avg %.1f kB), P-frames avg %.1f kB\n",
+                frames_encoded, bytes_encoded * 8.0 * 25 / frames_encoded / 1000, i_frames,
+                i_frames ? i_frame_bytes / 1000.0 / i_frames : 0,
+                frames_encoded > i_frames ? (bytes_encoded - i_frame_bytes) / 1000.0 / (frames_encoded - i_frames) : 0);
+    if (frames_to_encoder)
+        fprintf(stderr, "filters: %.3f ms/frame\n", filters_us / 1000.0 / frames_to_encoder);
+    fprintf(stderr, "executor: %u waits, %u notifications, %u resumes, %u coroutine frames from the heap\n",
+            executor.waits(), executor.notifications(), executor.resumes, FramePool::heap_allocations());
+    if (load_shed.threshold)
+        load_shed_print(&load_shed, stderr);
+    if (scene_detect_enabled && scene_detect.frames)
+        fprintf(stderr, "scene detect: %u frames, %.3f ms/frame, %u cuts, %u I-frames requested, max score %.1f\n",
+                scene_detect.frames, scene_detect.us / 1000.0 / scene_detect.frames,
+                scene_detect.cuts, i_frames_requested, scene_detect.max_score);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *camera_id = "CAM0";
+    int opt, intraperiod = -1, scene_detect_enabled = 0;
+    unsigned int load_shed_threshold = 0;
+    OverlayFilters filters;
+    unsigned int preview_width = 0;
+    bool preview_colour = false;
+    const char *snapshot_path = NULL;
+    int x, y, w, h;
+    FILE *source = NULL, *dest = NULL;
+    struct timeval start, end;
+    struct rusage usage;
+    int ret = 0;
+
+    while ((opt = getopt(argc, argv, "c:sg:l:b:m:k:p:rS:")) != -1) {
+        switch (opt) {
+        case 'c':
+            camera_id = optarg;
+            break;
+        case 's':
+            scene_detect_enabled = 1;
+            break;
+        case 'g':
+            intraperiod = atoi(optarg);
+            break;
+        case 'l':
+            load_shed_threshold = atoi(optarg);
+            break;
+        case 'b':
+            if (sscanf(optarg, "%d,%d", &x, &y) != 2)
+                goto usage;
+            std::get<BrightnessContrast>(filters.filters) = BrightnessContrast(x, y);
+            break;
+        case 'm':
+            if (sscanf(optarg, "%d,%d,%d,%d", &x, &y, &w, &h) != 4)
+                goto usage;
+            std::get<PrivacyMask>(filters.filters) = PrivacyMask(x, y, w, h);
+            break;
+        case 'k':
+            if (sscanf(optarg, "%d,%d,%d,%d", &x, &y, &w, &h) != 4)
+                goto usage;
+            //the frame size is filled in once the decoder has reported it
+            std::get<CropFill>(filters.filters) = CropFill(x, y, w, h, 0, 0);
+            break;
+        case 'p':
+            preview_width = atoi(optarg);
+            break;
+        case 'r':
+            preview_colour = true;
+            break;
+        case 'S':
+            snapshot_path = optarg;
+            break;
+        default:
+        usage:
+            fprintf(stderr, "usage: %s [-c camera-id] [-s] [-g intraperiod] [-l depth] [-b brightness,contrast]\n"
+                            "          [-m x,y,w,h] [-k x,y,w,h] [-p width [-r] [-S snapshot.png]]\n"
+                            "  -c -s -g -l  as for manual_decode_overlay_encode\n"
+                            "  -b  add brightness (-255..255) and scale contrast (256 = 1.0, up to 512)\n"
+                            "  -m  black out a rectangle (privacy mask)\n"
+                            "  -k  keep only this rectangle, black out the rest (letterbox)\n"
+                            "  -p  show a preview window this wide (grey, -r colour), QT_QPA_PLATFORM=offscreen works\n"
+                            "  -S  save the last preview frame when done\n", argv[0]);
+            return -1;
+        }
+    }
+    if (intraperiod < 0 && scene_detect_enabled)
+        intraperiod = 250;
+
+    //before the ports are created, they name themselves in the tracer
+    trace_init(16384);
+    trace_enable(getenv("MMAL_TRACE") != NULL);
+
+    bcm_host_init();
+    source = fopen("test.h264_2", "rb");
+    dest = fopen("out.h264", "wb");
+    if (!source || !dest) {
+        fprintf(stderr, "could not open test.h264_2 or out.h264\n");
+        ret = -1;
+    } else {
+        PreviewSink preview(preview_width);
+        auto transcode = [&]() {
+            try {
+                Pipeline pipeline(source, dest, camera_id, scene_detect_enabled, intraperiod, load_shed_threshold,
+                                  filters, preview_width ? &preview : NULL);
+                pipeline.run();
+                fprintf(stderr, "done\n");
+                if (getenv("MMAL_TRACE")) {
+                    int events = trace_write(getenv("MMAL_TRACE"));
+                    if (events < 0)
+                        fprintf(stderr, "could not write the trace to %s\n", getenv("MMAL_TRACE"));
+                    else
+                        fprintf(stderr, "trace: %d events written to %s\n", events, getenv("MMAL_TRACE"));
+                }
+                pipeline.print_statistics();
+            } catch (const std::exception &e) {
+                fprintf(stderr, "%s\n", e.what());
+                ret = -1;
+            }
+        };
+
+        gettimeofday(&start, NULL);
+        if (!preview_width) {
+            transcode();
+        } else {
+            //Qt wants the main thread, the pipeline gets its own
+            int qt_argc = 1;
+            QGuiApplication app(qt_argc, argv);
+            PreviewWindow window(preview, preview_colour);
+            window.show();
+            std::thread pipeline_thread([&]() {
+                transcode();
+                QMetaObject::invokeMethod(&app, "quit", Qt::QueuedConnection);
+            });
+            app.exec();
+            pipeline_thread.join();
+            if (snapshot_path && !window.snapshot(snapshot_path))
+                fprintf(stderr, "could not save %s\n", snapshot_path);
+            preview.print_statistics(stderr);
+        }
+        gettimeofday(&end, NULL);
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(stderr, "%.2f s wall, %.2f s user, %.2f s system, %ld voluntary / %ld involuntary context switches\n",
+                (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6,
+                usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+                usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6, usage.ru_nvcsw, usage.ru_nivcsw);
+    }
+    if (source)
+        fclose(source);
+    if (dest)
+        fclose(dest);
+    return ret;
+}
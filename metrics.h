@@ -0,0 +1,482 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/* Pipeline counters and gauges, served in the Prometheus text format.
+ *
+ * Every thread which counts something (main loop, MMAL callback threads,
+ * writer threads) gets a shard of its own on its first count, so a count is a
+ * plain store into a cache line no other thread writes: no locks, no atomic
+ * read-modify-write. A scrape adds up the shards. Gauges are single words set
+ * with an atomic store, or sampled when scraped (pool occupancy via
+ * mmal_queue_length()).
+ *
+ * metrics_serve() answers HTTP requests on the event loop (event_loop.h),
+ * on 127.0.0.1:<port> if the address is a number, else on a unix socket:
+ *   curl http://127.0.0.1:9100/metrics
+ *   curl --unix-socket /tmp/decode.metrics http://localhost/metrics
+ * The examples serve their metrics when MMAL_METRICS is set to either.
+ * While metrics are disabled, counting is one well predicted branch.
+ *
+ * Register everything before the first count; one registry per process. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "mmal.h"
+#include "mmal_pool.h"
+#include "mmal_queue.h"
+#include "event_loop.h"
+
+#define METRICS_MAX 64
+#define METRICS_MAX_THREADS 16
+#define METRICS_NAME 96
+#define METRICS_CLIENTS 4
+#define METRICS_REQUEST 1024
+
+typedef enum {
+    METRICS_COUNTER,
+    METRICS_GAUGE,
+} METRICS_TYPE_T;
+
+typedef int64_t (*METRICS_SAMPLE_CB_T)(void *userdata);
+
+typedef struct METRICS_SHARD_T {
+    uint64_t value[METRICS_MAX];    /* written by one thread only */
+} __attribute__((aligned(64))) METRICS_SHARD_T;
+
+typedef struct METRICS_DEF_T {
+    char name[METRICS_NAME];        /* family{labels} */
+    const char *help;
+    METRICS_TYPE_T type;
+    METRICS_SAMPLE_CB_T sample;     /* gauges computed when scraped */
+    void *userdata;
+} METRICS_DEF_T;
+
+struct METRICS_T;
+
+typedef struct METRICS_CLIENT_T {
+    struct METRICS_T *metrics;
+    EVENT_SOURCE_T source;          /* source.fd < 0 when the slot is free */
+    char request[METRICS_REQUEST];
+    size_t length;
+} METRICS_CLIENT_T;
+
+typedef struct METRICS_T {
+    int enabled;
+    unsigned int count;
+    METRICS_DEF_T def[METRICS_MAX];
+    int64_t gauge[METRICS_MAX];                 /* atomic */
+    METRICS_SHARD_T shard[METRICS_MAX_THREADS];
+    unsigned int shards;                        /* atomic, claimed so far */
+
+    EVENT_LOOP_T *loop;
+    EVENT_SOURCE_T listener;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    METRICS_CLIENT_T client[METRICS_CLIENTS];
+    unsigned int scrapes;
+} METRICS_T;
+
+/* the shard of this thread, or NULL if the shards ran out and it has to share */
+static __thread METRICS_SHARD_T *metrics_thread_shard;
+static __thread int metrics_thread_claimed;
+
+static void metrics_init(METRICS_T *m, int enabled)
+{
+    unsigned int i;
+
+    memset(m, 0, sizeof(*m));
+    m->enabled = enabled;
+    m->listener.fd = -1;
+    for (i = 0; i < METRICS_CLIENTS; i++)
+        m->client[i].source.fd = -1;
+}
+
+/** Returns the id, or -1 if the registry is full */
+static int metrics_register(METRICS_T *m, const char *name, METRICS_TYPE_T type, const char *help)
+{
+    METRICS_DEF_T *def;
+
+    if (m->count == METRICS_MAX || strlen(name) >= METRICS_NAME)
+        return -1;
+    def = &m->def[m->count];
+    strcpy(def->name, name);
+    def->help = help;
+    def->type = type;
+    return m->count++;
+}
+
+/** A gauge whose value is taken from cb when scraped (on the event loop thread) */
+static int metrics_register_sampled(METRICS_T *m, const char *name, const char *help,
+                                    METRICS_SAMPLE_CB_T cb, void *userdata)
+{
+    int id = metrics_register(m, name, METRICS_GAUGE, help);
+
+    if (id >= 0) {
+        m->def[id].sample = cb;
+        m->def[id].userdata = userdata;
+    }
+    return id;
+}
+
+static METRICS_SHARD_T *metrics_claim_shard(METRICS_T *m)
+{
+    unsigned int index = __atomic_fetch_add(&m->shards, 1, __ATOMIC_RELAXED);
+
+    metrics_thread_claimed = 1;
+    metrics_thread_shard = index < METRICS_MAX_THREADS - 1 ? &m->shard[index] : NULL;
+    return metrics_thread_shard;
+}
+
+/** Add to a counter, from any thread */
+static inline void metrics_add(METRICS_T *m, int id, uint64_t n)
+{
+    METRICS_SHARD_T *shard;
+
+    if (!m->enabled)
+        return;
+    shard = metrics_thread_claimed ? metrics_thread_shard : metrics_claim_shard(m);
+    if (shard)
+        __atomic_store_n(&shard->value[id], shard->value[id] + n, __ATOMIC_RELAXED);
+    else /* more threads than shards: the last one is shared */
+        __atomic_fetch_add(&m->shard[METRICS_MAX_THREADS - 1].value[id], n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_inc(METRICS_T *m, int id)
+{
+    metrics_add(m, id, 1);
+}
+
+/** Set a gauge, from any thread */
+static inline void metrics_set(METRICS_T *m, int id, int64_t value)
+{
+    if (m->enabled)
+        __atomic_store_n(&m->gauge[id], value, __ATOMIC_RELAXED);
+}
+
+static int64_t metrics_value(METRICS_T *m, int id)
+{
+    const METRICS_DEF_T *def = &m->def[id];
+    unsigned int i, shards = __atomic_load_n(&m->shards, __ATOMIC_RELAXED);
+    uint64_t sum;
+
+    if (def->sample)
+        return def->sample(def->userdata);
+    if (def->type == METRICS_GAUGE)
+        return __atomic_load_n(&m->gauge[id], __ATOMIC_RELAXED);
+    /* the last shard is the shared one */
+    if (shards > METRICS_MAX_THREADS - 1)
+        shards = METRICS_MAX_THREADS - 1;
+    sum = __atomic_load_n(&m->shard[METRICS_MAX_THREADS - 1].value[id], __ATOMIC_RELAXED);
+    for (i = 0; i < shards; i++)
+        sum += __atomic_load_n(&m->shard[i].value[id], __ATOMIC_RELAXED);
+    return sum;
+}
+
+static int metrics_same_family(const char *a, const char *b)
+{
+    size_t length = strcspn(a, "{");
+    return strcspn(b, "{") == length && !strncmp(a, b, length);
+}
+
+/** Everything in the Prometheus text format, metrics of a family together.
+ * Returns the length, 0 if it does not fit. */
+static size_t metrics_format(METRICS_T *m, char *text, size_t size)
+{
+    size_t length = 0;
+    unsigned int i, j, k;
+    int n;
+
+    for (i = 0; i < m->count; i++) {
+        const METRICS_DEF_T *def = &m->def[i];
+        int family = strcspn(def->name, "{");
+
+        /* families are written where they first appear */
+        for (k = 0; k < i && !metrics_same_family(m->def[k].name, def->name); k++)
+            ;
+        if (k < i)
+            continue;
+        n = snprintf(text + length, size - length, "# HELP %.*s %s\n# TYPE %.*s %s\n", family, def->name,
+                     def->help, family, def->name, def->type == METRICS_COUNTER ? "counter" : "gauge");
+        if (n < 0 || length + n >= size)
+            return 0;
+        length += n;
+        for (j = i; j < m->count; j++) {
+            if (!metrics_same_family(m->def[j].name, def->name))
+                continue;
+            n = snprintf(text + length, size - length, "%s %lld\n", m->def[j].name, (long long)metrics_value(m, j));
+            if (n < 0 || length + n >= size)
+                return 0;
+            length += n;
+        }
+    }
+    return length;
+}
+
+/** Write the metrics to file, for programs which run without an event loop.
+ * Returns 0 on success. */
+static int metrics_dump(METRICS_T *m, FILE *file)
+{
+    static char text[16384];
+    size_t length = metrics_format(m, text, sizeof(text));
+
+    return length && fwrite(text, 1, length, file) == length ? 0 : -1;
+}
+
+static void metrics_client_close(METRICS_CLIENT_T *client)
+{
+    int fd = client->source.fd;
+
+    event_loop_remove(client->metrics->loop, &client->source);
+    close(fd);
+    client->source.fd = -1;
+}
+
+static void metrics_client_handler(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    METRICS_CLIENT_T *client = (METRICS_CLIENT_T *)source->userdata;
+    METRICS_T *m = client->metrics;
+    static char body[16384];
+    char header[128];
+    struct iovec iov[2];
+    struct msghdr msg = { 0 };
+    size_t length;
+    ssize_t got;
+
+    (void)loop;
+    (void)events;
+    got = read(source->fd, client->request + client->length, sizeof(client->request) - 1 - client->length);
+    if (got < 0 && errno == EAGAIN)
+        return;
+    if (got <= 0) {
+        /* closed before asking, nobody to answer */
+        metrics_client_close(client);
+        return;
+    }
+    client->length += got;
+    client->request[client->length] = 0;
+    /* answer once the whole request header is there */
+    if (!strstr(client->request, "\r\n\r\n") && !strstr(client->request, "\n\n") &&
+        client->length < sizeof(client->request) - 1)
+        return;
+
+    length = metrics_format(m, body, sizeof(body));
+    iov[0].iov_base = header;
+    iov[0].iov_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n\r\n", length);
+    iov[1].iov_base = body;
+    iov[1].iov_len = length;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    /* a few kB, fits into the socket buffer: not worth waiting for EPOLLOUT.
+     * No SIGPIPE if the client has gone in the meantime. */
+    if (sendmsg(source->fd, &msg, MSG_NOSIGNAL) > 0)
+        m->scrapes++;
+    metrics_client_close(client);
+}
+
+static void metrics_listener_handler(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    METRICS_T *m = (METRICS_T *)source->userdata;
+    unsigned int i;
+    int fd;
+
+    (void)events;
+    fd = accept(source->fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    for (i = 0; i < METRICS_CLIENTS; i++) {
+        METRICS_CLIENT_T *client = &m->client[i];
+        if (client->source.fd >= 0)
+            continue;
+        client->metrics = m;
+        client->length = 0;
+        if (event_loop_add_fd(loop, &client->source, fd, EPOLLIN, metrics_client_handler, client) == 0)
+            return;
+        client->source.fd = -1;
+        break;
+    }
+    close(fd); /* too many clients */
+}
+
+/** Serve on 127.0.0.1:<address> if it is a number, else on the unix socket
+ * <address> (replacing a stale socket file). Returns 0 on success. */
+static int metrics_serve(METRICS_T *m, EVENT_LOOP_T *loop, const char *address)
+{
+    struct sockaddr_un un;
+    struct sockaddr_in in;
+    struct sockaddr *addr;
+    socklen_t addr_length;
+    char *end;
+    long port = strtol(address, &end, 10);
+    int fd, one = 1;
+
+    m->loop = loop;
+    if (*address && !*end) {
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons(port);
+        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr = (struct sockaddr *)&in;
+        addr_length = sizeof(in);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    } else {
+        if (strlen(address) >= sizeof(m->path))
+            return -1;
+        strcpy(m->path, address);
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, address);
+        unlink(address);
+        addr = (struct sockaddr *)&un;
+        addr_length = sizeof(un);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    }
+    if (fd < 0)
+        return -1;
+    if (bind(fd, addr, addr_length) != 0 || listen(fd, METRICS_CLIENTS) != 0 ||
+        event_loop_add_fd(loop, &m->listener, fd, EPOLLIN, metrics_listener_handler, m) != 0) {
+        close(fd);
+        m->listener.fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/** Enable and serve the metrics if MMAL_METRICS is set. Returns 0 unless
+ * serving failed. */
+static int metrics_serve_from_env(METRICS_T *m, EVENT_LOOP_T *loop)
+{
+    const char *address = getenv("MMAL_METRICS");
+
+    if (!address || !*address)
+        return 0;
+    m->enabled = 1;
+    if (metrics_serve(m, loop, address) != 0) {
+        fprintf(stderr, "could not serve metrics on %s\n", address);
+        return -1;
+    }
+    fprintf(stderr, "metrics on %s\n", address);
+    return 0;
+}
+
+static void metrics_stop(METRICS_T *m)
+{
+    unsigned int i;
+    int fd = m->listener.fd;
+
+    for (i = 0; i < METRICS_CLIENTS; i++)
+        if (m->client[i].source.fd >= 0)
+            metrics_client_close(&m->client[i]);
+    if (fd >= 0) {
+        event_loop_remove(m->loop, &m->listener);
+        close(fd);
+        if (m->path[0])
+            unlink(m->path);
+    }
+    m->listener.fd = -1;
+}
+
+/* MMAL helpers */
+
+typedef struct METRICS_PORT_T {
+    int buffers, bytes;
+} METRICS_PORT_T;
+
+/** Buffers and payload bytes through one point of the pipeline, e.g. "decoder_in".
+ * Returns 0 on success. */
+static int metrics_register_port(METRICS_T *m, METRICS_PORT_T *port, const char *label)
+{
+    char name[METRICS_NAME];
+
+    snprintf(name, sizeof(name), "mmal_buffers_total{port=\"%s\"}", label);
+    port->buffers = metrics_register(m, name, METRICS_COUNTER, "Buffers passed through the port");
+    snprintf(name, sizeof(name), "mmal_bytes_total{port=\"%s\"}", label);
+    port->bytes = metrics_register(m, name, METRICS_COUNTER, "Payload bytes passed through the port");
+    return port->buffers >= 0 && port->bytes >= 0 ? 0 : -1;
+}
+
+static inline void metrics_port_buffer(METRICS_T *m, const METRICS_PORT_T *port, const MMAL_BUFFER_HEADER_T *buffer)
+{
+    metrics_inc(m, port->buffers);
+    metrics_add(m, port->bytes, buffer->length);
+}
+
+typedef struct METRICS_EVENTS_T {
+    int error, format_changed, eos, other;
+} METRICS_EVENTS_T;
+
+/** Events (buffers with cmd set) from a component. Returns 0 on success. */
+static int metrics_register_events(METRICS_T *m, METRICS_EVENTS_T *events, const char *component)
+{
+    static const char help[] = "Events sent by the component";
+    char name[METRICS_NAME];
+
+    snprintf(name, sizeof(name), "mmal_events_total{component=\"%s\",event=\"error\"}", component);
+    events->error = metrics_register(m, name, METRICS_COUNTER, help);
+    snprintf(name, sizeof(name), "mmal_events_total{component=\"%s\",event=\"format_changed\"}", component);
+    events->format_changed = metrics_register(m, name, METRICS_COUNTER, help);
+    snprintf(name, sizeof(name), "mmal_events_total{component=\"%s\",event=\"eos\"}", component);
+    events->eos = metrics_register(m, name, METRICS_COUNTER, help);
+    snprintf(name, sizeof(name), "mmal_events_total{component=\"%s\",event=\"other\"}", component);
+    events->other = metrics_register(m, name, METRICS_COUNTER, help);
+    return events->error >= 0 && events->format_changed >= 0 && events->eos >= 0 && events->other >= 0 ? 0 : -1;
+}
+
+static inline void metrics_event(METRICS_T *m, const METRICS_EVENTS_T *events, const MMAL_BUFFER_HEADER_T *buffer)
+{
+    switch (buffer->cmd) {
+    case MMAL_EVENT_ERROR:
+        metrics_inc(m, events->error);
+        break;
+    case MMAL_EVENT_FORMAT_CHANGED:
+        metrics_inc(m, events->format_changed);
+        break;
+    case MMAL_EVENT_EOS:
+        metrics_inc(m, events->eos);
+        break;
+    default:
+        metrics_inc(m, events->other);
+        break;
+    }
+}
+
+static int64_t metrics_pool_free(void *userdata)
+{
+    MMAL_POOL_T *pool = *(MMAL_POOL_T **)userdata;
+    return pool ? mmal_queue_length(pool->queue) : 0;
+}
+
+static int64_t metrics_pool_size(void *userdata)
+{
+    MMAL_POOL_T *pool = *(MMAL_POOL_T **)userdata;
+    return pool ? pool->headers_num : 0;
+}
+
+/** Free and total buffer headers of the pool *pool, sampled when scraped. The
+ * pool may be created later (0 until then). Returns 0 on success. */
+static int metrics_register_pool(METRICS_T *m, const char *label, MMAL_POOL_T **pool)
+{
+    char name[METRICS_NAME];
+
+    snprintf(name, sizeof(name), "mmal_pool_free_buffers{pool=\"%s\"}", label);
+    if (metrics_register_sampled(m, name, "Buffer headers waiting in the pool queue", metrics_pool_free, pool) < 0)
+        return -1;
+    snprintf(name, sizeof(name), "mmal_pool_buffers{pool=\"%s\"}", label);
+    if (metrics_register_sampled(m, name, "Buffer headers in the pool", metrics_pool_size, pool) < 0)
+        return -1;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,586 @@
+#ifndef MMAL_CORO_HPP
+#define MMAL_CORO_HPP
+
+/* C++20 coroutines over MMAL ports and pools.
+ *
+ * Instead of a CONTEXT_T, callbacks and a semaphore per pipeline, every stage
+ * is a coroutine which waits for buffers:
+ *
+ *     Buffer frame = co_await decoder_out.receive();
+ *     ...
+ *     co_await encoder_in.send(std::move(frame));
+ *
+ * Component, Port, Pool and Buffer are move-only RAII handles. All coroutines
+ * run on one thread in Executor::run(). The MMAL callbacks only put buffers
+ * into MMAL queues and kick the executor through an eventfd (event_loop.h);
+ * the executor then resumes the coroutines whose buffers have arrived.
+ *
+ * Coroutine frames come from a fixed pool (FramePool), so starting a task on
+ * the frame path does not touch the heap. MMAL errors are thrown as Error.
+ * Sends, callbacks, queue puts/gets and releases go through trace.h, with the
+ * ports, their queues and pools named after the MMAL port.
+ * Build with -std=gnu++2a -fcoroutines (gcc 10) or -std=c++20. */
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "bcm_host.h"
+#include "mmal.h"
+#include "mmal_port.h"
+#include "mmal_pool.h"
+#include "mmal_queue.h"
+#include "util/mmal_util.h"
+#include "interface/vcos/vcos.h"
+#include "event_loop.h"
+#include "trace.h"
+
+namespace mmal_coro {
+
+class Error : public std::runtime_error {
+public:
+    Error(MMAL_STATUS_T status, const char *what)
+        : std::runtime_error(std::string(what) + ": " + mmal_status_to_string(status)), status(status) {}
+    MMAL_STATUS_T status;
+};
+
+inline void check(MMAL_STATUS_T status, const char *what)
+{
+    if (status != MMAL_SUCCESS)
+        throw Error(status, what);
+}
+
+/** Fixed-size blocks for coroutine frames. Only used from the executor thread.
+ * Frames which do not fit fall back to the heap and are counted. */
+class FramePool {
+public:
+    static constexpr std::size_t block_size = 512;
+    static constexpr std::size_t block_count = 64;
+
+    static void *allocate(std::size_t size)
+    {
+        State &s = state();
+        if (size <= block_size && s.free_list) {
+            Block *block = s.free_list;
+            s.free_list = block->next;
+            s.in_use++;
+            return block;
+        }
+        s.heap_allocations++;
+        void *p = std::malloc(size);
+        if (!p)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    static void deallocate(void *p, std::size_t size)
+    {
+        State &s = state();
+        Block *block = static_cast<Block *>(p);
+        if (size <= block_size && block >= s.blocks && block < s.blocks + block_count) {
+            block->next = s.free_list;
+            s.free_list = block;
+            s.in_use--;
+        } else {
+            std::free(p);
+        }
+    }
+
+    static unsigned int heap_allocations() { return state().heap_allocations; }
+    static unsigned int in_use() { return state().in_use; }
+
+private:
+    union Block {
+        Block *next;
+        alignas(std::max_align_t) unsigned char data[block_size];
+    };
+    struct State {
+        Block blocks[block_count];
+        Block *free_list = nullptr;
+        unsigned int in_use = 0, heap_allocations = 0;
+        State()
+        {
+            for (std::size_t i = 0; i < block_count; i++) {
+                blocks[i].next = free_list;
+                free_list = &blocks[i];
+            }
+        }
+    };
+    static State &state()
+    {
+        static State s;
+        return s;
+    }
+};
+
+/** Coroutine returning nothing. Awaiting a Task runs it to completion (and
+ * rethrows its exception); top-level tasks are started with Executor::spawn. */
+class Task {
+public:
+    struct promise_type {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept
+        {
+            struct Final {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+                {
+                    std::coroutine_handle<> next = h.promise().continuation;
+                    return next ? next : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+            return Final{};
+        }
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+
+        static void *operator new(std::size_t size) { return FramePool::allocate(size); }
+        static void operator delete(void *p, std::size_t size) { FramePool::deallocate(p, size); }
+    };
+
+    Task() = default;
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task &operator=(Task &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() { reset(); }
+
+    bool done() const { return !handle || handle.done(); }
+
+    /** Rethrow the exception the task finished with, if any */
+    void rethrow() const
+    {
+        if (handle && handle.promise().error)
+            std::rethrow_exception(handle.promise().error);
+    }
+
+    bool await_ready() const noexcept { return done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    void await_resume() const { rethrow(); }
+
+private:
+    friend class Executor;
+    explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    void reset()
+    {
+        if (handle)
+            handle.destroy();
+        handle = nullptr;
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+/** Something a coroutine can wait for, checked by the executor after every wake-up */
+class Waitable {
+public:
+    virtual ~Waitable() {}
+    virtual bool ready() = 0;
+    std::coroutine_handle<> waiter;
+};
+
+/** Single threaded executor. MMAL callbacks call wake() from their threads. */
+class Executor {
+public:
+    static constexpr unsigned int max_tasks = 16;
+    static constexpr unsigned int max_waitables = 16;
+
+    Executor()
+    {
+        if (event_loop_create(&loop) != 0 ||
+            event_loop_add_notifier(&loop, &notifier, [](EVENT_LOOP_T *, EVENT_SOURCE_T *, uint32_t) {}, this) != 0)
+            throw std::runtime_error("could not create event loop");
+    }
+    ~Executor()
+    {
+        event_loop_remove(&loop, &notifier);
+        event_loop_destroy(&loop);
+    }
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    /** Destroy all tasks, releasing the buffers they hold. Call before the pools go away. */
+    void clear()
+    {
+        while (task_count)
+            tasks[--task_count] = Task();
+        started = 0;
+    }
+
+    /** Thread safe */
+    void wake() { event_loop_notify(&notifier); }
+
+    /** The loop, to add sockets or timers which are serviced on the executor thread */
+    EVENT_LOOP_T *event_loop() { return &loop; }
+
+    void spawn(Task &&task)
+    {
+        if (task_count == max_tasks)
+            throw std::runtime_error("too many tasks");
+        tasks[task_count++] = std::move(task);
+        wake();
+    }
+
+    void add(Waitable *w)
+    {
+        if (waitable_count == max_waitables)
+            throw std::runtime_error("too many waitables");
+        waitables[waitable_count++] = w;
+    }
+
+    void remove(Waitable *w)
+    {
+        for (unsigned int i = 0; i < waitable_count; i++) {
+            if (waitables[i] == w) {
+                waitables[i] = waitables[--waitable_count];
+                return;
+            }
+        }
+    }
+
+    /** Run until all spawned tasks have finished or stop() was called.
+     * Rethrows the first exception a task finished with. */
+    void run()
+    {
+        stopped = false;
+        while (!stopped) {
+            bool progress = true, running = false;
+
+            while (progress && !stopped) {
+                progress = false;
+                //tasks spawned by other tasks start here
+                while (started < task_count) {
+                    tasks[started++].handle.resume();
+                    progress = true;
+                }
+                for (unsigned int i = 0; i < waitable_count; i++) {
+                    Waitable *w = waitables[i];
+                    if (w->waiter && w->ready()) {
+                        resumes++;
+                        std::exchange(w->waiter, nullptr).resume();
+                        progress = true;
+                    }
+                }
+            }
+            for (unsigned int i = 0; i < task_count; i++) {
+                tasks[i].rethrow();
+                running |= !tasks[i].done();
+            }
+            if (!running)
+                break;
+            if (event_loop_run_once(&loop, -1) < 0)
+                throw std::runtime_error("event loop failed");
+        }
+    }
+
+    void stop() { stopped = true; }
+
+    unsigned int waits() const { return loop.waits; }
+    unsigned int notifications() const { return notifier.notified; }
+    unsigned int resumes = 0;
+
+private:
+    EVENT_LOOP_T loop;
+    EVENT_SOURCE_T notifier;
+    Task tasks[max_tasks];
+    unsigned int task_count = 0, started = 0;
+    Waitable *waitables[max_waitables];
+    unsigned int waitable_count = 0;
+    bool stopped = false;
+};
+
+/** An owned buffer header, released when the handle goes away */
+class Buffer {
+public:
+    Buffer() = default;
+    explicit Buffer(MMAL_BUFFER_HEADER_T *header) : header(header) {}
+    Buffer(Buffer &&other) noexcept : header(std::exchange(other.header, nullptr)) {}
+    Buffer &operator=(Buffer &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            header = std::exchange(other.header, nullptr);
+        }
+        return *this;
+    }
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+    ~Buffer() { reset(); }
+
+    MMAL_BUFFER_HEADER_T *get() const { return header; }
+    MMAL_BUFFER_HEADER_T *operator->() const { return header; }
+    explicit operator bool() const { return header != nullptr; }
+    MMAL_BUFFER_HEADER_T *release() { return std::exchange(header, nullptr); }
+    void reset()
+    {
+        if (header)
+            trace_buffer_header_release(header);
+        header = nullptr;
+    }
+
+private:
+    MMAL_BUFFER_HEADER_T *header = nullptr;
+};
+
+/** Awaiter resuming once a buffer can be taken from an MMAL queue */
+class QueueWaitable : public Waitable {
+public:
+    QueueWaitable(Executor &executor, MMAL_QUEUE_T *queue) : executor(executor), queue(queue) { executor.add(this); }
+    ~QueueWaitable() { executor.remove(this); }
+    bool ready() override { return mmal_queue_length(queue) > 0; }
+
+    struct Awaiter {
+        QueueWaitable &w;
+        MMAL_BUFFER_HEADER_T *header;
+
+        bool await_ready() { return (header = trace_queue_get(w.queue)) != nullptr; }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            if (w.waiter)
+                throw std::logic_error("only one coroutine may wait for a queue");
+            w.waiter = h;
+        }
+        Buffer await_resume()
+        {
+            if (!header)
+                header = trace_queue_get(w.queue);
+            return Buffer(header);
+        }
+    };
+    Awaiter get() { return Awaiter{*this, nullptr}; }
+
+    Executor &executor;
+    MMAL_QUEUE_T *queue;
+};
+
+class Component {
+public:
+    Component() = default;
+    explicit Component(const char *name) { check(mmal_component_create(name, &component), name); }
+    Component(Component &&other) noexcept : component(std::exchange(other.component, nullptr)) {}
+    Component &operator=(Component &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            component = std::exchange(other.component, nullptr);
+        }
+        return *this;
+    }
+    Component(const Component &) = delete;
+    Component &operator=(const Component &) = delete;
+    ~Component() { reset(); }
+
+    MMAL_COMPONENT_T *get() const { return component; }
+    MMAL_COMPONENT_T *operator->() const { return component; }
+    MMAL_PORT_T *input(unsigned int i = 0) const { return component->input[i]; }
+    MMAL_PORT_T *output(unsigned int i = 0) const { return component->output[i]; }
+
+private:
+    void reset()
+    {
+        if (component)
+            mmal_component_destroy(component);
+        component = nullptr;
+    }
+
+    MMAL_COMPONENT_T *component = nullptr;
+};
+
+/** A port of a component, with the callback plumbing. Buffers and events the
+ * port returns are either queued for receive() or, for ports which only give
+ * back buffers we sent them (decoder/encoder input), released to their pool. */
+class Port {
+public:
+    enum Mode { RECEIVE, RELEASE };
+
+    Port() = default;
+    Port(Executor &executor, MMAL_PORT_T *port) : state(new State(executor, port)) {}
+    Port(Port &&other) noexcept : state(std::exchange(other.state, nullptr)) {}
+    Port &operator=(Port &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            state = std::exchange(other.state, nullptr);
+        }
+        return *this;
+    }
+    Port(const Port &) = delete;
+    Port &operator=(const Port &) = delete;
+    ~Port() { reset(); }
+
+    MMAL_PORT_T *get() const { return state->port; }
+    MMAL_PORT_T *operator->() const { return state->port; }
+
+    void enable(Mode mode)
+    {
+        state->mode = mode;
+        state->port->userdata = reinterpret_cast<MMAL_PORT_USERDATA_T *>(state);
+        check(mmal_port_enable(state->port, &State::callback), state->port->name);
+    }
+
+    void disable()
+    {
+        if (state->port->is_enabled)
+            check(mmal_port_disable(state->port), state->port->name);
+    }
+
+    /** co_await port.receive() -> Buffer (a buffer or an event) */
+    QueueWaitable::Awaiter receive() { return state->received.get(); }
+
+    /** co_await port.send(std::move(buffer)). Sending never blocks, the
+     * buffer comes back through receive() or to its pool. */
+    struct SendAwaiter {
+        MMAL_PORT_T *port;
+        Buffer buffer;
+        bool await_ready() const noexcept { return true; }
+        void await_suspend(std::coroutine_handle<>) noexcept {}
+        void await_resume()
+        {
+            MMAL_BUFFER_HEADER_T *header = buffer.get();
+            check(trace_port_send_buffer(port, header), port->name);
+            buffer.release();
+        }
+    };
+    SendAwaiter send(Buffer &&buffer) { return SendAwaiter{state->port, std::move(buffer)}; }
+
+private:
+    struct State {
+        State(Executor &executor, MMAL_PORT_T *port)
+            : executor(executor), port(port), queue(mmal_queue_create()), received(executor, queue)
+        {
+            if (!queue)
+                throw Error(MMAL_ENOMEM, "mmal_queue_create");
+            trace_name(port, port->name);
+            trace_name(queue, (std::string(port->name) + " received").c_str());
+        }
+        ~State()
+        {
+            MMAL_BUFFER_HEADER_T *header;
+            if (port->is_enabled)
+                mmal_port_disable(port);
+            while ((header = mmal_queue_get(queue)) != nullptr)
+                mmal_buffer_header_release(header);
+            mmal_queue_destroy(queue);
+        }
+
+        /** runs on an MMAL thread */
+        static void callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *header)
+        {
+            State *s = reinterpret_cast<State *>(port->userdata);
+            trace_callback(port, header);
+            if (s->mode == RELEASE && !header->cmd) {
+                trace_buffer_header_release(header);
+                return; /* the pool callback wakes the executor */
+            }
+            trace_queue_put(s->queue, header);
+            s->executor.wake();
+        }
+
+        Executor &executor;
+        MMAL_PORT_T *port;
+        MMAL_QUEUE_T *queue;
+        QueueWaitable received;
+        Mode mode = RECEIVE;
+    };
+
+    void reset()
+    {
+        delete state;
+        state = nullptr;
+    }
+
+    State *state = nullptr;
+};
+
+/** Buffer pool of a port. co_await pool.acquire() waits for a free buffer. */
+class Pool {
+public:
+    Pool() = default;
+    Pool(Executor &executor, MMAL_PORT_T *port, unsigned int num, unsigned int size)
+        : state(new State(executor, port, num, size)) {}
+    Pool(Pool &&other) noexcept : state(std::exchange(other.state, nullptr)) {}
+    Pool &operator=(Pool &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            state = std::exchange(other.state, nullptr);
+        }
+        return *this;
+    }
+    Pool(const Pool &) = delete;
+    Pool &operator=(const Pool &) = delete;
+    ~Pool() { reset(); }
+
+    MMAL_POOL_T *get() const { return state->pool; }
+    explicit operator bool() const { return state != nullptr; }
+
+    QueueWaitable::Awaiter acquire() { return state->free.get(); }
+
+    /** All buffers are back */
+    bool idle() const { return mmal_queue_length(state->pool->queue) == state->pool->headers_num; }
+
+private:
+    struct State {
+        State(Executor &executor, MMAL_PORT_T *port, unsigned int num, unsigned int size)
+            : executor(executor), port(port), pool(create(port, num, size)), free(executor, pool->queue)
+        {
+            mmal_pool_callback_set(pool, &State::callback, this);
+            trace_name(pool->queue, (std::string(port->name) + " pool").c_str());
+        }
+        ~State() { mmal_port_pool_destroy(port, pool); }
+
+        static MMAL_POOL_T *create(MMAL_PORT_T *port, unsigned int num, unsigned int size)
+        {
+            MMAL_POOL_T *pool = mmal_port_pool_create(port, num, size);
+            if (!pool)
+                throw Error(MMAL_ENOMEM, "mmal_port_pool_create");
+            return pool;
+        }
+
+        /** runs on an MMAL thread whenever a buffer is released */
+        static MMAL_BOOL_T callback(MMAL_POOL_T *, MMAL_BUFFER_HEADER_T *, void *userdata)
+        {
+            static_cast<State *>(userdata)->executor.wake();
+            return MMAL_TRUE; /* put it back into the pool queue */
+        }
+
+        Executor &executor;
+        MMAL_PORT_T *port;
+        MMAL_POOL_T *pool;
+        QueueWaitable free;
+    };
+
+    void reset()
+    {
+        delete state;
+        state = nullptr;
+    }
+
+    State *state = nullptr;
+};
+
+} // namespace mmal_coro
+
+#endif
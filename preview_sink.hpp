@@ -0,0 +1,171 @@
+#ifndef PREVIEW_SINK_HPP
+#define PREVIEW_SINK_HPP
+
+/* Preview of decoded frames in a Qt window, without ever stalling the pipeline.
+ *
+ * PreviewSink::submit() is called on the pipeline thread. It downscales the
+ * frame into the back slot of a FRAME_MAILBOX_T (frame_mailbox.h) and posts
+ * it; nothing on this path waits for the UI. The MMAL buffer itself is not
+ * kept, it goes on to the encoder right away.
+ *
+ * PreviewWindow runs on the Qt thread. It takes the latest frame from the
+ * mailbox on a timer and wraps it in a QImage without copying: grey previews
+ * use the luma plane of the mailbox slot as a Format_Grayscale8 image,
+ * colour previews are converted to RGB24 (colour_convert.h) into a buffer the
+ * image wraps. Frames the UI was too slow for are dropped in the mailbox.
+ *
+ * Runs with the offscreen platform (QT_QPA_PLATFORM=offscreen or -platform
+ * offscreen) on machines without a display or GPU; snapshot() saves what
+ * the window currently shows. Needs Qt 5.5 (Format_Grayscale8). No moc needed. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <QGuiApplication>
+#include <QImage>
+#include <QPainter>
+#include <QRasterWindow>
+#include <QTimerEvent>
+#include "frame.h"
+#include "frame_mailbox.h"
+#include "scale.h"
+#include "colour_convert.h"
+
+/** Pipeline side */
+class PreviewSink {
+public:
+    /** width of the preview, the height follows from the frames */
+    explicit PreviewSink(unsigned int width) : width(width) {}
+    ~PreviewSink()
+    {
+        frame_mailbox_destroy(&mailbox);
+        free(acc);
+    }
+    PreviewSink(const PreviewSink &) = delete;
+    PreviewSink &operator=(const PreviewSink &) = delete;
+
+    /** Call once the size of the decoded frames is known, before the first submit().
+     * Returns 0 on success. */
+    int configure(unsigned int src_width, unsigned int src_height)
+    {
+        unsigned int w = (width < src_width ? width : src_width) & ~1u;
+        unsigned int h = ((unsigned long)src_height * w / src_width) & ~1u;
+
+        if (w < 2 || h < 2 || frame_mailbox_create(&mailbox, w, h) != 0)
+            return -1;
+        acc = (uint16_t *)malloc(src_width * sizeof(*acc));
+        if (!acc)
+            return -1;
+        __atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    /** Pipeline thread. Never blocks. */
+    void submit(const FRAME_T *frame, int64_t pts)
+    {
+        uint64_t start = vcos_getmicrosecs64(), us;
+
+        if (!ready || scale_frame_i420(frame, frame_mailbox_back(&mailbox), acc) != 0)
+            return;
+        frame_mailbox_post(&mailbox, pts);
+        us = vcos_getmicrosecs64() - start;
+        submit_us += us;
+        if (us > submit_max_us)
+            submit_max_us = us;
+    }
+
+    /** Call after both sides have stopped */
+    void print_statistics(FILE *file) const
+    {
+        if (!mailbox.posted)
+            return;
+        fprintf(file, "preview: %u frames posted, %u shown, %u dropped, %.3f ms/frame (max %.3f ms) on the pipeline thread",
+                mailbox.posted, mailbox.taken, mailbox.dropped, submit_us / 1000.0 / mailbox.posted,
+                submit_max_us / 1000.0);
+        if (shown)
+            fprintf(file, ", %.1f ms (max %.1f ms) from post to the window", latency_us / 1000.0 / shown,
+                    latency_max_us / 1000.0);
+        fprintf(file, "\n");
+    }
+
+private:
+    friend class PreviewWindow;
+
+    unsigned int width;
+    int ready = 0;                  /* set by configure(), read by the UI */
+    FRAME_MAILBOX_T mailbox = {};
+    uint16_t *acc = nullptr;
+    uint64_t submit_us = 0, submit_max_us = 0;
+
+    /* UI thread */
+    unsigned int shown = 0;
+    uint64_t latency_us = 0, latency_max_us = 0;
+};
+
+/** UI side, create and use on the Qt thread */
+class PreviewWindow : public QRasterWindow {
+public:
+    PreviewWindow(PreviewSink &sink, bool colour, int interval_ms = 10) : sink(sink), colour(colour)
+    {
+        colour_coeffs_init(&coeffs, COLOUR_MATRIX_BT601, COLOUR_RANGE_LIMITED);
+        setTitle("preview");
+        startTimer(interval_ms, Qt::PreciseTimer);
+    }
+    ~PreviewWindow() { free(rgb); }
+
+    /** Save the frame shown last. Returns false if there is none or saving failed. */
+    bool snapshot(const QString &path) const { return !image.isNull() && image.save(path); }
+
+protected:
+    void timerEvent(QTimerEvent *) override
+    {
+        uint64_t posted_us, latency;
+        int64_t pts;
+        const FRAME_T *frame;
+
+        if (!__atomic_load_n(&sink.ready, __ATOMIC_ACQUIRE))
+            return;
+        frame = frame_mailbox_take(&sink.mailbox, &pts, &posted_us);
+        if (!frame)
+            return;
+
+        if (!colour) {
+            image = QImage(frame->plane[0], frame->width, frame->height, frame->pitch[0], QImage::Format_Grayscale8);
+        } else {
+            FRAME_T dst;
+            COLOUR_JOB_T job = { COLOUR_I420_TO_RGB24, frame, &dst, &coeffs };
+            if (!rgb)
+                rgb = (uint8_t *)malloc(frame->width * frame->height * 3);
+            if (!rgb)
+                return;
+            frame_init_packed(&dst, rgb, frame->width * 3, frame->width, frame->height);
+            colour_convert(&job);
+            image = QImage(rgb, frame->width, frame->height, frame->width * 3, QImage::Format_RGB888);
+        }
+        if (width() < 16)
+            resize(frame->width, frame->height);
+        update();
+
+        latency = vcos_getmicrosecs64() - posted_us;
+        sink.shown++;
+        sink.latency_us += latency;
+        if (latency > sink.latency_max_us)
+            sink.latency_max_us = latency;
+    }
+
+    void paintEvent(QPaintEvent *) override
+    {
+        QPainter painter(this);
+        if (!image.isNull())
+            painter.drawImage(QRect(0, 0, width(), height()), image);
+    }
+
+private:
+    PreviewSink &sink;
+    bool colour;
+    COLOUR_COEFFS_T coeffs;
+    uint8_t *rgb = nullptr;
+    QImage image;   /* wraps the mailbox slot or rgb, no copy */
+};
+
+#endif
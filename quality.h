@@ -0,0 +1,546 @@
+#ifndef QUALITY_H
+#define QUALITY_H
+
+/* PSNR and SSIM of a decoded frame against its reference, per plane (Y, U, V)
+ * and combined, for comparing encoder settings.
+ *
+ * PSNR comes from the sum of squared errors of each plane. SSIM is computed the
+ * way x264 and ffmpeg do it: sums of a, b, a*a + b*b and a*b over 4x4 blocks,
+ * then the SSIM of every 8x8 window made of 2x2 neighbouring blocks, so windows
+ * overlap by 4 pixels and each pixel is read once. Both sums run 8 or 16 pixels
+ * at a time with NEON or SSE2, scalar otherwise; everything is exact integer
+ * arithmetic up to the per window SSIM, so the vector and reference code give
+ * identical results (see the quality benchmark). The combined PSNR is over the
+ * squared errors of all planes, the combined SSIM weights the planes by their
+ * size ((4 Y + U + V) / 6 for 4:2:0).
+ *
+ * Every plane can be split into bands of rows computed on their own.
+ * QUALITY_WORKERS_T uses this to spread a frame across threads.
+ * QUALITY_LOG_T writes per frame results as CSV or JSON and keeps the totals. */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "interface/vcos/vcos.h"
+#include "frame.h"
+#include "thread_roles.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define QUALITY_PSNR_MAX 100.0      /* for identical planes */
+
+/** Results of one frame (or the average of several), index 0-2 the planes, 3 combined */
+typedef struct QUALITY_T {
+    double psnr[4], ssim[4];
+} QUALITY_T;
+
+/** What one band adds up, per plane */
+typedef struct QUALITY_ACC_T {
+    uint64_t sse[3], samples[3];
+    double ssim[3];
+    uint64_t windows[3];
+} QUALITY_ACC_T;
+
+static double quality_psnr(uint64_t sse, uint64_t samples)
+{
+    double psnr;
+
+    if (!samples)
+        return 0;
+    if (!sse)
+        return QUALITY_PSNR_MAX;
+    psnr = 10.0 * log10(255.0 * 255.0 * samples / sse);
+    return psnr < QUALITY_PSNR_MAX ? psnr : QUALITY_PSNR_MAX;
+}
+
+/** SSIM in dB, which spreads out the values close to 1 */
+static double quality_ssim_db(double ssim)
+{
+    return ssim < 1.0 ? -10.0 * log10(1.0 - ssim) : QUALITY_PSNR_MAX;
+}
+
+static void quality_result(const QUALITY_ACC_T *acc, QUALITY_T *q)
+{
+    uint64_t sse = 0, samples = 0;
+    double ssim = 0;
+    unsigned int p;
+
+    for (p = 0; p < 3; p++) {
+        q->psnr[p] = quality_psnr(acc->sse[p], acc->samples[p]);
+        q->ssim[p] = acc->windows[p] ? acc->ssim[p] / acc->windows[p] : 1.0;
+        sse += acc->sse[p];
+        samples += acc->samples[p];
+        ssim += q->ssim[p] * acc->samples[p];
+    }
+    q->psnr[3] = quality_psnr(sse, samples);
+    q->ssim[3] = samples ? ssim / samples : 1.0;
+}
+
+/* ---- row kernels ---- */
+
+static uint64_t quality_sse_row_ref(const uint8_t *a, const uint8_t *b, unsigned int from, unsigned int n)
+{
+    uint64_t sum = 0;
+    unsigned int i;
+
+    for (i = from; i < n; i++) {
+        int d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+/** Sum of squared differences of n bytes */
+static uint64_t quality_sse_row(const uint8_t *a, const uint8_t *b, unsigned int n)
+{
+    uint64_t sum = 0;
+    unsigned int i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    /* a row of up to 16384 pixels fits the 32 bit lanes */
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t d = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        acc = vpadalq_u16(acc, vmull_u8(vget_low_u8(d), vget_low_u8(d)));
+        acc = vpadalq_u16(acc, vmull_u8(vget_high_u8(d), vget_high_u8(d)));
+    }
+    sum = (uint64_t)vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) + vgetq_lane_u32(acc, 2) +
+          vgetq_lane_u32(acc, 3);
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+    uint32_t lanes[4];
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i d = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+        __m128i lo = _mm_unpacklo_epi8(d, zero), hi = _mm_unpackhi_epi8(d, zero);
+        acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+    }
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    sum = (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    return sum + quality_sse_row_ref(a, b, i, n);
+}
+
+static void quality_block_sums_ref(const uint8_t *a, unsigned int pitch_a, const uint8_t *b,
+                                   unsigned int pitch_b, unsigned int from, unsigned int blocks, int32_t *sums)
+{
+    unsigned int k, x, y;
+
+    for (k = from; k < blocks; k++) {
+        int32_t s1 = 0, s2 = 0, ss = 0, s12 = 0;
+        for (y = 0; y < 4; y++) {
+            for (x = 0; x < 4; x++) {
+                int pa = a[y * pitch_a + k * 4 + x], pb = b[y * pitch_b + k * 4 + x];
+                s1 += pa;
+                s2 += pb;
+                ss += pa * pa + pb * pb;
+                s12 += pa * pb;
+            }
+        }
+        sums[k * 4 + 0] = s1;
+        sums[k * 4 + 1] = s2;
+        sums[k * 4 + 2] = ss;
+        sums[k * 4 + 3] = s12;
+    }
+}
+
+/** s1, s2, ss, s12 of each 4x4 block along 4 rows, two blocks per step */
+static void quality_block_sums(const uint8_t *a, unsigned int pitch_a, const uint8_t *b, unsigned int pitch_b,
+                               unsigned int blocks, int32_t *sums)
+{
+    unsigned int k = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; k + 2 <= blocks; k += 2) {
+        uint16x8_t s1 = vdupq_n_u16(0), s2 = vdupq_n_u16(0);
+        uint32x4_t ss = vdupq_n_u32(0), s12 = vdupq_n_u32(0);
+        uint32x2_t r1, r2, rss, r12;
+        unsigned int y;
+        for (y = 0; y < 4; y++) {
+            uint8x8_t x = vld1_u8(a + y * pitch_a + k * 4), z = vld1_u8(b + y * pitch_b + k * 4);
+            s1 = vaddw_u8(s1, x);
+            s2 = vaddw_u8(s2, z);
+            ss = vpadalq_u16(ss, vmull_u8(x, x));
+            ss = vpadalq_u16(ss, vmull_u8(z, z));
+            s12 = vpadalq_u16(s12, vmull_u8(x, z));
+        }
+        /* lanes 0-1 belong to the first block, 2-3 to the second */
+        r1 = vpadd_u32(vget_low_u32(vpaddlq_u16(s1)), vget_high_u32(vpaddlq_u16(s1)));
+        r2 = vpadd_u32(vget_low_u32(vpaddlq_u16(s2)), vget_high_u32(vpaddlq_u16(s2)));
+        rss = vpadd_u32(vget_low_u32(ss), vget_high_u32(ss));
+        r12 = vpadd_u32(vget_low_u32(s12), vget_high_u32(s12));
+        sums[k * 4 + 0] = vget_lane_u32(r1, 0);
+        sums[k * 4 + 1] = vget_lane_u32(r2, 0);
+        sums[k * 4 + 2] = vget_lane_u32(rss, 0);
+        sums[k * 4 + 3] = vget_lane_u32(r12, 0);
+        sums[k * 4 + 4] = vget_lane_u32(r1, 1);
+        sums[k * 4 + 5] = vget_lane_u32(r2, 1);
+        sums[k * 4 + 6] = vget_lane_u32(rss, 1);
+        sums[k * 4 + 7] = vget_lane_u32(r12, 1);
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1);
+    for (; k + 2 <= blocks; k += 2) {
+        __m128i s1 = zero, s2 = zero, ss = zero, s12 = zero;
+        int32_t lanes[4][4];
+        unsigned int y, i;
+        for (y = 0; y < 4; y++) {
+            __m128i x = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(a + y * pitch_a + k * 4)), zero);
+            __m128i z = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(b + y * pitch_b + k * 4)), zero);
+            s1 = _mm_add_epi16(s1, x);
+            s2 = _mm_add_epi16(s2, z);
+            ss = _mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(x, x), _mm_madd_epi16(z, z)));
+            s12 = _mm_add_epi32(s12, _mm_madd_epi16(x, z));
+        }
+        /* every 32 bit lane holds two columns, lanes 0-1 are the first block */
+        _mm_storeu_si128((__m128i *)lanes[0], _mm_madd_epi16(s1, ones));
+        _mm_storeu_si128((__m128i *)lanes[1], _mm_madd_epi16(s2, ones));
+        _mm_storeu_si128((__m128i *)lanes[2], ss);
+        _mm_storeu_si128((__m128i *)lanes[3], s12);
+        for (i = 0; i < 4; i++) {
+            sums[k * 4 + i] = lanes[i][0] + lanes[i][1];
+            sums[k * 4 + 4 + i] = lanes[i][2] + lanes[i][3];
+        }
+    }
+#endif
+    quality_block_sums_ref(a, pitch_a, b, pitch_b, k, blocks, sums);
+}
+
+/** SSIM of an 8x8 window from the sums of its four blocks */
+static double quality_ssim_window(int64_t s1, int64_t s2, int64_t ss, int64_t s12)
+{
+    /* the constants scaled by 64 pixels, and 64 * 63 for the variances */
+    const double c1 = 0.01 * 0.01 * 255 * 255 * 64, c2 = 0.03 * 0.03 * 255 * 255 * 64 * 63;
+    int64_t vars = ss * 64 - s1 * s1 - s2 * s2, covar = s12 * 64 - s1 * s2;
+
+    return (2.0 * s1 * s2 + c1) * (2.0 * covar + c2) / ((double)(s1 * s1 + s2 * s2 + c1) * (vars + c2));
+}
+
+/** Sum of the SSIM of the windows between two rows of block sums */
+static double quality_ssim_row(const int32_t *top, const int32_t *bottom, unsigned int blocks)
+{
+    double sum = 0;
+    unsigned int k;
+
+    for (k = 0; k + 1 < blocks; k++) {
+        const int32_t *t = top + k * 4, *b = bottom + k * 4;
+        sum += quality_ssim_window((int64_t)t[0] + t[4] + b[0] + b[4], (int64_t)t[1] + t[5] + b[1] + b[5],
+                                   (int64_t)t[2] + t[6] + b[2] + b[6], (int64_t)t[3] + t[7] + b[3] + b[7]);
+    }
+    return sum;
+}
+
+/* ---- bands ---- */
+
+/** Adds band of bands of every plane of dist against ref to acc. sums needs
+ * room for 8 ints per block of a luma row (2 rows of block sums). */
+static void quality_band_impl(const FRAME_T *ref, const FRAME_T *dist, unsigned int band, unsigned int bands,
+                              int32_t *sums, QUALITY_ACC_T *acc, int simd)
+{
+    unsigned int p;
+
+    for (p = 0; p < 3; p++) {
+        unsigned int width = p ? (ref->width + 1) / 2 : ref->width;
+        unsigned int height = p ? (ref->height + 1) / 2 : ref->height;
+        unsigned int pa = ref->pitch[p], pb = dist->pitch[p];
+        const uint8_t *a = ref->plane[p], *b = dist->plane[p];
+        unsigned int blocks = width / 4, window_rows = height / 4 ? height / 4 - 1 : 0;
+        unsigned int first = height * band / bands, last = height * (band + 1) / bands, y;
+        int32_t *top = sums, *bottom = sums + blocks * 4;
+
+        for (y = first; y < last; y++)
+            acc->sse[p] += simd ? quality_sse_row(a + (size_t)y * pa, b + (size_t)y * pb, width) :
+                                  quality_sse_row_ref(a + (size_t)y * pa, b + (size_t)y * pb, 0, width);
+        acc->samples[p] += (uint64_t)(last - first) * width;
+
+        if (blocks < 2)
+            continue;
+        /* window row y covers block rows y and y + 1 */
+        first = window_rows * band / bands;
+        last = window_rows * (band + 1) / bands;
+        for (y = first; y < last; y++) {
+            int32_t *swap;
+            if (y == first) {
+                if (simd)
+                    quality_block_sums(a + (size_t)y * 4 * pa, pa, b + (size_t)y * 4 * pb, pb, blocks, bottom);
+                else
+                    quality_block_sums_ref(a + (size_t)y * 4 * pa, pa, b + (size_t)y * 4 * pb, pb, 0, blocks, bottom);
+            }
+            swap = top;
+            top = bottom;
+            bottom = swap;
+            if (simd)
+                quality_block_sums(a + (size_t)(y + 1) * 4 * pa, pa, b + (size_t)(y + 1) * 4 * pb, pb, blocks, bottom);
+            else
+                quality_block_sums_ref(a + (size_t)(y + 1) * 4 * pa, pa, b + (size_t)(y + 1) * 4 * pb, pb, 0,
+                                       blocks, bottom);
+            acc->ssim[p] += quality_ssim_row(top, bottom, blocks);
+            acc->windows[p] += blocks - 1;
+        }
+    }
+}
+
+/** Both frames must be I420 of the same visible size */
+static int quality_frame_impl(const FRAME_T *ref, const FRAME_T *dist, QUALITY_T *q, int simd)
+{
+    QUALITY_ACC_T acc;
+    int32_t *sums;
+
+    if (ref->width != dist->width || ref->height != dist->height ||
+        !(sums = (int32_t *)malloc((ref->width / 4 + 1) * 8 * sizeof(int32_t))))
+        return -1;
+    memset(&acc, 0, sizeof(acc));
+    quality_band_impl(ref, dist, 0, 1, sums, &acc, simd);
+    quality_result(&acc, q);
+    free(sums);
+    return 0;
+}
+
+static int quality_frame(const FRAME_T *ref, const FRAME_T *dist, QUALITY_T *q)
+{
+    return quality_frame_impl(ref, dist, q, 1);
+}
+
+static int quality_frame_ref(const FRAME_T *ref, const FRAME_T *dist, QUALITY_T *q)
+{
+    return quality_frame_impl(ref, dist, q, 0);
+}
+
+/* ---- multithreaded band split ---- */
+
+#define QUALITY_MAX_WORKERS 8
+
+struct QUALITY_WORKERS_T;
+
+typedef struct QUALITY_WORKER_T {
+    struct QUALITY_WORKERS_T *pool;
+    unsigned int index;
+    VCOS_THREAD_T thread;
+    VCOS_SEMAPHORE_T start;
+    int32_t *sums;
+    unsigned int sums_width;    /* luma width sums has room for */
+    QUALITY_ACC_T acc;
+} QUALITY_WORKER_T;
+
+/** A set of persistent threads which each measure one band of rows of every
+ * plane. The calling thread does the last band itself (worker[count]). */
+typedef struct QUALITY_WORKERS_T {
+    unsigned int count;
+    QUALITY_WORKER_T worker[QUALITY_MAX_WORKERS + 1];
+    VCOS_SEMAPHORE_T done;
+    const FRAME_T *ref, *dist;
+    int quit;
+} QUALITY_WORKERS_T;
+
+static void quality_worker_band(QUALITY_WORKER_T *w)
+{
+    memset(&w->acc, 0, sizeof(w->acc));
+    quality_band_impl(w->pool->ref, w->pool->dist, w->index, w->pool->count + 1, w->sums, &w->acc, 1);
+}
+
+static void *quality_worker_thread(void *arg)
+{
+    QUALITY_WORKER_T *w = (QUALITY_WORKER_T *)arg;
+
+    thread_role_enter(THREAD_ROLE_WORKER, "quality worker");
+    for (;;) {
+        vcos_semaphore_wait(&w->start);
+        if (w->pool->quit)
+            break;
+        quality_worker_band(w);
+        vcos_semaphore_post(&w->pool->done);
+    }
+    thread_role_leave();
+    return NULL;
+}
+
+/** Start threads-1 helper threads (the caller is the last one). Returns 0 on success. */
+static int quality_workers_create(QUALITY_WORKERS_T *pool, unsigned int threads)
+{
+    unsigned int i;
+
+    memset(pool, 0, sizeof(*pool));
+    if (threads < 1)
+        threads = 1;
+    if (threads > QUALITY_MAX_WORKERS + 1)
+        threads = QUALITY_MAX_WORKERS + 1;
+    if (vcos_semaphore_create(&pool->done, "quality done", 0) != VCOS_SUCCESS)
+        return -1;
+
+    for (i = 0; i < threads - 1; i++) {
+        QUALITY_WORKER_T *w = &pool->worker[i];
+        w->pool = pool;
+        w->index = i;
+        if (vcos_semaphore_create(&w->start, "quality start", 0) != VCOS_SUCCESS)
+            return -1;
+        if (vcos_thread_create(&w->thread, "quality worker", NULL, quality_worker_thread, w) != VCOS_SUCCESS) {
+            vcos_semaphore_delete(&w->start);
+            return -1;
+        }
+        pool->count++;
+    }
+    pool->worker[pool->count].pool = pool;
+    pool->worker[pool->count].index = pool->count;
+    return 0;
+}
+
+/** Measure a whole frame, split into bands across all threads. Returns 0 on success. */
+static int quality_workers_run(QUALITY_WORKERS_T *pool, const FRAME_T *ref, const FRAME_T *dist, QUALITY_T *q)
+{
+    QUALITY_ACC_T acc;
+    unsigned int i, p;
+
+    if (ref->width != dist->width || ref->height != dist->height)
+        return -1;
+    for (i = 0; i <= pool->count; i++) {
+        QUALITY_WORKER_T *w = &pool->worker[i];
+        if (w->sums_width < ref->width) {
+            int32_t *sums = (int32_t *)realloc(w->sums, (ref->width / 4 + 1) * 8 * sizeof(int32_t));
+            if (!sums)
+                return -1;
+            w->sums = sums;
+            w->sums_width = ref->width;
+        }
+    }
+
+    pool->ref = ref;
+    pool->dist = dist;
+    for (i = 0; i < pool->count; i++)
+        vcos_semaphore_post(&pool->worker[i].start);
+    quality_worker_band(&pool->worker[pool->count]);
+    for (i = 0; i < pool->count; i++)
+        vcos_semaphore_wait(&pool->done);
+
+    memset(&acc, 0, sizeof(acc));
+    for (i = 0; i <= pool->count; i++) {
+        for (p = 0; p < 3; p++) {
+            acc.sse[p] += pool->worker[i].acc.sse[p];
+            acc.samples[p] += pool->worker[i].acc.samples[p];
+            acc.ssim[p] += pool->worker[i].acc.ssim[p];
+            acc.windows[p] += pool->worker[i].acc.windows[p];
+        }
+    }
+    quality_result(&acc, q);
+    return 0;
+}
+
+static void quality_workers_destroy(QUALITY_WORKERS_T *pool)
+{
+    unsigned int i;
+
+    pool->quit = 1;
+    for (i = 0; i < pool->count; i++) {
+        vcos_semaphore_post(&pool->worker[i].start);
+        vcos_thread_join(&pool->worker[i].thread, NULL);
+        vcos_semaphore_delete(&pool->worker[i].start);
+    }
+    for (i = 0; i <= pool->count; i++)
+        free(pool->worker[i].sums);
+    vcos_semaphore_delete(&pool->done);
+    pool->count = 0;
+}
+
+/* ---- results ---- */
+
+/** Per frame results as CSV (one line per frame) or JSON (an array of frames
+ * and a summary), and the totals over all frames */
+typedef struct QUALITY_LOG_T {
+    FILE *file;                 /* NULL to only keep the totals */
+    int json;
+    unsigned int frames;
+    double psnr[4], ssim[4];    /* sums of the per frame values */
+    double min_psnr, min_ssim;
+    unsigned int min_psnr_frame, min_ssim_frame;
+} QUALITY_LOG_T;
+
+/** Writes to path, JSON when it ends in .json, else CSV. "-" is stdout, NULL nothing. */
+static int quality_log_open(QUALITY_LOG_T *log, const char *path)
+{
+    const char *dot = path ? strrchr(path, '.') : NULL;
+
+    memset(log, 0, sizeof(*log));
+    log->min_psnr = log->min_ssim = INFINITY;
+    if (!path)
+        return 0;
+    log->json = dot && !strcmp(dot, ".json");
+    if (!(log->file = strcmp(path, "-") ? fopen(path, "w") : stdout))
+        return -1;
+    if (log->json)
+        fprintf(log->file, "{\n  \"frames\": [\n");
+    else
+        fprintf(log->file, "frame,psnr_y,psnr_u,psnr_v,psnr,ssim_y,ssim_u,ssim_v,ssim\n");
+    return 0;
+}
+
+static void quality_log_frame(QUALITY_LOG_T *log, const QUALITY_T *q)
+{
+    unsigned int i;
+
+    for (i = 0; i < 4; i++) {
+        log->psnr[i] += q->psnr[i];
+        log->ssim[i] += q->ssim[i];
+    }
+    if (q->psnr[3] < log->min_psnr) {
+        log->min_psnr = q->psnr[3];
+        log->min_psnr_frame = log->frames;
+    }
+    if (q->ssim[3] < log->min_ssim) {
+        log->min_ssim = q->ssim[3];
+        log->min_ssim_frame = log->frames;
+    }
+
+    if (log->file && log->json)
+        fprintf(log->file, "%s    { \"frame\": %u, \"psnr\": [%.4f, %.4f, %.4f, %.4f], "
+                "\"ssim\": [%.6f, %.6f, %.6f, %.6f] }", log->frames ? ",\n" : "", log->frames,
+                q->psnr[0], q->psnr[1], q->psnr[2], q->psnr[3], q->ssim[0], q->ssim[1], q->ssim[2], q->ssim[3]);
+    else if (log->file)
+        fprintf(log->file, "%u,%.4f,%.4f,%.4f,%.4f,%.6f,%.6f,%.6f,%.6f\n", log->frames,
+                q->psnr[0], q->psnr[1], q->psnr[2], q->psnr[3], q->ssim[0], q->ssim[1], q->ssim[2], q->ssim[3]);
+    log->frames++;
+}
+
+/** Average over all frames so far */
+static void quality_log_average(const QUALITY_LOG_T *log, QUALITY_T *q)
+{
+    unsigned int i;
+
+    for (i = 0; i < 4; i++) {
+        q->psnr[i] = log->frames ? log->psnr[i] / log->frames : 0;
+        q->ssim[i] = log->frames ? log->ssim[i] / log->frames : 0;
+    }
+}
+
+/** Finish the file (the JSON summary). Returns 0 if everything was written. */
+static int quality_log_close(QUALITY_LOG_T *log)
+{
+    QUALITY_T avg;
+    int error;
+
+    if (!log->file)
+        return 0;
+    quality_log_average(log, &avg);
+    if (log->json)
+        fprintf(log->file, "%s  ],\n  \"summary\": { \"frames\": %u, "
+                "\"psnr\": [%.4f, %.4f, %.4f, %.4f], \"ssim\": [%.6f, %.6f, %.6f, %.6f], \"ssim_db\": %.4f, "
+                "\"min_psnr\": %.4f, \"min_psnr_frame\": %u, \"min_ssim\": %.6f, \"min_ssim_frame\": %u }\n}\n",
+                log->frames ? "\n" : "", log->frames, avg.psnr[0], avg.psnr[1], avg.psnr[2], avg.psnr[3],
+                avg.ssim[0], avg.ssim[1], avg.ssim[2], avg.ssim[3], quality_ssim_db(avg.ssim[3]),
+                log->frames ? log->min_psnr : 0, log->min_psnr_frame, log->frames ? log->min_ssim : 0,
+                log->min_ssim_frame);
+    error = ferror(log->file);
+    if (log->file != stdout)
+        error |= fclose(log->file);
+    else
+        fflush(stdout);
+    log->file = NULL;
+    return error ? -1 : 0;
+}
+
+#endif
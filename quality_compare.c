@@ -0,0 +1,478 @@
+#include "bcm_host.h"
+#include "mmal.h"
+#include "util/mmal_default_components.h"
+#include "util/mmal_util.h"
+#include "util/mmal_util_params.h"
+#include "interface/vcos/vcos.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "frame.h"
+#include "h264_nal.h"
+#include "y4m.h"
+#include "quality.h"
+#include "buffer_arena.h"
+
+#define CHECK_STATUS(status, msg) if (status != MMAL_SUCCESS) { fprintf(stderr, "%s: " msg "\n", s->name); goto error; }
+
+/** One side of the comparison: a Y4M/raw I420 file read from a mapping, or an
+ * H.264 stream decoded on the VideoCore one frame at a time */
+typedef struct SOURCE_T {
+    const char *name;
+    int is_yuv;
+    Y4M_READER_T yuv;
+
+    FILE *file;
+    H264_READER_T reader;
+    H264_AU_T au;               /* being sent, may need several buffers */
+    size_t sent;
+    unsigned int aus;
+    MMAL_COMPONENT_T *decoder;
+    MMAL_POOL_T *pool_in, *pool_out;
+    BUFFER_ARENA_POOL_T *arena_in, *arena_out;  /* both sources share the buffer budget */
+    MMAL_QUEUE_T *queue;
+    VCOS_SEMAPHORE_T semaphore;
+    MMAL_STATUS_T status;
+    MMAL_BOOL_T eos_sent, eos_received;
+    MMAL_BUFFER_HEADER_T *frame;    /* handed out by source_next_frame, released on the next call */
+    unsigned int frames;
+} SOURCE_T;
+
+/** Callback from the control port.
+ * Component is sending us an event. */
+static void control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    SOURCE_T *s = (SOURCE_T *)port->userdata;
+
+    if (buffer->cmd == MMAL_EVENT_ERROR)
+        s->status = *(MMAL_STATUS_T *)buffer->data;
+    mmal_buffer_header_release(buffer);
+    vcos_semaphore_post(&s->semaphore);
+}
+
+/** Callback from the decoder input port.
+ * Buffer has been consumed and is available to be used again. */
+static void input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    SOURCE_T *s = (SOURCE_T *)port->userdata;
+
+    mmal_buffer_header_release(buffer);
+    vcos_semaphore_post(&s->semaphore);
+}
+
+/** Callback from the decoder output port.
+ * Buffer has been produced by the port and is available for processing. */
+static void output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    SOURCE_T *s = (SOURCE_T *)port->userdata;
+
+    mmal_queue_put(s->queue, buffer);
+    vcos_semaphore_post(&s->semaphore);
+}
+
+/** Fill the buffer with the next (part of an) access unit. Returns 0 at the end of the stream. */
+static int source_read(SOURCE_T *s, MMAL_BUFFER_HEADER_T *buffer)
+{
+    size_t length;
+
+    while (s->sent == s->au.size) {
+        if (!h264_reader_next_au(&s->reader, &s->au))
+            return 0;
+        s->sent = 0;
+        s->aus++;
+    }
+
+    length = s->au.size - s->sent;
+    if (length > buffer->alloc_size)
+        length = buffer->alloc_size;
+    memcpy(buffer->data, s->au.data + s->sent, length);
+    buffer->length = length;
+    buffer->offset = 0;
+    buffer->flags = s->sent == 0 ? MMAL_BUFFER_HEADER_FLAG_FRAME_START : 0;
+    s->sent += length;
+    if (s->sent == s->au.size)
+        buffer->flags |= MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+    /* only the order matters, frames are matched by index */
+    buffer->pts = buffer->dts = (int64_t)s->aus * 40000;
+    return 1;
+}
+
+/** Open a .y4m or .yuv file (width and height needed for .yuv), or set up a
+ * decoder for anything else. Its pools are only declared, see source_start(). */
+static int source_open(SOURCE_T *s, const char *name, unsigned int width, unsigned int height)
+{
+    const char *dot = strrchr(name, '.');
+    MMAL_ES_FORMAT_T *format_in;
+    MMAL_STATUS_T status;
+    char pool_name[32];
+
+    memset(s, 0, sizeof(*s));
+    if (dot && (!strcmp(dot, ".y4m") || !strcmp(dot, ".yuv"))) {
+        s->name = name;
+        s->is_yuv = 1;
+        if (y4m_open(&s->yuv, name, width, height, 0) != 0) {
+            fprintf(stderr, "%s: could not open (a .yuv file needs -w and -h)\n", name);
+            return -1;
+        }
+        return 0;
+    }
+
+    vcos_semaphore_create(&s->semaphore, "quality source", 1);
+    s->name = name;
+    if (!(s->file = fopen(name, "rb")) || h264_reader_init(&s->reader, s->file)) {
+        fprintf(stderr, "%s: could not open\n", name);
+        return -1;
+    }
+
+    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_DECODER, &s->decoder);
+    CHECK_STATUS(status, "failed to create decoder");
+
+    s->decoder->control->userdata = (struct MMAL_PORT_USERDATA_T *)(void *)s;
+    status = mmal_port_enable(s->decoder->control, control_callback);
+    CHECK_STATUS(status, "failed to enable control port");
+
+    status = mmal_port_parameter_set_boolean(s->decoder->input[0], MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+    CHECK_STATUS(status, "failed to set zero copy on decoder input");
+    status = mmal_port_parameter_set_boolean(s->decoder->output[0], MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+    CHECK_STATUS(status, "failed to set zero copy on decoder output");
+
+    /* whole access units are sent, the real size comes with the format changed event */
+    format_in = s->decoder->input[0]->format;
+    format_in->type = MMAL_ES_TYPE_VIDEO;
+    format_in->encoding = MMAL_ENCODING_H264;
+    format_in->es->video.width = 1280;
+    format_in->es->video.height = 720;
+    format_in->es->video.frame_rate.num = 25;
+    format_in->es->video.frame_rate.den = 1;
+    format_in->es->video.par.num = 1;
+    format_in->es->video.par.den = 1;
+    format_in->flags |= MMAL_ES_FORMAT_FLAG_FRAMED;
+
+    status = mmal_port_format_commit(s->decoder->input[0]);
+    CHECK_STATUS(status, "failed to commit format");
+    status = mmal_port_format_commit(s->decoder->output[0]);
+    CHECK_STATUS(status, "failed to commit format");
+
+    s->decoder->input[0]->buffer_num = s->decoder->input[0]->buffer_num_recommended;
+    s->decoder->input[0]->buffer_size = s->decoder->input[0]->buffer_size_recommended;
+    s->decoder->output[0]->buffer_num = s->decoder->output[0]->buffer_num_min;
+    s->decoder->output[0]->buffer_size = s->decoder->output[0]->buffer_size_min;
+
+    snprintf(pool_name, sizeof(pool_name), "%.24s in", name);
+    s->arena_in = buffer_arena_pool_add(pool_name, s->decoder->input[0], s->decoder->input[0]->buffer_num_min,
+                                        s->decoder->input[0]->buffer_num, s->decoder->input[0]->buffer_size);
+    snprintf(pool_name, sizeof(pool_name), "%.24s out", name);
+    s->arena_out = buffer_arena_pool_add(pool_name, s->decoder->output[0], s->decoder->output[0]->buffer_num_min,
+                                         s->decoder->output[0]->buffer_num, s->decoder->output[0]->buffer_size);
+    s->queue = mmal_queue_create();
+    status = s->arena_in && s->arena_out && s->queue ? MMAL_SUCCESS : MMAL_ENOMEM;
+    CHECK_STATUS(status, "failed to declare pools");
+    return 0;
+
+error:
+    return -1;
+}
+
+/** Create the pools, once all sources are open so that they share the budget
+ * evenly, and start decoding */
+static int source_start(SOURCE_T *s)
+{
+    MMAL_STATUS_T status;
+
+    if (s->is_yuv)
+        return 0;
+    s->pool_in = buffer_arena_pool_create(s->arena_in);
+    s->pool_out = buffer_arena_pool_create(s->arena_out);
+    status = s->pool_in && s->pool_out ? MMAL_SUCCESS : MMAL_ENOMEM;
+    CHECK_STATUS(status, "failed to create pools");
+    s->decoder->input[0]->buffer_num = s->pool_in->headers_num;
+    s->decoder->output[0]->buffer_num = s->pool_out->headers_num;
+
+    s->decoder->input[0]->userdata = (struct MMAL_PORT_USERDATA_T *)(void *)s;
+    s->decoder->output[0]->userdata = (struct MMAL_PORT_USERDATA_T *)(void *)s;
+    status = mmal_port_enable(s->decoder->input[0], input_callback);
+    CHECK_STATUS(status, "failed to enable input port");
+    status = mmal_port_enable(s->decoder->output[0], output_callback);
+    CHECK_STATUS(status, "failed to enable output port");
+    return 0;
+
+error:
+    return -1;
+}
+
+/** Assume the buffers can't be reused: disable, destroy the pool, take the new
+ * format, make a new pool and enable again */
+static MMAL_STATUS_T source_format_changed(SOURCE_T *s, MMAL_BUFFER_HEADER_T *event_buffer)
+{
+    MMAL_EVENT_FORMAT_CHANGED_T *event = mmal_event_format_changed_get(event_buffer);
+    MMAL_PORT_T *port = s->decoder->output[0];
+    MMAL_STATUS_T status;
+
+    status = mmal_port_disable(port);
+    CHECK_STATUS(status, "failed to disable port");
+    while (mmal_queue_length(s->pool_out->queue) != s->pool_out->headers_num) {
+        MMAL_BUFFER_HEADER_T *buf;
+        vcos_semaphore_wait(&s->semaphore);
+        if ((buf = mmal_queue_get(s->queue)) != NULL)
+            mmal_buffer_header_release(buf);
+    }
+
+    buffer_arena_pool_destroy(s->arena_out);
+    s->pool_out = NULL;
+    status = mmal_format_full_copy(port->format, event->format);
+    CHECK_STATUS(status, "failed to copy port format");
+    status = mmal_port_format_commit(port);
+    CHECK_STATUS(status, "failed to commit port format");
+
+    buffer_arena_pool_resize(s->arena_out, port->buffer_num_min, port->buffer_num, port->buffer_size);
+    s->pool_out = buffer_arena_pool_create(s->arena_out);
+    status = s->pool_out ? MMAL_SUCCESS : MMAL_ENOMEM;
+    CHECK_STATUS(status, "failed to create pool");
+    port->buffer_num = s->pool_out->headers_num;
+    status = mmal_port_enable(port, output_callback);
+    CHECK_STATUS(status, "failed to enable port");
+
+error:
+    return status;
+}
+
+/** The planes of the next frame in display order. Returns 1 for a frame, 0 at
+ * the end and -1 on errors. The frame stays valid until the next call. */
+static int source_next_frame(SOURCE_T *s, FRAME_T *frame)
+{
+    MMAL_BUFFER_HEADER_T *buffer;
+    MMAL_STATUS_T status;
+
+    if (s->is_yuv) {
+        const uint8_t *data = y4m_next_frame(&s->yuv);
+        unsigned int chroma_width = (s->yuv.width + 1) / 2, chroma_height = (s->yuv.height + 1) / 2;
+        if (!data)
+            return 0;
+        /* the planes are packed, which frame_init_i420 can't describe for odd sizes */
+        frame->plane[0] = (uint8_t *)data;
+        frame->plane[1] = frame->plane[0] + (size_t)s->yuv.width * s->yuv.height;
+        frame->plane[2] = frame->plane[1] + (size_t)chroma_width * chroma_height;
+        frame->pitch[0] = s->yuv.width;
+        frame->pitch[1] = frame->pitch[2] = chroma_width;
+        frame->width = s->yuv.width;
+        frame->height = s->yuv.height;
+        s->frames++;
+        return 1;
+    }
+
+    if (s->frame) {
+        mmal_buffer_header_release(s->frame);
+        s->frame = NULL;
+    }
+    for (;;) {
+        if (s->status != MMAL_SUCCESS) {
+            fprintf(stderr, "%s: decoder error %s\n", s->name, mmal_status_to_string(s->status));
+            return -1;
+        }
+
+        /* Send data to decode to the input port of the video decoder */
+        while (!s->eos_sent && (buffer = mmal_queue_get(s->pool_in->queue)) != NULL) {
+            if (!source_read(s, buffer)) {
+                buffer->length = 0;
+                buffer->flags = MMAL_BUFFER_HEADER_FLAG_EOS;
+                buffer->pts = buffer->dts = MMAL_TIME_UNKNOWN;
+                s->eos_sent = MMAL_TRUE;
+            }
+            status = mmal_port_send_buffer(s->decoder->input[0], buffer);
+            CHECK_STATUS(status, "failed to send buffer");
+        }
+
+        /* Send empty buffers to the output port of the decoder */
+        while ((buffer = mmal_queue_get(s->pool_out->queue)) != NULL) {
+            status = mmal_port_send_buffer(s->decoder->output[0], buffer);
+            CHECK_STATUS(status, "failed to send buffer");
+        }
+
+        while ((buffer = mmal_queue_get(s->queue)) != NULL) {
+            if (buffer->cmd == MMAL_EVENT_FORMAT_CHANGED) {
+                status = source_format_changed(s, buffer);
+                mmal_buffer_header_release(buffer);
+                if (status != MMAL_SUCCESS)
+                    return -1;
+                continue;
+            }
+            if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_EOS)
+                s->eos_received = MMAL_TRUE;
+            if (!buffer->cmd && buffer->length) {
+                MMAL_VIDEO_FORMAT_T *video = &s->decoder->output[0]->format->es->video;
+                frame_init_i420(frame, buffer->data + buffer->offset, video->width, video->height,
+                                video->crop.width ? video->crop.width : video->width,
+                                video->crop.height ? video->crop.height : video->height);
+                s->frame = buffer;
+                s->frames++;
+                return 1;
+            }
+            mmal_buffer_header_release(buffer);
+        }
+
+        if (s->eos_received)
+            return 0;
+        vcos_semaphore_wait(&s->semaphore);
+    }
+
+error:
+    return -1;
+}
+
+static void source_close(SOURCE_T *s)
+{
+    if (!s->name)
+        return;
+    if (s->is_yuv) {
+        y4m_close(&s->yuv);
+        return;
+    }
+    if (s->frame)
+        mmal_buffer_header_release(s->frame);
+    if (s->decoder) {
+        mmal_port_disable(s->decoder->input[0]);
+        mmal_port_disable(s->decoder->output[0]);
+        mmal_port_disable(s->decoder->control);
+    }
+    buffer_arena_pool_destroy(s->arena_in);
+    buffer_arena_pool_destroy(s->arena_out);
+    if (s->decoder)
+        mmal_component_release(s->decoder);
+    if (s->queue)
+        mmal_queue_destroy(s->queue);
+    if (s->file) {
+        h264_reader_free(&s->reader);
+        fclose(s->file);
+    }
+    vcos_semaphore_delete(&s->semaphore);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-t threads] [-n frames] [-w width -h height] [-o metrics.csv|metrics.json] "
+                    "reference distorted\n"
+                    "  Compares two videos frame by frame (PSNR and SSIM of Y, U, V). Each is a .y4m or .yuv\n"
+                    "  file or an H.264 stream, which is decoded.\n"
+                    "  -t  threads computing the metrics (default: all cores)\n"
+                    "  -n  stop after this many frames\n"
+                    "  -w/-h  size of .yuv files\n"
+                    "  -o  per frame results, JSON if the name ends in .json, else CSV (- for stdout)\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    SOURCE_T ref, dist;
+    QUALITY_WORKERS_T workers;
+    QUALITY_LOG_T log;
+    QUALITY_T q, avg;
+    FRAME_T ref_frame, dist_frame;
+    const char *output = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int width = 0, height = 0, max_frames = 0;
+    int opt, r = 0, d = 0, result = -1, workers_created = 0;
+    uint64_t start_time, metrics_us = 0;
+    double seconds;
+
+    while ((opt = getopt(argc, argv, "t:n:w:h:o:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            max_frames = atoi(optarg);
+            break;
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 'h':
+            height = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    bcm_host_init();
+    //MMAL_POOL_BUDGET limits the buffer memory of both decoders together
+    if (buffer_arena_init_from_env() != 0)
+        return -1;
+    memset(&ref, 0, sizeof(ref));
+    memset(&dist, 0, sizeof(dist));
+    memset(&log, 0, sizeof(log));
+
+    if (source_open(&ref, argv[optind], width, height) != 0 ||
+        source_open(&dist, argv[optind + 1], width, height) != 0 ||
+        source_start(&ref) != 0 || source_start(&dist) != 0)
+        goto error;
+    if (quality_workers_create(&workers, threads > 0 ? threads : 1) != 0) {
+        fprintf(stderr, "failed to start the metric threads\n");
+        goto error;
+    }
+    workers_created = 1;
+    if (quality_log_open(&log, output) != 0) {
+        fprintf(stderr, "could not open %s\n", output);
+        goto error;
+    }
+
+    start_time = vcos_getmicrosecs64();
+    while (!max_frames || log.frames < max_frames) {
+        uint64_t start;
+
+        /* both decoders run while the other one is waited for */
+        if ((r = source_next_frame(&ref, &ref_frame)) <= 0 || (d = source_next_frame(&dist, &dist_frame)) <= 0)
+            break;
+        if (ref_frame.width != dist_frame.width || ref_frame.height != dist_frame.height) {
+            fprintf(stderr, "frame %u: %ux%u against %ux%u, the sizes must match\n", log.frames,
+                    ref_frame.width, ref_frame.height, dist_frame.width, dist_frame.height);
+            r = -1;
+            break;
+        }
+        start = vcos_getmicrosecs64();
+        quality_workers_run(&workers, &ref_frame, &dist_frame, &q);
+        metrics_us += vcos_getmicrosecs64() - start;
+        quality_log_frame(&log, &q);
+        buffer_arena_sample();
+    }
+    seconds = (vcos_getmicrosecs64() - start_time) / 1e6;
+
+    if (r < 0 || d < 0)
+        goto error;
+    if (r == 0 && source_next_frame(&dist, &dist_frame) > 0)
+        fprintf(stderr, "%s has more frames than %s, compared the first %u\n", dist.name, ref.name, log.frames);
+    else if (r > 0 && d == 0)
+        fprintf(stderr, "%s has more frames than %s, compared the first %u\n", ref.name, dist.name, log.frames);
+
+    quality_log_average(&log, &avg);
+    fprintf(stderr, "compared %u frames in %.2fs (%.1f fps), metrics %.2f ms/frame on %u threads\n",
+            log.frames, seconds, seconds > 0 ? log.frames / seconds : 0,
+            log.frames ? metrics_us / 1000.0 / log.frames : 0, workers.count + 1);
+    fprintf(stderr, "PSNR Y %.3f U %.3f V %.3f all %.3f dB, lowest %.3f (frame %u)\n",
+            avg.psnr[0], avg.psnr[1], avg.psnr[2], avg.psnr[3], log.frames ? log.min_psnr : 0, log.min_psnr_frame);
+    fprintf(stderr, "SSIM Y %.5f U %.5f V %.5f all %.5f (%.3f dB), lowest %.5f (frame %u)\n",
+            avg.ssim[0], avg.ssim[1], avg.ssim[2], avg.ssim[3], quality_ssim_db(avg.ssim[3]),
+            log.frames ? log.min_ssim : 0, log.min_ssim_frame);
+    if (buffer_arena.pools)
+        buffer_arena_print(stderr);
+    result = log.frames ? 0 : -1;
+
+error:
+    if (quality_log_close(&log) != 0) {
+        fprintf(stderr, "could not write %s\n", output);
+        result = -1;
+    }
+    if (workers_created)
+        quality_workers_destroy(&workers);
+    source_close(&dist);
+    source_close(&ref);
+    buffer_arena_destroy();
+    return result;
+}
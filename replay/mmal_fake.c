@@ -0,0 +1,1013 @@
+/* Host-side fake of the part of the MMAL API the examples use, which replays a
+ * callback timeline recorded on the Pi with mmal_record.so. The CPU side of an
+ * example (main loop, overlay, writer) then runs on a development machine
+ * under the same load as on the Pi: the same number of callbacks in the same
+ * order, with the same lengths, flags, pts and format changes, at the
+ * recorded times.
+ *
+ *   make replay USERLAND=<userland checkout>
+ *   MMAL_REPLAY=run.timeline ./replay/manual_decode_overlay_encode
+ *
+ * One thread delivers the callbacks. The k-th callback of a port is due at its
+ * recorded time, but no earlier than its recorded hold time after the buffer
+ * it returns was sent, so a slower example sees later callbacks instead of
+ * buffers appearing out of nowhere. Events (format changed, errors) need no
+ * buffer. Once a port's timeline is used up, input buffers are handed back
+ * straight away and output buffers are kept. MMAL_REPLAY_SPEED=2 plays twice
+ * as fast, 0 ignores the recorded times. A summary of callback rates, hold
+ * times and how far the replay fell behind the recording is printed at exit.
+ *
+ * Payloads are not recorded: output buffers carry whatever was in them, so
+ * frames are blank and the encoded output is not decodable. The input of a
+ * decoder is looked at though: a buffer with a NAL unit whose
+ * forbidden_zero_bit is set, as in a corrupted stream, makes the decoder raise
+ * MMAL_EVENT_ERROR (MMAL_EIO) on its control port, to exercise error recovery
+ * (make check-recovery). Connections and graphs are not faked; examples built
+ * on them keep their buffers on the VideoCore side anyway. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bcm_host.h"
+#include "mmal.h"
+#include "mmal_events.h"
+#include "util/mmal_util.h"
+#include "util/mmal_util_params.h"
+#include "timeline.h"
+
+#define FAKE_MAX_COMPONENTS 8
+#define FAKE_EVENT_SIZE 256
+
+typedef struct FAKE_FORMAT_T {
+    MMAL_ES_FORMAT_T format;
+    MMAL_ES_SPECIFIC_FORMAT_T es;
+} FAKE_FORMAT_T;
+
+struct FAKE_POOL_T;
+
+typedef struct FAKE_BUFFER_T {
+    MMAL_BUFFER_HEADER_T header;
+    MMAL_BUFFER_HEADER_TYPE_SPECIFIC_T type;
+    struct FAKE_POOL_T *pool;       /* NULL for events */
+    uint8_t *payload;               /* examples may point data elsewhere */
+    int refcount;
+    uint64_t sent;
+} FAKE_BUFFER_T;
+
+typedef struct FAKE_POOL_T {
+    MMAL_POOL_T pool;
+    FAKE_BUFFER_T *buffers;
+    MMAL_POOL_BH_CB_T cb;
+    void *userdata;
+    void *allocator_context;
+    mmal_pool_allocator_free_t allocator_free;
+} FAKE_POOL_T;
+
+struct MMAL_QUEUE_T {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    MMAL_BUFFER_HEADER_T *head, **tail;
+    unsigned int length;
+};
+
+typedef struct FAKE_PORT_T {
+    MMAL_PORT_T port;
+    char name[TIMELINE_NAME + 16];
+    MMAL_PORT_BH_CB_T cb;
+    int timeline;                   /* index in the timeline, -1 if not recorded */
+    unsigned int next;              /* next callback of the timeline */
+    const TIMELINE_FORMAT_T *changed;   /* last format change delivered */
+    MMAL_BUFFER_HEADER_T *held, **held_tail;
+    unsigned int errors;            /* control port: injected errors to deliver */
+} FAKE_PORT_T;
+
+typedef struct FAKE_COMPONENT_T {
+    MMAL_COMPONENT_T component;
+    char name[TIMELINE_NAME];
+    FAKE_PORT_T ports[3];
+    MMAL_PORT_T *port_list[3];
+    int refcount;
+} FAKE_COMPONENT_T;
+
+typedef struct FAKE_STATS_T {
+    unsigned long delivered, holds;
+    uint64_t first, last;
+    int64_t hold, behind, behind_max;
+} FAKE_STATS_T;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;            /* a buffer was sent or a port enabled */
+    pthread_cond_t delivered;       /* a callback returned */
+    pthread_t thread;
+    int running, stop, loaded;
+    TIMELINE_T timeline;
+    FAKE_STATS_T stats[TIMELINE_MAX_PORTS];
+    double speed;
+    uint64_t start;
+    FAKE_COMPONENT_T *components[FAKE_MAX_COMPONENTS];
+    char created[FAKE_MAX_COMPONENTS * 4][TIMELINE_NAME];
+    unsigned int created_count;
+    FAKE_PORT_T *delivering;
+    FAKE_BUFFER_T *events;          /* free event buffers, chained through header.next */
+    unsigned int injected;          /* decoder errors raised for corrupt input */
+} fake = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER, .delivered = PTHREAD_COND_INITIALIZER };
+
+static const char *const fake_port_types[] = { "unknown", "ctr", "in", "out", "clk" };
+
+static uint64_t fake_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Recorded time to replay time */
+static uint64_t fake_scale(int64_t us)
+{
+    return fake.speed > 0 && us > 0 ? (uint64_t)(us / fake.speed) : 0;
+}
+
+static void fake_summary(void)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&fake.lock);
+    if (fake.injected)
+        fprintf(stderr, "replay: %u decoder errors raised for corrupt input\n", fake.injected);
+    for (i = 0; i < fake.timeline.ports; i++) {
+        const TIMELINE_PORT_T *tl = &fake.timeline.port[i];
+        const FAKE_STATS_T *s = &fake.stats[i];
+        double rate = 0, recorded_rate = 0, recorded_hold = 0;
+        unsigned long j, holds = 0;
+
+        if (!s->delivered)
+            continue;
+        if (s->delivered > 1 && s->last > s->first)
+            rate = (s->delivered - 1) * 1e6 / (s->last - s->first);
+        if (s->delivered > 1 && tl->callbacks[s->delivered - 1].t > tl->callbacks[0].t)
+            recorded_rate = (s->delivered - 1) * 1e6 / (tl->callbacks[s->delivered - 1].t - tl->callbacks[0].t);
+        for (j = 0; j < s->delivered && j < tl->count; j++) {
+            if (tl->callbacks[j].hold >= 0) {
+                recorded_hold += tl->callbacks[j].hold;
+                holds++;
+            }
+        }
+        fprintf(stderr, "replay: %s:%s:%u %lu/%u callbacks, %.1f/s (recorded %.1f/s), held %.1f ms (recorded %.1f ms), "
+                "behind %.1f ms avg %.1f ms max\n", tl->component, fake_port_types[tl->type < 5 ? tl->type : 0], tl->index, s->delivered, tl->count,
+                rate, recorded_rate, s->holds ? s->hold / 1e3 / s->holds : 0.0, holds ? recorded_hold / 1e3 / holds : 0.0,
+                s->behind / 1e3 / s->delivered, s->behind_max / 1e3);
+    }
+    pthread_mutex_unlock(&fake.lock);
+}
+
+/** Loads MMAL_REPLAY once. Returns 0 if there is no timeline to replay. */
+static int fake_load(void)
+{
+    const char *path = getenv("MMAL_REPLAY"), *speed = getenv("MMAL_REPLAY_SPEED");
+    pthread_condattr_t attr;
+    int error;
+
+    if (fake.loaded)
+        return 1;
+    if (!path) {
+        fprintf(stderr, "mmal_fake: set MMAL_REPLAY to a timeline recorded with mmal_record.so\n");
+        return 0;
+    }
+    if ((error = timeline_read(&fake.timeline, path)) != 0) {
+        if (error < 0)
+            fprintf(stderr, "mmal_fake: could not open %s\n", path);
+        else
+            fprintf(stderr, "mmal_fake: %s:%d: not a timeline record\n", path, error);
+        return 0;
+    }
+    fake.speed = speed ? atof(speed) : 1.0;
+    fake.loaded = 1;
+    /* the due times are monotonic */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_destroy(&fake.wake);
+    pthread_cond_init(&fake.wake, &attr);
+    pthread_condattr_destroy(&attr);
+    atexit(fake_summary);
+    return 1;
+}
+
+/** When the next callback of the port is due, UINT64_MAX if it cannot be delivered. Locked. */
+static uint64_t fake_due(FAKE_PORT_T *port)
+{
+    const FAKE_BUFFER_T *held = (const FAKE_BUFFER_T *)port->held;
+    const TIMELINE_PORT_T *tl = port->timeline >= 0 ? &fake.timeline.port[port->timeline] : NULL;
+    uint64_t due;
+
+    if (port->errors)
+        return 0;
+    if (!tl || port->next == tl->count) {
+        if (port->port.type == MMAL_PORT_TYPE_INPUT && held)
+            return held->sent;
+        return UINT64_MAX;
+    }
+    const TIMELINE_CALLBACK_T *cb = &tl->callbacks[port->next];
+    due = fake.start + fake_scale(cb->t);
+    if (cb->cmd)
+        return due;
+    if (!held)
+        return UINT64_MAX;
+    if (cb->hold >= 0 && held->sent + fake_scale(cb->hold) > due)
+        due = held->sent + fake_scale(cb->hold);
+    return due;
+}
+
+/** An event buffer carrying the recorded event. Locked. */
+static MMAL_BUFFER_HEADER_T *fake_event(const TIMELINE_CALLBACK_T *cb)
+{
+    FAKE_BUFFER_T *event = fake.events;
+    MMAL_BUFFER_HEADER_T *buffer;
+
+    if (event)
+        fake.events = (FAKE_BUFFER_T *)event->header.next;
+    else if (!(event = (FAKE_BUFFER_T *)calloc(1, sizeof(*event) + FAKE_EVENT_SIZE)))
+        return NULL;
+    buffer = &event->header;
+    memset(event, 0, sizeof(*event));
+    event->refcount = 1;
+    buffer->data = (uint8_t *)(event + 1);
+    buffer->alloc_size = FAKE_EVENT_SIZE;
+    buffer->type = &event->type;
+    buffer->cmd = cb->cmd;
+    buffer->pts = buffer->dts = MMAL_TIME_UNKNOWN;
+    memset(buffer->data, 0, FAKE_EVENT_SIZE);
+
+    if (cb->cmd == MMAL_EVENT_FORMAT_CHANGED && cb->format) {
+        MMAL_EVENT_FORMAT_CHANGED_T *changed = (MMAL_EVENT_FORMAT_CHANGED_T *)buffer->data;
+        MMAL_ES_FORMAT_T *format = (MMAL_ES_FORMAT_T *)(changed + 1);
+        MMAL_VIDEO_FORMAT_T *video = &((MMAL_ES_SPECIFIC_FORMAT_T *)(format + 1))->video;
+
+        changed->buffer_num_min = cb->format->num_min;
+        changed->buffer_size_min = cb->format->size_min;
+        changed->buffer_num_recommended = cb->format->num_rec;
+        changed->buffer_size_recommended = cb->format->size_rec;
+        format->type = MMAL_ES_TYPE_VIDEO;
+        format->encoding = cb->format->encoding;
+        video->width = cb->format->width;
+        video->height = cb->format->height;
+        video->crop.x = cb->format->crop_x;
+        video->crop.y = cb->format->crop_y;
+        video->crop.width = cb->format->crop_width;
+        video->crop.height = cb->format->crop_height;
+        video->frame_rate.num = cb->format->fps_num;
+        video->frame_rate.den = cb->format->fps_den;
+        video->par.num = video->par.den = 1;
+        buffer->length = sizeof(*changed) + sizeof(*format) + sizeof(MMAL_ES_SPECIFIC_FORMAT_T);
+    } else if (cb->cmd == MMAL_EVENT_ERROR) {
+        *(MMAL_STATUS_T *)buffer->data = (MMAL_STATUS_T)cb->arg;
+        buffer->length = sizeof(MMAL_STATUS_T);
+    }
+    return buffer;
+}
+
+/** Takes the buffer for the next callback of the port off the timeline. Locked. */
+static MMAL_BUFFER_HEADER_T *fake_next(FAKE_PORT_T *port, uint64_t now)
+{
+    if (port->errors) {
+        TIMELINE_CALLBACK_T error;
+        memset(&error, 0, sizeof(error));
+        error.cmd = MMAL_EVENT_ERROR;
+        error.arg = MMAL_EIO;
+        port->errors--;
+        return fake_event(&error);
+    }
+
+    const TIMELINE_PORT_T *tl = port->timeline >= 0 ? &fake.timeline.port[port->timeline] : NULL;
+    const TIMELINE_CALLBACK_T *cb = tl && port->next < tl->count ? &tl->callbacks[port->next++] : NULL;
+    FAKE_STATS_T *stats = port->timeline >= 0 ? &fake.stats[port->timeline] : NULL;
+    MMAL_BUFFER_HEADER_T *buffer;
+
+    if (cb && cb->cmd) {
+        buffer = fake_event(cb);
+        if (cb->format)
+            port->changed = cb->format;
+    } else {
+        FAKE_BUFFER_T *held = (FAKE_BUFFER_T *)port->held;
+
+        buffer = port->held;
+        if (!(port->held = buffer->next))
+            port->held_tail = &port->held;
+        buffer->next = NULL;
+        buffer->cmd = 0;
+        buffer->offset = 0;
+        if (cb) {
+            buffer->length = cb->length < buffer->alloc_size ? cb->length : buffer->alloc_size;
+            buffer->flags = cb->flags;
+            buffer->pts = buffer->dts = cb->pts;
+        }
+        if (stats && cb) {
+            stats->hold += now - held->sent;
+            stats->holds++;
+        }
+    }
+    if (stats && cb) {
+        int64_t behind = (int64_t)(now - fake.start - fake_scale(cb->t));
+        if (!stats->delivered++)
+            stats->first = now;
+        stats->last = now;
+        stats->behind += behind > 0 ? behind : 0;
+        if (behind > stats->behind_max)
+            stats->behind_max = behind;
+    }
+    return buffer;
+}
+
+static void *fake_replay(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&fake.lock);
+    while (!fake.stop) {
+        FAKE_PORT_T *port = NULL;
+        MMAL_BUFFER_HEADER_T *buffer;
+        uint64_t due = UINT64_MAX, now;
+        unsigned int i, j;
+
+        for (i = 0; i < FAKE_MAX_COMPONENTS; i++) {
+            for (j = 0; fake.components[i] && j < 3; j++) {
+                FAKE_PORT_T *p = &fake.components[i]->ports[j];
+                uint64_t d = p->port.is_enabled ? fake_due(p) : UINT64_MAX;
+                if (d < due) {
+                    due = d;
+                    port = p;
+                }
+            }
+        }
+        if (!port) {
+            pthread_cond_wait(&fake.wake, &fake.lock);
+            continue;
+        }
+        now = fake_now_us();
+        if (due > now) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += (due - now) / 1000000;
+            ts.tv_nsec += (due - now) % 1000000 * 1000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&fake.wake, &fake.lock, &ts);
+            continue;
+        }
+        if (!(buffer = fake_next(port, now)))
+            continue;
+        fake.delivering = port;
+        pthread_mutex_unlock(&fake.lock);
+        port->cb(&port->port, buffer);
+        pthread_mutex_lock(&fake.lock);
+        fake.delivering = NULL;
+        pthread_cond_broadcast(&fake.delivered);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return NULL;
+}
+
+void bcm_host_init(void)
+{
+}
+
+const char *mmal_status_to_string(MMAL_STATUS_T status)
+{
+    static const char *const names[] = {
+        "SUCCESS", "ENOMEM", "ENOSPC", "EINVAL", "ENOSYS", "ENOENT", "ENXIO", "EIO", "ESPIPE",
+        "ECORRUPT", "ENOTREADY", "ECONFIG", "EISCONN", "ENOTCONN", "EAGAIN", "EFAULT",
+    };
+    return (unsigned int)status < sizeof(names) / sizeof(names[0]) ? names[status] : "UNKNOWN";
+}
+
+/* Formats */
+
+MMAL_ES_FORMAT_T *mmal_format_alloc(void)
+{
+    FAKE_FORMAT_T *f = (FAKE_FORMAT_T *)calloc(1, sizeof(*f));
+
+    if (!f)
+        return NULL;
+    f->format.es = &f->es;
+    return &f->format;
+}
+
+void mmal_format_free(MMAL_ES_FORMAT_T *format)
+{
+    if (!format)
+        return;
+    free(format->extradata);
+    free(format);
+}
+
+MMAL_STATUS_T mmal_format_extradata_alloc(MMAL_ES_FORMAT_T *format, unsigned int size)
+{
+    uint8_t *extradata = (uint8_t *)realloc(format->extradata, size ? size : 1);
+
+    if (!extradata)
+        return MMAL_ENOMEM;
+    format->extradata = extradata;
+    return MMAL_SUCCESS;
+}
+
+void mmal_format_copy(MMAL_ES_FORMAT_T *dst, MMAL_ES_FORMAT_T *src)
+{
+    MMAL_ES_SPECIFIC_FORMAT_T *es = dst->es;
+    uint8_t *extradata = dst->extradata;
+
+    *es = *src->es;
+    *dst = *src;
+    dst->es = es;
+    dst->extradata = extradata;
+    dst->extradata_size = 0;
+}
+
+MMAL_STATUS_T mmal_format_full_copy(MMAL_ES_FORMAT_T *dst, MMAL_ES_FORMAT_T *src)
+{
+    mmal_format_copy(dst, src);
+    if (src->extradata_size) {
+        if (mmal_format_extradata_alloc(dst, src->extradata_size) != MMAL_SUCCESS)
+            return MMAL_ENOMEM;
+        memcpy(dst->extradata, src->extradata, src->extradata_size);
+        dst->extradata_size = src->extradata_size;
+    }
+    return MMAL_SUCCESS;
+}
+
+MMAL_EVENT_FORMAT_CHANGED_T *mmal_event_format_changed_get(MMAL_BUFFER_HEADER_T *buffer)
+{
+    MMAL_EVENT_FORMAT_CHANGED_T *event;
+
+    if (!buffer || buffer->cmd != MMAL_EVENT_FORMAT_CHANGED ||
+        buffer->length < sizeof(*event) + sizeof(MMAL_ES_FORMAT_T) + sizeof(MMAL_ES_SPECIFIC_FORMAT_T))
+        return NULL;
+    event = (MMAL_EVENT_FORMAT_CHANGED_T *)buffer->data;
+    event->format = (MMAL_ES_FORMAT_T *)(event + 1);
+    event->format->es = (MMAL_ES_SPECIFIC_FORMAT_T *)(event->format + 1);
+    return event;
+}
+
+/* Queues */
+
+MMAL_QUEUE_T *mmal_queue_create(void)
+{
+    MMAL_QUEUE_T *queue = (MMAL_QUEUE_T *)calloc(1, sizeof(*queue));
+
+    if (!queue)
+        return NULL;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->available, NULL);
+    queue->tail = &queue->head;
+    return queue;
+}
+
+void mmal_queue_put(MMAL_QUEUE_T *queue, MMAL_BUFFER_HEADER_T *buffer)
+{
+    pthread_mutex_lock(&queue->lock);
+    buffer->next = NULL;
+    *queue->tail = buffer;
+    queue->tail = &buffer->next;
+    queue->length++;
+    pthread_cond_signal(&queue->available);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void mmal_queue_put_back(MMAL_QUEUE_T *queue, MMAL_BUFFER_HEADER_T *buffer)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (!(buffer->next = queue->head))
+        queue->tail = &buffer->next;
+    queue->head = buffer;
+    queue->length++;
+    pthread_cond_signal(&queue->available);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static MMAL_BUFFER_HEADER_T *fake_queue_take(MMAL_QUEUE_T *queue)
+{
+    MMAL_BUFFER_HEADER_T *buffer = queue->head;
+
+    if (!buffer)
+        return NULL;
+    if (!(queue->head = buffer->next))
+        queue->tail = &queue->head;
+    buffer->next = NULL;
+    queue->length--;
+    return buffer;
+}
+
+MMAL_BUFFER_HEADER_T *mmal_queue_get(MMAL_QUEUE_T *queue)
+{
+    MMAL_BUFFER_HEADER_T *buffer;
+
+    pthread_mutex_lock(&queue->lock);
+    buffer = fake_queue_take(queue);
+    pthread_mutex_unlock(&queue->lock);
+    return buffer;
+}
+
+MMAL_BUFFER_HEADER_T *mmal_queue_wait(MMAL_QUEUE_T *queue)
+{
+    MMAL_BUFFER_HEADER_T *buffer;
+
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->head)
+        pthread_cond_wait(&queue->available, &queue->lock);
+    buffer = fake_queue_take(queue);
+    pthread_mutex_unlock(&queue->lock);
+    return buffer;
+}
+
+unsigned int mmal_queue_length(MMAL_QUEUE_T *queue)
+{
+    unsigned int length;
+
+    pthread_mutex_lock(&queue->lock);
+    length = queue->length;
+    pthread_mutex_unlock(&queue->lock);
+    return length;
+}
+
+void mmal_queue_destroy(MMAL_QUEUE_T *queue)
+{
+    if (!queue)
+        return;
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->available);
+    free(queue);
+}
+
+/* Buffer headers and pools */
+
+void mmal_buffer_header_reset(MMAL_BUFFER_HEADER_T *header)
+{
+    header->length = header->offset = header->flags = 0;
+    header->pts = header->dts = MMAL_TIME_UNKNOWN;
+}
+
+void mmal_buffer_header_acquire(MMAL_BUFFER_HEADER_T *header)
+{
+    __atomic_add_fetch(&((FAKE_BUFFER_T *)header)->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void mmal_buffer_header_release(MMAL_BUFFER_HEADER_T *header)
+{
+    FAKE_BUFFER_T *buffer = (FAKE_BUFFER_T *)header;
+    FAKE_POOL_T *pool = buffer->pool;
+
+    if (__atomic_sub_fetch(&buffer->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    buffer->refcount = 1;
+    mmal_buffer_header_reset(header);
+    header->cmd = 0;
+    if (!pool) {
+        pthread_mutex_lock(&fake.lock);
+        header->next = (MMAL_BUFFER_HEADER_T *)fake.events;
+        fake.events = buffer;
+        pthread_mutex_unlock(&fake.lock);
+        return;
+    }
+    if (pool->cb && !pool->cb(&pool->pool, header, pool->userdata))
+        return;
+    mmal_queue_put(pool->pool.queue, header);
+}
+
+static void *fake_alloc(void *context, uint32_t size)
+{
+    (void)context;
+    return malloc(size);
+}
+
+static void fake_free(void *context, void *mem)
+{
+    (void)context;
+    free(mem);
+}
+
+MMAL_POOL_T *mmal_pool_create_with_allocator(unsigned int headers, uint32_t payload_size, void *allocator_context,
+                                             mmal_pool_allocator_alloc_t allocator_alloc,
+                                             mmal_pool_allocator_free_t allocator_free)
+{
+    FAKE_POOL_T *pool = (FAKE_POOL_T *)calloc(1, sizeof(*pool));
+    unsigned int i;
+
+    if (!pool)
+        return NULL;
+    pool->allocator_context = allocator_context;
+    pool->allocator_free = allocator_free;
+    pool->buffers = (FAKE_BUFFER_T *)calloc(headers ? headers : 1, sizeof(FAKE_BUFFER_T));
+    pool->pool.header = (MMAL_BUFFER_HEADER_T **)calloc(headers ? headers : 1, sizeof(MMAL_BUFFER_HEADER_T *));
+    pool->pool.queue = mmal_queue_create();
+    if (!pool->buffers || !pool->pool.header || !pool->pool.queue) {
+        mmal_pool_destroy(&pool->pool);
+        return NULL;
+    }
+    for (i = 0; i < headers; i++) {
+        FAKE_BUFFER_T *buffer = &pool->buffers[i];
+
+        buffer->pool = pool;
+        buffer->refcount = 1;
+        buffer->header.type = &buffer->type;
+        if (payload_size && !(buffer->payload = (uint8_t *)allocator_alloc(allocator_context, payload_size))) {
+            mmal_pool_destroy(&pool->pool);
+            return NULL;
+        }
+        buffer->header.data = buffer->payload;
+        buffer->header.alloc_size = payload_size;
+        mmal_buffer_header_reset(&buffer->header);
+        pool->pool.header[i] = &buffer->header;
+        pool->pool.headers_num = i + 1;
+        mmal_queue_put(pool->pool.queue, &buffer->header);
+    }
+    return &pool->pool;
+}
+
+MMAL_POOL_T *mmal_pool_create(unsigned int headers, uint32_t payload_size)
+{
+    return mmal_pool_create_with_allocator(headers, payload_size, NULL, fake_alloc, fake_free);
+}
+
+void mmal_pool_destroy(MMAL_POOL_T *mmal_pool)
+{
+    FAKE_POOL_T *pool = (FAKE_POOL_T *)mmal_pool;
+    unsigned int i;
+
+    if (!pool)
+        return;
+    for (i = 0; i < pool->pool.headers_num; i++)
+        if (pool->buffers[i].payload)
+            pool->allocator_free(pool->allocator_context, pool->buffers[i].payload);
+    mmal_queue_destroy(pool->pool.queue);
+    free(pool->pool.header);
+    free(pool->buffers);
+    free(pool);
+}
+
+void mmal_pool_callback_set(MMAL_POOL_T *mmal_pool, MMAL_POOL_BH_CB_T cb, void *userdata)
+{
+    FAKE_POOL_T *pool = (FAKE_POOL_T *)mmal_pool;
+
+    pool->cb = cb;
+    pool->userdata = userdata;
+}
+
+MMAL_POOL_T *mmal_port_pool_create(MMAL_PORT_T *port, unsigned int headers, uint32_t payload_size)
+{
+    (void)port;
+    return mmal_pool_create(headers, payload_size);
+}
+
+void mmal_port_pool_destroy(MMAL_PORT_T *port, MMAL_POOL_T *pool)
+{
+    (void)port;
+    mmal_pool_destroy(pool);
+}
+
+/* Ports */
+
+/** Buffer requirements: from the last format change, else the recording, else the format */
+static void fake_port_requirements(FAKE_PORT_T *port)
+{
+    MMAL_PORT_T *p = &port->port;
+    MMAL_VIDEO_FORMAT_T *video = &p->format->es->video;
+
+    if (port->changed) {
+        p->buffer_num_min = port->changed->num_min;
+        p->buffer_size_min = port->changed->size_min;
+        p->buffer_num_recommended = port->changed->num_rec;
+        p->buffer_size_recommended = port->changed->size_rec;
+    } else if (port->timeline >= 0) {
+        const TIMELINE_PORT_T *tl = &fake.timeline.port[port->timeline];
+        p->buffer_num_min = tl->num_min;
+        p->buffer_size_min = tl->size_min;
+        p->buffer_num_recommended = tl->num_rec;
+        p->buffer_size_recommended = tl->size_rec;
+    } else {
+        p->buffer_num_min = 1;
+        p->buffer_num_recommended = 3;
+        if (p->format->encoding == MMAL_ENCODING_I420)
+            p->buffer_size_min = ((video->width + 31) & ~31) * ((video->height + 15) & ~15) * 3 / 2;
+        else
+            p->buffer_size_min = 65536;
+        p->buffer_size_recommended = p->buffer_size_min;
+    }
+    if (p->buffer_num < p->buffer_num_min)
+        p->buffer_num = p->buffer_num_min;
+    if (p->buffer_size < p->buffer_size_min)
+        p->buffer_size = p->buffer_size_min;
+}
+
+MMAL_STATUS_T mmal_port_format_commit(MMAL_PORT_T *mmal_port)
+{
+    pthread_mutex_lock(&fake.lock);
+    fake_port_requirements((FAKE_PORT_T *)mmal_port);
+    pthread_mutex_unlock(&fake.lock);
+    return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_enable(MMAL_PORT_T *mmal_port, MMAL_PORT_BH_CB_T cb)
+{
+    FAKE_PORT_T *port = (FAKE_PORT_T *)mmal_port;
+
+    if (!cb && mmal_port->type != MMAL_PORT_TYPE_CONTROL)
+        return MMAL_EINVAL;
+    pthread_mutex_lock(&fake.lock);
+    if (mmal_port->is_enabled) {
+        pthread_mutex_unlock(&fake.lock);
+        return MMAL_EINVAL;
+    }
+    port->cb = cb;
+    mmal_port->is_enabled = 1;
+    if (!fake.running) {
+        fake.start = fake_now_us();
+        fake.stop = 0;
+        if (pthread_create(&fake.thread, NULL, fake_replay, NULL) != 0) {
+            mmal_port->is_enabled = 0;
+            pthread_mutex_unlock(&fake.lock);
+            return MMAL_ENOMEM;
+        }
+        fake.running = 1;
+    }
+    pthread_cond_signal(&fake.wake);
+    pthread_mutex_unlock(&fake.lock);
+    return MMAL_SUCCESS;
+}
+
+/** Hands the buffers the port holds back through its callback, as the VideoCore does */
+static void fake_port_return(FAKE_PORT_T *port, MMAL_PORT_BH_CB_T cb, MMAL_BUFFER_HEADER_T *held)
+{
+    while (held) {
+        MMAL_BUFFER_HEADER_T *next = held->next;
+        held->next = NULL;
+        held->length = 0;
+        if (cb)
+            cb(&port->port, held);
+        held = next;
+    }
+}
+
+/** Takes the held buffers away from the port, once the replay thread is done with it. Locked. */
+static MMAL_BUFFER_HEADER_T *fake_port_take(FAKE_PORT_T *port)
+{
+    MMAL_BUFFER_HEADER_T *held;
+
+    while (fake.delivering == port && !pthread_equal(pthread_self(), fake.thread))
+        pthread_cond_wait(&fake.delivered, &fake.lock);
+    held = port->held;
+    port->held = NULL;
+    port->held_tail = &port->held;
+    return held;
+}
+
+MMAL_STATUS_T mmal_port_disable(MMAL_PORT_T *mmal_port)
+{
+    FAKE_PORT_T *port = (FAKE_PORT_T *)mmal_port;
+    MMAL_BUFFER_HEADER_T *held;
+
+    pthread_mutex_lock(&fake.lock);
+    if (!mmal_port->is_enabled) {
+        pthread_mutex_unlock(&fake.lock);
+        return MMAL_EINVAL;
+    }
+    mmal_port->is_enabled = 0;
+    held = fake_port_take(port);
+    pthread_mutex_unlock(&fake.lock);
+    fake_port_return(port, port->cb, held);
+    return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_flush(MMAL_PORT_T *mmal_port)
+{
+    FAKE_PORT_T *port = (FAKE_PORT_T *)mmal_port;
+    MMAL_BUFFER_HEADER_T *held;
+
+    pthread_mutex_lock(&fake.lock);
+    held = fake_port_take(port);
+    pthread_mutex_unlock(&fake.lock);
+    fake_port_return(port, port->cb, held);
+    return MMAL_SUCCESS;
+}
+
+/** Whether a buffer for a decoder holds a NAL unit with the forbidden_zero_bit set */
+static int fake_corrupt(const MMAL_PORT_T *port, const MMAL_BUFFER_HEADER_T *buffer)
+{
+    const uint8_t *data = buffer->data + buffer->offset;
+    uint32_t i;
+
+    if (port->type != MMAL_PORT_TYPE_INPUT || !strstr(port->component->name, "video_decode"))
+        return 0;
+    for (i = 0; i + 3 < buffer->length; i++)
+        if (!data[i] && !data[i + 1] && data[i + 2] == 1 && (data[i + 3] & 0x80))
+            return 1;
+    return 0;
+}
+
+MMAL_STATUS_T mmal_port_send_buffer(MMAL_PORT_T *mmal_port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    FAKE_PORT_T *port = (FAKE_PORT_T *)mmal_port;
+
+    pthread_mutex_lock(&fake.lock);
+    if (!mmal_port->is_enabled) {
+        pthread_mutex_unlock(&fake.lock);
+        return MMAL_EINVAL;
+    }
+    ((FAKE_BUFFER_T *)buffer)->sent = fake_now_us();
+    if (fake_corrupt(mmal_port, buffer)) {
+        ((FAKE_PORT_T *)mmal_port->component->control)->errors++;
+        fake.injected++;
+    }
+    buffer->next = NULL;
+    *port->held_tail = buffer;
+    port->held_tail = &buffer->next;
+    pthread_cond_signal(&fake.wake);
+    pthread_mutex_unlock(&fake.lock);
+    return MMAL_SUCCESS;
+}
+
+/* Parameters are accepted and read back as zero */
+
+MMAL_STATUS_T mmal_port_parameter_set(MMAL_PORT_T *port, const MMAL_PARAMETER_HEADER_T *param)
+{
+    (void)port;
+    (void)param;
+    return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_parameter_get(MMAL_PORT_T *port, MMAL_PARAMETER_HEADER_T *param)
+{
+    (void)port;
+    if (param->size > sizeof(*param))
+        memset(param + 1, 0, param->size - sizeof(*param));
+    return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_parameter_set_boolean(MMAL_PORT_T *port, uint32_t id, MMAL_BOOL_T value)
+{
+    (void)port;
+    (void)id;
+    (void)value;
+    return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_parameter_set_uint32(MMAL_PORT_T *port, uint32_t id, uint32_t value)
+{
+    (void)port;
+    (void)id;
+    (void)value;
+    return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_parameter_get_uint32(MMAL_PORT_T *port, uint32_t id, uint32_t *value)
+{
+    (void)port;
+    (void)id;
+    *value = 0;
+    return MMAL_SUCCESS;
+}
+
+/* Components: a control, an input and an output port each */
+
+static void fake_port_init(FAKE_COMPONENT_T *component, FAKE_PORT_T *port, MMAL_PORT_TYPE_T type,
+                           unsigned int instance)
+{
+    unsigned int i;
+
+    port->port.type = type;
+    port->port.index = 0;
+    port->port.index_all = port - component->ports;
+    port->port.component = &component->component;
+    port->port.format = mmal_format_alloc();
+    port->held_tail = &port->held;
+    snprintf(port->name, sizeof(port->name), "%s:%s:0", component->name, fake_port_types[type]);
+    port->port.name = port->name;
+
+    port->timeline = -1;
+    for (i = 0; i < fake.timeline.ports; i++) {
+        const TIMELINE_PORT_T *tl = &fake.timeline.port[i];
+        if (!strcmp(tl->component, component->name) && tl->instance == instance && tl->type == (unsigned int)type &&
+            tl->index == 0) {
+            port->timeline = i;
+            break;
+        }
+    }
+    fake_port_requirements(port);
+    port->port.buffer_num = port->port.buffer_num_recommended;
+    port->port.buffer_size = port->port.buffer_size_recommended;
+}
+
+MMAL_STATUS_T mmal_component_create(const char *name, MMAL_COMPONENT_T **mmal_component)
+{
+    FAKE_COMPONENT_T *component;
+    unsigned int i, slot, instance = 0;
+
+    pthread_mutex_lock(&fake.lock);
+    if (!fake_load()) {
+        pthread_mutex_unlock(&fake.lock);
+        return MMAL_ENOSYS;
+    }
+    for (slot = 0; slot < FAKE_MAX_COMPONENTS && fake.components[slot]; slot++)
+        ;
+    if (slot == FAKE_MAX_COMPONENTS || !(component = (FAKE_COMPONENT_T *)calloc(1, sizeof(*component)))) {
+        pthread_mutex_unlock(&fake.lock);
+        return MMAL_ENOMEM;
+    }
+    snprintf(component->name, sizeof(component->name), "%s", name);
+    for (i = 0; i < fake.created_count; i++)
+        if (!strcmp(fake.created[i], component->name))
+            instance++;
+    if (fake.created_count < sizeof(fake.created) / sizeof(fake.created[0]))
+        strcpy(fake.created[fake.created_count++], component->name);
+
+    fake_port_init(component, &component->ports[0], MMAL_PORT_TYPE_CONTROL, instance);
+    fake_port_init(component, &component->ports[1], MMAL_PORT_TYPE_INPUT, instance);
+    fake_port_init(component, &component->ports[2], MMAL_PORT_TYPE_OUTPUT, instance);
+    for (i = 0; i < 3; i++) {
+        component->port_list[i] = &component->ports[i].port;
+        if (!component->ports[i].port.format) {
+            while (i-- > 0)
+                mmal_format_free(component->ports[i].port.format);
+            free(component);
+            pthread_mutex_unlock(&fake.lock);
+            return MMAL_ENOMEM;
+        }
+    }
+    component->component.name = component->name;
+    component->component.control = component->port_list[0];
+    component->component.input_num = 1;
+    component->component.input = &component->port_list[1];
+    component->component.output_num = 1;
+    component->component.output = &component->port_list[2];
+    component->component.port_num = 3;
+    component->component.port = component->port_list;
+    component->component.id = slot;
+    component->refcount = 1;
+    fake.components[slot] = component;
+    pthread_mutex_unlock(&fake.lock);
+
+    *mmal_component = &component->component;
+    return MMAL_SUCCESS;
+}
+
+void mmal_component_acquire(MMAL_COMPONENT_T *mmal_component)
+{
+    __atomic_add_fetch(&((FAKE_COMPONENT_T *)mmal_component)->refcount, 1, __ATOMIC_RELAXED);
+}
+
+MMAL_STATUS_T mmal_component_release(MMAL_COMPONENT_T *mmal_component)
+{
+    FAKE_COMPONENT_T *component = (FAKE_COMPONENT_T *)mmal_component;
+    int i, stop = 1;
+
+    if (!component)
+        return MMAL_EINVAL;
+    if (__atomic_sub_fetch(&component->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return MMAL_SUCCESS;
+
+    for (i = 2; i >= 0; i--)
+        if (component->ports[i].port.is_enabled)
+            mmal_port_disable(&component->ports[i].port);
+
+    pthread_mutex_lock(&fake.lock);
+    fake.components[component->component.id] = NULL;
+    for (i = 0; i < FAKE_MAX_COMPONENTS; i++)
+        if (fake.components[i])
+            stop = 0;
+    if (stop && fake.running) {
+        fake.stop = 1;
+        fake.running = 0;
+        pthread_cond_signal(&fake.wake);
+        pthread_mutex_unlock(&fake.lock);
+        if (!pthread_equal(pthread_self(), fake.thread))
+            pthread_join(fake.thread, NULL);
+        else
+            pthread_detach(fake.thread);
+    } else {
+        pthread_mutex_unlock(&fake.lock);
+    }
+
+    for (i = 0; i < 3; i++)
+        mmal_format_free(component->ports[i].port.format);
+    free(component);
+    return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_component_destroy(MMAL_COMPONENT_T *component)
+{
+    return mmal_component_release(component);
+}
+
+MMAL_STATUS_T mmal_component_enable(MMAL_COMPONENT_T *component)
+{
+    component->is_enabled = 1;
+    return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_component_disable(MMAL_COMPONENT_T *component)
+{
+    component->is_enabled = 0;
+    return MMAL_SUCCESS;
+}
@@ -0,0 +1,208 @@
+/* Records the MMAL callback timeline of any example, for replaying it with
+ * mmal_fake.c on a machine without VideoCore.
+ *
+ *   make mmal_record.so
+ *   MMAL_RECORD=run.timeline LD_PRELOAD=./mmal_record.so ./manual_decode_overlay_encode
+ *
+ * mmal_port_enable() is wrapped to put a recording callback in front of the
+ * example's, and mmal_port_send_buffer() to know how long the port held each
+ * buffer. Every callback is written as a line of timeline.h: port, length,
+ * flags, cmd, pts, the time and the hold time, and the new format of format
+ * changed events. Without MMAL_RECORD the calls are passed straight through. */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mmal.h"
+#include "mmal_events.h"
+#include "timeline.h"
+
+#define RECORD_SENT 256         /* buffers in flight */
+
+typedef MMAL_STATUS_T (*PORT_ENABLE_T)(MMAL_PORT_T *port, MMAL_PORT_BH_CB_T cb);
+typedef MMAL_STATUS_T (*PORT_SEND_T)(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+
+static struct {
+    pthread_mutex_t lock;
+    FILE *file;
+    uint64_t start;
+    PORT_ENABLE_T port_enable;
+    PORT_SEND_T port_send_buffer;
+    struct {
+        MMAL_PORT_T *port;
+        MMAL_PORT_BH_CB_T cb;
+    } ports[TIMELINE_MAX_PORTS];
+    unsigned int port_count;
+    struct {
+        MMAL_COMPONENT_T *component;
+        unsigned int instance;
+    } components[TIMELINE_MAX_PORTS];
+    unsigned int component_count;
+    struct {
+        MMAL_BUFFER_HEADER_T *buffer;
+        uint64_t time;
+    } sent[RECORD_SENT];
+    unsigned int sent_count;
+    unsigned long callbacks, unmatched;
+} record = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t record_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+__attribute__((constructor)) static void record_init(void)
+{
+    const char *path = getenv("MMAL_RECORD");
+
+    record.port_enable = (PORT_ENABLE_T)dlsym(RTLD_NEXT, "mmal_port_enable");
+    record.port_send_buffer = (PORT_SEND_T)dlsym(RTLD_NEXT, "mmal_port_send_buffer");
+    if (!path)
+        return;
+    if (!(record.file = fopen(path, "w")))
+        fprintf(stderr, "mmal_record: could not open %s\n", path);
+    else
+        fprintf(record.file, "# mmal timeline 1\n");
+}
+
+__attribute__((destructor)) static void record_exit(void)
+{
+    if (!record.file)
+        return;
+    pthread_mutex_lock(&record.lock);
+    fclose(record.file);
+    record.file = NULL;
+    fprintf(stderr, "mmal_record: %lu callbacks in %u ports recorded, %lu without a send\n", record.callbacks,
+            record.port_count, record.unmatched);
+    pthread_mutex_unlock(&record.lock);
+}
+
+/** The time the buffer was sent, 0 if it was not (events). Forgets it. Locked. */
+static uint64_t record_take_sent(MMAL_BUFFER_HEADER_T *buffer)
+{
+    unsigned int i;
+
+    for (i = 0; i < record.sent_count; i++) {
+        if (record.sent[i].buffer == buffer) {
+            uint64_t time = record.sent[i].time;
+            record.sent[i] = record.sent[--record.sent_count];
+            return time;
+        }
+    }
+    return 0;
+}
+
+static void record_put_sent(MMAL_BUFFER_HEADER_T *buffer, uint64_t time)
+{
+    unsigned int i;
+
+    for (i = 0; i < record.sent_count && record.sent[i].buffer != buffer; i++)
+        ;
+    if (i == RECORD_SENT)
+        return;
+    if (i == record.sent_count)
+        record.sent_count++;
+    record.sent[i].buffer = buffer;
+    record.sent[i].time = time;
+}
+
+/** Index of the port, added on first sight. Locked. */
+static int record_port(MMAL_PORT_T *port)
+{
+    unsigned int i, instance = 0;
+
+    for (i = 0; i < record.port_count; i++)
+        if (record.ports[i].port == port)
+            return i;
+    if (record.port_count == TIMELINE_MAX_PORTS)
+        return -1;
+
+    for (i = 0; i < record.component_count && record.components[i].component != port->component; i++)
+        if (!strcmp(record.components[i].component->name, port->component->name))
+            instance++;
+    if (i == record.component_count && i < TIMELINE_MAX_PORTS) {
+        record.components[i].component = port->component;
+        record.components[i].instance = instance;
+        record.component_count++;
+    }
+    if (i < record.component_count)
+        instance = record.components[i].instance;
+
+    if (!record.start)
+        record.start = record_now_us();
+    record.ports[record.port_count].port = port;
+    timeline_write_port(record.file, record.port_count, port->component->name, instance, port->type, port->index,
+                        port->buffer_num_min, port->buffer_size_min, port->buffer_num_recommended,
+                        port->buffer_size_recommended);
+    return record.port_count++;
+}
+
+static void record_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    uint64_t now = record_now_us(), sent;
+    MMAL_PORT_BH_CB_T cb = NULL;
+    int index;
+
+    pthread_mutex_lock(&record.lock);
+    index = record_port(port);
+    if (index >= 0)
+        cb = record.ports[index].cb;
+    sent = record_take_sent(buffer);
+    if (record.file && index >= 0) {
+        if (buffer->cmd == MMAL_EVENT_FORMAT_CHANGED) {
+            MMAL_EVENT_FORMAT_CHANGED_T *event = mmal_event_format_changed_get(buffer);
+            if (event) {
+                MMAL_VIDEO_FORMAT_T *video = &event->format->es->video;
+                TIMELINE_FORMAT_T format = {
+                    event->format->encoding, video->width, video->height, video->crop.x, video->crop.y,
+                    video->crop.width, video->crop.height, video->frame_rate.num, video->frame_rate.den,
+                    event->buffer_num_min, event->buffer_size_min, event->buffer_num_recommended,
+                    event->buffer_size_recommended,
+                };
+                timeline_write_format(record.file, index, &format);
+            }
+        }
+        if (!buffer->cmd && !sent)
+            record.unmatched++;
+        timeline_write_callback(record.file, now - record.start, index, sent ? (int64_t)(now - sent) : -1,
+                                buffer->cmd, buffer->length, buffer->flags, buffer->pts,
+                                buffer->cmd == MMAL_EVENT_ERROR && buffer->length >= sizeof(MMAL_STATUS_T) ?
+                                *(int32_t *)buffer->data : 0);
+        record.callbacks++;
+    }
+    pthread_mutex_unlock(&record.lock);
+
+    if (cb)
+        cb(port, buffer);
+}
+
+MMAL_STATUS_T mmal_port_enable(MMAL_PORT_T *port, MMAL_PORT_BH_CB_T cb)
+{
+    int index;
+
+    if (!record.file || !cb)
+        return record.port_enable(port, cb);
+    pthread_mutex_lock(&record.lock);
+    index = record_port(port);
+    if (index >= 0)
+        record.ports[index].cb = cb;
+    pthread_mutex_unlock(&record.lock);
+    return record.port_enable(port, index >= 0 ? record_callback : cb);
+}
+
+MMAL_STATUS_T mmal_port_send_buffer(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    if (record.file) {
+        pthread_mutex_lock(&record.lock);
+        record_put_sent(buffer, record_now_us());
+        pthread_mutex_unlock(&record.lock);
+    }
+    return record.port_send_buffer(port, buffer);
+}
@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+"""Writes a made-up timeline (see timeline.h) of manual_decode_overlay_encode
+decoding and re-encoding <frames> 1280x720 frames at 25 fps, the first of
+them frame <first> (0 if not given) by pts, for runs on the replay without a
+recording from the Pi:
+
+    python3 replay/synthetic_timeline.py 360 > run.timeline
+    python3 replay/synthetic_timeline.py 167 193 > second_gop.timeline
+
+Every input buffer comes back after 6 ms, every frame is decoded 40 ms after
+the last and encoded 15 ms after that, with an I-frame every 60 frames. The
+last callback of each output port carries EOS."""
+
+import sys
+
+FORMAT_CHANGED = 0x48434645  # MMAL_EVENT_FORMAT_CHANGED, 'EFCH'
+I420 = 0x30323449
+FRAME_END, KEYFRAME, EOS = 0x4, 0x8, 0x1
+PTS_UNKNOWN = -(1 << 63)
+FRAME_SIZE = 1280 * 720 * 3 // 2
+
+
+def callback(t, port, hold, cmd, length, flags, pts):
+    return t, 'c %d %d %d %d %d %d %d 0' % (t, port, hold, cmd, length, flags, pts)
+
+
+def main():
+    frames = int(sys.argv[1]) if len(sys.argv) > 1 else 360
+    first = int(sys.argv[2]) if len(sys.argv) > 2 else 0
+    records = []
+    for k in range(frames + 1):
+        t = 20000 + k * 40000
+        records.append(callback(t, 1, 6000, 0, 0, EOS if k == frames else FRAME_END, PTS_UNKNOWN))
+    # the decoder output format, which makes the example set up the encoder
+    records.append((30000, 'f 2 %d 1280 720 0 0 1280 720 0 0 1 %d 3 %d\n%s\n'
+                    'p 3 vc.ril.video_encode 0 2 0 1 %d 3 %d\np 4 vc.ril.video_encode 0 3 0 1 65536 1 65536'
+                    % (I420, FRAME_SIZE, FRAME_SIZE, callback(30000, 2, -1, FORMAT_CHANGED, 0, 0, PTS_UNKNOWN)[1],
+                       FRAME_SIZE, FRAME_SIZE)))
+    for k in range(frames + 1):
+        t = 60000 + 40000 * k
+        eos = k == frames
+        pts = (first + k) * 40000
+        records.append(callback(t, 2, 40000, 0, 0 if eos else FRAME_SIZE, EOS if eos else FRAME_END, pts))
+        records.append(callback(t + 8000, 3, 8000, 0, 0, 0, pts))
+        if k == 0:
+            records.append(callback(t + 2000, 4, 30000, 0, 30, 0x20, PTS_UNKNOWN))  # SPS/PPS
+        key = k % 60 == 0
+        records.append(callback(t + 15000, 4, 40000, 0, 0 if eos else 80000 if key else 20000,
+                                EOS if eos else FRAME_END | (KEYFRAME if key else 0), pts))
+    records.sort(key=lambda r: r[0])
+    print('# mmal timeline 1')
+    print('p 0 vc.ril.video_decode 0 1 0 1 0 1 0')
+    print('p 1 vc.ril.video_decode 0 2 0 3 262144 3 262144')
+    print('p 2 vc.ril.video_decode 0 3 0 1 0 3 0')
+    for record in records:
+        print(record[1])
+
+
+if __name__ == '__main__':
+    main()
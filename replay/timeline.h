@@ -0,0 +1,162 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+/* Text format of a recorded MMAL callback timeline (mmal_record.c writes it,
+ * mmal_fake.c replays it). One record per line, times in microseconds since
+ * the first port was enabled:
+ *
+ *   p <port> <component> <instance> <type> <index> <num_min> <size_min> <num_rec> <size_rec>
+ *       a port, when it is first enabled. instance counts components of the same name.
+ *   c <t> <port> <hold> <cmd> <length> <flags> <pts> <arg>
+ *       a callback. hold is the time since the buffer was sent to the port
+ *       (-1 for events, which were never sent), arg the status of an error event.
+ *   f <port> <encoding> <width> <height> <x> <y> <w> <h> <fps_num> <fps_den> <num_min> <size_min> <num_rec> <size_rec>
+ *       the new format of the format changed event in the next c record. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TIMELINE_MAX_PORTS 32
+#define TIMELINE_NAME 64
+
+typedef struct TIMELINE_FORMAT_T {
+    uint32_t encoding, width, height;
+    int32_t crop_x, crop_y, crop_width, crop_height, fps_num, fps_den;
+    uint32_t num_min, size_min, num_rec, size_rec;
+} TIMELINE_FORMAT_T;
+
+typedef struct TIMELINE_CALLBACK_T {
+    int64_t t, hold, pts;
+    uint32_t cmd, length, flags;
+    int32_t arg;
+    TIMELINE_FORMAT_T *format;      /* format changed events only */
+} TIMELINE_CALLBACK_T;
+
+typedef struct TIMELINE_PORT_T {
+    char component[TIMELINE_NAME];
+    unsigned int instance, type, index;
+    uint32_t num_min, size_min, num_rec, size_rec;
+    TIMELINE_CALLBACK_T *callbacks;
+    unsigned int count, allocated;
+} TIMELINE_PORT_T;
+
+typedef struct TIMELINE_T {
+    TIMELINE_PORT_T port[TIMELINE_MAX_PORTS];
+    unsigned int ports;
+} TIMELINE_T;
+
+static void timeline_write_port(FILE *file, unsigned int port, const char *component, unsigned int instance,
+                                unsigned int type, unsigned int index, uint32_t num_min, uint32_t size_min,
+                                uint32_t num_rec, uint32_t size_rec)
+{
+    fprintf(file, "p %u %s %u %u %u %u %u %u %u\n", port, component, instance, type, index,
+            num_min, size_min, num_rec, size_rec);
+}
+
+static void timeline_write_callback(FILE *file, int64_t t, unsigned int port, int64_t hold, uint32_t cmd,
+                                    uint32_t length, uint32_t flags, int64_t pts, int32_t arg)
+{
+    fprintf(file, "c %lld %u %lld %u %u %u %lld %d\n", (long long)t, port, (long long)hold, cmd, length, flags,
+            (long long)pts, arg);
+}
+
+static void timeline_write_format(FILE *file, unsigned int port, const TIMELINE_FORMAT_T *f)
+{
+    fprintf(file, "f %u %u %u %u %d %d %d %d %d %d %u %u %u %u\n", port, f->encoding, f->width, f->height,
+            f->crop_x, f->crop_y, f->crop_width, f->crop_height, f->fps_num, f->fps_den,
+            f->num_min, f->size_min, f->num_rec, f->size_rec);
+}
+
+static void timeline_free(TIMELINE_T *tl)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < tl->ports; i++) {
+        for (j = 0; j < tl->port[i].count; j++)
+            free(tl->port[i].callbacks[j].format);
+        free(tl->port[i].callbacks);
+    }
+    tl->ports = 0;
+}
+
+/** Returns 0 on success, else the line which could not be read */
+static int timeline_read(TIMELINE_T *tl, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    char line[512], component[TIMELINE_NAME];
+    TIMELINE_FORMAT_T format, *pending = NULL;
+    TIMELINE_CALLBACK_T cb;
+    unsigned int port, line_number = 0;
+    long long t, hold, pts;
+    int error = 0;
+
+    memset(tl, 0, sizeof(*tl));
+    if (!file)
+        return -1;
+    while (!error && fgets(line, sizeof(line), file)) {
+        TIMELINE_PORT_T *p;
+
+        line_number++;
+        memset(&cb, 0, sizeof(cb));
+        switch (line[0]) {
+        case 'p':
+            if (sscanf(line, "p %u %63s", &port, component) != 2 || port != tl->ports || port == TIMELINE_MAX_PORTS) {
+                error = line_number;
+                break;
+            }
+            p = &tl->port[tl->ports++];
+            strcpy(p->component, component);
+            if (sscanf(line, "p %*u %*s %u %u %u %u %u %u %u", &p->instance, &p->type, &p->index,
+                       &p->num_min, &p->size_min, &p->num_rec, &p->size_rec) != 7)
+                error = line_number;
+            break;
+        case 'f':
+            memset(&format, 0, sizeof(format));
+            if (sscanf(line, "f %u %u %u %u %d %d %d %d %d %d %u %u %u %u", &port, &format.encoding, &format.width,
+                       &format.height, &format.crop_x, &format.crop_y, &format.crop_width, &format.crop_height,
+                       &format.fps_num, &format.fps_den, &format.num_min, &format.size_min, &format.num_rec,
+                       &format.size_rec) != 14 || !(pending = (TIMELINE_FORMAT_T *)malloc(sizeof(format)))) {
+                error = line_number;
+                break;
+            }
+            *pending = format;
+            break;
+        case 'c':
+            if (sscanf(line, "c %lld %u %lld %u %u %u %lld %d", &t, &port, &hold, &cb.cmd, &cb.length, &cb.flags,
+                       &pts, &cb.arg) != 8 || port >= tl->ports) {
+                error = line_number;
+                break;
+            }
+            p = &tl->port[port];
+            if (p->count == p->allocated) {
+                TIMELINE_CALLBACK_T *grown = (TIMELINE_CALLBACK_T *)realloc(p->callbacks,
+                                                 (p->allocated * 2 + 64) * sizeof(*grown));
+                if (!grown) {
+                    error = line_number;
+                    break;
+                }
+                p->callbacks = grown;
+                p->allocated = p->allocated * 2 + 64;
+            }
+            cb.t = t;
+            cb.hold = hold;
+            cb.pts = pts;
+            cb.format = pending;
+            pending = NULL;
+            p->callbacks[p->count++] = cb;
+            break;
+        default:
+            /* comments and empty lines */
+            break;
+        }
+    }
+    free(pending);
+    fclose(file);
+    if (error)
+        timeline_free(tl);
+    return error;
+}
+
+#endif
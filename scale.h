@@ -0,0 +1,86 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+/* Area-averaging downscaler for the planes of decoded frames.
+ *
+ * Every destination pixel is the rounded average of the block of source pixels
+ * it covers. The source rows of a block are first summed into a 16 bit row
+ * accumulator, 16 pixels at a time with GCC vector types (NEON / SSE2), so each
+ * source pixel is touched exactly once; the horizontal sums then only run over
+ * the accumulator once per destination row. Blocks may be at most 257 rows high. */
+
+#include <stdint.h>
+#include <string.h>
+#include "frame.h"
+
+typedef uint8_t scale_bytes_t __attribute__((vector_size(16)));
+typedef uint16_t scale_words_t __attribute__((vector_size(16)));
+
+/** acc[i] += src[i] */
+static void scale_accumulate_row(uint16_t *acc, const uint8_t *src, unsigned int n)
+{
+    /* interleaving with zero bytes widens to 16 bit on a little endian CPU */
+    static const scale_bytes_t lo = { 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23 };
+    static const scale_bytes_t hi = { 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31 };
+    const scale_bytes_t zero = { 0 };
+    unsigned int i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        scale_bytes_t s;
+        scale_words_t a[2];
+        memcpy(&s, src + i, 16);
+        memcpy(a, acc + i, 32);
+        a[0] += (scale_words_t)__builtin_shuffle(s, zero, lo);
+        a[1] += (scale_words_t)__builtin_shuffle(s, zero, hi);
+        memcpy(acc + i, a, 32);
+    }
+    for (; i < n; i++)
+        acc[i] += src[i];
+}
+
+/** Downscale one plane. acc is scratch space for sw values. Returns -1 if
+ * the destination is larger than the source or the ratio is too big. */
+static int scale_plane(const uint8_t *src, unsigned int src_pitch, unsigned int sw, unsigned int sh,
+                       uint8_t *dst, unsigned int dst_pitch, unsigned int dw, unsigned int dh,
+                       uint16_t *acc)
+{
+    unsigned int ox, oy, x, y;
+
+    if (!dw || !dh || dw > sw || dh > sh || (sh + dh - 1) / dh > 257)
+        return -1;
+
+    for (oy = 0; oy < dh; oy++) {
+        unsigned int y0 = oy * sh / dh, y1 = (oy + 1) * sh / dh;
+        uint8_t *out = dst + oy * dst_pitch;
+
+        memset(acc, 0, sw * sizeof(*acc));
+        for (y = y0; y < y1; y++)
+            scale_accumulate_row(acc, src + y * src_pitch, sw);
+
+        for (ox = 0; ox < dw; ox++) {
+            unsigned int x0 = ox * sw / dw, x1 = (ox + 1) * sw / dw;
+            unsigned int area = (x1 - x0) * (y1 - y0), sum = 0;
+            for (x = x0; x < x1; x++)
+                sum += acc[x];
+            out[ox] = (sum + area / 2) / area;
+        }
+    }
+    return 0;
+}
+
+/** Downscale all three planes of an I420 frame, each on its own. dst must have
+ * even dimensions, acc is scratch space for src->width values. Returns 0 on success. */
+static int scale_frame_i420(const FRAME_T *src, FRAME_T *dst, uint16_t *acc)
+{
+    unsigned int p;
+
+    for (p = 0; p < 3; p++) {
+        unsigned int shift = p ? 1 : 0;
+        if (scale_plane(src->plane[p], src->pitch[p], src->width >> shift, src->height >> shift,
+                        dst->plane[p], dst->pitch[p], dst->width >> shift, dst->height >> shift, acc))
+            return -1;
+    }
+    return 0;
+}
+
+#endif
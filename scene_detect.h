@@ -0,0 +1,137 @@
+#ifndef SCENE_DETECT_H
+#define SCENE_DETECT_H
+
+/* Scene-cut detection on the decoded luma plane.
+ *
+ * Every row_step-th luma row is compared with the same row of the previous
+ * frame (sum of absolute differences, 16 pixels at a time with SSE2 psadbw or
+ * NEON vabd/vpadal, scalar otherwise). The score is the mean absolute
+ * difference per sampled pixel. A frame is a cut when its score is both above
+ * an absolute minimum and a multiple of the recent average, so slow pans and
+ * noisy sources do not trigger on every frame. At most one cut is reported per
+ * min_gap frames, which keeps fast flashes from turning into a burst of I-frames. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "interface/vcos/vcos.h"
+#include "frame.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+typedef struct SCENE_DETECT_T {
+    unsigned int width, height, row_step, rows;
+    uint8_t *prev;              /* sampled rows of the previous frame, width bytes each */
+    int have_prev;
+
+    /* tuning, set by scene_detect_create, may be changed afterwards */
+    double min_score;           /* mean absolute difference a cut needs at least */
+    double factor;              /* ... and relative to the running average */
+    unsigned int min_gap;       /* frames */
+
+    double average;             /* running average of the score of non-cut frames */
+    double score, max_score;    /* last and highest score */
+    unsigned int since_cut;
+
+    unsigned int frames, cuts;
+    uint64_t us;                /* time spent in scene_detect_frame, all frames */
+} SCENE_DETECT_T;
+
+/** Sum of absolute differences of n bytes */
+static uint32_t scene_sad_row(const uint8_t *a, const uint8_t *b, unsigned int n)
+{
+    uint32_t sum = 0;
+    unsigned int i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t d = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        acc = vpadalq_u16(acc, vpaddlq_u8(d));
+    }
+    sum = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) + vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(x, y));
+    }
+    sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+    for (; i < n; i++)
+        sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    return sum;
+}
+
+/** Detector for width x height frames, comparing every row_step-th row.
+ * Returns 0 on success. */
+static int scene_detect_create(SCENE_DETECT_T *sd, unsigned int width, unsigned int height, unsigned int row_step)
+{
+    memset(sd, 0, sizeof(*sd));
+    if (!width || !height || !row_step)
+        return -1;
+    sd->width = width;
+    sd->height = height;
+    sd->row_step = row_step;
+    sd->rows = (height + row_step - 1) / row_step;
+    sd->prev = (uint8_t *)malloc((size_t)width * sd->rows);
+    sd->min_score = 12.0;
+    sd->factor = 4.0;
+    sd->min_gap = 12;
+    return sd->prev ? 0 : -1;
+}
+
+static void scene_detect_destroy(SCENE_DETECT_T *sd)
+{
+    free(sd->prev);
+    sd->prev = NULL;
+}
+
+/** Compare the luma plane with the previous frame's. Returns 1 if the frame
+ * starts a new scene. The first frame is never a cut. */
+static int scene_detect_frame(SCENE_DETECT_T *sd, const FRAME_T *frame)
+{
+    uint64_t start = vcos_getmicrosecs64();
+    uint64_t sad = 0;
+    unsigned int r;
+    int cut = 0;
+
+    if (frame->width != sd->width || frame->height != sd->height)
+        return 0;
+
+    for (r = 0; r < sd->rows; r++) {
+        const uint8_t *row = frame->plane[0] + (size_t)r * sd->row_step * frame->pitch[0];
+        uint8_t *prev = sd->prev + (size_t)r * sd->width;
+        if (sd->have_prev)
+            sad += scene_sad_row(row, prev, sd->width);
+        memcpy(prev, row, sd->width);
+    }
+
+    if (sd->have_prev) {
+        sd->score = (double)sad / ((double)sd->width * sd->rows);
+        if (sd->score > sd->max_score)
+            sd->max_score = sd->score;
+        sd->since_cut++;
+
+        cut = sd->score >= sd->min_score && sd->score >= sd->factor * sd->average &&
+              sd->since_cut >= sd->min_gap;
+        if (cut) {
+            sd->since_cut = 0;
+            sd->cuts++;
+        } else {
+            /* cuts are kept out of the average, otherwise the next one would be missed */
+            sd->average += (sd->score - sd->average) / 16;
+        }
+    }
+    sd->have_prev = 1;
+    sd->frames++;
+    sd->us += vcos_getmicrosecs64() - start;
+    return cut;
+}
+
+#endif
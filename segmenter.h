@@ -0,0 +1,401 @@
+#ifndef SEGMENTER_H
+#define SEGMENTER_H
+
+/* Encoded video in segments of a few seconds, with a rolling HLS style
+ * playlist, for streams which run for days.
+ *
+ * A new segment starts at the first IDR after the target duration (in media
+ * time, from the pts). Every segment begins with the SPS/PPS, so each file can
+ * be decoded on its own. The encoder output path only ever writes to the
+ * current file: a writer thread opens the next segment ahead of time, and
+ * closes finished ones, rewrites the playlist (temporary file, then rename, so
+ * readers never see half of it) and deletes segments which dropped out of the
+ * playlist a while ago. If the next file is not open yet at an IDR, the
+ * current segment just gets longer.
+ *
+ * Segments are H.264 Annex B elementary streams (<prefix>-NNNNN.h264), not
+ * MPEG-TS: fine for ffmpeg/ffplay and for archiving, players which insist on
+ * TS need a remux. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "interface/vcos/vcos.h"
+#include "thread_roles.h"
+
+#define SEGMENTER_KEYFRAME 0x1      /* access unit starts with an IDR */
+#define SEGMENTER_FRAME_END 0x2     /* last piece of the access unit */
+#define SEGMENTER_CONFIG 0x4        /* SPS/PPS */
+#define SEGMENTER_MAX_CONFIG 1024
+#define SEGMENTER_WINDOW 6          /* segments in the playlist */
+#define SEGMENTER_KEEP 2            /* segments kept on disk after they left the playlist */
+#define SEGMENTER_MAX_JOBS 4
+
+typedef struct SEGMENTER_SEGMENT_T {
+    int fd;
+    unsigned int index;
+    int64_t duration_us;
+    uint64_t bytes;
+} SEGMENTER_SEGMENT_T;
+
+typedef struct SEGMENTER_T {
+    char prefix[200];
+    char playlist[256];
+    int64_t target_us;
+
+    /* encoder output path only */
+    SEGMENTER_SEGMENT_T current;    /* current.fd < 0 before the first IDR */
+    int64_t start_pts, last_pts, frame_us;
+    int in_au;
+
+    VCOS_MUTEX_T lock;
+    uint8_t config[SEGMENTER_MAX_CONFIG];                   /* protected by lock */
+    size_t config_size;                                     /* protected by lock */
+    int spare_fd, spare_prefixed;                           /* protected by lock, opened ahead */
+    unsigned int spare_index;                               /* protected by lock */
+    SEGMENTER_SEGMENT_T jobs[SEGMENTER_MAX_JOBS];           /* protected by lock, finished segments */
+    unsigned int job_head, job_tail;                        /* protected by lock */
+    int quit;                                               /* protected by lock */
+    VCOS_SEMAPHORE_T pending;
+    VCOS_THREAD_T thread;
+
+    /* writer thread only */
+    unsigned int next_index;
+    SEGMENTER_SEGMENT_T listed[SEGMENTER_WINDOW];
+    unsigned int listed_count;
+    unsigned int deleted, failed;
+    uint64_t open_us, open_max_us, opened;
+
+    /* encoder output path */
+    unsigned int segments, rotations, late, dropped;
+    int64_t min_us, max_us, total_us;
+    uint64_t rotate_us, rotate_max_us;
+} SEGMENTER_T;
+
+static void segmenter_path(const SEGMENTER_T *seg, unsigned int index, char *path, size_t size)
+{
+    snprintf(path, size, "%s-%05u.h264", seg->prefix, index);
+}
+
+static int segmenter_write_all(int fd, const uint8_t *data, size_t size)
+{
+    while (size) {
+        ssize_t done = write(fd, data, size);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return -1;
+        data += done;
+        size -= done;
+    }
+    return 0;
+}
+
+/** Writer thread: the playlist as it is now, atomically */
+static int segmenter_write_playlist(SEGMENTER_T *seg, int end)
+{
+    char tmp[sizeof(seg->playlist) + 4], path[256];
+    const char *name;
+    int64_t longest = 0;
+    unsigned int i;
+    FILE *file;
+    int ok;
+
+    for (i = 0; i < seg->listed_count; i++)
+        if (seg->listed[i].duration_us > longest)
+            longest = seg->listed[i].duration_us;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", seg->playlist);
+    file = fopen(tmp, "w");
+    if (!file)
+        return -1;
+    fprintf(file, "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%lld\n#EXT-X-MEDIA-SEQUENCE:%u\n",
+            (long long)((longest + 999999) / 1000000), seg->listed_count ? seg->listed[0].index : 0);
+    for (i = 0; i < seg->listed_count; i++) {
+        segmenter_path(seg, seg->listed[i].index, path, sizeof(path));
+        name = strrchr(path, '/');
+        fprintf(file, "#EXTINF:%.3f,\n%s\n", seg->listed[i].duration_us / 1e6, name ? name + 1 : path);
+    }
+    if (end)
+        fprintf(file, "#EXT-X-ENDLIST\n");
+    ok = !ferror(file);
+    if (fclose(file) != 0 || !ok || rename(tmp, seg->playlist) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/** Writer thread: close a finished segment, put it in the playlist, expire old ones */
+static void segmenter_finish(SEGMENTER_T *seg, const SEGMENTER_SEGMENT_T *done, int end)
+{
+    char path[256];
+
+    if (close(done->fd) != 0)
+        seg->failed++;
+    if (seg->listed_count == SEGMENTER_WINDOW) {
+        memmove(&seg->listed[0], &seg->listed[1], (SEGMENTER_WINDOW - 1) * sizeof(seg->listed[0]));
+        seg->listed_count--;
+    }
+    seg->listed[seg->listed_count++] = *done;
+    if (segmenter_write_playlist(seg, end) != 0)
+        seg->failed++;
+
+    /* players may still be fetching what just left the playlist */
+    if (seg->listed[0].index >= SEGMENTER_KEEP + 1) {
+        segmenter_path(seg, seg->listed[0].index - SEGMENTER_KEEP - 1, path, sizeof(path));
+        if (unlink(path) == 0)
+            seg->deleted++;
+    }
+}
+
+/** Writer thread (the first one from segmenter_create): open the next
+ * segment, with the SPS/PPS if they are known */
+static void segmenter_open_spare(SEGMENTER_T *seg)
+{
+    uint64_t start = vcos_getmicrosecs64(), us;
+    uint8_t config[SEGMENTER_MAX_CONFIG];
+    size_t config_size;
+    char path[256];
+    int fd, prefixed = 0;
+
+    vcos_mutex_lock(&seg->lock);
+    config_size = seg->config_size;
+    memcpy(config, seg->config, config_size);
+    vcos_mutex_unlock(&seg->lock);
+
+    segmenter_path(seg, seg->next_index, path, sizeof(path));
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        seg->failed++;
+        return;
+    }
+    if (config_size) {
+        if (segmenter_write_all(fd, config, config_size) != 0)
+            seg->failed++;
+        prefixed = 1;
+    }
+
+    us = vcos_getmicrosecs64() - start;
+    seg->opened++;
+    seg->open_us += us;
+    if (us > seg->open_max_us)
+        seg->open_max_us = us;
+
+    vcos_mutex_lock(&seg->lock);
+    seg->spare_fd = fd;
+    seg->spare_index = seg->next_index++;
+    seg->spare_prefixed = prefixed;
+    vcos_mutex_unlock(&seg->lock);
+}
+
+static void *segmenter_thread(void *arg)
+{
+    SEGMENTER_T *seg = (SEGMENTER_T *)arg;
+
+    thread_role_enter(THREAD_ROLE_IO, "segment writer");
+    for (;;) {
+        SEGMENTER_SEGMENT_T done;
+        int have_job, need_spare, quit;
+
+        vcos_semaphore_wait(&seg->pending);
+        for (;;) {
+            vcos_mutex_lock(&seg->lock);
+            have_job = seg->job_head != seg->job_tail;
+            if (have_job)
+                done = seg->jobs[seg->job_head++ % SEGMENTER_MAX_JOBS];
+            quit = seg->quit;
+            need_spare = seg->spare_fd < 0 && !quit;
+            vcos_mutex_unlock(&seg->lock);
+            if (!have_job)
+                break;
+            /* the last job is the final segment: close the playlist */
+            segmenter_finish(seg, &done, quit && seg->job_head == seg->job_tail);
+        }
+        if (quit)
+            break;
+        if (need_spare)
+            segmenter_open_spare(seg);
+    }
+    thread_role_leave();
+    return NULL;
+}
+
+/** Segments of about target_ms, listed in playlist (e.g. live.m3u8) and named
+ * after it (live-00000.h264, ...). Returns 0 on success. */
+static int segmenter_create(SEGMENTER_T *seg, const char *playlist, unsigned int target_ms)
+{
+    const char *dot = strrchr(playlist, '.');
+    size_t length = dot && !strchr(dot, '/') ? (size_t)(dot - playlist) : strlen(playlist);
+    char path[256];
+
+    memset(seg, 0, sizeof(*seg));
+    seg->current.fd = -1;
+    seg->spare_fd = -1;
+    seg->min_us = INT64_MAX;
+    if (length >= sizeof(seg->prefix) || strlen(playlist) >= sizeof(seg->playlist) || !target_ms)
+        return -1;
+    memcpy(seg->prefix, playlist, length);
+    strcpy(seg->playlist, playlist);
+    seg->target_us = target_ms * 1000ll;
+
+    if (vcos_mutex_create(&seg->lock, "segmenter") != VCOS_SUCCESS)
+        return -1;
+    /* the first one here, so the first IDR always finds a file ready */
+    segmenter_open_spare(seg);
+    if (seg->spare_fd < 0)
+        goto fail_spare;
+    if (vcos_semaphore_create(&seg->pending, "segmenter", 1) != VCOS_SUCCESS)
+        goto fail_semaphore;
+    if (vcos_thread_create(&seg->thread, "segment writer", NULL, segmenter_thread, seg) != VCOS_SUCCESS)
+        goto fail_thread;
+    return 0;
+
+fail_thread:
+    vcos_semaphore_delete(&seg->pending);
+fail_semaphore:
+    close(seg->spare_fd);
+    seg->spare_fd = -1;
+    segmenter_path(seg, seg->spare_index, path, sizeof(path));
+    unlink(path);
+fail_spare:
+    vcos_mutex_delete(&seg->lock);
+    return -1;
+}
+
+static void segmenter_count(SEGMENTER_T *seg, int64_t duration_us)
+{
+    seg->segments++;
+    seg->total_us += duration_us;
+    if (duration_us < seg->min_us)
+        seg->min_us = duration_us;
+    if (duration_us > seg->max_us)
+        seg->max_us = duration_us;
+}
+
+/** Encoder output path: try to start a new segment with the access unit at pts.
+ * Never waits for the writer thread. */
+static void segmenter_rotate(SEGMENTER_T *seg, int64_t pts)
+{
+    uint64_t start = vcos_getmicrosecs64(), us;
+    SEGMENTER_SEGMENT_T next = { -1, 0, 0, 0 };
+    int prefixed = 0;
+
+    vcos_mutex_lock(&seg->lock);
+    if (seg->spare_fd >= 0 && seg->job_tail - seg->job_head < SEGMENTER_MAX_JOBS) {
+        next.fd = seg->spare_fd;
+        next.index = seg->spare_index;
+        prefixed = seg->spare_prefixed;
+        seg->spare_fd = -1;
+        if (seg->current.fd >= 0) {
+            seg->current.duration_us = pts - seg->start_pts;
+            seg->jobs[seg->job_tail++ % SEGMENTER_MAX_JOBS] = seg->current;
+        }
+    }
+    vcos_mutex_unlock(&seg->lock);
+    if (next.fd < 0) {
+        seg->late++;
+        return;
+    }
+    /* the writer closes the old one and opens the one after this */
+    vcos_semaphore_post(&seg->pending);
+
+    if (seg->current.fd >= 0)
+        segmenter_count(seg, seg->current.duration_us);
+    seg->current = next;
+    seg->start_pts = pts;
+    if (!prefixed && seg->config_size)
+        segmenter_write_all(next.fd, seg->config, seg->config_size);
+
+    us = vcos_getmicrosecs64() - start;
+    seg->rotations++;
+    seg->rotate_us += us;
+    if (us > seg->rotate_max_us)
+        seg->rotate_max_us = us;
+}
+
+/** Encoder output path: one buffer of the encoded stream, flags SEGMENTER_*,
+ * pts in microseconds of media time */
+static void segmenter_add(SEGMENTER_T *seg, const uint8_t *data, size_t size, unsigned int flags, int64_t pts)
+{
+    if (flags & SEGMENTER_CONFIG) {
+        vcos_mutex_lock(&seg->lock);
+        if (size <= sizeof(seg->config)) {
+            memcpy(seg->config, data, size);
+            seg->config_size = size;
+        }
+        vcos_mutex_unlock(&seg->lock);
+        /* a new SPS/PPS mid-stream also goes into the current segment */
+        if (seg->current.fd >= 0)
+            segmenter_write_all(seg->current.fd, data, size);
+        return;
+    }
+
+    if (!seg->in_au) {
+        if (seg->last_pts && pts > seg->last_pts)
+            seg->frame_us = pts - seg->last_pts;
+        seg->last_pts = pts;
+        if ((flags & SEGMENTER_KEYFRAME) && (seg->current.fd < 0 || pts - seg->start_pts >= seg->target_us))
+            segmenter_rotate(seg, pts);
+    }
+    seg->in_au = !(flags & SEGMENTER_FRAME_END);
+
+    if (seg->current.fd < 0) {
+        /* nothing decodable before the first IDR */
+        seg->dropped++;
+        return;
+    }
+    if (segmenter_write_all(seg->current.fd, data, size) == 0)
+        seg->current.bytes += size;
+}
+
+/** Finish the last segment and the playlist, stop the writer thread */
+static void segmenter_destroy(SEGMENTER_T *seg)
+{
+    char path[256];
+
+    vcos_mutex_lock(&seg->lock);
+    /* the last segment needs a free job slot: wait for the writer to drain them */
+    while (seg->current.fd >= 0 && seg->job_tail - seg->job_head == SEGMENTER_MAX_JOBS) {
+        vcos_mutex_unlock(&seg->lock);
+        vcos_semaphore_post(&seg->pending);
+        vcos_sleep(1);
+        vcos_mutex_lock(&seg->lock);
+    }
+    if (seg->current.fd >= 0) {
+        seg->current.duration_us = seg->last_pts + seg->frame_us - seg->start_pts;
+        seg->jobs[seg->job_tail++ % SEGMENTER_MAX_JOBS] = seg->current;
+        segmenter_count(seg, seg->current.duration_us);
+        seg->current.fd = -1;
+    }
+    seg->quit = 1;
+    vcos_mutex_unlock(&seg->lock);
+    vcos_semaphore_post(&seg->pending);
+    vcos_thread_join(&seg->thread, NULL);
+
+    if (seg->spare_fd >= 0) {
+        close(seg->spare_fd);
+        segmenter_path(seg, seg->spare_index, path, sizeof(path));
+        unlink(path);
+    }
+    vcos_semaphore_delete(&seg->pending);
+    vcos_mutex_delete(&seg->lock);
+}
+
+static void segmenter_print(const SEGMENTER_T *seg, FILE *file)
+{
+    if (!seg->segments) {
+        fprintf(file, "segmenter: no segment finished, %u late rotations\n", seg->late);
+        return;
+    }
+    fprintf(file, "segmenter: %u segments, %.2f s avg (%.2f..%.2f s), %u late rotations, rotation %.1f us avg "
+            "(max %.1f us) on the encoder path, open %.2f ms avg (max %.2f ms) on the writer, %u deleted, %u failed\n",
+            seg->segments, seg->total_us / 1e6 / seg->segments, seg->min_us / 1e6, seg->max_us / 1e6, seg->late,
+            (double)seg->rotate_us / seg->rotations, (double)seg->rotate_max_us,
+            seg->opened ? seg->open_us / 1e3 / seg->opened : 0, seg->open_max_us / 1e3, seg->deleted, seg->failed);
+}
+
+#endif
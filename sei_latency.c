@@ -0,0 +1,158 @@
+/* Receiving side of manual_decode_overlay_encode -L: reads an H.264 stream,
+ * takes the latency SEI (sei_timestamp.h) out of every picture and reports
+ * per frame and as a distribution
+ *   pipeline  from ingest to leaving the encoder, on the sender's clock
+ *   arrival   from ingest to this process reading the SEI, wall clock: the
+ *             glass-to-glass latency, only meaningful with synchronised clocks
+ *             (or -m on the same machine, with the monotonic clock)
+ * and the sequence numbers missing in between.
+ *
+ * The stream is read with read(), not stdio, so a picture is seen as soon as
+ * it arrives through a pipe or socket:
+ *   nc -l 5000 | ./sei_latency -
+ * For a file the arrival times are just the time it was read.
+ *
+ * Usage: ./sei_latency [-m] [-o frames.csv] file.h264|- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "sei_timestamp.h"
+
+#define READ_CHUNK (64 * 1024)
+
+typedef struct LATENCY_T {
+    int64_t *us;
+    size_t n, alloc;
+} LATENCY_T;
+
+static void latency_add(LATENCY_T *l, int64_t us)
+{
+    if (l->n == l->alloc) {
+        size_t alloc = l->alloc * 2 + 1024;
+        int64_t *grown = (int64_t *)realloc(l->us, alloc * sizeof(*grown));
+        if (!grown)
+            return;
+        l->us = grown;
+        l->alloc = alloc;
+    }
+    l->us[l->n++] = us;
+}
+
+static int compare_us(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void latency_print(LATENCY_T *l, const char *name)
+{
+    if (!l->n)
+        return;
+    qsort(l->us, l->n, sizeof(*l->us), compare_us);
+    printf("%-8s min %.2f ms, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", name, l->us[0] / 1e3,
+           l->us[l->n / 2] / 1e3, l->us[l->n * 90 / 100] / 1e3, l->us[l->n * 99 / 100] / 1e3, l->us[l->n - 1] / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+    LATENCY_T pipeline = { 0 }, arrival = { 0 };
+    uint8_t *buf;
+    size_t len = 0, alloc = 4 * READ_CHUNK;
+    FILE *csv = NULL;
+    uint32_t next_seq = 0;
+    unsigned int frames = 0, missing = 0, reordered = 0;
+    int opt, fd, monotonic = 0;
+    ssize_t got;
+
+    while ((opt = getopt(argc, argv, "mo:")) != -1) {
+        switch (opt) {
+        case 'm':
+            monotonic = 1;
+            break;
+        case 'o':
+            if (!(csv = fopen(optarg, "w"))) {
+                fprintf(stderr, "cannot open %s\n", optarg);
+                return 1;
+            }
+            fprintf(csv, "seq,pipeline_ms,arrival_ms\n");
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m] [-o frames.csv] file.h264|-\n"
+                            "  -m  sender on the same machine: arrival latency from the monotonic clock\n"
+                            "  -o  write the latencies of every frame as CSV\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-m] [-o frames.csv] file.h264|-\n", argv[0]);
+        return 1;
+    }
+    fd = strcmp(argv[optind], "-") ? open(argv[optind], O_RDONLY) : 0;
+    if (fd < 0 || !(buf = (uint8_t *)malloc(alloc))) {
+        fprintf(stderr, "cannot read %s\n", argv[optind]);
+        return 1;
+    }
+
+    do {
+        uint64_t now;
+        size_t pos, end;
+
+        if (alloc - len < READ_CHUNK) {
+            uint8_t *grown = (uint8_t *)realloc(buf, alloc * 2);
+            if (!grown)
+                break;
+            buf = grown;
+            alloc *= 2;
+        }
+        got = read(fd, buf + len, alloc - len);
+        now = sei_ts_clock_us(monotonic ? CLOCK_MONOTONIC : CLOCK_REALTIME);
+        if (got > 0)
+            len += got;
+
+        /* every NAL unit followed by a start code is complete, at the end everything is */
+        pos = h264_find_start_code(buf, 0, len);
+        if (pos == len && len > 3)
+            pos = len - 3; /* may be the beginning of a start code */
+        while (pos < len) {
+            SEI_TS_T ts;
+            end = h264_find_start_code(buf, pos + 3, len);
+            if (end == len && got > 0)
+                break;
+            if (sei_ts_parse(buf + pos, end - pos, &ts)) {
+                int64_t pipeline_us = ts.emit_us - ts.ingest_us;
+                int64_t arrival_us = now - (monotonic ? ts.ingest_us : ts.ingest_wall_us);
+                if (frames && ts.seq != next_seq) {
+                    if ((int32_t)(ts.seq - next_seq) > 0)
+                        missing += ts.seq - next_seq;
+                    else
+                        reordered++;
+                }
+                next_seq = ts.seq + 1;
+                frames++;
+                latency_add(&pipeline, pipeline_us);
+                latency_add(&arrival, arrival_us);
+                if (csv)
+                    fprintf(csv, "%u,%.3f,%.3f\n", ts.seq, pipeline_us / 1e3, arrival_us / 1e3);
+            }
+            pos = end;
+        }
+        memmove(buf, buf + pos, len - pos);
+        len -= pos;
+    } while (got > 0);
+
+    if (csv)
+        fclose(csv);
+    if (fd > 0)
+        close(fd);
+    free(buf);
+    printf("%u frames with latency SEI, %u missing, %u out of order\n", frames, missing, reordered);
+    latency_print(&pipeline, "pipeline");
+    latency_print(&arrival, "arrival");
+    free(pipeline.us);
+    free(arrival.us);
+    return frames ? 0 : 1;
+}
@@ -0,0 +1,194 @@
+#ifndef SEI_TIMESTAMP_H
+#define SEI_TIMESTAMP_H
+
+/* Latency stamps carried in the H.264 stream: a user data unregistered SEI
+ * (payload type 5) in front of the first slice of every encoded picture, with
+ * a sequence number, the time the picture entered the pipeline (wall clock
+ * and CLOCK_MONOTONIC) and the monotonic time it left the encoder.
+ *
+ * The writer puts the SEI between the buffer's leading NAL units (AUD,
+ * SPS/PPS) and its first slice with separate writes, so the encoded picture
+ * goes from the MMAL buffer to the file without being copied around it.
+ * sei_latency.c reads the stamps back on the receiving side: pipeline latency
+ * needs no clock sync, glass-to-glass latency uses the wall clock and needs
+ * the two machines synchronised (NTP, PTP). */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "h264_nal.h"
+
+#define SEI_TS_PAYLOAD 28           /* seq, ingest wall, ingest monotonic, emit monotonic */
+#define SEI_TS_MAX 96               /* a whole SEI NAL unit, start code and emulation prevention included */
+#define SEI_TS_RING 64              /* frames in flight in the pipeline, at most */
+
+/* identifies our SEI among other user data */
+static const uint8_t sei_ts_uuid[16] = {
+    0x6d, 0x6d, 0x61, 0x6c, 0x2d, 0x6c, 0x61, 0x74, 0x65, 0x6e, 0x63, 0x79, 0x2d, 0x74, 0x73, 0x31
+};
+
+typedef struct SEI_TS_T {
+    uint32_t seq;
+    uint64_t ingest_wall_us;        /* CLOCK_REALTIME */
+    uint64_t ingest_us;             /* CLOCK_MONOTONIC */
+    uint64_t emit_us;               /* CLOCK_MONOTONIC */
+} SEI_TS_T;
+
+/** Ingest times by frame number, until the encoded frame comes out */
+typedef struct SEI_TS_RING_T {
+    struct {
+        uint64_t wall_us, us;
+    } frame[SEI_TS_RING];
+    uint32_t seq;
+} SEI_TS_RING_T;
+
+static uint64_t sei_ts_clock_us(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sei_ts_ingest(SEI_TS_RING_T *ring, unsigned int frame)
+{
+    ring->frame[frame % SEI_TS_RING].wall_us = sei_ts_clock_us(CLOCK_REALTIME);
+    ring->frame[frame % SEI_TS_RING].us = sei_ts_clock_us(CLOCK_MONOTONIC);
+}
+
+/** The stamp for an encoded frame leaving the pipeline now */
+static void sei_ts_emit(SEI_TS_RING_T *ring, unsigned int frame, SEI_TS_T *ts)
+{
+    ts->seq = ring->seq++;
+    ts->ingest_wall_us = ring->frame[frame % SEI_TS_RING].wall_us;
+    ts->ingest_us = ring->frame[frame % SEI_TS_RING].us;
+    ts->emit_us = sei_ts_clock_us(CLOCK_MONOTONIC);
+}
+
+static void sei_ts_put(uint8_t *p, uint64_t value, unsigned int bytes)
+{
+    while (bytes--) {
+        p[bytes] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static uint64_t sei_ts_get(const uint8_t *p, unsigned int bytes)
+{
+    uint64_t value = 0;
+
+    while (bytes--)
+        value = value << 8 | *p++;
+    return value;
+}
+
+/** Write the SEI NAL unit for ts into out (SEI_TS_MAX bytes), returns its size */
+static size_t sei_ts_build(uint8_t *out, const SEI_TS_T *ts)
+{
+    uint8_t rbsp[2 + sizeof(sei_ts_uuid) + SEI_TS_PAYLOAD + 1];
+    size_t i, size = 0, zeros = 0;
+
+    rbsp[0] = 5;                    /* user_data_unregistered */
+    rbsp[1] = sizeof(sei_ts_uuid) + SEI_TS_PAYLOAD;
+    memcpy(rbsp + 2, sei_ts_uuid, sizeof(sei_ts_uuid));
+    sei_ts_put(rbsp + 18, ts->seq, 4);
+    sei_ts_put(rbsp + 22, ts->ingest_wall_us, 8);
+    sei_ts_put(rbsp + 30, ts->ingest_us, 8);
+    sei_ts_put(rbsp + 38, ts->emit_us, 8);
+    rbsp[46] = 0x80;                /* rbsp_trailing_bits */
+
+    out[size++] = 0;
+    out[size++] = 0;
+    out[size++] = 0;
+    out[size++] = 1;
+    out[size++] = H264_NAL_SEI;
+    for (i = 0; i < sizeof(rbsp); i++) {
+        /* emulation prevention, a timestamp easily has two zero bytes in a row */
+        if (zeros == 2 && rbsp[i] <= 3) {
+            out[size++] = 3;
+            zeros = 0;
+        }
+        out[size++] = rbsp[i];
+        zeros = rbsp[i] ? 0 : zeros + 1;
+    }
+    return size;
+}
+
+/** Where the SEI goes into an encoded buffer: behind the AUD, SPS and PPS it
+ * starts with, in front of the first slice */
+static size_t sei_ts_insert_offset(const uint8_t *data, size_t size)
+{
+    size_t pos = h264_find_start_code(data, 0, size);
+
+    while (pos < size) {
+        unsigned int header = data[pos + 2] == 1 ? 3 : 4, type;
+        if (pos + header >= size)
+            break;
+        type = data[pos + header] & 0x1f;
+        if (type != H264_NAL_AUD && type != H264_NAL_SPS && type != H264_NAL_PPS)
+            return pos;
+        pos = h264_find_start_code(data, pos + 3, size);
+    }
+    return size;
+}
+
+/** Write the first buffer of an encoded picture with the SEI in it.
+ * Returns 0, -1 on write errors. */
+static int sei_ts_write(FILE *file, const uint8_t *sei, size_t sei_size, const uint8_t *data, size_t size)
+{
+    size_t at = sei_ts_insert_offset(data, size);
+
+    return fwrite(data, 1, at, file) != at || fwrite(sei, 1, sei_size, file) != sei_size ||
+           fwrite(data + at, 1, size - at, file) != size - at ? -1 : 0;
+}
+
+/** Find our stamp in a SEI NAL unit (start code included). Returns 1 if found. */
+static int sei_ts_parse(const uint8_t *nal, size_t size, SEI_TS_T *ts)
+{
+    uint8_t rbsp[256];
+    size_t i, len = 0, zeros = 0, pos = 0;
+    unsigned int header;
+
+    if (size < 5)
+        return 0;
+    header = nal[2] == 1 ? 3 : 4;
+    if ((nal[header] & 0x1f) != H264_NAL_SEI)
+        return 0;
+    for (i = header + 1; i < size && len < sizeof(rbsp); i++) {
+        if (zeros == 2 && nal[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        rbsp[len++] = nal[i];
+        zeros = nal[i] ? 0 : zeros + 1;
+    }
+
+    /* sei_message()s until the trailing bits */
+    while (pos + 2 <= len && rbsp[pos] != 0x80) {
+        unsigned int type = 0, payload = 0;
+        while (pos < len && rbsp[pos] == 0xff)
+            type += rbsp[pos++];
+        if (pos < len)
+            type += rbsp[pos++];
+        while (pos < len && rbsp[pos] == 0xff)
+            payload += rbsp[pos++];
+        if (pos < len)
+            payload += rbsp[pos++];
+        if (pos + payload > len)
+            return 0;
+        if (type == 5 && payload >= sizeof(sei_ts_uuid) + SEI_TS_PAYLOAD &&
+            !memcmp(rbsp + pos, sei_ts_uuid, sizeof(sei_ts_uuid))) {
+            const uint8_t *p = rbsp + pos + sizeof(sei_ts_uuid);
+            ts->seq = sei_ts_get(p, 4);
+            ts->ingest_wall_us = sei_ts_get(p + 4, 8);
+            ts->ingest_us = sei_ts_get(p + 12, 8);
+            ts->emit_us = sei_ts_get(p + 20, 8);
+            return 1;
+        }
+        pos += payload;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,144 @@
+/* Reference consumer of the decoded frames published by
+ * manual_decode_overlay_encode -P <socket> (shm_frame_ring.h).
+ *
+ * Maps the frame ring read-only, waits for frames on the futex and reads them
+ * in place: it prints the average luma of every frame it gets, and once per
+ * second the frame rate, the latency from publishing to the consumer and the
+ * frames it missed. -w simulates a consumer which is slower than the
+ * decoder; the pipeline does not notice, this process just skips frames.
+ *
+ * Usage: ./shm_frame_consumer [-l] [-n frames] [-w ms] [-o out.yuv] socket */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "shm_frame_ring.h"
+
+/** Average luma of the frame, every 4th row and column */
+static unsigned int average_luma(const FRAME_T *frame)
+{
+    uint64_t sum = 0;
+    unsigned int x, y, n = 0;
+
+    for (y = 0; y < frame->height; y += 4) {
+        const uint8_t *row = frame->plane[0] + (size_t)y * frame->pitch[0];
+        for (x = 0; x < frame->width; x += 4, n++)
+            sum += row[x];
+    }
+    return n ? sum / n : 0;
+}
+
+/** Append the frame as planar I420 without padding */
+static int write_frame(FILE *file, const FRAME_T *frame)
+{
+    unsigned int p, y;
+
+    for (p = 0; p < 3; p++) {
+        unsigned int width = p ? frame->width / 2 : frame->width, height = p ? frame->height / 2 : frame->height;
+        for (y = 0; y < height; y++)
+            if (fwrite(frame->plane[p] + (size_t)y * frame->pitch[p], 1, width, file) != width)
+                return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    SHM_RING_CONSUMER_T ring;
+    FILE *out = NULL;
+    const char *out_path = NULL;
+    unsigned int limit = 0, work_ms = 0, frames = 0, second_frames = 0;
+    uint64_t second_start, latency_sum = 0, latency_max = 0;
+    int opt, latest = 0;
+
+    while ((opt = getopt(argc, argv, "ln:w:o:")) != -1) {
+        switch (opt) {
+        case 'l':
+            latest = 1;
+            break;
+        case 'n':
+            limit = atoi(optarg);
+            break;
+        case 'w':
+            work_ms = atoi(optarg);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-l] [-n frames] [-w ms] [-o out.yuv] socket\n"
+                        "  -l  only read the newest frame, skip older ones\n"
+                        "  -n  stop after this many frames\n"
+                        "  -w  pretend every frame takes ms to process\n"
+                        "  -o  write the frames as raw I420\n", argv[0]);
+        return 1;
+    }
+    if (shm_ring_consumer_connect(&ring, argv[optind]) != 0) {
+        fprintf(stderr, "could not get the frame ring from %s\n", argv[optind]);
+        return 1;
+    }
+    fprintf(stderr, "frame ring: %ux%u I420, pitch %u, %u slots\n", ring.header->width, ring.header->height,
+            ring.header->pitch, ring.header->slots);
+    if (out_path && !(out = fopen(out_path, "wb"))) {
+        fprintf(stderr, "could not open %s\n", out_path);
+        return 1;
+    }
+
+    second_start = shm_ring_now_us();
+    while (!limit || frames < limit) {
+        FRAME_T frame;
+        int64_t pts;
+        uint64_t published, now;
+        unsigned int luma;
+
+        //the publisher going away looks like a pause, give up after a while
+        if (!shm_ring_wait(&ring, 5000)) {
+            fprintf(stderr, "no frames for 5 s\n");
+            break;
+        }
+        while (shm_ring_begin(&ring, &frame, &pts, &published, latest)) {
+            now = shm_ring_now_us();
+            luma = average_luma(&frame);
+            if (out && write_frame(out, &frame) != 0) {
+                fprintf(stderr, "write failed\n");
+                limit = frames;
+                break;
+            }
+            if (work_ms)
+                usleep(work_ms * 1000);
+            //only now is it known whether the publisher overwrote the slot meanwhile
+            if (!shm_ring_end(&ring))
+                continue;
+            frames++;
+            second_frames++;
+            latency_sum += now - published;
+            if (now - published > latency_max)
+                latency_max = now - published;
+            printf("pts %lld luma %u\n", (long long)pts, luma);
+        }
+
+        now = shm_ring_now_us();
+        if (now - second_start >= 1000000) {
+            fprintf(stderr, "%.1f fps, latency avg %.2f ms max %.2f ms, %u skipped, %u torn\n",
+                    second_frames * 1e6 / (now - second_start),
+                    second_frames ? latency_sum / 1e3 / second_frames : 0, latency_max / 1e3,
+                    ring.skipped, ring.torn);
+            second_start = now;
+            second_frames = 0;
+            latency_sum = latency_max = 0;
+        }
+    }
+
+    fprintf(stderr, "%u frames read, %u skipped, %u torn\n", ring.read, ring.skipped, ring.torn);
+    if (out)
+        fclose(out);
+    shm_ring_consumer_destroy(&ring);
+    return 0;
+}
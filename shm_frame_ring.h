@@ -0,0 +1,405 @@
+#ifndef SHM_FRAME_RING_H
+#define SHM_FRAME_RING_H
+
+/* Decoded frames for other processes, through a ring of frame slots in shared
+ * memory.
+ *
+ * The publisher owns a memfd holding a header and a few I420 frame slots. It
+ * copies every frame into the next slot (the one copy; consumers use the
+ * pixels in place), bumps the sequence number in the header and wakes the
+ * consumers with a futex on it. It never waits for anybody: a consumer which
+ * falls more than slots - 1 frames behind skips the frames which have been
+ * overwritten, and a frame overwritten while it was being read is detected by
+ * the per-slot sequence lock and discarded.
+ *
+ * Consumers get the fd over a unix socket (SCM_RIGHTS) and map it read-only;
+ * with F_SEAL_FUTURE_WRITE (Linux 5.1) they cannot map it writable either.
+ * Because they cannot write, the publisher does a FUTEX_WAKE for every frame,
+ * which costs about a microsecond. Timestamps are CLOCK_MONOTONIC, the same in
+ * every process. Linux only. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include "frame.h"
+#include "event_loop.h"
+
+#define SHM_RING_MAGIC 0x4d524853 /* "SHRM" */
+#define SHM_RING_VERSION 1
+#define SHM_RING_MAX_SLOTS 16
+#define SHM_RING_PAGE 4096
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+typedef struct SHM_RING_SLOT_T {
+    uint32_t lock;          /* 2 * seq + 1 while frame seq is written, 2 * seq + 2 once it is complete */
+    uint32_t reserved;
+    int64_t pts;
+    uint64_t publish_us;    /* CLOCK_MONOTONIC */
+    uint64_t offset;        /* of the pixels, from the start of the ring */
+} SHM_RING_SLOT_T;
+
+/** At offset 0 of the memfd */
+typedef struct SHM_RING_HEADER_T {
+    uint32_t magic, version;
+    uint32_t slots;
+    uint32_t width, height; /* I420, Y then U then V, chroma pitch is pitch / 2 */
+    uint32_t pitch;
+    uint64_t slot_size, total_size;
+    uint32_t seq;           /* frames published so far, the futex word */
+    uint32_t reserved;
+    SHM_RING_SLOT_T slot[SHM_RING_MAX_SLOTS];
+} SHM_RING_HEADER_T;
+
+typedef struct SHM_RING_PUBLISHER_T {
+    int fd;
+    uint8_t *base;
+    SHM_RING_HEADER_T *header;
+    EVENT_LOOP_T *loop;
+    EVENT_SOURCE_T listener;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    unsigned int consumers;     /* fds handed out */
+    uint64_t copy_us;           /* time spent publishing */
+} SHM_RING_PUBLISHER_T;
+
+typedef struct SHM_RING_CONSUMER_T {
+    int fd;
+    const uint8_t *base;
+    const SHM_RING_HEADER_T *header;
+    uint32_t next;              /* sequence number of the next frame to read */
+    uint32_t reading;           /* frame between begin and end */
+    unsigned int read, skipped, torn;
+} SHM_RING_CONSUMER_T;
+
+static inline uint64_t shm_ring_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int shm_ring_futex(const uint32_t *word, int op, uint32_t value, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+/** Ring of slots frames of width x height. Returns 0 on success. */
+static int shm_ring_publisher_create(SHM_RING_PUBLISHER_T *pub, unsigned int slots,
+                                     unsigned int width, unsigned int height)
+{
+    SHM_RING_HEADER_T *h;
+    uint64_t pitch = (width + 31) & ~31u, slot_size, total;
+    unsigned int i;
+
+    memset(pub, 0, sizeof(*pub));
+    pub->fd = -1;
+    pub->listener.fd = -1;
+    if (slots < 2 || slots > SHM_RING_MAX_SLOTS || (width | height) & 1)
+        return -1;
+    slot_size = (pitch * height * 3 / 2 + SHM_RING_PAGE - 1) & ~(uint64_t)(SHM_RING_PAGE - 1);
+    total = SHM_RING_PAGE + slot_size * slots;
+
+    pub->fd = syscall(SYS_memfd_create, "frame ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (pub->fd < 0 || ftruncate(pub->fd, total) != 0)
+        return -1;
+    pub->base = (uint8_t *)mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, pub->fd, 0);
+    if (pub->base == MAP_FAILED) {
+        pub->base = NULL;
+        return -1;
+    }
+    /* fix the size for the consumers, and keep them from mapping it writable
+     * (older kernels do not know F_SEAL_FUTURE_WRITE, then only the size is sealed) */
+    if (fcntl(pub->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE) != 0)
+        fcntl(pub->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+
+    h = pub->header = (SHM_RING_HEADER_T *)pub->base;
+    h->magic = SHM_RING_MAGIC;
+    h->version = SHM_RING_VERSION;
+    h->slots = slots;
+    h->width = width;
+    h->height = height;
+    h->pitch = pitch;
+    h->slot_size = slot_size;
+    h->total_size = total;
+    for (i = 0; i < slots; i++)
+        h->slot[i].offset = SHM_RING_PAGE + i * slot_size;
+    return 0;
+}
+
+static void shm_ring_copy_plane(uint8_t *dst, unsigned int dst_pitch, const uint8_t *src, unsigned int src_pitch,
+                                unsigned int width, unsigned int height)
+{
+    unsigned int y;
+
+    if (dst_pitch == src_pitch) {
+        memcpy(dst, src, (size_t)src_pitch * (height - 1) + width);
+        return;
+    }
+    for (y = 0; y < height; y++)
+        memcpy(dst + (size_t)y * dst_pitch, src + (size_t)y * src_pitch, width);
+}
+
+/** Copy the frame (same size as the ring) into the next slot and wake the
+ * consumers. Never waits for them. Single producer thread. */
+static void shm_ring_publish(SHM_RING_PUBLISHER_T *pub, const FRAME_T *frame, int64_t pts)
+{
+    SHM_RING_HEADER_T *h = pub->header;
+    uint64_t start = shm_ring_now_us();
+    uint32_t seq = h->seq;
+    SHM_RING_SLOT_T *slot = &h->slot[seq % h->slots];
+    uint8_t *y = pub->base + slot->offset, *u = y + (size_t)h->pitch * h->height;
+    uint8_t *v = u + (size_t)h->pitch / 2 * h->height / 2;
+
+    /* sequence lock: odd while writing, readers check it before and after */
+    __atomic_store_n(&slot->lock, 2 * seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    shm_ring_copy_plane(y, h->pitch, frame->plane[0], frame->pitch[0], h->width, h->height);
+    shm_ring_copy_plane(u, h->pitch / 2, frame->plane[1], frame->pitch[1], h->width / 2, h->height / 2);
+    shm_ring_copy_plane(v, h->pitch / 2, frame->plane[2], frame->pitch[2], h->width / 2, h->height / 2);
+    slot->pts = pts;
+    slot->publish_us = shm_ring_now_us();
+    __atomic_store_n(&slot->lock, 2 * seq + 2, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELEASE);
+    shm_ring_futex(&h->seq, FUTEX_WAKE, INT_MAX, NULL);
+    pub->copy_us += shm_ring_now_us() - start;
+}
+
+/** Hand the memfd to whoever connects */
+static void shm_ring_listener_handler(EVENT_LOOP_T *loop, EVENT_SOURCE_T *source, uint32_t events)
+{
+    SHM_RING_PUBLISHER_T *pub = (SHM_RING_PUBLISHER_T *)source->userdata;
+    char control[CMSG_SPACE(sizeof(int))], byte = 'F';
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fd;
+
+    (void)loop;
+    (void)events;
+    fd = accept(source->fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &pub->fd, sizeof(int));
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) == 1)
+        pub->consumers++;
+    close(fd);
+}
+
+/** Accept consumers on a unix socket, serviced by the event loop.
+ * Returns 0 on success. */
+static int shm_ring_publisher_listen(SHM_RING_PUBLISHER_T *pub, EVENT_LOOP_T *loop, const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(pub->path))
+        return -1;
+    strcpy(pub->path, path);
+    pub->loop = loop;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0 ||
+        event_loop_add_fd(loop, &pub->listener, fd, EPOLLIN, shm_ring_listener_handler, pub) != 0) {
+        close(fd);
+        pub->listener.fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void shm_ring_publisher_destroy(SHM_RING_PUBLISHER_T *pub)
+{
+    int fd = pub->listener.fd;
+
+    if (fd >= 0) {
+        event_loop_remove(pub->loop, &pub->listener);
+        close(fd);
+        unlink(pub->path);
+    }
+    if (pub->base)
+        munmap(pub->base, pub->header->total_size);
+    if (pub->fd >= 0)
+        close(pub->fd);
+    pub->base = NULL;
+    pub->fd = -1;
+}
+
+/** Map a ring fd read-only (from shm_ring_consumer_connect or inherited).
+ * Reading starts with the next frame published. Returns 0 on success. */
+static int shm_ring_consumer_attach(SHM_RING_CONSUMER_T *c, int fd)
+{
+    const SHM_RING_HEADER_T *h;
+    struct stat st;
+    void *p;
+
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    if (fstat(fd, &st) != 0 || st.st_size < SHM_RING_PAGE)
+        return -1;
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    c->base = (const uint8_t *)p;
+    h = c->header = (const SHM_RING_HEADER_T *)p;
+    if (h->magic != SHM_RING_MAGIC || h->version != SHM_RING_VERSION || h->total_size != (uint64_t)st.st_size ||
+        h->slots < 2 || h->slots > SHM_RING_MAX_SLOTS) {
+        munmap(p, st.st_size);
+        c->base = NULL;
+        return -1;
+    }
+    c->next = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+/** Connect to a publisher's socket and map its ring. Returns 0 on success. */
+static int shm_ring_consumer_connect(SHM_RING_CONSUMER_T *c, const char *path)
+{
+    char control[CMSG_SPACE(sizeof(int))], byte;
+    struct iovec iov = { &byte, 1 };
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int sock, fd = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0 && recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == 1) {
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    close(sock);
+    if (fd < 0)
+        return -1;
+    if (shm_ring_consumer_attach(c, fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void shm_ring_consumer_destroy(SHM_RING_CONSUMER_T *c)
+{
+    if (c->base)
+        munmap((void *)c->base, c->header->total_size);
+    if (c->fd >= 0)
+        close(c->fd);
+    c->base = NULL;
+    c->fd = -1;
+}
+
+/** Wait up to timeout_ms (-1: forever) for a frame which has not been read yet.
+ * Returns 1 if there is one. */
+static int shm_ring_wait(SHM_RING_CONSUMER_T *c, int timeout_ms)
+{
+    uint32_t seq = __atomic_load_n(&c->header->seq, __ATOMIC_ACQUIRE);
+    struct timespec ts;
+
+    if (seq != c->next)
+        return 1;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = timeout_ms % 1000 * 1000000L;
+    shm_ring_futex(&c->header->seq, FUTEX_WAIT, seq, timeout_ms < 0 ? NULL : &ts);
+    return __atomic_load_n(&c->header->seq, __ATOMIC_ACQUIRE) != c->next;
+}
+
+/** Point frame at the oldest unread frame still in the ring, in place. With
+ * latest set, older unread frames are skipped. Returns 0 if there is none.
+ * The pixels may be overwritten at any time: only trust what was read from
+ * them if shm_ring_end() returns 1. */
+static int shm_ring_begin(SHM_RING_CONSUMER_T *c, FRAME_T *frame, int64_t *pts, uint64_t *publish_us, int latest)
+{
+    const SHM_RING_HEADER_T *h = c->header;
+
+    for (;;) {
+        uint32_t head = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE), oldest = head - (h->slots - 1);
+        const SHM_RING_SLOT_T *slot;
+
+        if (head == c->next)
+            return 0;
+        if (latest)
+            oldest = head - 1;
+        if ((int32_t)(c->next - oldest) < 0) {
+            /* overwritten or about to be: skip ahead */
+            c->skipped += oldest - c->next;
+            c->next = oldest;
+        }
+        slot = &h->slot[c->next % h->slots];
+        if (__atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE) != 2 * c->next + 2) {
+            c->skipped++;
+            c->next++;
+            continue;
+        }
+        frame_init_i420(frame, (uint8_t *)c->base + slot->offset, h->pitch, h->height, h->width, h->height);
+        *pts = slot->pts;
+        if (publish_us)
+            *publish_us = slot->publish_us;
+        c->reading = c->next++;
+        return 1;
+    }
+}
+
+/** Returns 1 if the frame from shm_ring_begin() was not touched while it was used */
+static int shm_ring_end(SHM_RING_CONSUMER_T *c)
+{
+    const SHM_RING_SLOT_T *slot = &c->header->slot[c->reading % c->header->slots];
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->lock, __ATOMIC_RELAXED) != 2 * c->reading + 2) {
+        c->torn++;
+        return 0;
+    }
+    c->read++;
+    return 1;
+}
+
+#endif
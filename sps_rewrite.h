@@ -0,0 +1,402 @@
+#ifndef SPS_REWRITE_H
+#define SPS_REWRITE_H
+
+/* Rewrites the SPS of an H.264 stream for low latency decoding: the VUI gets
+ * a bitstream_restriction with max_num_reorder_frames = 0 and
+ * max_dec_frame_buffering = max_num_ref_frames, added if the SPS has no VUI
+ * or no bitstream_restriction, updated if it has. Without it a decoder may
+ * assume the worst case and hold back several pictures before it outputs the
+ * first one; how much the VideoCore decoder gains has not been measured.
+ *
+ * Only correct for streams without B-frames (output order = decoding order),
+ * which is what the camera and the VideoCore encoder produce. Check the
+ * stream with sps_stream_reorders() before rewriting anything.
+ *
+ * The SPS is unescaped, parsed field by field into a new RBSP and escaped
+ * again, so emulation prevention bytes end up where the new bit positions
+ * need them. An SPS which cannot be parsed is left alone. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "h264_nal.h"
+
+#define SPS_REWRITE_MAX 1024        /* largest SPS handled, escaped */
+#define SPS_REWRITE_GROWTH 16       /* an SPS grows by at most this much */
+#define SPS_SCAN_SLICES 2000        /* checked for B-frames before rewriting */
+
+typedef struct SPS_BITS_T {
+    uint8_t *data;
+    size_t size;                    /* bytes */
+    size_t pos;                     /* bits */
+    int error;                      /* read past the end or out of room */
+} SPS_BITS_T;
+
+static unsigned int sps_read_bit(SPS_BITS_T *b)
+{
+    unsigned int bit;
+
+    if (b->pos >= b->size * 8) {
+        b->error = 1;
+        return 0;
+    }
+    bit = (b->data[b->pos >> 3] >> (7 - (b->pos & 7))) & 1;
+    b->pos++;
+    return bit;
+}
+
+static uint32_t sps_read_bits(SPS_BITS_T *b, unsigned int n)
+{
+    uint32_t value = 0;
+
+    while (n--)
+        value = value << 1 | sps_read_bit(b);
+    return value;
+}
+
+static uint32_t sps_read_ue(SPS_BITS_T *b)
+{
+    unsigned int zeros = 0;
+
+    while (!sps_read_bit(b) && !b->error)
+        if (++zeros > 31) {
+            b->error = 1;
+            return 0;
+        }
+    return ((1u << zeros) - 1) + sps_read_bits(b, zeros);
+}
+
+static void sps_write_bit(SPS_BITS_T *b, unsigned int bit)
+{
+    if (b->pos >= b->size * 8) {
+        b->error = 1;
+        return;
+    }
+    if (bit)
+        b->data[b->pos >> 3] |= 0x80 >> (b->pos & 7);
+    else
+        b->data[b->pos >> 3] &= ~(0x80 >> (b->pos & 7));
+    b->pos++;
+}
+
+static void sps_write_bits(SPS_BITS_T *b, uint32_t value, unsigned int n)
+{
+    while (n--)
+        sps_write_bit(b, (value >> n) & 1);
+}
+
+static void sps_write_ue(SPS_BITS_T *b, uint32_t value)
+{
+    unsigned int bits = 0;
+
+    while ((value + 1) >> (bits + 1))
+        bits++;
+    sps_write_bits(b, 0, bits);
+    sps_write_bits(b, value + 1, bits + 1);
+}
+
+/* copy a field from the old SPS to the new one, returning its value */
+static uint32_t sps_copy_bits(SPS_BITS_T *in, SPS_BITS_T *out, unsigned int n)
+{
+    uint32_t value = sps_read_bits(in, n);
+
+    sps_write_bits(out, value, n);
+    return value;
+}
+
+static uint32_t sps_copy_ue(SPS_BITS_T *in, SPS_BITS_T *out)
+{
+    uint32_t value = sps_read_ue(in);
+
+    sps_write_ue(out, value);
+    return value;
+}
+
+/* se(v) has the same bits as ue(v), only the value differs */
+#define sps_copy_se sps_copy_ue
+
+static void sps_copy_scaling_list(SPS_BITS_T *in, SPS_BITS_T *out, unsigned int size)
+{
+    int last = 8, next = 8;
+    unsigned int i;
+
+    for (i = 0; i < size && !in->error; i++) {
+        if (next) {
+            uint32_t code = sps_copy_se(in, out);
+            int delta = code & 1 ? (int)((code + 1) / 2) : -(int)(code / 2);
+            next = (last + delta + 256) % 256;
+        }
+        last = next ? next : last;
+    }
+}
+
+static void sps_copy_hrd(SPS_BITS_T *in, SPS_BITS_T *out)
+{
+    uint32_t i, count = sps_copy_ue(in, out) + 1;
+
+    sps_copy_bits(in, out, 8);      /* bit_rate_scale, cpb_size_scale */
+    for (i = 0; i < count && !in->error; i++) {
+        sps_copy_ue(in, out);
+        sps_copy_ue(in, out);
+        sps_copy_bits(in, out, 1);
+    }
+    sps_copy_bits(in, out, 20);     /* four delay/offset lengths */
+}
+
+/** Remove the emulation prevention bytes, returns the RBSP size */
+static size_t sps_unescape(const uint8_t *in, size_t size, uint8_t *out)
+{
+    size_t i, len = 0, zeros = 0;
+
+    for (i = 0; i < size; i++) {
+        if (zeros == 2 && in[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        out[len++] = in[i];
+        zeros = in[i] ? 0 : zeros + 1;
+    }
+    return len;
+}
+
+/** Add the emulation prevention bytes, returns the escaped size or 0 without room */
+static size_t sps_escape(const uint8_t *in, size_t size, uint8_t *out, size_t alloc)
+{
+    size_t i, len = 0, zeros = 0;
+
+    for (i = 0; i < size; i++) {
+        if (zeros == 2 && in[i] <= 3) {
+            if (len == alloc)
+                return 0;
+            out[len++] = 3;
+            zeros = 0;
+        }
+        if (len == alloc)
+            return 0;
+        out[len++] = in[i];
+        zeros = in[i] ? 0 : zeros + 1;
+    }
+    return len;
+}
+
+/** Rewrite one SPS NAL unit (start code included) into out. Returns the new
+ * size, 0 if it is no SPS, cannot be parsed or does not fit. */
+static size_t sps_rewrite_nal(const uint8_t *nal, size_t size, uint8_t *out, size_t alloc)
+{
+    uint8_t old_rbsp[SPS_REWRITE_MAX], new_rbsp[SPS_REWRITE_MAX + SPS_REWRITE_GROWTH];
+    SPS_BITS_T in, out_bits;
+    unsigned int header, profile, chroma = 1, ref_frames, restriction = 0, i;
+    size_t escaped;
+
+    if (size < 5)
+        return 0;
+    header = nal[2] == 1 ? 3 : 4;
+    if ((nal[header] & 0x1f) != H264_NAL_SPS || size - header - 1 > SPS_REWRITE_MAX || alloc < header + 1)
+        return 0;
+    memset(&in, 0, sizeof(in));
+    memset(&out_bits, 0, sizeof(out_bits));
+    in.data = old_rbsp;
+    in.size = sps_unescape(nal + header + 1, size - header - 1, old_rbsp);
+    out_bits.data = new_rbsp;
+    out_bits.size = sizeof(new_rbsp);
+
+    profile = sps_copy_bits(&in, &out_bits, 8);
+    sps_copy_bits(&in, &out_bits, 16);          /* constraint flags, level_idc */
+    sps_copy_ue(&in, &out_bits);                /* seq_parameter_set_id */
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 ||
+        profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138 ||
+        profile == 139 || profile == 134 || profile == 135) {
+        chroma = sps_copy_ue(&in, &out_bits);
+        if (chroma == 3)
+            sps_copy_bits(&in, &out_bits, 1);   /* separate_colour_plane_flag */
+        sps_copy_ue(&in, &out_bits);            /* bit depths */
+        sps_copy_ue(&in, &out_bits);
+        sps_copy_bits(&in, &out_bits, 1);       /* qpprime_y_zero_transform_bypass_flag */
+        if (sps_copy_bits(&in, &out_bits, 1))   /* seq_scaling_matrix_present_flag */
+            for (i = 0; i < (chroma != 3 ? 8u : 12u); i++)
+                if (sps_copy_bits(&in, &out_bits, 1))
+                    sps_copy_scaling_list(&in, &out_bits, i < 6 ? 16 : 64);
+    }
+    sps_copy_ue(&in, &out_bits);                /* log2_max_frame_num_minus4 */
+    switch (sps_copy_ue(&in, &out_bits)) {      /* pic_order_cnt_type */
+    case 0:
+        sps_copy_ue(&in, &out_bits);
+        break;
+    case 1: {
+        uint32_t cycle;
+        sps_copy_bits(&in, &out_bits, 1);
+        sps_copy_se(&in, &out_bits);
+        sps_copy_se(&in, &out_bits);
+        cycle = sps_copy_ue(&in, &out_bits);
+        for (i = 0; i < cycle && !in.error; i++)
+            sps_copy_se(&in, &out_bits);
+        break;
+    }
+    default:
+        break;
+    }
+    ref_frames = sps_copy_ue(&in, &out_bits);   /* max_num_ref_frames */
+    sps_copy_bits(&in, &out_bits, 1);           /* gaps_in_frame_num_value_allowed_flag */
+    sps_copy_ue(&in, &out_bits);                /* size in macroblocks */
+    sps_copy_ue(&in, &out_bits);
+    if (!sps_copy_bits(&in, &out_bits, 1))      /* frame_mbs_only_flag */
+        sps_copy_bits(&in, &out_bits, 1);
+    sps_copy_bits(&in, &out_bits, 1);           /* direct_8x8_inference_flag */
+    if (sps_copy_bits(&in, &out_bits, 1))       /* frame_cropping_flag */
+        for (i = 0; i < 4; i++)
+            sps_copy_ue(&in, &out_bits);
+
+    if (sps_read_bit(&in)) {                    /* vui_parameters_present_flag */
+        unsigned int hrd;
+        sps_write_bit(&out_bits, 1);
+        if (sps_copy_bits(&in, &out_bits, 1) && sps_copy_bits(&in, &out_bits, 8) == 255)
+            sps_copy_bits(&in, &out_bits, 32);  /* sar_width, sar_height */
+        if (sps_copy_bits(&in, &out_bits, 1))   /* overscan_info_present_flag */
+            sps_copy_bits(&in, &out_bits, 1);
+        if (sps_copy_bits(&in, &out_bits, 1)) { /* video_signal_type_present_flag */
+            sps_copy_bits(&in, &out_bits, 4);
+            if (sps_copy_bits(&in, &out_bits, 1))
+                sps_copy_bits(&in, &out_bits, 24);
+        }
+        if (sps_copy_bits(&in, &out_bits, 1)) { /* chroma_loc_info_present_flag */
+            sps_copy_ue(&in, &out_bits);
+            sps_copy_ue(&in, &out_bits);
+        }
+        if (sps_copy_bits(&in, &out_bits, 1)) { /* timing_info_present_flag */
+            sps_copy_bits(&in, &out_bits, 32);
+            sps_copy_bits(&in, &out_bits, 32);
+            sps_copy_bits(&in, &out_bits, 1);
+        }
+        hrd = sps_copy_bits(&in, &out_bits, 1);
+        if (hrd)
+            sps_copy_hrd(&in, &out_bits);
+        if (sps_copy_bits(&in, &out_bits, 1)) {
+            sps_copy_hrd(&in, &out_bits);
+            hrd = 1;
+        }
+        if (hrd)
+            sps_copy_bits(&in, &out_bits, 1);   /* low_delay_hrd_flag */
+        sps_copy_bits(&in, &out_bits, 1);       /* pic_struct_present_flag */
+        restriction = sps_read_bit(&in);
+    } else {
+        sps_write_bit(&out_bits, 1);
+        sps_write_bits(&out_bits, 0, 8);        /* nothing but the bitstream_restriction */
+    }
+
+    sps_write_bit(&out_bits, 1);                /* bitstream_restriction_flag */
+    if (restriction) {
+        sps_copy_bits(&in, &out_bits, 1);
+        for (i = 0; i < 4; i++)
+            sps_copy_ue(&in, &out_bits);
+        sps_read_ue(&in);                       /* the old max_num_reorder_frames */
+        sps_read_ue(&in);                       /* and max_dec_frame_buffering */
+    } else {
+        /* the values inferred when the restriction is missing */
+        sps_write_bit(&out_bits, 1);            /* motion_vectors_over_pic_boundaries_flag */
+        sps_write_ue(&out_bits, 2);             /* max_bytes_per_pic_denom */
+        sps_write_ue(&out_bits, 1);             /* max_bits_per_mb_denom */
+        sps_write_ue(&out_bits, 16);            /* log2_max_mv_length_horizontal */
+        sps_write_ue(&out_bits, 16);            /* log2_max_mv_length_vertical */
+    }
+    sps_write_ue(&out_bits, 0);                 /* max_num_reorder_frames */
+    sps_write_ue(&out_bits, ref_frames);        /* max_dec_frame_buffering */
+
+    sps_write_bit(&out_bits, 1);                /* rbsp_trailing_bits */
+    while (out_bits.pos & 7)
+        sps_write_bit(&out_bits, 0);
+    if (in.error || out_bits.error)
+        return 0;
+
+    memcpy(out, nal, header + 1);
+    escaped = sps_escape(new_rbsp, out_bits.pos / 8, out + header + 1, alloc - header - 1);
+    return escaped ? header + 1 + escaped : 0;
+}
+
+/** slice_type % 5 of the first slice in an Annex B buffer (0 P, 1 B, 2 I),
+ * -1 without a slice. A B-slice means the SPS must not be rewritten. */
+static int sps_first_slice_type(const uint8_t *data, size_t size)
+{
+    size_t pos = h264_find_start_code(data, 0, size);
+
+    while (pos < size) {
+        size_t end = h264_find_start_code(data, pos + 3, size);
+        unsigned int header = data[pos + 2] == 1 ? 3 : 4, type;
+        if (pos + header < end) {
+            type = data[pos + header] & 0x1f;
+            if (type == H264_NAL_SLICE || type == H264_NAL_IDR) {
+                uint8_t rbsp[16];
+                size_t len = end - pos - header - 1;
+                SPS_BITS_T b = { rbsp, 0, 0, 0 };
+                b.size = sps_unescape(data + pos + header + 1, len < sizeof(rbsp) - 4 ? len : sizeof(rbsp) - 4, rbsp);
+                sps_read_ue(&b);                /* first_mb_in_slice */
+                type = sps_read_ue(&b) % 5;
+                return b.error ? -1 : (int)type;
+            }
+        }
+        pos = end;
+    }
+    return -1;
+}
+
+/** Whether the first slice in an Annex B buffer is a B or SP slice, which
+ * may be output after pictures decoded later */
+static int sps_slice_reorders(const uint8_t *data, size_t size)
+{
+    int type = sps_first_slice_type(data, size);
+
+    return type == 1 || type == 3;
+}
+
+/** Scan up to max_slices slices of the stream from the current position of
+ * the file for B or SP slices, then seek back.
+ * Returns 1 if there are some, 0 if not, -1 if the file cannot be scanned
+ * (a pipe). */
+static int sps_stream_reorders(FILE *file, unsigned int max_slices)
+{
+    H264_READER_T r;
+    H264_NAL_T nal;
+    long start = ftell(file);
+    unsigned int slices = 0;
+    int found = 0;
+
+    if (start < 0 || h264_reader_init(&r, file) != 0)
+        return -1;
+    while (!found && slices < max_slices && h264_reader_next_nal(&r, &nal)) {
+        if (!h264_nal_is_slice(&nal))
+            continue;
+        slices++;
+        found = sps_slice_reorders(nal.data, nal.size);
+    }
+    h264_reader_free(&r);
+    clearerr(file);
+    return fseek(file, start, SEEK_SET) == 0 ? found : -1;
+}
+
+/** Copy an Annex B buffer (an access unit, the extradata) to out with every
+ * SPS rewritten. out needs room for size + SPS_REWRITE_GROWTH per SPS.
+ * Returns the new size, 0 without room. */
+static size_t sps_rewrite_buffer(const uint8_t *in, size_t size, uint8_t *out, size_t alloc, unsigned int *rewritten)
+{
+    size_t pos = h264_find_start_code(in, 0, size), len = 0, written;
+
+    if (pos > alloc)
+        return 0;
+    memcpy(out, in, pos);           /* anything in front of the first start code */
+    len = pos;
+    while (pos < size) {
+        size_t end = h264_find_start_code(in, pos + 3, size);
+        if ((written = sps_rewrite_nal(in + pos, end - pos, out + len, alloc - len)) != 0) {
+            (*rewritten)++;
+        } else {
+            if (end - pos > alloc - len)
+                return 0;
+            memcpy(out + len, in + pos, end - pos);
+            written = end - pos;
+        }
+        len += written;
+        pos = end;
+    }
+    return len;
+}
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+/* Lock-free handoff from MMAL callbacks to the processing thread.
+ *
+ * SPSC_QUEUE_T is a bounded ring for exactly one producer thread and one
+ * consumer thread. Producer and consumer indices live on their own cache
+ * lines, and each side keeps a cached copy of the other side's index, so a
+ * push or pop normally touches no cache line written by the other thread.
+ *
+ * SPSC_BELL_T wakes the consumer. Several queues (one per callback) can share
+ * one bell. The consumer spins for a while before it parks on a futex, and a
+ * producer only makes the wake-up syscall if the consumer is actually parked:
+ * a burst of buffers costs at most one futex wake instead of a mutex and a
+ * semaphore post per buffer (mmal_queue_put + vcos_semaphore_post).
+ *
+ * Linux only (futex). */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SPSC_CACHE_LINE 64
+#define SPSC_ALIGNED __attribute__((aligned(SPSC_CACHE_LINE)))
+
+typedef struct SPSC_QUEUE_T {
+    void **slots;
+    unsigned int mask;
+
+    unsigned int tail SPSC_ALIGNED;      /* written by the producer */
+    unsigned int head_cache;             /* producer's copy of head */
+
+    unsigned int head SPSC_ALIGNED;      /* written by the consumer */
+    unsigned int tail_cache;             /* consumer's copy of tail */
+} SPSC_QUEUE_T;
+
+/** Ring for at least capacity entries. Returns 0 on success. */
+static int spsc_queue_create(SPSC_QUEUE_T *q, unsigned int capacity)
+{
+    unsigned int size = 2;
+
+    memset(q, 0, sizeof(*q));
+    while (size < capacity)
+        size *= 2;
+    q->slots = calloc(size, sizeof(*q->slots));
+    q->mask = size - 1;
+    return q->slots ? 0 : -1;
+}
+
+static void spsc_queue_destroy(SPSC_QUEUE_T *q)
+{
+    free(q->slots);
+    q->slots = NULL;
+}
+
+/** Producer side. Returns -1 if the ring is full. */
+static int spsc_queue_push(SPSC_QUEUE_T *q, void *item)
+{
+    unsigned int tail = q->tail;
+
+    if (tail - q->head_cache > q->mask) {
+        q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (tail - q->head_cache > q->mask)
+            return -1;
+    }
+    q->slots[tail & q->mask] = item;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/** Consumer side. Returns NULL if the ring is empty. */
+static void *spsc_queue_pop(SPSC_QUEUE_T *q)
+{
+    unsigned int head = q->head;
+    void *item;
+
+    if (head == q->tail_cache) {
+        q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (head == q->tail_cache)
+            return NULL;
+    }
+    item = q->slots[head & q->mask];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+/** Number of entries, exact on the consumer side */
+static unsigned int spsc_queue_length(SPSC_QUEUE_T *q)
+{
+    return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+}
+
+enum {
+    SPSC_BELL_IDLE,       /* nothing new since the consumer last woke up */
+    SPSC_BELL_RUNG,       /* something was pushed, consumer not parked */
+    SPSC_BELL_PARKED,     /* consumer is (about to be) asleep in the futex */
+};
+
+typedef struct SPSC_BELL_T {
+    int state SPSC_ALIGNED;
+    unsigned int spin;               /* polls before parking */
+    unsigned int wakes SPSC_ALIGNED; /* futex wake syscalls made by the producers */
+    unsigned int parks;              /* futex wait syscalls made by the consumer */
+} SPSC_BELL_T;
+
+/** spin is the number of polls before the consumer parks. On a single core
+ * spinning only delays the producer, so it is turned off there. */
+static void spsc_bell_init(SPSC_BELL_T *bell, unsigned int spin)
+{
+    memset(bell, 0, sizeof(*bell));
+    bell->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? spin : 0;
+}
+
+static inline void spsc_cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/** Producer side, after pushing. Cheap if the bell is already ringing. */
+static void spsc_bell_ring(SPSC_BELL_T *bell)
+{
+    /* the push has to be visible before we look at the state, or the
+     * consumer could drain, miss the entry and park */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bell->state, __ATOMIC_RELAXED) == SPSC_BELL_RUNG)
+        return;
+    if (__atomic_exchange_n(&bell->state, SPSC_BELL_RUNG, __ATOMIC_SEQ_CST) == SPSC_BELL_PARKED) {
+        __atomic_fetch_add(&bell->wakes, 1, __ATOMIC_RELAXED);
+        syscall(SYS_futex, &bell->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/** Consumer side: return once the bell has been rung since the last call.
+ * Everything pushed before that ring can then be popped. */
+static void spsc_bell_wait(SPSC_BELL_T *bell)
+{
+    unsigned int i;
+    int expected;
+
+    for (;;) {
+        for (i = 0; i < bell->spin; i++) {
+            if (__atomic_load_n(&bell->state, __ATOMIC_RELAXED) == SPSC_BELL_RUNG)
+                break;
+            spsc_cpu_relax();
+        }
+        if (__atomic_exchange_n(&bell->state, SPSC_BELL_IDLE, __ATOMIC_SEQ_CST) == SPSC_BELL_RUNG)
+            return;
+
+        expected = SPSC_BELL_IDLE;
+        if (!__atomic_compare_exchange_n(&bell->state, &expected, SPSC_BELL_PARKED, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            continue; /* rung in between */
+        bell->parks++;
+        syscall(SYS_futex, &bell->state, FUTEX_WAIT_PRIVATE, SPSC_BELL_PARKED, NULL, NULL, 0);
+    }
+}
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef TEXT_OVERLAY_H
+#define TEXT_OVERLAY_H
+
+/* Burned-in text (timecode, frame number, camera id) for decoded I420 frames.
+ *
+ * The 5x7 bitmap font is rasterised once into a glyph atlas at the requested
+ * scale (luma values plus a coverage mask). Setting a new string only copies
+ * the atlas cells of the characters that differ from the previous string into
+ * a pre-rendered strip, so the per-frame work is reduced to blending the strip
+ * rows into the frame, which is done 16 pixels at a time. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "frame.h"
+
+#define TEXT_OVERLAY_MAX_CHARS 64
+
+/** Draw a solid box behind the text instead of a one pixel outline. */
+#define TEXT_OVERLAY_FLAG_OPAQUE 0x1
+
+#define TEXT_FONT_WIDTH 5
+#define TEXT_FONT_HEIGHT 7
+#define TEXT_INK_LUMA 235
+#define TEXT_BACKGROUND_LUMA 16
+#define TEXT_NEUTRAL_CHROMA 128
+
+static const char text_font_charset[] = " 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ:-./_?";
+
+/* One row per byte, bit 4 is the leftmost pixel. Same order as text_font_charset. */
+static const uint8_t text_font[][TEXT_FONT_HEIGHT] = {
+    {0x00,0x00,0x00,0x00,0x00,0x00,0x00}, /* space */
+    {0x0E,0x11,0x13,0x15,0x19,0x11,0x0E}, {0x04,0x0C,0x04,0x04,0x04,0x04,0x0E}, /* 0 1 */
+    {0x0E,0x11,0x01,0x02,0x04,0x08,0x1F}, {0x1F,0x02,0x04,0x02,0x01,0x11,0x0E}, /* 2 3 */
+    {0x02,0x06,0x0A,0x12,0x1F,0x02,0x02}, {0x1F,0x10,0x1E,0x01,0x01,0x11,0x0E}, /* 4 5 */
+    {0x06,0x08,0x10,0x1E,0x11,0x11,0x0E}, {0x1F,0x01,0x02,0x04,0x08,0x08,0x08}, /* 6 7 */
+    {0x0E,0x11,0x11,0x0E,0x11,0x11,0x0E}, {0x0E,0x11,0x11,0x0F,0x01,0x02,0x0C}, /* 8 9 */
+    {0x0E,0x11,0x11,0x11,0x1F,0x11,0x11}, {0x1E,0x11,0x11,0x1E,0x11,0x11,0x1E}, /* A B */
+    {0x0E,0x11,0x10,0x10,0x10,0x11,0x0E}, {0x1C,0x12,0x11,0x11,0x11,0x12,0x1C}, /* C D */
+    {0x1F,0x10,0x10,0x1E,0x10,0x10,0x1F}, {0x1F,0x10,0x10,0x1E,0x10,0x10,0x10}, /* E F */
+    {0x0E,0x11,0x10,0x17,0x11,0x11,0x0F}, {0x11,0x11,0x11,0x1F,0x11,0x11,0x11}, /* G H */
+    {0x0E,0x04,0x04,0x04,0x04,0x04,0x0E}, {0x07,0x02,0x02,0x02,0x02,0x12,0x0C}, /* I J */
+    {0x11,0x12,0x14,0x18,0x14,0x12,0x11}, {0x10,0x10,0x10,0x10,0x10,0x10,0x1F}, /* K L */
+    {0x11,0x1B,0x15,0x15,0x11,0x11,0x11}, {0x11,0x11,0x19,0x15,0x13,0x11,0x11}, /* M N */
+    {0x0E,0x11,0x11,0x11,0x11,0x11,0x0E}, {0x1E,0x11,0x11,0x1E,0x10,0x10,0x10}, /* O P */
+    {0x0E,0x11,0x11,0x11,0x15,0x12,0x0D}, {0x1E,0x11,0x11,0x1E,0x14,0x12,0x11}, /* Q R */
+    {0x0F,0x10,0x10,0x0E,0x01,0x01,0x1E}, {0x1F,0x04,0x04,0x04,0x04,0x04,0x04}, /* S T */
+    {0x11,0x11,0x11,0x11,0x11,0x11,0x0E}, {0x11,0x11,0x11,0x11,0x11,0x0A,0x04}, /* U V */
+    {0x11,0x11,0x11,0x15,0x15,0x15,0x0A}, {0x11,0x11,0x0A,0x04,0x0A,0x11,0x11}, /* W X */
+    {0x11,0x11,0x11,0x0A,0x04,0x04,0x04}, {0x1F,0x01,0x02,0x04,0x08,0x10,0x1F}, /* Y Z */
+    {0x00,0x0C,0x0C,0x00,0x0C,0x0C,0x00}, {0x00,0x00,0x00,0x1F,0x00,0x00,0x00}, /* : - */
+    {0x00,0x00,0x00,0x00,0x00,0x0C,0x0C}, {0x00,0x01,0x02,0x04,0x08,0x10,0x00}, /* . / */
+    {0x00,0x00,0x00,0x00,0x00,0x00,0x1F}, {0x0E,0x11,0x01,0x02,0x04,0x00,0x04}, /* _ ? */
+};
+
+#define TEXT_GLYPH_COUNT (sizeof(text_font) / sizeof(text_font[0]))
+
+typedef struct TEXT_OVERLAY_T {
+    unsigned int flags;
+    unsigned int scale;            /* size of one font pixel in frame pixels, always even */
+    unsigned int cell_w, cell_h;   /* glyph cell incl. one font pixel border, in luma pixels */
+    uint8_t *atlas_ink;            /* TEXT_GLYPH_COUNT cells of cell_w x cell_h luma values */
+    uint8_t *atlas_mask;           /* coverage of the cells above, 0x00 or 0xff */
+
+    /* Pre-rendered run of the current string, TEXT_OVERLAY_MAX_CHARS cells wide */
+    unsigned int strip_pitch;
+    uint8_t *strip_ink;
+    uint8_t *strip_mask;
+    uint8_t *strip_mask_uv;        /* half resolution mask for the chroma planes */
+    char text[TEXT_OVERLAY_MAX_CHARS + 1];
+    unsigned int length;
+
+    unsigned int x, y;             /* top left corner in the frame, rounded down to even */
+    unsigned long glyphs_redrawn;  /* statistics: atlas cells copied into the strip */
+} TEXT_OVERLAY_T;
+
+typedef uint8_t text_vec_t __attribute__((vector_size(16)));
+
+static int text_font_pixel(unsigned int glyph, int gx, int gy)
+{
+    if (gx < 0 || gy < 0 || gx >= TEXT_FONT_WIDTH || gy >= TEXT_FONT_HEIGHT)
+        return 0;
+    return (text_font[glyph][gy] >> (TEXT_FONT_WIDTH - 1 - gx)) & 1;
+}
+
+static unsigned int text_glyph_index(char c)
+{
+    const char *p;
+
+    if (c >= 'a' && c <= 'z')
+        c -= 'a' - 'A';
+    p = c ? strchr(text_font_charset, c) : NULL;
+    return p ? (unsigned int)(p - text_font_charset) : TEXT_GLYPH_COUNT - 1;
+}
+
+/** Rasterise the font into the atlas. Returns 0 on success. */
+static int text_overlay_create(TEXT_OVERLAY_T *ov, unsigned int scale, unsigned int flags)
+{
+    unsigned int g, cx, cy;
+
+    memset(ov, 0, sizeof(*ov));
+    ov->flags = flags;
+    ov->scale = scale < 2 ? 2 : scale & ~1u; /* keeps cells aligned to the 2x2 chroma grid */
+    ov->cell_w = (TEXT_FONT_WIDTH + 2) * ov->scale;
+    ov->cell_h = (TEXT_FONT_HEIGHT + 2) * ov->scale;
+    ov->strip_pitch = ov->cell_w * TEXT_OVERLAY_MAX_CHARS;
+
+    ov->atlas_ink = (uint8_t *)malloc(TEXT_GLYPH_COUNT * ov->cell_w * ov->cell_h);
+    ov->atlas_mask = (uint8_t *)malloc(TEXT_GLYPH_COUNT * ov->cell_w * ov->cell_h);
+    ov->strip_ink = (uint8_t *)calloc(ov->strip_pitch, ov->cell_h);
+    ov->strip_mask = (uint8_t *)calloc(ov->strip_pitch, ov->cell_h);
+    ov->strip_mask_uv = (uint8_t *)calloc(ov->strip_pitch / 2, ov->cell_h / 2);
+    if (!ov->atlas_ink || !ov->atlas_mask || !ov->strip_ink || !ov->strip_mask || !ov->strip_mask_uv)
+        return -1;
+
+    for (g = 0; g < TEXT_GLYPH_COUNT; g++) {
+        uint8_t *ink = ov->atlas_ink + g * ov->cell_w * ov->cell_h;
+        uint8_t *mask = ov->atlas_mask + g * ov->cell_w * ov->cell_h;
+
+        for (cy = 0; cy < ov->cell_h; cy++) {
+            for (cx = 0; cx < ov->cell_w; cx++) {
+                int gx = cx / ov->scale - 1, gy = cy / ov->scale - 1;
+                int on = text_font_pixel(g, gx, gy);
+                int outline = 0, dx, dy;
+
+                for (dy = -1; dy <= 1; dy++)
+                    for (dx = -1; dx <= 1; dx++)
+                        outline |= text_font_pixel(g, gx + dx, gy + dy);
+
+                ink[cy * ov->cell_w + cx] = on ? TEXT_INK_LUMA : TEXT_BACKGROUND_LUMA;
+                mask[cy * ov->cell_w + cx] = (outline || (flags & TEXT_OVERLAY_FLAG_OPAQUE)) ? 0xff : 0;
+            }
+        }
+    }
+    return 0;
+}
+
+static void text_overlay_destroy(TEXT_OVERLAY_T *ov)
+{
+    free(ov->atlas_ink);
+    free(ov->atlas_mask);
+    free(ov->strip_ink);
+    free(ov->strip_mask);
+    free(ov->strip_mask_uv);
+    memset(ov, 0, sizeof(*ov));
+}
+
+/** Copy one atlas cell into position pos of the strip. */
+static void text_overlay_draw_cell(TEXT_OVERLAY_T *ov, unsigned int pos, char c)
+{
+    unsigned int g = text_glyph_index(c), row;
+    const uint8_t *ink = ov->atlas_ink + g * ov->cell_w * ov->cell_h;
+    const uint8_t *mask = ov->atlas_mask + g * ov->cell_w * ov->cell_h;
+
+    for (row = 0; row < ov->cell_h; row++) {
+        memcpy(ov->strip_ink + row * ov->strip_pitch + pos * ov->cell_w, ink + row * ov->cell_w, ov->cell_w);
+        memcpy(ov->strip_mask + row * ov->strip_pitch + pos * ov->cell_w, mask + row * ov->cell_w, ov->cell_w);
+    }
+    for (row = 0; row < ov->cell_h / 2; row++) {
+        uint8_t *uv = ov->strip_mask_uv + row * (ov->strip_pitch / 2) + pos * (ov->cell_w / 2);
+        const uint8_t *m = mask + 2 * row * ov->cell_w;
+        unsigned int i;
+        for (i = 0; i < ov->cell_w / 2; i++)
+            uv[i] = m[2 * i];
+    }
+    ov->glyphs_redrawn++;
+}
+
+/** Lay out a new string. Only characters differing from the previous string
+ * are redrawn into the strip. Strings are truncated to TEXT_OVERLAY_MAX_CHARS. */
+static void text_overlay_set_text(TEXT_OVERLAY_T *ov, const char *text)
+{
+    unsigned int i;
+
+    for (i = 0; i < TEXT_OVERLAY_MAX_CHARS && text[i]; i++) {
+        if (i >= ov->length || ov->text[i] != text[i]) {
+            text_overlay_draw_cell(ov, i, text[i]);
+            ov->text[i] = text[i];
+        }
+    }
+    ov->text[i] = 0;
+    ov->length = i;
+}
+
+/** dst = mask ? src : dst, 16 pixels at a time (NEON vbsl / SSE2 and-or). */
+static void text_overlay_blend_row(uint8_t *dst, const uint8_t *src, const uint8_t *mask, unsigned int n)
+{
+    unsigned int i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        text_vec_t d, s, m;
+        memcpy(&d, dst + i, 16);
+        memcpy(&s, src + i, 16);
+        memcpy(&m, mask + i, 16);
+        d = (d & ~m) | (s & m);
+        memcpy(dst + i, &d, 16);
+    }
+    for (; i < n; i++)
+        dst[i] = (dst[i] & ~mask[i]) | (src[i] & mask[i]);
+}
+
+/** dst = mask ? value : dst, 16 pixels at a time. */
+static void text_overlay_fill_row(uint8_t *dst, uint8_t value, const uint8_t *mask, unsigned int n)
+{
+    text_vec_t v;
+    unsigned int i = 0;
+
+    memset(&v, value, sizeof(v));
+    for (; i + 16 <= n; i += 16) {
+        text_vec_t d, m;
+        memcpy(&d, dst + i, 16);
+        memcpy(&m, mask + i, 16);
+        d = (d & ~m) | (v & m);
+        memcpy(dst + i, &d, 16);
+    }
+    for (; i < n; i++)
+        dst[i] = (dst[i] & ~mask[i]) | (value & mask[i]);
+}
+
+/** Burn the current string into the frame, clipped to its visible area. */
+static void text_overlay_blit(const TEXT_OVERLAY_T *ov, FRAME_T *frame)
+{
+    unsigned int x = ov->x & ~1u, y = ov->y & ~1u;
+    unsigned int w = ov->length * ov->cell_w, h = ov->cell_h, row, p;
+
+    if (x >= frame->width || y >= frame->height || !w)
+        return;
+    if (x + w > frame->width)
+        w = (frame->width - x) & ~1u;
+    if (y + h > frame->height)
+        h = (frame->height - y) & ~1u;
+
+    for (row = 0; row < h; row++) {
+        uint8_t *dst = frame->plane[0] + (y + row) * frame->pitch[0] + x;
+        if (ov->flags & TEXT_OVERLAY_FLAG_OPAQUE)
+            memcpy(dst, ov->strip_ink + row * ov->strip_pitch, w);
+        else
+            text_overlay_blend_row(dst, ov->strip_ink + row * ov->strip_pitch,
+                                   ov->strip_mask + row * ov->strip_pitch, w);
+    }
+
+    for (p = 1; p < 3; p++) {
+        for (row = 0; row < h / 2; row++) {
+            uint8_t *dst = frame->plane[p] + (y / 2 + row) * frame->pitch[p] + x / 2;
+            if (ov->flags & TEXT_OVERLAY_FLAG_OPAQUE)
+                memset(dst, TEXT_NEUTRAL_CHROMA, w / 2);
+            else
+                text_overlay_fill_row(dst, TEXT_NEUTRAL_CHROMA,
+                                      ov->strip_mask_uv + row * (ov->strip_pitch / 2), w / 2);
+        }
+    }
+}
+
+#endif
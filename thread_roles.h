@@ -0,0 +1,358 @@
+#ifndef THREAD_ROLES_H
+#define THREAD_ROLES_H
+
+/* CPU affinity and real-time priority by thread role, and the CPU time and
+ * context switches of every thread.
+ *
+ * The roles are
+ *   main      the main loop: event loop, reading the input, writing the output
+ *   callback  the threads MMAL calls the port and pool callbacks on
+ *   worker    CPU filters (colour conversion, quality metrics)
+ *   io        writer threads (segments, thumbnails)
+ * Every thread calls thread_role_enter() as it starts; the callbacks call it
+ * every time and only the first call does anything. The configuration comes
+ * from MMAL_THREADS, space separated role=cpus[:fifoN] and isolate=cpus:
+ *   MMAL_THREADS="main=2:fifo50 callback=3:fifo60 worker=0-1 io=0 isolate=2-3"
+ * cpus is a list such as 0-1,3. fifoN runs the role SCHED_FIFO at priority N,
+ * which needs root or an rtprio limit (ulimit -r); without it the thread runs
+ * as before and a warning is printed. isolate keeps the cores for the roles
+ * pinned to them, the roles without cpus of their own run on the others. That
+ * only keeps this process off them, boot with isolcpus=2-3 to keep the rest of
+ * the system off as well.
+ *
+ * A thread inherits affinity and policy from the thread which starts it, so
+ * the main thread enters its role after the components are created.
+ *
+ * thread_roles_print() lists the threads which entered a role, with the CPUs
+ * and policy in effect, CPU time and context switches (from /proc). A thread
+ * which ends calls thread_role_leave() to leave its final numbers.
+ *
+ * FRAME_JITTER_T collects the intervals between frames leaving the pipeline:
+ * compare p99 against the median of runs with and without MMAL_THREADS.
+ *
+ * One configuration per process. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#define THREAD_ROLES_MAX_THREADS 32
+#define FRAME_JITTER_SAMPLES 16384
+
+typedef enum {
+    THREAD_ROLE_MAIN,
+    THREAD_ROLE_CALLBACK,
+    THREAD_ROLE_WORKER,
+    THREAD_ROLE_IO,
+    THREAD_ROLES
+} THREAD_ROLE_T;
+
+static const char *const thread_role_names[THREAD_ROLES] = { "main", "callback", "worker", "io" };
+
+typedef struct THREAD_ROLE_THREAD_T {
+    int tid;                        /* atomic, set last */
+    THREAD_ROLE_T role;
+    char name[16];
+    int left;                       /* the thread has ended, the numbers are final */
+    double cpu_s;
+    unsigned long voluntary, involuntary;
+} THREAD_ROLE_THREAD_T;
+
+typedef struct THREAD_ROLES_T {
+    const char *spec;               /* NULL if not configured */
+    struct {
+        unsigned long cpus;         /* one bit per CPU, 0 to leave it alone */
+        int priority;               /* SCHED_FIFO priority, 0 to leave it alone */
+    } role[THREAD_ROLES];
+    unsigned long isolated;
+    unsigned long online;
+    unsigned int failures;          /* atomic, affinity or priority which could not be set */
+    THREAD_ROLE_THREAD_T thread[THREAD_ROLES_MAX_THREADS];
+    unsigned int threads;           /* atomic, claimed so far */
+} THREAD_ROLES_T;
+
+static THREAD_ROLES_T thread_roles_global;
+static __thread int thread_role_entered;
+static __thread THREAD_ROLE_THREAD_T *thread_role_self;
+
+/** Parse a CPU list like "0-1,3" up to the end or a ':'. Returns -1 if it is not one. */
+static int thread_roles_parse_cpus(const char *list, unsigned long *cpus)
+{
+    *cpus = 0;
+    while (*list && *list != ':') {
+        unsigned int first, last;
+        int used;
+        if (sscanf(list, "%u%n", &first, &used) != 1)
+            return -1;
+        list += used;
+        last = first;
+        if (*list == '-') {
+            if (sscanf(list + 1, "%u%n", &last, &used) != 1)
+                return -1;
+            list += used + 1;
+        }
+        if (last < first || last >= 8 * sizeof(*cpus))
+            return -1;
+        while (first <= last)
+            *cpus |= 1ul << first++;
+        if (*list == ',')
+            list++;
+        else if (*list && *list != ':')
+            return -1;
+    }
+    return *cpus ? 0 : -1;
+}
+
+/** Take the configuration from spec (see above), NULL for none. Call once,
+ * before any thread enters its role. Returns 0, -1 if spec is malformed. */
+static int thread_roles_init(const char *spec)
+{
+    THREAD_ROLES_T *r = &thread_roles_global;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *all = spec;
+    char item[64];
+
+    memset(r, 0, sizeof(*r));
+    r->online = cpus > 0 && cpus < (long)(8 * sizeof(r->online)) ? (1ul << cpus) - 1 : ~0ul;
+    if (!spec || !*spec)
+        return 0;
+    while (*spec) {
+        size_t len = strcspn(spec, " ");
+        const char *value;
+        unsigned long mask;
+        int role;
+
+        if (len >= sizeof(item))
+            return -1;
+        memcpy(item, spec, len);
+        item[len] = 0;
+        spec += len + strspn(spec + len, " ");
+        if (!len)
+            continue;
+        if (!(value = strchr(item, '=')) || thread_roles_parse_cpus(value + 1, &mask) != 0)
+            return -1;
+        if (!strncmp(item, "isolate=", 8)) {
+            r->isolated = mask;
+            continue;
+        }
+        for (role = 0; role < THREAD_ROLES; role++)
+            if ((size_t)(value - item) == strlen(thread_role_names[role]) &&
+                !strncmp(item, thread_role_names[role], value - item))
+                break;
+        if (role == THREAD_ROLES)
+            return -1;
+        r->role[role].cpus = mask;
+        if ((value = strchr(value, ':'))) {
+            int priority;
+            if (sscanf(value, ":fifo%d", &priority) != 1 || priority < sched_get_priority_min(SCHED_FIFO) ||
+                priority > sched_get_priority_max(SCHED_FIFO))
+                return -1;
+            r->role[role].priority = priority;
+        }
+    }
+    r->spec = all;
+    return 0;
+}
+
+/** The configuration of MMAL_THREADS, if set. Returns 0, -1 (with a message) if it is malformed. */
+static int thread_roles_init_from_env(void)
+{
+    const char *spec = getenv("MMAL_THREADS");
+
+    if (thread_roles_init(spec) == 0)
+        return 0;
+    fprintf(stderr, "bad MMAL_THREADS \"%s\", expected e.g. \"main=2:fifo50 callback=3:fifo60 worker=0-1 io=0 "
+            "isolate=2-3\"\n", spec);
+    return -1;
+}
+
+static void thread_roles_format_cpus(unsigned long cpus, char *out, size_t size)
+{
+    unsigned int cpu = 0, len = 0;
+
+    out[0] = 0;
+    while (cpu < 8 * sizeof(cpus) && len < size) {
+        unsigned int first = cpu;
+        if (!(cpus >> cpu & 1)) {
+            cpu++;
+            continue;
+        }
+        while (cpu + 1 < 8 * sizeof(cpus) && (cpus >> (cpu + 1) & 1))
+            cpu++;
+        len += snprintf(out + len, size - len, first == cpu ? "%s%u" : "%s%u-%u", len ? "," : "", first, cpu);
+        cpu++;
+    }
+}
+
+/** Pin the calling thread and set its priority as configured for the role */
+static void thread_role_apply(THREAD_ROLE_T role, const char *name)
+{
+    THREAD_ROLES_T *r = &thread_roles_global;
+    unsigned long cpus = r->role[role].cpus;
+
+    if (!cpus && r->isolated)
+        cpus = r->online & ~r->isolated;
+    if (cpus && syscall(SYS_sched_setaffinity, 0, sizeof(cpus), &cpus) != 0) {
+        char list[64];
+        thread_roles_format_cpus(cpus, list, sizeof(list));
+        fprintf(stderr, "thread roles: cannot pin %s (%s) to cpus %s: %s\n", name, thread_role_names[role], list,
+                strerror(errno));
+        __atomic_fetch_add(&r->failures, 1, __ATOMIC_RELAXED);
+    }
+    if (r->role[role].priority) {
+        struct sched_param param;
+        int error;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = r->role[role].priority;
+        if ((error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0) {
+            fprintf(stderr, "thread roles: cannot run %s (%s) SCHED_FIFO %d: %s\n", name, thread_role_names[role],
+                    param.sched_priority, strerror(error));
+            __atomic_fetch_add(&r->failures, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/** The calling thread takes the role (name NULL: keep the thread's name).
+ * Only the first call of a thread does anything. */
+static void thread_role_enter(THREAD_ROLE_T role, const char *name)
+{
+    THREAD_ROLES_T *r = &thread_roles_global;
+    THREAD_ROLE_THREAD_T *t;
+    unsigned int index;
+
+    if (thread_role_entered)
+        return;
+    thread_role_entered = 1;
+    index = __atomic_fetch_add(&r->threads, 1, __ATOMIC_RELAXED);
+    if (index < THREAD_ROLES_MAX_THREADS) {
+        t = thread_role_self = &r->thread[index];
+        t->role = role;
+        if (name)
+            snprintf(t->name, sizeof(t->name), "%s", name);
+        else
+            prctl(PR_GET_NAME, t->name);
+        __atomic_store_n(&t->tid, (int)syscall(SYS_gettid), __ATOMIC_RELEASE);
+    }
+    if (r->spec)
+        thread_role_apply(role, name ? name : thread_role_self ? thread_role_self->name : thread_role_names[role]);
+}
+
+/** CPU time and context switches of thread tid so far. Returns 0, -1 if it is gone. */
+static int thread_roles_sample(THREAD_ROLE_THREAD_T *t)
+{
+    char path[64], line[512], *p;
+    unsigned long utime, stime, value;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", t->tid);
+    if (!(file = fopen(path, "r")))
+        return -1;
+    p = fgets(line, sizeof(line), file) ? strrchr(line, ')') : NULL;
+    fclose(file);
+    /* state ppid pgrp session tty tpgid flags minflt cminflt majflt cmajflt utime stime */
+    if (!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+    t->cpu_s = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/status", t->tid);
+    if (!(file = fopen(path, "r")))
+        return -1;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "voluntary_ctxt_switches: %lu", &value) == 1)
+            t->voluntary = value;
+        else if (sscanf(line, "nonvoluntary_ctxt_switches: %lu", &value) == 1)
+            t->involuntary = value;
+    }
+    fclose(file);
+    return 0;
+}
+
+/** The calling thread is about to end, keep its final numbers */
+static void thread_role_leave(void)
+{
+    if (thread_role_self && thread_roles_sample(thread_role_self) == 0)
+        thread_role_self->left = 1;
+}
+
+static void thread_roles_print(FILE *file)
+{
+    THREAD_ROLES_T *r = &thread_roles_global;
+    unsigned int i, threads = __atomic_load_n(&r->threads, __ATOMIC_RELAXED);
+
+    fprintf(file, "thread roles: %s%s%s", r->spec ? "MMAL_THREADS=\"" : "not configured", r->spec ? r->spec : "",
+            r->spec ? "\"" : "");
+    if (r->failures)
+        fprintf(file, ", %u settings failed", r->failures);
+    fprintf(file, "\n");
+    for (i = 0; i < threads && i < THREAD_ROLES_MAX_THREADS; i++) {
+        THREAD_ROLE_THREAD_T *t = &r->thread[i];
+        int tid = __atomic_load_n(&t->tid, __ATOMIC_ACQUIRE), policy;
+        unsigned long cpus[16] = { 0 }; /* the kernel wants room for all its CPUs */
+        char list[64] = "?";
+
+        if (!tid)
+            continue;
+        if (!t->left && thread_roles_sample(t) != 0) {
+            fprintf(file, "  %-8s %-16s tid %-6d ended\n", thread_role_names[t->role], t->name, tid);
+            continue;
+        }
+        if (!t->left && syscall(SYS_sched_getaffinity, tid, sizeof(cpus), cpus) > 0)
+            thread_roles_format_cpus(cpus[0] & r->online, list, sizeof(list));
+        policy = t->left ? -1 : sched_getscheduler(tid);
+        fprintf(file, "  %-8s %-16s tid %-6d cpus %-8s %-6s %7.2f s cpu, %lu voluntary / %lu involuntary context "
+                "switches\n", thread_role_names[t->role], t->name, tid, t->left ? "-" : list,
+                policy == SCHED_FIFO ? "fifo" : policy == SCHED_RR ? "rr" : policy < 0 ? "-" : "other", t->cpu_s,
+                t->voluntary, t->involuntary);
+    }
+}
+
+typedef struct FRAME_JITTER_T {
+    uint64_t last_us;
+    uint32_t interval_us[FRAME_JITTER_SAMPLES];
+    unsigned int intervals;
+} FRAME_JITTER_T;
+
+/** A frame left the pipeline */
+static void frame_jitter_add(FRAME_JITTER_T *j)
+{
+    struct timespec ts;
+    uint64_t now;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    if (j->last_us && j->intervals < FRAME_JITTER_SAMPLES)
+        j->interval_us[j->intervals++] = now - j->last_us;
+    j->last_us = now;
+}
+
+static int frame_jitter_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/** Sorts the intervals, call at the end */
+static void frame_jitter_print(FRAME_JITTER_T *j, FILE *file)
+{
+    unsigned int n = j->intervals;
+    double p50, p99;
+
+    if (!n)
+        return;
+    qsort(j->interval_us, n, sizeof(j->interval_us[0]), frame_jitter_compare);
+    p50 = j->interval_us[n / 2] / 1000.0;
+    p99 = j->interval_us[n * 99 / 100] / 1000.0;
+    fprintf(file, "frame time: p50 %.2f ms, p99 %.2f ms (%.2fx the median), max %.2f ms over %u frames, thread roles %s\n",
+            p50, p99, p50 > 0 ? p99 / p50 : 0.0, j->interval_us[n - 1] / 1000.0, n,
+            thread_roles_global.spec ? "configured" : "not configured");
+}
+
+#endif
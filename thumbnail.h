@@ -0,0 +1,225 @@
+#ifndef THUMBNAIL_H
+#define THUMBNAIL_H
+
+/* Periodic thumbnails of a decoded stream.
+ *
+ * thumbnail_writer_submit() runs on the frame path: it downscales the frame
+ * (scale.h) into one of a few preallocated slots and hands the slot to a
+ * writer thread, which converts and writes the file. If all slots are still
+ * waiting to be written the thumbnail is dropped instead of blocking. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "interface/vcos/vcos.h"
+#include "frame.h"
+#include "scale.h"
+#include "colour_convert.h"
+#include "thread_roles.h"
+
+#define THUMBNAIL_SLOTS 4
+
+typedef enum {
+    THUMBNAIL_RAW, /* I420 planes without padding */
+    THUMBNAIL_PGM, /* luma only */
+    THUMBNAIL_PPM, /* RGB, BT.601 limited range */
+} THUMBNAIL_FORMAT_T;
+
+typedef struct THUMBNAIL_SLOT_T {
+    uint8_t *data;
+    FRAME_T frame;
+    int64_t pts;
+    unsigned int index;
+} THUMBNAIL_SLOT_T;
+
+typedef struct THUMBNAIL_WRITER_T {
+    const char *prefix;
+    THUMBNAIL_FORMAT_T format;
+    unsigned int src_width, width, height;
+
+    THUMBNAIL_SLOT_T slot[THUMBNAIL_SLOTS];
+    VCOS_MUTEX_T lock;
+    unsigned int free_slots[THUMBNAIL_SLOTS], free_count;   /* protected by lock */
+    unsigned int queued[THUMBNAIL_SLOTS], head, tail;       /* protected by lock */
+    VCOS_SEMAPHORE_T pending;
+    VCOS_THREAD_T thread;
+    int quit;
+
+    uint16_t *acc;         /* scaler scratch, frame path only */
+    uint8_t *rgb;          /* writer thread only */
+    COLOUR_COEFFS_T coeffs;
+
+    unsigned int submitted, written, dropped;
+    unsigned int failed;   /* counted by both threads, atomically */
+    uint64_t scale_us;     /* time spent on the frame path */
+} THUMBNAIL_WRITER_T;
+
+static const char *thumbnail_extension(THUMBNAIL_FORMAT_T format)
+{
+    return format == THUMBNAIL_RAW ? "yuv" : format == THUMBNAIL_PGM ? "pgm" : "ppm";
+}
+
+static int thumbnail_write_file(THUMBNAIL_WRITER_T *w, THUMBNAIL_SLOT_T *slot)
+{
+    const FRAME_T *f = &slot->frame;
+    char name[256];
+    FILE *file;
+    unsigned int p, y;
+    int ok = 1;
+
+    snprintf(name, sizeof(name), "%s%06u.%s", w->prefix, slot->index, thumbnail_extension(w->format));
+    file = fopen(name, "wb");
+    if (!file)
+        return -1;
+
+    switch (w->format) {
+    case THUMBNAIL_RAW:
+        for (p = 0; p < 3; p++)
+            for (y = 0; y < (p ? f->height / 2 : f->height); y++)
+                ok &= fwrite(f->plane[p] + y * f->pitch[p], 1, p ? f->width / 2 : f->width, file) > 0;
+        break;
+    case THUMBNAIL_PGM:
+        fprintf(file, "P5\n%u %u\n255\n", f->width, f->height);
+        for (y = 0; y < f->height; y++)
+            ok &= fwrite(f->plane[0] + y * f->pitch[0], 1, f->width, file) > 0;
+        break;
+    case THUMBNAIL_PPM: {
+        FRAME_T rgb;
+        COLOUR_JOB_T job = { COLOUR_I420_TO_RGB24, f, &rgb, &w->coeffs };
+        frame_init_packed(&rgb, w->rgb, f->width * 3, f->width, f->height);
+        colour_convert(&job);
+        fprintf(file, "P6\n%u %u\n255\n", f->width, f->height);
+        ok &= fwrite(w->rgb, 3 * f->width, f->height, file) == f->height;
+        break;
+    }
+    }
+    return (fclose(file) == 0 && ok) ? 0 : -1;
+}
+
+static void *thumbnail_writer_thread(void *arg)
+{
+    THUMBNAIL_WRITER_T *w = (THUMBNAIL_WRITER_T *)arg;
+
+    thread_role_enter(THREAD_ROLE_IO, "thumbnail writer");
+    for (;;) {
+        unsigned int index;
+
+        vcos_semaphore_wait(&w->pending);
+        vcos_mutex_lock(&w->lock);
+        if (w->head == w->tail) {
+            vcos_mutex_unlock(&w->lock);
+            if (w->quit)
+                break;
+            continue;
+        }
+        index = w->queued[w->head++ % THUMBNAIL_SLOTS];
+        vcos_mutex_unlock(&w->lock);
+
+        if (thumbnail_write_file(w, &w->slot[index]) == 0)
+            w->written++;
+        else
+            __atomic_fetch_add(&w->failed, 1, __ATOMIC_RELAXED);
+
+        vcos_mutex_lock(&w->lock);
+        w->free_slots[w->free_count++] = index;
+        vcos_mutex_unlock(&w->lock);
+    }
+    thread_role_leave();
+    return NULL;
+}
+
+/** Thumbnails are width pixels wide (rounded to even) with the aspect ratio of
+ * the src_width x src_height frames. Files are named <prefix><number>.<ext>.
+ * Returns 0 on success. */
+static int thumbnail_writer_create(THUMBNAIL_WRITER_T *w, const char *prefix, THUMBNAIL_FORMAT_T format,
+                                   unsigned int src_width, unsigned int src_height, unsigned int width)
+{
+    unsigned int i;
+
+    memset(w, 0, sizeof(*w));
+    w->prefix = prefix;
+    w->format = format;
+    w->src_width = src_width;
+    w->width = (width < src_width ? width : src_width) & ~1u;
+    w->height = ((unsigned long)src_height * w->width / src_width) & ~1u;
+    if (w->width < 2 || w->height < 2)
+        return -1;
+    colour_coeffs_init(&w->coeffs, COLOUR_MATRIX_BT601, COLOUR_RANGE_LIMITED);
+
+    w->acc = malloc(src_width * sizeof(*w->acc));
+    w->rgb = malloc(w->width * w->height * 3);
+    if (!w->acc || !w->rgb)
+        return -1;
+    for (i = 0; i < THUMBNAIL_SLOTS; i++) {
+        THUMBNAIL_SLOT_T *slot = &w->slot[i];
+        slot->data = malloc(w->width * w->height * 3 / 2);
+        if (!slot->data)
+            return -1;
+        frame_init_i420(&slot->frame, slot->data, w->width, w->height, w->width, w->height);
+        w->free_slots[w->free_count++] = i;
+    }
+
+    if (vcos_mutex_create(&w->lock, "thumbnail") != VCOS_SUCCESS)
+        return -1;
+    if (vcos_semaphore_create(&w->pending, "thumbnail", 0) != VCOS_SUCCESS)
+        return -1;
+    if (vcos_thread_create(&w->thread, "thumbnail writer", NULL, thumbnail_writer_thread, w) != VCOS_SUCCESS)
+        return -1;
+    return 0;
+}
+
+/** Scale the frame into a free slot and queue it for writing. Never blocks on
+ * the writer: returns -1 and counts a drop if no slot is free. */
+static int thumbnail_writer_submit(THUMBNAIL_WRITER_T *w, const FRAME_T *frame, int64_t pts)
+{
+    uint64_t start = vcos_getmicrosecs64();
+    THUMBNAIL_SLOT_T *slot;
+    unsigned int index;
+
+    vcos_mutex_lock(&w->lock);
+    if (!w->free_count) {
+        vcos_mutex_unlock(&w->lock);
+        w->dropped++;
+        return -1;
+    }
+    index = w->free_slots[--w->free_count];
+    vcos_mutex_unlock(&w->lock);
+
+    slot = &w->slot[index];
+    slot->pts = pts;
+    slot->index = w->submitted++;
+    if (frame->width != w->src_width || scale_frame_i420(frame, &slot->frame, w->acc) != 0) {
+        vcos_mutex_lock(&w->lock);
+        w->free_slots[w->free_count++] = index;
+        vcos_mutex_unlock(&w->lock);
+        __atomic_fetch_add(&w->failed, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    vcos_mutex_lock(&w->lock);
+    w->queued[w->tail++ % THUMBNAIL_SLOTS] = index;
+    vcos_mutex_unlock(&w->lock);
+    vcos_semaphore_post(&w->pending);
+
+    w->scale_us += vcos_getmicrosecs64() - start;
+    return 0;
+}
+
+/** Write out all queued thumbnails and stop the writer thread */
+static void thumbnail_writer_destroy(THUMBNAIL_WRITER_T *w)
+{
+    unsigned int i;
+
+    w->quit = 1;
+    vcos_semaphore_post(&w->pending);
+    vcos_thread_join(&w->thread, NULL);
+    vcos_semaphore_delete(&w->pending);
+    vcos_mutex_delete(&w->lock);
+    for (i = 0; i < THUMBNAIL_SLOTS; i++)
+        free(w->slot[i].data);
+    free(w->acc);
+    free(w->rgb);
+}
+
+#endif
@@ -0,0 +1,425 @@
+#include "bcm_host.h"
+#include "mmal.h"
+#include "util/mmal_default_components.h"
+#include "util/mmal_util.h"
+#include "util/mmal_util_params.h"
+#include "interface/vcos/vcos.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "frame.h"
+#include "h264_nal.h"
+#include "h264_poc.h"
+#include "decoder_recovery.h"
+#include "thumbnail.h"
+#include "metrics.h"
+#include "thread_roles.h"
+
+#define CHECK_STATUS(status, msg) if (status != MMAL_SUCCESS) { fprintf(stderr, msg"\n"); goto error; }
+
+static const int FRAME_RATE = 25;
+
+static FILE *source_file;
+static H264_READER_T reader;
+
+/* Macros abstracting the I/O, just to make the example code clearer */
+#define SOURCE_OPEN(uri) \
+    source_file = fopen(uri, "rb"); if (!source_file || h264_reader_init(&reader, source_file)) goto error;
+#define SOURCE_CLOSE() \
+    if (source_file) { h264_reader_free(&reader); fclose(source_file); }
+
+/** Context for our application */
+static struct CONTEXT_T {
+    VCOS_SEMAPHORE_T semaphore;
+    MMAL_QUEUE_T *queue;
+    MMAL_STATUS_T status;
+    METRICS_T metrics; //no event loop here, written to stderr at the end when MMAL_METRICS is set
+    METRICS_PORT_T metrics_in, metrics_out;
+    METRICS_EVENTS_T metrics_events;
+    int thumbnails;
+    DECODER_RECOVERY_T recovery; //decoder errors are recovered from at the next IDR
+} context;
+
+/** Access unit currently being sent to the decoder. It may need several buffers. */
+static struct {
+    H264_AU_T au;
+    size_t sent;
+    int64_t pts;
+    unsigned int index;     /* number of access units read so far */
+    H264_POC_T poc;         /* presentation order of the access units */
+    unsigned int skipped;   /* not sent in keyframe mode */
+} input;
+
+
+/** Callback from the control port.
+ * Component is sending us an event. */
+static void control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
+
+    thread_role_enter(THREAD_ROLE_CALLBACK, NULL);
+    metrics_event(&ctx->metrics, &ctx->metrics_events, buffer);
+    switch (buffer->cmd)
+    {
+    case MMAL_EVENT_EOS:
+        /* Only sink component generate EOS events */
+        break;
+    case MMAL_EVENT_ERROR:
+        /* Something went wrong. The main loop flushes the decoder and resyncs at the next IDR */
+        decoder_recovery_error(&ctx->recovery, *(MMAL_STATUS_T *)buffer->data);
+        break;
+    default:
+        break;
+    }
+
+    /* Done with the event, recycle it */
+    mmal_buffer_header_release(buffer);
+
+    /* Kick the processing thread */
+    vcos_semaphore_post(&ctx->semaphore);
+}
+
+/** Callback from the decoder input port.
+ * Buffer has been consumed and is available to be used again. */
+static void input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
+
+    thread_role_enter(THREAD_ROLE_CALLBACK, NULL);
+    /* The decoder is done with the data, just recycle the buffer header into its pool */
+    mmal_buffer_header_release(buffer);
+
+    /* Kick the processing thread */
+    vcos_semaphore_post(&ctx->semaphore);
+}
+
+/** Callback from the decoder output port.
+ * Buffer has been produced by the port and is available for processing. */
+static void output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    struct CONTEXT_T *ctx = (struct CONTEXT_T *)port->userdata;
+
+    thread_role_enter(THREAD_ROLE_CALLBACK, NULL);
+    /* Queue the decoded video frame */
+    mmal_queue_put(ctx->queue, buffer);
+
+    /* Kick the processing thread */
+    vcos_semaphore_post(&ctx->semaphore);
+}
+
+/** Fill the buffer with the next (part of an) access unit.
+ * In keyframe mode everything but IDR access units is skipped, so the decoder
+ * only has to decode one picture per GOP. Returns 0 at the end of the stream. */
+static int read_access_unit(struct CONTEXT_T *ctx, MMAL_BUFFER_HEADER_T *buffer, int keyframes_only)
+{
+    size_t length;
+    int64_t frame;
+
+    while (input.sent == input.au.size) {
+        if (!h264_reader_next_au(&reader, &input.au))
+            return 0;
+        input.sent = 0;
+        /* in the order the decoder outputs the frames, B-frames are shown before the P-frame decoded first */
+        frame = h264_poc_frame(&input.poc, input.au.data, input.au.size, input.index++);
+        input.pts = frame >= 0 ? frame * 1000000 / FRAME_RATE : MMAL_TIME_UNKNOWN;
+        if (decoder_recovery_skip(&ctx->recovery, &input.au)) {
+            input.sent = input.au.size;
+        } else if (keyframes_only && !input.au.keyframe) {
+            input.sent = input.au.size;
+            input.skipped++;
+        }
+    }
+
+    length = input.au.size - input.sent;
+    if (length > buffer->alloc_size)
+        length = buffer->alloc_size;
+    memcpy(buffer->data, input.au.data + input.sent, length);
+    buffer->length = length;
+    buffer->offset = 0;
+    buffer->flags = input.sent == 0 ? MMAL_BUFFER_HEADER_FLAG_FRAME_START : 0;
+    input.sent += length;
+    if (input.sent == input.au.size)
+        buffer->flags |= MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+    if (input.au.keyframe)
+        buffer->flags |= MMAL_BUFFER_HEADER_FLAG_KEYFRAME;
+    buffer->pts = input.pts;
+    buffer->dts = MMAL_TIME_UNKNOWN;
+    return 1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-k] [-n seconds] [-w width] [-f raw|pgm|ppm] [-o prefix] [file]\n"
+                    "  -k  only decode keyframes (IDR access units)\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    MMAL_STATUS_T status = MMAL_EINVAL;
+    MMAL_COMPONENT_T *decoder = NULL;
+    MMAL_POOL_T *pool_in = NULL, *pool_out = NULL;
+    MMAL_ES_FORMAT_T *format_in;
+    MMAL_BOOL_T eos_sent = MMAL_FALSE, eos_received = MMAL_FALSE;
+    MMAL_BUFFER_HEADER_T *buffer;
+    THUMBNAIL_WRITER_T writer;
+    THUMBNAIL_FORMAT_T thumbnail_format = THUMBNAIL_PGM;
+    const char *filename = "test.h264_2", *prefix = "thumb";
+    unsigned int interval = 1, thumbnail_width = 160, frames = 0;
+    int keyframes_only = 0, writer_created = 0, opt;
+    int64_t next_thumbnail = 0;
+    uint64_t start_time;
+
+    while ((opt = getopt(argc, argv, "kn:w:f:o:")) != -1) {
+        switch (opt) {
+        case 'k':
+            keyframes_only = 1;
+            break;
+        case 'n':
+            interval = atoi(optarg);
+            break;
+        case 'w':
+            thumbnail_width = atoi(optarg);
+            break;
+        case 'f':
+            thumbnail_format = !strcmp(optarg, "raw") ? THUMBNAIL_RAW :
+                               !strcmp(optarg, "ppm") ? THUMBNAIL_PPM : THUMBNAIL_PGM;
+            break;
+        case 'o':
+            prefix = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (optind < argc)
+        filename = argv[optind];
+
+    bcm_host_init();
+    vcos_semaphore_create(&context.semaphore, "example", 1);
+
+    metrics_init(&context.metrics, getenv("MMAL_METRICS") != NULL);
+    if (thread_roles_init_from_env() != 0)
+        return -1;
+    context.thumbnails = metrics_register(&context.metrics, "thumbnails_submitted_total", METRICS_COUNTER,
+                                          "Frames handed to the thumbnail writer");
+    if (context.thumbnails < 0 ||
+        metrics_register_port(&context.metrics, &context.metrics_in, "decoder_in") ||
+        metrics_register_port(&context.metrics, &context.metrics_out, "decoder_out") ||
+        metrics_register_events(&context.metrics, &context.metrics_events, "decoder") ||
+        metrics_register_pool(&context.metrics, "decoder_in", &pool_in) ||
+        metrics_register_pool(&context.metrics, "decoder_out", &pool_out))
+    {
+        fprintf(stderr, "failed to set up metrics\n");
+        return -1;
+    }
+
+    SOURCE_OPEN(filename)
+
+    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_DECODER, &decoder);
+    CHECK_STATUS(status, "failed to create decoder");
+
+    /* Enable control port so we can receive events from the component */
+    decoder->control->userdata = (struct MMAL_PORT_USERDATA_T*)(void *)&context;
+    status = mmal_port_enable(decoder->control, control_callback);
+    CHECK_STATUS(status, "failed to enable control port");
+
+    status = mmal_port_parameter_set_boolean(decoder->input[0], MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+    CHECK_STATUS(status, "failed to set zero copy on decoder input");
+    status = mmal_port_parameter_set_boolean(decoder->output[0], MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+    CHECK_STATUS(status, "failed to set zero copy on decoder output");
+
+    /* Set format of video decoder input port. We send whole access units, so the data is framed */
+    format_in = decoder->input[0]->format;
+    format_in->type = MMAL_ES_TYPE_VIDEO;
+    format_in->encoding = MMAL_ENCODING_H264;
+    format_in->es->video.width = 1280;
+    format_in->es->video.height = 720;
+    format_in->es->video.frame_rate.num = FRAME_RATE;
+    format_in->es->video.frame_rate.den = 1;
+    format_in->es->video.par.num = 1;
+    format_in->es->video.par.den = 1;
+    format_in->flags |= MMAL_ES_FORMAT_FLAG_FRAMED;
+
+    status = mmal_port_format_commit(decoder->input[0]);
+    CHECK_STATUS(status, "failed to commit format");
+
+    status = mmal_port_format_commit(decoder->output[0]);
+    CHECK_STATUS(status, "failed to commit format");
+
+    decoder->input[0]->buffer_num = decoder->input[0]->buffer_num_recommended;
+    decoder->input[0]->buffer_size = decoder->input[0]->buffer_size_recommended;
+    decoder->output[0]->buffer_num = decoder->output[0]->buffer_num_min;
+    decoder->output[0]->buffer_size = decoder->output[0]->buffer_size_min;
+
+    pool_in = mmal_port_pool_create(decoder->input[0], decoder->input[0]->buffer_num, decoder->input[0]->buffer_size);
+    pool_out = mmal_port_pool_create(decoder->output[0], decoder->output[0]->buffer_num, decoder->output[0]->buffer_size);
+
+    context.queue = mmal_queue_create();
+
+    /* Store a reference to our context in each port (will be used during callbacks) */
+    decoder->input[0]->userdata = (struct MMAL_PORT_USERDATA_T*)(void *)&context;
+    decoder->output[0]->userdata = (struct MMAL_PORT_USERDATA_T*)(void *)&context;
+
+    status = mmal_port_enable(decoder->input[0], input_callback);
+    CHECK_STATUS(status, "failed to enable input port");
+    status = mmal_port_enable(decoder->output[0], output_callback);
+    CHECK_STATUS(status, "failed to enable output port");
+
+    fprintf(stderr, "start decoding%s\n", keyframes_only ? " (keyframes only)" : "");
+    start_time = vcos_getmicrosecs64();
+    thread_role_enter(THREAD_ROLE_MAIN, "main");
+
+    while (eos_received == MMAL_FALSE)
+    {
+        /* Wait for buffer headers to be available on either of the decoder ports */
+        vcos_semaphore_wait(&context.semaphore);
+
+        if (decoder_recovery_pending(&context.recovery))
+        {
+            fprintf(stderr, "decoder error %s, resyncing at the next IDR\n", mmal_status_to_string(context.recovery.status));
+            status = decoder_recovery_start(&context.recovery, decoder);
+            CHECK_STATUS(status, "failed to flush the decoder");
+            input.sent = input.au.size;
+        }
+
+        /* Send data to decode to the input port of the video decoder */
+        while (!eos_sent && (buffer = mmal_queue_get(pool_in->queue)) != NULL)
+        {
+            if (!read_access_unit(&context, buffer, keyframes_only))
+            {
+                buffer->length = 0;
+                buffer->flags = MMAL_BUFFER_HEADER_FLAG_EOS;
+                buffer->pts = buffer->dts = MMAL_TIME_UNKNOWN;
+                eos_sent = MMAL_TRUE;
+            }
+            metrics_port_buffer(&context.metrics, &context.metrics_in, buffer);
+            status = mmal_port_send_buffer(decoder->input[0], buffer);
+            CHECK_STATUS(status, "failed to send buffer");
+        }
+
+        /* Get our decoded frames */
+        while ((buffer = mmal_queue_get(context.queue)) != NULL)
+        {
+            eos_received = buffer->flags & MMAL_BUFFER_HEADER_FLAG_EOS;
+
+            if (buffer->cmd)
+                metrics_event(&context.metrics, &context.metrics_events, buffer);
+            else
+                metrics_port_buffer(&context.metrics, &context.metrics_out, buffer);
+            if (buffer->cmd == MMAL_EVENT_FORMAT_CHANGED)
+            {
+                MMAL_EVENT_FORMAT_CHANGED_T *event = mmal_event_format_changed_get(buffer);
+
+                //Assume we can't reuse the buffers, so have to disable, destroy
+                //pool, create new pool, enable port, feed in buffers.
+                status = mmal_port_disable(decoder->output[0]);
+                CHECK_STATUS(status, "failed to disable port");
+
+                while (mmal_queue_length(pool_out->queue) != pool_out->headers_num)
+                {
+                    MMAL_BUFFER_HEADER_T *buf;
+                    vcos_semaphore_wait(&context.semaphore);
+                    if ((buf = mmal_queue_get(context.queue)) != NULL)
+                        mmal_buffer_header_release(buf);
+                }
+
+                mmal_port_pool_destroy(decoder->output[0], pool_out);
+                status = mmal_format_full_copy(decoder->output[0]->format, event->format);
+                CHECK_STATUS(status, "failed to copy port format");
+                status = mmal_port_format_commit(decoder->output[0]);
+                CHECK_STATUS(status, "failed to commit port format");
+
+                pool_out = mmal_port_pool_create(decoder->output[0],
+                                                 decoder->output[0]->buffer_num,
+                                                 decoder->output[0]->buffer_size);
+
+                status = mmal_port_enable(decoder->output[0], output_callback);
+                CHECK_STATUS(status, "failed to enable port");
+            }
+            else if (!buffer->cmd && buffer->length)
+            {
+                MMAL_VIDEO_FORMAT_T *video = &decoder->output[0]->format->es->video;
+                int64_t pts = buffer->pts != MMAL_TIME_UNKNOWN ? buffer->pts :
+                              (int64_t)frames * 1000000 / FRAME_RATE;
+                FRAME_T frame;
+
+                decoder_recovery_frame(&context.recovery);
+                frame_init_i420(&frame, buffer->data + buffer->offset, video->width, video->height,
+                                video->crop.width ? video->crop.width : video->width,
+                                video->crop.height ? video->crop.height : video->height);
+
+                if (!writer_created)
+                {
+                    if (thumbnail_writer_create(&writer, prefix, thumbnail_format,
+                                                frame.width, frame.height, thumbnail_width) != 0)
+                    {
+                        fprintf(stderr, "failed to create thumbnail writer\n");
+                        status = MMAL_ENOMEM;
+                        mmal_buffer_header_release(buffer);
+                        goto error;
+                    }
+                    writer_created = 1;
+                }
+
+                /* in keyframe mode every decoded frame is a candidate */
+                if (pts >= next_thumbnail)
+                {
+                    thumbnail_writer_submit(&writer, &frame, pts);
+                    metrics_inc(&context.metrics, context.thumbnails);
+                    while (next_thumbnail <= pts)
+                        next_thumbnail += (int64_t)interval * 1000000;
+                }
+                frames++;
+            }
+            mmal_buffer_header_release(buffer);
+        }
+
+        /* Send empty buffers to the output port of the decoder */
+        while ((buffer = mmal_queue_get(pool_out->queue)) != NULL)
+        {
+            status = mmal_port_send_buffer(decoder->output[0], buffer);
+            CHECK_STATUS(status, "failed to send buffer");
+        }
+    }
+
+    {
+        double seconds = (vcos_getmicrosecs64() - start_time) / 1e6;
+        double duration = (double)input.index / FRAME_RATE;
+
+        fprintf(stderr, "stop decoding: %u of %u access units decoded (%u skipped), %.1fs of video in %.2fs (%.1fx real time)\n",
+                frames, input.index, input.skipped, duration, seconds, seconds > 0 ? duration / seconds : 0);
+        if (context.recovery.errors)
+            decoder_recovery_print(&context.recovery, stderr);
+    }
+
+    mmal_port_disable(decoder->input[0]);
+    mmal_port_disable(decoder->output[0]);
+    mmal_port_disable(decoder->control);
+
+error:
+    if (writer_created)
+    {
+        thumbnail_writer_destroy(&writer);
+        fprintf(stderr, "thumbnails: %u written, %u dropped, %u failed, %.3f ms scaling per thumbnail\n",
+                writer.written, writer.dropped, writer.failed,
+                writer.submitted ? writer.scale_us / 1000.0 / writer.submitted : 0);
+    }
+    thread_roles_print(stderr);
+    if (pool_in)
+        mmal_port_pool_destroy(decoder->input[0], pool_in);
+    if (pool_out)
+        mmal_port_pool_destroy(decoder->output[0], pool_out);
+    if (decoder)
+        mmal_component_release(decoder);
+    if (context.queue)
+        mmal_queue_destroy(context.queue);
+
+    if (context.metrics.enabled)
+        metrics_dump(&context.metrics, stderr);
+
+    SOURCE_CLOSE();
+    vcos_semaphore_delete(&context.semaphore);
+    return status == MMAL_SUCCESS ? 0 : -1;
+}
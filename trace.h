@@ -0,0 +1,333 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Buffer header lifecycle tracing, written as Chrome trace JSON.
+ *
+ * Every traced send to a port, port callback, queue put/get and release is
+ * recorded with the header, the port or queue, the thread and a timestamp.
+ * Each thread writes into a ring of its own (claimed on its first event), so
+ * recording is a clock read and a few plain stores; old events are
+ * overwritten, the rings always hold the last trace_init() events per thread.
+ * Tracing can be switched on and off at any time; while it is off an event
+ * costs one branch, so it can stay compiled in.
+ *
+ * trace_write() takes a snapshot of all rings (while they are being written)
+ * and writes it for chrome://tracing or ui.perfetto.dev:
+ *   - a send and the callback which returns the header from the same port
+ *     are one span ("b"/"e", the header is the id) on the port's track,
+ *   - a put and the get of the header from the same queue likewise,
+ *   - the number of headers each port holds (from the start of the snapshot)
+ *     is a counter track, so a component sitting on all buffers or starving
+ *     shows up as a flat line,
+ *   - releases are instant events on their thread.
+ * Ports and queues show up under the names given with trace_name().
+ *
+ * One tracer per process. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include "mmal.h"
+#include "mmal_queue.h"
+
+#define TRACE_MAX_THREADS 16
+#define TRACE_MAX_NAMES 32
+#define TRACE_NAME 32
+
+typedef enum {
+    TRACE_SEND,         /* object is the port */
+    TRACE_CALLBACK,     /* object is the port */
+    TRACE_PUT,          /* object is the queue */
+    TRACE_GET,          /* object is the queue */
+    TRACE_RELEASE,
+} TRACE_TYPE_T;
+
+typedef struct TRACE_EVENT_T {
+    uint64_t ns;
+    const void *header;
+    const void *object;
+    uint32_t type;
+    uint32_t cmd;
+} TRACE_EVENT_T;
+
+typedef struct TRACE_RING_T {
+    uint64_t head;                  /* atomic, events written so far */
+    TRACE_EVENT_T *events;
+    int tid;
+    char thread[16];
+} __attribute__((aligned(64))) TRACE_RING_T;
+
+typedef struct TRACE_T {
+    int enabled;                    /* atomic */
+    unsigned int size;              /* events per ring, a power of two */
+    TRACE_RING_T ring[TRACE_MAX_THREADS];
+    unsigned int rings;             /* atomic, claimed so far */
+    unsigned int lost;              /* events of threads which found no ring */
+    struct {
+        const void *object;
+        char name[TRACE_NAME];
+    } names[TRACE_MAX_NAMES];
+    unsigned int name_count;
+} TRACE_T;
+
+static TRACE_T trace_global;
+/* the ring of this thread, NULL until its first event or if there was none left */
+static __thread TRACE_RING_T *trace_thread_ring;
+static __thread int trace_thread_claimed;
+
+static uint64_t trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Keep the last events_per_thread (rounded up to a power of two) events of
+ * every thread. Call once, before any thread traces. */
+static void trace_init(unsigned int events_per_thread)
+{
+    unsigned int size = 1;
+
+    while (size < events_per_thread)
+        size <<= 1;
+    memset(&trace_global, 0, sizeof(trace_global));
+    trace_global.size = size;
+}
+
+static void trace_enable(int enabled)
+{
+    __atomic_store_n(&trace_global.enabled, enabled && trace_global.size, __ATOMIC_RELAXED);
+}
+
+static int trace_enabled(void)
+{
+    return __atomic_load_n(&trace_global.enabled, __ATOMIC_RELAXED);
+}
+
+/** Show the port or queue as name (copied) */
+static void trace_name(const void *object, const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < trace_global.name_count && trace_global.names[i].object != object; i++)
+        ;
+    if (i == TRACE_MAX_NAMES)
+        return;
+    trace_global.names[i].object = object;
+    snprintf(trace_global.names[i].name, TRACE_NAME, "%s", name);
+    if (i == trace_global.name_count)
+        trace_global.name_count++;
+}
+
+static TRACE_RING_T *trace_claim_ring(void)
+{
+    unsigned int index = __atomic_fetch_add(&trace_global.rings, 1, __ATOMIC_RELAXED);
+    TRACE_RING_T *ring;
+
+    trace_thread_claimed = 1;
+    if (index >= TRACE_MAX_THREADS)
+        return NULL;
+    ring = &trace_global.ring[index];
+    ring->tid = (int)syscall(SYS_gettid);
+    prctl(PR_GET_NAME, ring->thread);
+    /* published last: trace_write() skips rings without events */
+    __atomic_store_n(&ring->events, (TRACE_EVENT_T *)calloc(trace_global.size, sizeof(TRACE_EVENT_T)),
+                     __ATOMIC_RELEASE);
+    if (ring->events)
+        trace_thread_ring = ring;
+    return trace_thread_ring;
+}
+
+static void trace_record(TRACE_TYPE_T type, const void *object, const MMAL_BUFFER_HEADER_T *header)
+{
+    TRACE_RING_T *ring = trace_thread_ring;
+    TRACE_EVENT_T *event;
+    uint64_t head;
+
+    if (!ring && (trace_thread_claimed || !(ring = trace_claim_ring()))) {
+        __atomic_fetch_add(&trace_global.lost, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    head = ring->head;
+    event = &ring->events[head & (trace_global.size - 1)];
+    event->ns = trace_now_ns();
+    event->header = header;
+    event->object = object;
+    event->type = type;
+    event->cmd = header ? header->cmd : 0;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/** Record an event, from any thread */
+static inline void trace_event(TRACE_TYPE_T type, const void *object, const MMAL_BUFFER_HEADER_T *header)
+{
+    if (__builtin_expect(trace_enabled(), 0))
+        trace_record(type, object, header);
+}
+
+/* Traced versions of the MMAL calls. trace_callback() goes first in a port
+ * callback. */
+
+static inline MMAL_STATUS_T trace_port_send_buffer(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *header)
+{
+    trace_event(TRACE_SEND, port, header);
+    return mmal_port_send_buffer(port, header);
+}
+
+static inline void trace_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *header)
+{
+    trace_event(TRACE_CALLBACK, port, header);
+}
+
+static inline void trace_queue_put(MMAL_QUEUE_T *queue, MMAL_BUFFER_HEADER_T *header)
+{
+    trace_event(TRACE_PUT, queue, header);
+    mmal_queue_put(queue, header);
+}
+
+static inline MMAL_BUFFER_HEADER_T *trace_queue_get(MMAL_QUEUE_T *queue)
+{
+    MMAL_BUFFER_HEADER_T *header = mmal_queue_get(queue);
+
+    if (header)
+        trace_event(TRACE_GET, queue, header);
+    return header;
+}
+
+static inline void trace_buffer_header_release(MMAL_BUFFER_HEADER_T *header)
+{
+    trace_event(TRACE_RELEASE, NULL, header);
+    mmal_buffer_header_release(header);
+}
+
+/* Writing the trace */
+
+typedef struct TRACE_ENTRY_T {
+    TRACE_EVENT_T event;
+    unsigned int ring;
+} TRACE_ENTRY_T;
+
+static int trace_compare(const void *a, const void *b)
+{
+    uint64_t x = ((const TRACE_ENTRY_T *)a)->event.ns, y = ((const TRACE_ENTRY_T *)b)->event.ns;
+    return x < y ? -1 : x > y;
+}
+
+static const char *trace_object_name(const void *object, char *buffer, size_t size)
+{
+    unsigned int i;
+
+    for (i = 0; i < trace_global.name_count; i++)
+        if (trace_global.names[i].object == object)
+            return trace_global.names[i].name;
+    snprintf(buffer, size, "%p", object);
+    return buffer;
+}
+
+/** Copy the events of a ring which are not overwritten meanwhile. Returns the count. */
+static unsigned int trace_snapshot(unsigned int index, TRACE_ENTRY_T *entries)
+{
+    TRACE_RING_T *ring = &trace_global.ring[index];
+    TRACE_EVENT_T *events = __atomic_load_n(&ring->events, __ATOMIC_ACQUIRE);
+    uint64_t head, first, i, oldest;
+    unsigned int count = 0;
+
+    if (!events)
+        return 0;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    first = head > trace_global.size ? head - trace_global.size : 0;
+    for (i = first; i < head; i++) {
+        entries[count].event = events[i & (trace_global.size - 1)];
+        entries[count++].ring = index;
+    }
+    /* the writer may have gone round meanwhile, its newest events replaced the oldest copied ones */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    oldest = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    oldest = oldest >= trace_global.size ? oldest - trace_global.size + 1 : 0;
+    if (oldest > first) {
+        unsigned int stale = oldest - first < count ? oldest - first : count;
+        memmove(entries, entries + stale, (count - stale) * sizeof(*entries));
+        count -= stale;
+    }
+    return count;
+}
+
+/** Write what the rings hold to path. Tracing may go on meanwhile.
+ * Returns the number of events written, -1 on failure. */
+static int trace_write(const char *path)
+{
+    unsigned int rings = __atomic_load_n(&trace_global.rings, __ATOMIC_ACQUIRE), r, count = 0, i, j;
+    TRACE_ENTRY_T *entries;
+    struct {
+        const void *port;
+        int held;
+    } ports[TRACE_MAX_NAMES];
+    unsigned int port_count = 0;
+    int pid = (int)getpid();
+    char name[TRACE_NAME], header[24], ts[32];
+    const char *label;
+    FILE *file;
+
+    if (rings > TRACE_MAX_THREADS)
+        rings = TRACE_MAX_THREADS;
+    if (!trace_global.size || !(entries = (TRACE_ENTRY_T *)malloc((size_t)rings * trace_global.size * sizeof(*entries) + 1)))
+        return -1;
+    for (r = 0; r < rings; r++)
+        count += trace_snapshot(r, entries + count);
+    qsort(entries, count, sizeof(*entries), trace_compare);
+
+    if (!(file = fopen(path, "w"))) {
+        free(entries);
+        return -1;
+    }
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (r = 0; r < rings; r++)
+        if (trace_global.ring[r].events)
+            fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                    pid, trace_global.ring[r].tid, trace_global.ring[r].thread);
+
+    for (i = 0; i < count; i++) {
+        const TRACE_EVENT_T *e = &entries[i].event;
+        int tid = trace_global.ring[entries[i].ring].tid;
+
+        /* microseconds; printf of doubles would be most of the time spent here */
+        snprintf(ts, sizeof(ts), "%llu.%03u", (unsigned long long)(e->ns / 1000), (unsigned int)(e->ns % 1000));
+        snprintf(header, sizeof(header), "%p", e->header);
+        if (e->type == TRACE_RELEASE) {
+            fprintf(file, "{\"name\":\"release\",\"cat\":\"buffer\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%s,\"pid\":%d,"
+                    "\"tid\":%d,\"args\":{\"header\":\"%s\"}},\n", ts, pid, tid, header);
+            continue;
+        }
+        label = trace_object_name(e->object, name, sizeof(name));
+        fprintf(file, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\",\"id\":\"%s\",\"ts\":%s,\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"cmd\":%u}},\n", label, e->type <= TRACE_CALLBACK ? "port" : "queue",
+                e->type == TRACE_SEND || e->type == TRACE_PUT ? "b" : "e", header, ts, pid, tid, e->cmd);
+
+        /* headers held by the port: sent minus returned (events come without being sent) */
+        if (e->type > TRACE_CALLBACK || (e->type == TRACE_CALLBACK && e->cmd))
+            continue;
+        for (j = 0; j < port_count && ports[j].port != e->object; j++)
+            ;
+        if (j == port_count) {
+            if (port_count == TRACE_MAX_NAMES)
+                continue;
+            ports[port_count].port = e->object;
+            ports[port_count++].held = 0;
+        }
+        ports[j].held += e->type == TRACE_SEND ? 1 : -1;
+        fprintf(file, "{\"name\":\"%s held\",\"ph\":\"C\",\"ts\":%s,\"pid\":%d,\"args\":{\"headers\":%d}},\n",
+                label, ts, pid, ports[j].held);
+    }
+    /* last, JSON has no trailing commas */
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"mmal, %u events lost\"}}\n]}\n",
+            pid, __atomic_load_n(&trace_global.lost, __ATOMIC_RELAXED));
+    free(entries);
+    return fclose(file) == 0 ? (int)count : -1;
+}
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef Y4M_H
+#define Y4M_H
+
+/* Memory-mapped YUV4MPEG2 and raw I420 input.
+ *
+ * The file is mapped read-only and frames are handed out as pointers into the
+ * mapping, so reading costs no copy. Only 8 bit 4:2:0 is supported. The planes
+ * of a frame are packed: width x height luma, then two (width+1)/2 x
+ * (height+1)/2 chroma planes. y4m_copy_i420() lays them out the way the
+ * VideoCore wants I420 (pitch a multiple of 32, height of 16), replicating the
+ * last column and row into the padding so the edge macroblocks stay cheap to
+ * encode. When the size is already aligned the packed frame has that layout
+ * and can be sent as it is. */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct Y4M_READER_T {
+    const uint8_t *data;            /* the mapped file */
+    size_t size;
+    size_t first;                   /* offset of the first frame (header) */
+    size_t offset;                  /* offset of the next frame (header) */
+    int raw;                        /* no headers, frames back to back */
+    unsigned int width, height;
+    int fps_num, fps_den;
+    int par_num, par_den;
+    size_t frame_size;
+    unsigned int frames;            /* read so far */
+} Y4M_READER_T;
+
+static unsigned int y4m_frame_size(unsigned int width, unsigned int height)
+{
+    return width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+}
+
+/** Parse the stream header ("YUV4MPEG2 W1920 H1080 F25:1 Ip A1:1 C420jpeg\n") */
+static int y4m_parse_header(Y4M_READER_T *r)
+{
+    const char *p = (const char *)r->data + 9, *end = (const char *)memchr(r->data, '\n', r->size);
+
+    if (!end)
+        return -1;
+    while (p < end) {
+        size_t length;
+        char tag;
+        if (*p == ' ') {
+            p++;
+            continue;
+        }
+        tag = *p++;
+        length = strcspn(p, " \n");
+        switch (tag) {
+        case 'W':
+            r->width = strtoul(p, NULL, 10);
+            break;
+        case 'H':
+            r->height = strtoul(p, NULL, 10);
+            break;
+        case 'F':
+            if (sscanf(p, "%d:%d", &r->fps_num, &r->fps_den) != 2)
+                return -1;
+            break;
+        case 'A':
+            if (sscanf(p, "%d:%d", &r->par_num, &r->par_den) != 2)
+                return -1;
+            break;
+        case 'C':
+            /* 420jpeg, 420paldv, 420mpeg2 and 420 only differ in chroma siting */
+            if (!((length == 3 && !strncmp(p, "420", 3)) || (length == 7 && !strncmp(p, "420jpeg", 7)) ||
+                  (length == 8 && !strncmp(p, "420paldv", 8)) || (length == 8 && !strncmp(p, "420mpeg2", 8)))) {
+                fprintf(stderr, "y4m: only 8 bit 4:2:0 is supported, not C%.*s\n", (int)length, p);
+                return -1;
+            }
+            break;
+        default:
+            /* interlacing and extensions do not change the frame layout */
+            break;
+        }
+        p += length;
+    }
+    if (!r->width || !r->height)
+        return -1;
+    r->first = r->offset = end + 1 - (const char *)r->data;
+    return 0;
+}
+
+/** Map the file. Without a YUV4MPEG2 header it is read as raw I420 frames of
+ * width x height at fps_num frames per second, which must then be given. */
+static int y4m_open(Y4M_READER_T *r, const char *path, unsigned int width, unsigned int height, int fps_num)
+{
+    struct stat st;
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+    r->fps_num = fps_num > 0 ? fps_num : 25;
+    r->fps_den = r->par_num = r->par_den = 1;
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    r->size = st.st_size;
+    r->data = (const uint8_t *)mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r->data == MAP_FAILED) {
+        r->data = NULL;
+        return -1;
+    }
+    /* frames are read front to back, let the kernel read ahead */
+    madvise((void *)r->data, r->size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+    if (r->size > 10 && !memcmp(r->data, "YUV4MPEG2 ", 10)) {
+        if (y4m_parse_header(r) != 0) {
+            munmap((void *)r->data, r->size);
+            r->data = NULL;
+            return -1;
+        }
+    } else {
+        if (!width || !height) {
+            munmap((void *)r->data, r->size);
+            r->data = NULL;
+            return -1;
+        }
+        r->raw = 1;
+        r->width = width;
+        r->height = height;
+    }
+    r->frame_size = y4m_frame_size(r->width, r->height);
+    return 0;
+}
+
+static void y4m_close(Y4M_READER_T *r)
+{
+    if (r->data)
+        munmap((void *)r->data, r->size);
+    r->data = NULL;
+}
+
+/** The planes of the next frame, NULL at the end of the file (or of a truncated last frame) */
+static const uint8_t *y4m_next_frame(Y4M_READER_T *r)
+{
+    const uint8_t *frame;
+
+    if (!r->raw) {
+        const uint8_t *end;
+        if (r->size - r->offset < 6 || memcmp(r->data + r->offset, "FRAME", 5))
+            return NULL;
+        if (!(end = (const uint8_t *)memchr(r->data + r->offset, '\n', r->size - r->offset)))
+            return NULL;
+        r->offset = end + 1 - r->data;
+    }
+    if (r->size - r->offset < r->frame_size)
+        return NULL;
+    frame = r->data + r->offset;
+    r->offset += r->frame_size;
+    r->frames++;
+    return frame;
+}
+
+/** Start again at the first frame, for looping over a short clip */
+static void y4m_rewind(Y4M_READER_T *r)
+{
+    r->offset = r->first;
+}
+
+static void y4m_copy_plane(uint8_t *dst, unsigned int pitch, unsigned int rows,
+                           const uint8_t *src, unsigned int width, unsigned int height)
+{
+    unsigned int y;
+
+    if (pitch == width) {
+        memcpy(dst, src, (size_t)width * height);
+    } else {
+        for (y = 0; y < height; y++) {
+            memcpy(dst + (size_t)y * pitch, src + (size_t)y * width, width);
+            memset(dst + (size_t)y * pitch + width, src[(size_t)y * width + width - 1], pitch - width);
+        }
+    }
+    for (y = height; y < rows; y++)
+        memcpy(dst + (size_t)y * pitch, dst + (size_t)(height - 1) * pitch, pitch);
+}
+
+/** Copy a packed frame into an I420 buffer of the given pitch and aligned
+ * height (see frame_init_i420), filling the padding from the edges. */
+static void y4m_copy_i420(uint8_t *dst, unsigned int pitch, unsigned int aligned_height,
+                          const uint8_t *src, unsigned int width, unsigned int height)
+{
+    unsigned int chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+    size_t luma = (size_t)pitch * aligned_height, chroma = luma / 4;
+
+    y4m_copy_plane(dst, pitch, aligned_height, src, width, height);
+    src += (size_t)width * height;
+    y4m_copy_plane(dst + luma, pitch / 2, aligned_height / 2, src, chroma_width, chroma_height);
+    src += (size_t)chroma_width * chroma_height;
+    y4m_copy_plane(dst + luma + chroma, pitch / 2, aligned_height / 2, src, chroma_width, chroma_height);
+}
+
+#endif